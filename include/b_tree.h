@@ -3,13 +3,187 @@
 
 #include "jdisk.h"
 
+/* Key types.  BYTES keys are compared with memcmp.  The integer types are
+   unsigned and passed in native byte order (an unsigned int, unsigned long or
+   unsigned __int128); nodes store them that way and compare them as numbers. */
+
+#define B_TREE_KEY_BYTES (0)
+#define B_TREE_KEY_U32   (1)
+#define B_TREE_KEY_U64   (2)
+#define B_TREE_KEY_U128  (3)
+
+/* Sector 0 holds B_TREE_KEY_TYPE_TAG | key type in bytes 16-19.  Trees written
+   before there were key types don't have the tag, and are BYTES. */
+
+#define B_TREE_KEY_TYPE_TAG (0x4b455900)
+
+/* Create flags, kept in sector 0 as B_TREE_FLAGS_TAG | flags in bytes 20-23.
+
+   B_TREE_COMPRESS compresses values and packs the small ones several to a sector.
+   Their lbas are then handles: the sector times 16 plus a slot (B_TREE_VALUE_SECTOR
+   and B_TREE_VALUE_SLOT), and must be read with b_tree_read().  Slot 0 is a plain
+   sector.  A handle stays the same when its value is rewritten, even if it no longer
+   fits its slot.  The disk can have at most 2^28 sectors, and compressed trees can't
+   be compacted.
+
+   B_TREE_ALLOC allocates sectors from a free-space bitmap (one sector per 8192,
+   the last of each), with placement hints instead of always at the end: a new leaf
+   gets a run of sectors that its values go into, and a split internal node goes
+   next to the one it split from.  These trees can't be compacted either.
+
+   B_TREE_BSTAR handles a full node the B*-tree way: it shares keys with a sibling that
+   has room, and when both are full, the two become three.  Nodes end up fuller than
+   with plain splits, which take half of a full node.
+
+   B_TREE_TOPDOWN inserts in one pass: full nodes are split on the way down, before
+   the insert goes into them, so nothing above the node it's in is needed again.  It
+   can't be used with B_TREE_BSTAR.
+
+   B_TREE_BUFFERED is for write-heavy loads, after Bε-trees: internal nodes have
+   buffers of inserts that haven't reached their leaves, and a full buffer goes down a
+   level all at once, so that a leaf gets its inserts in batches.  An insert of a new key
+   writes its value and a message into the root's buffer; a find checks the buffers on
+   its way down.  An insert looks its key up first, and one that's there keeps its lba
+   and has its value written in place.  With B_TREE_BLOOM, a key the filter turns away
+   skips the lookup, and its insert reads nothing.  Cursors (and so export) first flush
+   every buffer down to the leaves.  A node has a key less room, and the tree can't be
+   compacted, nor use B_TREE_BSTAR or B_TREE_TOPDOWN.
+
+   B_TREE_BLOOM keeps a Bloom filter of the keys, in memory and in sectors of its own, so
+   that a find (or update, cas, modify) of a key that isn't there almost never reads
+   anything.  It's written at detach.  Attach doesn't read it: it's read in on its first
+   use, or, in a tree that wasn't detached, rebuilt from the keys by a thread, with every
+   find going to the tree until that's done.  It grows as keys are added, into a new run
+   that's rebuilt the same way.  A compaction keeps it in memory while sectors move, and
+   writes it after them.
+
+   B_TREE_COUNTED keeps, in each internal node, how many keys are under each of its
+   children, for the order statistics below.  An insert of a new key then writes every
+   node on its path, and a node has room for fewer keys.  It can't be used with
+   B_TREE_TOPDOWN or B_TREE_BUFFERED. */
+
+#define B_TREE_FLAGS_TAG (0x464c4700)
+#define B_TREE_COMPRESS  (1)
+#define B_TREE_ALLOC     (2)
+#define B_TREE_BSTAR     (4)
+#define B_TREE_TOPDOWN   (8)
+#define B_TREE_BUFFERED  (16)
+#define B_TREE_BLOOM     (32)
+#define B_TREE_COUNTED   (64)
+
+#define B_TREE_VALUE_SECTOR(lba) ((lba) >> 4)
+#define B_TREE_VALUE_SLOT(lba)   ((lba) & 15)
+
+/* size is only where the disk starts: it grows as the tree needs it, up to 2^32 sectors
+   (2^28 compressed), and sector 0 records how big it got.  b_tree_insert() returns 0
+   when the disk is full and can't grow, and so do the record operations below, with
+   cas returning -1.  The tree is then unchanged, but for nodes that a B_TREE_TOPDOWN
+   insert had already split. */
+
 void *b_tree_create(char *filename, long size, int key_size);
+void *b_tree_create_typed(char *filename, long size, int key_size, int key_type);
+void *b_tree_create_flags(char *filename, long size, int key_size, int key_type, int flags);
 void *b_tree_attach(char *filename);
+int b_tree_detach(void *b_tree);        /* Frees the tree and unattaches its jdisk */
 
 unsigned int b_tree_insert(void *b_tree, void *key, void *record);
 unsigned int b_tree_find(void *b_tree, void *key);
+int b_tree_read(void *b_tree, unsigned int lba, void *record);   /* The value at lba: 0, or -1 */
+
+/* Inserts n keys, with their lbas into lbas unless it's NULL, and returns how many went in
+   (fewer than n when the disk fills).  Keys in increasing order are the fast case: those
+   that go into the same leaf go in without a descent, and the leaf is written once. */
+int b_tree_insert_batch(void *b_tree, int n, void **keys, void **records, unsigned int *lbas);
+
+/* Record operations, on the value of a key that's in the tree.  They write the value's
+   sector and nothing else.
+   update copies len bytes of data into the value at offset, and returns its lba (0 if
+   the key isn't there).
+   cas does the same with desired if the bytes there equal expected: 1 if it swapped,
+   0 if they didn't match, -1 if the key isn't there.
+   modify calls fn on a copy of the value, and writes it back if fn returns nonzero.
+   If the key isn't there, fn gets zeros and exists = 0, and a nonzero return inserts
+   the key.  It returns the value's lba, or 0 for nothing.
+   b_tree_insert() of a key that's there also just writes the value. */
+typedef int (*B_Tree_Modify)(void *record, int exists, void *arg);
+
+unsigned int b_tree_update(void *b_tree, void *key, int offset, int len, void *data);
+int b_tree_cas(void *b_tree, void *key, int offset, int len, void *expected, void *desired);
+unsigned int b_tree_modify(void *b_tree, void *key, B_Tree_Modify fn, void *arg);
+
 void *b_tree_disk(void *b_tree);
 int b_tree_key_size(void *b_tree);
+int b_tree_key_type(void *b_tree);
+int b_tree_flags(void *b_tree);
+unsigned long b_tree_sectors(void *b_tree);          /* Sectors used so far, sector 0 included */
+long b_tree_nodes(void *b_tree, int *height);        /* Nodes in the tree, and its levels.  Reads internal nodes */
+int b_tree_compare(void *b_tree, void *a, void *b);   /* <0, 0, >0 in the tree's key order */
+
+/* Keys as text, for tools.  BYTES keys are the text, zero-padded to key_size.
+   Integer keys are numbers in decimal, 0x hex or 0 octal, up to the key's full
+   width.  parse may be given s == key; it returns 1, or 0 if s isn't a key.
+   format writes a string into s, which needs key_size+1 bytes, and 40 for any
+   integer key. */
+int b_tree_parse_key(char *s, int key_size, int key_type, void *key);
+void b_tree_format_key(void *key, int key_size, int key_type, char *s);
+
+/* Ordered scan from the first key >= start_key (NULL: from the start).  next copies
+   out a key and its value lba, and returns 0 at the end.  Inserts invalidate cursors. */
+void *b_tree_cursor(void *b_tree, void *start_key);
+int b_tree_cursor_next(void *cursor, void *key, unsigned int *lba);
+void b_tree_cursor_free(void *cursor);
+
+/* Order statistics, for B_TREE_COUNTED trees; each reads one node a level at most (count_range
+   two below where lo and hi part).  They return -1 on other trees.
+   rank is the number of keys less than key.  count_range is the number of keys >= lo and
+   < hi; NULL for either means no bound.  select copies out key k (from 0, in key order) and
+   its value lba (lba may be NULL), and returns 1, or 0 if there are no more than k keys.
+   sample does the same with a k picked uniformly at random, from a generator of the tree's. */
+long b_tree_rank(void *b_tree, void *key);
+long b_tree_count_range(void *b_tree, void *lo, void *hi);
+int b_tree_select(void *b_tree, long k, void *key, unsigned int *lba);
+int b_tree_sample(void *b_tree, void *key, unsigned int *lba);
+
+/* Export writes every pair, in key order, to a file: a 24-byte header (B_TREE_EXPORT_MAGIC,
+   key size, key type, 0, and the number of pairs as 8 bytes), then for each pair the key,
+   the value's length in 2 bytes, and the value without its trailing zeros.  Import reads
+   one into a tree whose keys are the same kind (bytes or integers) and big enough; into an
+   empty tree, sorted pairs are bulk loaded bottom up.  Both return the number of pairs,
+   or -1 on an error. */
+
+#define B_TREE_EXPORT_MAGIC (0x50584542)
+
+long b_tree_export(void *b_tree, char *filename);
+long b_tree_import(void *b_tree, char *filename);
+
+/* Online compaction: begin, then call step between other operations until it returns 0.
+   Moves sectors, so value lbas from before the compaction are no longer valid. */
+int b_tree_compact_begin(void *b_tree);
+long b_tree_compact_step(void *b_tree, int max_moves);
+
+/* Keeps up to max_nodes interior nodes in memory (0, the default, for none), so
+   that lookups only read leaves from disk.  Often-searched nodes also get a
+   cache-friendlier copy of their keys. */
+void b_tree_set_cache(void *b_tree, int max_nodes);
+
+/* Keeps a hash index in memory from up to max_keys keys (0, the default, for none) to
+   their value lbas, so that a find (or update, cas, modify) of a key in it reads no
+   nodes at all.  Finds and inserts fill it, and when it's full, the keys used least
+   lately make room.  It starts empty, and a compaction empties it. */
+void b_tree_set_index(void *b_tree, long max_keys);
+
+/* b_tree_attach() only reads sector 0 and the root.  b_tree_warmup() then fills the
+   cache in the background: a thread reads the top levels levels (the root is level
+   0) breadth first, and operations put what it has read into the cache as they go.
+   The cache must be on.  progress returns 1 until the warmup is over, and how many
+   nodes it has cached and how many levels it has read. */
+int b_tree_warmup(void *b_tree, int levels);
+int b_tree_warmup_progress(void *b_tree, long *nodes, int *levels);
+
+/* b_tree_detach() with the cache on saves the sectors in it to a manifest, tree_file.warm,
+   and b_tree_save_warmup() does it at any other time.  When there is one, b_tree_attach()
+   turns the cache on at the size it had and warms it from the manifest, in lba order. */
+int b_tree_save_warmup(void *b_tree);
 
 void b_tree_print_tree(void *tree);
 #endif
@@ -0,0 +1,74 @@
+#ifndef _B_TREE_FORMAT_
+#define _B_TREE_FORMAT_
+
+/* On-disk format constants that b_tree.c writes and b_tree_dcs checks.  They
+   are private to the two of them: nothing in b_tree.h depends on them. */
+
+/* B_TREE_ALLOC: each group of ALLOC_GROUP sectors ends in the bitmap sector
+   that says which of them are used. */
+
+#define ALLOC_GROUP (8192)             /* Sectors per bitmap sector */
+
+/* B_TREE_BUFFERED: an internal node's message buffer is BUFFER_SECTORS
+   contiguous sectors. */
+
+#define BUFFER_SECTORS (8)             /* Sectors in a B_TREE_BUFFERED node's message buffer */
+
+/* B_TREE_BLOOM: a key sets BLOOM_K bits, all in one 64-byte block.  Its hash
+   is FNV-1a, then murmur3's finalizer (the hash index uses it too).  The high
+   half of the hash picks the block of a filter of some number of sectors, and
+   the low half two 9-bit steps through it. */
+
+#define BLOOM_K    (7)                 /* Bits set for a key, all in one 64-byte block */
+
+static inline unsigned long hash_key(const unsigned char *key, int key_size)
+{
+  unsigned long h = 0xcbf29ce484222325UL;
+  int i;
+
+  for (i = 0; i < key_size; i++) {
+    h ^= key[i];
+    h *= 0x100000001b3UL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* The 64-byte block that a key with hash h goes in */
+static inline unsigned long bloom_block(unsigned long h, unsigned long sectors)
+{
+  return ((h >> 32) * (sectors * 16UL)) >> 32;
+}
+
+/* With set, sets the bits of the key with hash h, and returns how many weren't
+   set before; without, returns 1 if they all are. */
+static inline int bloom_bits(unsigned char *filter, unsigned long sectors, unsigned long h, int set)
+{
+  unsigned char *bits = filter + bloom_block(h, sectors) * 64;
+  unsigned int a = h & 511, b = ((h >> 9) & 511) | 1, bit;
+  int i, n = 0;
+
+  for (i = 0; i < BLOOM_K; i++) {
+    bit = (a + i * b) & 511;
+    if (!(bits[bit >> 3] & (1 << (bit & 7)))) {
+      if (!set) return 0;
+      bits[bit >> 3] |= 1 << (bit & 7);
+      n++;
+    }
+  }
+  return set ? n : 1;
+}
+
+/* B_TREE_COMPRESS: a pack sector is a slot count, the end of its data, and
+   PACK_SLOTS (offset, length) pairs; a length of PACK_FORWARD means the slot
+   holds the lba its value moved to. */
+
+#define PACK_SLOTS   (15)
+#define PACK_HEADER  (4 + 4 * PACK_SLOTS)
+#define PACK_FORWARD (0xffff)
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _B_TREE_INSTRUMENT_
+#define _B_TREE_INSTRUMENT_
+
+#include <stdio.h>
+
+/* Only available when linking with obj/b_tree_instrument.o instead of obj/b_tree.o */
+
+#define B_TREE_MAX_LEVELS (32)
+#define B_TREE_LAT_BUCKETS (48)       /* Bucket i holds latencies in [2^i, 2^(i+1)) ns */
+
+typedef struct {
+  long finds;
+  long inserts;
+  long appends;                       /* Inserts that went straight to the rightmost leaf */
+  long batched;                       /* Batch inserts that went into the leaf of the one before */
+  long updates;                       /* update, cas and modify */
+  long filtered;                      /* Lookups that the Bloom filter turned away */
+  long indexed;                       /* Lookups that the hash index answered */
+  long nodes_visited;
+  long key_slots_scanned;             /* Keys a linear in-node search would compare, see b_tree.c */
+  long cache_hits;                    /* Nodes that were already in memory */
+  long cache_misses;                  /* Nodes that had to be read from the jdisk */
+  long node_writes;
+  long splits[B_TREE_MAX_LEVELS];     /* Indexed by depth, 0 is the root */
+  long redistributions;               /* B_TREE_BSTAR: overflows that a sibling took keys from */
+  long flushes;                       /* B_TREE_BUFFERED: buffers sent down a level */
+  long messages;                      /* and the messages that were in them */
+  long bytes_copied;                  /* Key and lba bytes memcpy'd by the tree */
+  long mallocs;
+  long sampled_ops;                   /* Operations that were timed */
+  long sampled_ns;
+  long max_ns;
+  long latency[B_TREE_LAT_BUCKETS];
+} B_Tree_Stats;
+
+typedef struct {
+  const char *name;   /* find, insert, read_node, write_node or split */
+  char phase;         /* 'X': has a duration.  'i': instant */
+  long ts;            /* CLOCK_MONOTONIC nanoseconds */
+  long dur;           /* Nanoseconds */
+  double device_us;   /* Modeled jdisk time spent inside the event */
+  unsigned int lba;   /* For read_node/write_node */
+  int level;          /* For split */
+} B_Tree_Event;
+
+typedef void (*B_Tree_Trace_Fn)(void *arg, B_Tree_Event *e);
+
+void b_tree_stats(void *b_tree, B_Tree_Stats *stats);
+void b_tree_reset_stats(void *b_tree);
+void b_tree_print_stats(void *b_tree, FILE *f);
+
+/* Time one out of every n operations (0 turns sampling off).  When a trace
+   hook is set, every operation is timed. */
+void b_tree_set_sample_rate(void *b_tree, int n);
+
+void b_tree_set_trace(void *b_tree, B_Tree_Trace_Fn fn, void *arg);
+
+/* Writes events to fn in Chrome's trace-event JSON format (chrome://tracing, Perfetto). */
+int b_tree_trace_file(void *b_tree, char *fn);
+void b_tree_trace_close(void *b_tree);
+
+#endif
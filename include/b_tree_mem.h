@@ -0,0 +1,35 @@
+#ifndef _B_TREE_MEM_
+#define _B_TREE_MEM_
+
+#include "b_tree.h"
+
+/* An in-memory ingest front-end (a memtable) over one b_tree.  Inserts go into a
+   sorted skip list in memory and return without touching the jdisk.  When it holds
+   max_keys keys, it is set aside whole and a background thread merges it into the
+   tree in key order, while a fresh one takes new inserts.  If the one set aside is
+   still being merged when the new one fills, inserts wait for the merge.
+
+   A find looks in the memtables first, newest first, and then in the tree, so it
+   always sees the last value inserted.  Values are not on disk until they are
+   merged, so there are no lbas: find copies the value out instead.
+
+   Any number of threads may call insert and find at once.  After open, the tree is
+   the front-end's: touch it only after b_tree_mem_flush(), while nothing else runs.
+   Close merges what is left and stops the thread, but doesn't detach the tree. */
+
+void *b_tree_mem_open(void *b_tree, long max_keys);
+int b_tree_mem_close(void *mem);              /* 0, or -1 if a merge failed */
+
+/* insert returns 0, or -1 once a merge has failed (the disk is full): the keys it
+   didn't merge stay in memory and can still be found, but no more are taken.
+   find returns 1 and copies the value (a full sector) into record, or returns 0. */
+int b_tree_mem_insert(void *mem, void *key, void *record);
+int b_tree_mem_find(void *mem, void *key, void *record);
+
+int b_tree_mem_flush(void *mem);              /* Merges everything now and waits: 0, or -1 */
+long b_tree_mem_keys(void *mem);              /* Keys in memory, not yet merged */
+
+/* Merges so far, keys they wrote, and inserts that had to wait for one */
+void b_tree_mem_stats(void *mem, long *merges, long *merged, long *stalls);
+
+#endif
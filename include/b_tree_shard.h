@@ -0,0 +1,42 @@
+#ifndef _B_TREE_SHARD_
+#define _B_TREE_SHARD_
+
+#include "b_tree.h"
+
+/* A sharded front-end: keys are partitioned over nshards independent b_trees,
+   each in its own jdisk file (base.0, base.1, ...) and driven by its own worker
+   thread, so the b_tree code itself stays single-threaded.  The file base holds
+   a small text manifest: the shard count, the partitioning, and the split keys.
+
+   HASH spreads keys evenly.  RANGE gives shard i the keys in [splits[i-1], splits[i]),
+   for nshards-1 increasing split keys.  When create fails (a shard file can't
+   be created, or the splits don't increase), it removes the shard files it made.
+
+   Any number of threads may call insert, find and read at once.  Value lbas are
+   per shard: read values with b_tree_shard_read(). */
+
+#define B_TREE_SHARD_HASH  (0)
+#define B_TREE_SHARD_RANGE (1)
+
+void *b_tree_shard_create(char *base, int nshards, long shard_size, int key_size, int key_type,
+                          int partition, void **splits);
+void *b_tree_shard_attach(char *base);
+void b_tree_shard_close(void *shards);      /* Stops the workers and frees everything */
+
+int b_tree_shard_count(void *shards);
+int b_tree_shard_of(void *shards, void *key);
+void *b_tree_shard_tree(void *shards, int shard);   /* Only touch it while nothing else runs */
+
+unsigned int b_tree_shard_insert(void *shards, void *key, void *record);
+unsigned int b_tree_shard_find(void *shards, void *key);
+int b_tree_shard_read(void *shards, int shard, unsigned int lba, void *buf);
+
+/* Hands n inserts to the workers at once and waits for all of them.  lbas may be NULL. */
+void b_tree_shard_insert_batch(void *shards, int n, void **keys, void **records, unsigned int *lbas);
+
+/* Ordered scan over all shards, merged.  Like b_tree_cursor(), not valid across inserts. */
+void *b_tree_shard_cursor(void *shards, void *start_key);
+int b_tree_shard_cursor_next(void *cursor, void *key, int *shard, unsigned int *lba);
+void b_tree_shard_cursor_free(void *cursor);
+
+#endif
@@ -4,15 +4,29 @@
 #define JDISK_SECTOR_SIZE (1024)
 #define JDISK_DELAY (1)
 
+/* Latency models.  The model is picked from $JDISK_LATENCY when the disk is
+   created or attached, and can be changed with jdisk_set_latency(). */
+
+#define JDISK_LATENCY_NONE  (0)
+#define JDISK_LATENCY_FIXED (1)   /* param = microseconds per sector */
+#define JDISK_LATENCY_HDD   (2)   /* seek distance + rotation + transfer */
+#define JDISK_LATENCY_NVME  (3)   /* param = queue depth, for multi-sector I/O */
+
 void *jdisk_create(char *fn, unsigned long size);
 void *jdisk_attach(char *fn);
 int jdisk_unattach(void *jd);
+void *jdisk_reopen(void *jd);         /* Another handle on the same disk, e.g. for another thread */
 
 int jdisk_read(void *jd, unsigned int lba, void *buf);
 int jdisk_write(void *jd, unsigned int lba, void *buf);
+int jdisk_read_many(void *jd, unsigned int lba, int n, void *buf);   /* n sectors in one I/O */
 
 unsigned long jdisk_size(void *jd);
+int jdisk_grow(void *jd, unsigned long size);   /* Makes the disk bigger: 0, or -1 */
 long jdisk_reads(void *jd);
 long jdisk_writes(void *jd);
 
+int jdisk_set_latency(void *jd, int model, double param);
+double jdisk_device_time(void *jd);   /* Modeled device seconds since create/attach */
+
 #endif
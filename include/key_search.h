@@ -0,0 +1,58 @@
+#ifndef _KEY_SEARCH_
+#define _KEY_SEARCH_
+
+/* In-node key search.
+
+   keys points to nkeys keys of key_size bytes each, stored back to back and
+   sorted in memcmp order.  A search returns the index of the first key that is
+   >= probe (nkeys if there is none), and sets *equal if that key == probe.
+
+   The SIMD kernels load 16 or 32 bytes at a time, so there must be at least
+   KEY_SEARCH_PAD readable bytes after the last key. */
+
+#define KEY_SEARCH_PAD (32)
+
+typedef int (*Key_Search)(const unsigned char *keys, int nkeys, int key_size,
+                          const unsigned char *probe, int *equal);
+
+int key_search_linear(const unsigned char *keys, int nkeys, int key_size, const unsigned char *probe, int *equal);
+int key_search_binary(const unsigned char *keys, int nkeys, int key_size, const unsigned char *probe, int *equal);
+int key_search_sse42(const unsigned char *keys, int nkeys, int key_size, const unsigned char *probe, int *equal);
+int key_search_avx2(const unsigned char *keys, int nkeys, int key_size, const unsigned char *probe, int *equal);
+
+/* For keys that are unsigned integers in native byte order (key_size 4, 8 or 16),
+   sorted numerically rather than in memcmp order */
+int key_search_native(const unsigned char *keys, int nkeys, int key_size, const unsigned char *probe, int *equal);
+int key_search_native_avx2(const unsigned char *keys, int nkeys, int key_size, const unsigned char *probe, int *equal);
+
+/* The fastest kernel for key_size that this CPU supports */
+Key_Search key_search_pick(int key_size);
+Key_Search key_search_pick_native(int key_size);
+
+/* Whether a kernel can run here with this key size */
+int key_search_supported(Key_Search f, int key_size);
+
+char *key_search_name(Key_Search f);
+
+/* Eytzinger layout: the keys of one node copied into the order of an implicit
+   binary search tree (key k's children are keys 2k and 2k+1), so the first
+   levels of a search share a cache line and the next ones can be prefetched.
+   It's a copy -- build it for nodes that are searched often.  native is as
+   for key_search_native. */
+
+typedef struct {
+  int nkeys;
+  int key_size;
+  int native;
+  unsigned char *keys;        /* Slots 1..nkeys, 64-byte aligned */
+  unsigned char *index;       /* index[k] = position of slot k's key in the node; index[0] = nkeys */
+} Key_Layout;
+
+Key_Layout *key_layout_build(const unsigned char *keys, int nkeys, int key_size, int native);
+int key_layout_search(Key_Layout *l, const unsigned char *probe, int *equal);
+void key_layout_free(Key_Layout *l);
+
+/* Whether a layout searches faster than key_search_pick's kernel for this key size */
+int key_layout_pays(int key_size, int native);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _LZ_
+#define _LZ_
+
+/* A small LZ77 codec in the style of LZ4, for value sectors.
+
+   The stream is a series of sequences: a token byte (literal count in the high
+   nibble, match length - 4 in the low one, 15 meaning more in the bytes that
+   follow, each adding up to 255), the literals, and a 2-byte little-endian
+   match offset.  The last sequence is literals only.
+
+   lz_compress returns the compressed size, or -1 if it would be over cap.
+   lz_decompress returns the decompressed size, or -1 if the input is damaged
+   or decompresses to more than cap bytes. */
+
+int lz_compress(const unsigned char *in, int n, unsigned char *out, int cap);
+int lz_decompress(const unsigned char *in, int n, unsigned char *out, int cap);
+
+#endif
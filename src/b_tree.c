@@ -1,55 +1,213 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "jdisk.h"
+#include "key_search.h"
+#include "lz.h"
 #include "../include/b_tree.h"
+#include "b_tree_format.h"
 
+/*
+Instrumentation hooks.  Everything inside INST() only exists in the
+instrumented build (src/b_tree_instrument.c, which defines B_TREE_INSTRUMENT
+and includes this file), so the regular b_tree.o pays nothing for it.
+*/
+#ifdef B_TREE_INSTRUMENT
+#include "b_tree_instrument.h"
+#define INST(stmt) stmt
+#else
+#define INST(stmt)
+#endif
+
+/*
+key_slots_scanned adds up, for each in-node search that returned i of nkeys,
+the keys up to and including the one it stopped at.  That is what a linear
+scan compares; the binary and SIMD kernels compare fewer, or several at once.
+*/
+#define INST_SLOTS(btree, i, nkeys) INST((btree)->stats.key_slots_scanned += ((i) < (nkeys)) ? (i) + 1 : (i))
 
 
 typedef struct tnode {
    unsigned char bytes[1024+256]; /* This holds the sector for reading and writing.  
                                                    It has extra room because your internal representation  
                                                    will hold an extra key. */
+                                             /* Between operations it mirrors keys[] back to back at
+                                                bytes+2, which is what find() searches. */
    unsigned char nkeys;                      /* Number of keys in the node */
    unsigned char flush;                      /* Should I flush this to disk at the end of b_tree_insert()? */
    unsigned char internal;                   /* Internal or external node */
    unsigned int lba;                         /* LBA when the node is flushed */
    unsigned char **keys;                     /* Pointers to the keys.  Size = MAXKEY+1 */
    unsigned int *lbas;                       /* Pointer to the array of LBA's.  Size = MAXKEY+2 */
+   unsigned int *counts;                     /* B_TREE_COUNTED internal nodes: keys under each child.  Size = MAXKEY+2 */
    struct tnode *parent;                     /* Pointer to my parent -- useful for splitting */
    struct tnode **children;                  /* Multiple nodes -- will simplify handling shit greatly*/
    int parent_index;                         /* My index in my parent */
    struct tnode *ptr;                        /* Free list link */
+   unsigned int buffer;                      /* B_TREE_BUFFERED internal nodes: first sector of the message buffer, 0 if none */
+   int nmsgs;                                /* and how many messages are in it */
 } Tree_Node;
 
+typedef struct cnode {                       /* A sector in the interior node cache */
+   unsigned int lba;                         /* 0 if the slot is free */
+   unsigned int hits;
+   int ref;                                  /* Clock bit */
+   int next;                                 /* Next slot in the hash chain, -1 at the end */
+   Key_Layout *layout;                       /* Eytzinger copy of the keys, NULL until the node is hot */
+   unsigned char bytes[1024+KEY_SEARCH_PAD];
+} Cache_Node;
+
 typedef struct {
    int key_size;                 /* These are the first 16/12 bytes in sector 0 */
    unsigned int root_lba;
    unsigned long first_free_block;
+   int key_type;                 /* B_TREE_KEY_*, tagged in bytes 16-19 */
+   int flags;                    /* B_TREE_COMPRESS, tagged in bytes 20-23 */
 
    void *disk;                   /* The jdisk */
+   char *filename;               /* Its file, which the warmup manifest is named after */
    unsigned long size;           /* The jdisk's size */
    unsigned long num_lbas;       /* size/JDISK_SECTOR_SIZE */
    int keys_per_block;           /* MAXKEY */
    int lbas_per_block;           /* MAXKEY+1 */
+   Key_Search search;            /* In-node search kernel, picked for the key type and the CPU */
    Tree_Node *free_list;         /* Free list of nodes */
+   Tree_Node *used_list;         /* Nodes read during the current operation (linked by ptr) */
    Tree_Node *root;              /* Root node*/
 
    Tree_Node *tmp_e;             /* When find() fails, this is a pointer to the external node */
    int tmp_e_index;              /* and the index where the key should have gone */
 
+   Tree_Node *tail;              /* Copy of the rightmost leaf for appends, none if NULL or its lba is 0 */
+   int append;                   /* The insert going on is an append, so its splits are skewed */
+
    int flush;                    /* Should I flush sector[0] to disk after b_tree_insert() */
+
+   struct compactor *compact;    /* State of an online compaction, NULL if none is running */
+   struct node_cache *cache;     /* Interior nodes kept in memory, NULL if off */
+   struct warmup *warm;          /* Background cache warmup, NULL if none */
+   struct key_index *index;      /* Hash index from keys to value lbas, NULL if off */
+
+   unsigned int pack_lba;        /* Sector that new compressed values go in, 0 if none yet */
+   unsigned char pack[1024];     /* and a copy of it */
+
+   unsigned char *rbuf;          /* B_TREE_BUFFERED: the root's message buffer, as on disk */
+   unsigned int vrun;            /* and the next sector of the run that raw values come from */
+   unsigned int vrun_end;
+   int vrun_saved;               /* The rest of the run is in sector 0, and no value has come from it yet */
+   int drained;                  /* No buffer has messages in it */
+
+   unsigned long rand;           /* B_TREE_COUNTED: xorshift state for b_tree_sample() */
+
+   unsigned char *bloom;         /* B_TREE_BLOOM: the filter, in memory */
+   unsigned char *bloom_dirty;   /* and which of its sectors changed since they were written */
+   unsigned int bloom_lba;       /* Where it is on disk */
+   unsigned int bloom_sectors;
+   unsigned long bloom_keys;     /* About how many keys are in it */
+   int bloom_current;            /* Sector 0 says the filter on disk has every key */
+   struct bloom_scan *bloom_scan; /* Its background rebuild, NULL if none */
+
+   unsigned char *map;           /* B_TREE_ALLOC: the free-space bitmap, 1 bit per sector, 1 = used */
+   unsigned char *map_state;     /* MAP_UNREAD, MAP_CLEAN or MAP_DIRTY for each group */
+   unsigned long map_groups;
+#ifdef B_TREE_INSTRUMENT
+   B_Tree_Stats stats;           /* Counters, see b_tree_instrument.h */
+   B_Tree_Trace_Fn trace;        /* Trace hook, or NULL */
+   void *trace_arg;
+   int sample_every;             /* Time one out of every sample_every operations */
+   long op_count;
+   long op_start;                /* Start of the current operation in ns, 0 if untimed */
+   double op_device;             /* Modeled device time at the start of the operation */
+   int depth_base;               /* Depth of the topmost node a top-down insert still holds */
+#endif
 } B_Tree;
 
+#ifdef B_TREE_INSTRUMENT
+void inst_attach(B_Tree *btree);
+void inst_op_begin(B_Tree *btree);
+void inst_op_end(B_Tree *btree, const char *name);
+long inst_io_begin(B_Tree *btree, double *device);
+void inst_io_end(B_Tree *btree, const char *name, unsigned int lba, long start, double device);
+void inst_split(B_Tree *btree, int level);
+void inst_detach(B_Tree *btree);
+#endif
+
 void write_tree(B_Tree *btree);
 void read_tree(B_Tree *btree);
+int reserve(B_Tree *btree, unsigned long n);
+unsigned int alloc_near(B_Tree *btree, unsigned int hint, int run);
+unsigned int alloc_run(B_Tree *btree, int n);
+unsigned int buffer_run(B_Tree *btree, int n);
+void map_resize(B_Tree *btree, int state);
+void map_set(B_Tree *btree, unsigned long lba);
+void map_clear(B_Tree *btree, unsigned long lba);
+void map_flush(B_Tree *btree);
+
+int bloom_may(B_Tree *btree, void *key);
+void bloom_add(B_Tree *btree, void *key);
+void bloom_room(B_Tree *btree);
+void bloom_load(B_Tree *btree);
+void bloom_close(B_Tree *btree);
+int bloom_build(B_Tree *btree, unsigned int sectors);
+void bloom_save(B_Tree *btree);
+void bloom_leave(B_Tree *btree);
+void bloom_home(B_Tree *btree, unsigned int lba, unsigned long room);
+int bloom_scan_start(B_Tree *btree);
+int bloom_scan_take(B_Tree *btree);
+void bloom_scan_stop(B_Tree *btree);
+void bloom_scan_wrote(B_Tree *btree, unsigned char *keys, int n, int stride, int internal);
+
+unsigned int find(B_Tree *mytree, void *key);
+unsigned int find_value(B_Tree *mytree, void *key);
+unsigned int insert(B_Tree *mytree, void *key, void *record);
+unsigned int split(B_Tree *mytree, Tree_Node *node_found);
+void overflow(B_Tree *mytree, Tree_Node *node);
+unsigned int append(B_Tree *mytree, void *key, void *record);
+unsigned int insert_topdown(B_Tree *mytree, void *key, void *record);
+unsigned int insert_buffered(B_Tree *mytree, void *key, void *record, int fresh);
+unsigned int find_buffered(B_Tree *mytree, void *key);
+void buffer_attach(B_Tree *btree);
+void buffer_close(B_Tree *btree);
+int buffer_drain(B_Tree *mytree);
+void buffer_root(B_Tree *mytree);
+void buffer_renumber(Tree_Node *node, int from);
+void tail_set(B_Tree *mytree, Tree_Node *node);
+
+Tree_Node *new_node(B_Tree *btree);
+Tree_Node *get_node(B_Tree *btree);
+void release_nodes(B_Tree *btree);
 
 void write_node(B_Tree *btree, Tree_Node *node);
 void read_node(B_Tree *btree, Tree_Node *node, unsigned int lba, Tree_Node* parent);
 
 void shift_node_dat(Tree_Node *node, int i);
 
+int key_type_size(int key_type);
+Key_Search pick_search(B_Tree *btree);
+
+void compact_note(B_Tree *btree, Tree_Node *node);
+
+Cache_Node *cache_get(B_Tree *btree, unsigned int lba);
+void cache_put(B_Tree *btree, unsigned int lba, unsigned char *bytes);
+void cache_drop(B_Tree *btree, unsigned int lba);
+unsigned int find_cached(B_Tree *mytree, void *key);
+
+unsigned int index_get(B_Tree *btree, void *key);
+void index_put(B_Tree *btree, void *key, unsigned int lba);
+
+void warm_drain(B_Tree *btree);
+void warm_wrote(B_Tree *btree);
+void warm_load(B_Tree *btree);
+
+unsigned int value_new(B_Tree *btree, unsigned char *record, unsigned int hint);
+int value_read(B_Tree *btree, unsigned int lba, unsigned char *record);
+int value_write(B_Tree *btree, unsigned int lba, unsigned char *record);
+
 unsigned int get_node_level(Tree_Node *node);
 void print_node(B_Tree *tree, Tree_Node *node);
 
@@ -62,16 +220,81 @@ Write a btree info onto the disk that it is associated with.
 void write_tree(B_Tree *btree)
 {
    unsigned char buf[1024];
+
+   // The bitmap goes out with sector 0
+   if(btree->map != NULL)
+   {
+      map_flush(btree);
+   }
+   memset(buf, 0, 1024);
    // The first 4 bytes are for the key size
    *((unsigned int *)(buf)) = btree->key_size;
    // the next 4 bytes define the root lba
    *((unsigned int *)(buf + 4)) = btree->root_lba;
    // The first free lba on the disk
    *((unsigned long int *)(buf + 8)) = btree->first_free_block;
+   // The key type, tagged so that it can't be mistaken for old garbage
+   *((unsigned int *)(buf + 16)) = B_TREE_KEY_TYPE_TAG | btree->key_type;
+   // And the flags, the same way
+   *((unsigned int *)(buf + 20)) = B_TREE_FLAGS_TAG | btree->flags;
+   // How many sectors the disk has grown to
+   *((unsigned long int *)(buf + 24)) = btree->num_lbas;
+   // The Bloom filter's sectors, its keys, and whether it has all of them
+   if(btree->flags & B_TREE_BLOOM)
+   {
+      *((unsigned int *)(buf + 32)) = btree->bloom_lba;
+      *((unsigned int *)(buf + 36)) = btree->bloom_sectors;
+      *((unsigned long int *)(buf + 40)) = btree->bloom_keys;
+      *((unsigned int *)(buf + 48)) = btree->bloom_current;
+   }
+   // What a buffered tree's detach left of its value run
+   if(btree->vrun_saved)
+   {
+      *((unsigned int *)(buf + 52)) = btree->vrun;
+      *((unsigned int *)(buf + 56)) = btree->vrun_end;
+   }
 
    // Write  the buffer to the disk
    //printf("WARNING: ABOUT TO WRITE INTO JDISK\n");
    jdisk_write(btree->disk, 0, (void*)buf);
+
+   // The superblock owns the root, as far as the compactor is concerned
+   if(btree->compact != NULL)
+   {
+      compact_note(btree, NULL);
+   }
+}
+
+/*
+n sectors at the end of the used space, all of them used: message buffers,
+the runs that a buffered tree's values come from, and Bloom filters.
+*/
+unsigned int buffer_run(B_Tree *btree, int n)
+{
+   unsigned int lba = alloc_run(btree, n);
+
+   if(!(btree->flags & B_TREE_ALLOC))
+   {
+      btree->first_free_block = lba + n;
+      return lba;
+   }
+   for(int i = 1; i < n; ++i)
+   {
+      map_set(btree, lba + i);
+   }
+   return lba;
+}
+
+// Maxkey for a key size and the create flags
+static int keys_per_node(int key_size, int flags)
+{
+   int room = 1024 - 6 - ((flags & B_TREE_BUFFERED) ? 8 : 0);
+
+   if(flags & B_TREE_COUNTED)
+   {
+      return (room - 4) / (key_size + 8);
+   }
+   return room / (key_size + 4);
 }
 
 /*
@@ -86,662 +309,5645 @@ void read_tree(B_Tree *btree)
    btree->key_size = *(unsigned int*)(buf);
    btree->root_lba = *(unsigned int*)(buf + 4);
    btree->first_free_block = *(unsigned long int*)(buf + 8);
-   // allocate space for the root
-   btree->root = malloc(sizeof(Tree_Node));
+   unsigned int tag = *(unsigned int*)(buf + 16);
+   btree->key_type = B_TREE_KEY_BYTES;
+   if((tag & 0xffffff00) == B_TREE_KEY_TYPE_TAG && key_type_size(tag & 0xff) == btree->key_size)
+   {
+      btree->key_type = tag & 0xff;
+   }
+   tag = *(unsigned int*)(buf + 20);
+   btree->flags = 0;
+   if((tag & 0xffffff00) == B_TREE_FLAGS_TAG)
+   {
+      btree->flags = tag & 0xff;
+   }
 
    // num sectors
    btree->num_lbas = btree->size / 1024;
-   // Maxkey
-   btree->keys_per_block =  (1024 - 6) / (btree->key_size + 4);
+   // A file shorter than the size in sector 0 has lost its (sparse) tail: put it back
+   unsigned long grown = *(unsigned long int*)(buf + 24);
+   if(grown > btree->num_lbas && grown <= 0xffffffffUL && jdisk_grow(btree->disk, grown * 1024) == 0)
+   {
+      btree->size = grown * 1024;
+      btree->num_lbas = grown;
+   }
+   if(btree->flags & B_TREE_ALLOC)
+   {
+      map_resize(btree, 0);
+   }
+   // Maxkey -- a buffered tree's internal nodes keep their buffer in the room of one key,
+   // and a counted tree's nodes have a count next to every lba
+   btree->keys_per_block = keys_per_node(btree->key_size, btree->flags);
+   // Maxkey + 1
+   btree->lbas_per_block = btree->keys_per_block + 1;
+   btree->search = pick_search(btree);
+
+   // allocate space for the root - it lives for as long as the tree is attached
+   btree->root = new_node(btree);
 
    // Also read in the root node
    read_node(btree, btree->root, btree->root_lba, NULL);
-}
-
-void write_node(B_Tree *btree, Tree_Node *node)
-{
-   //printf("MAXKEYS: %d, NKEYS: %d\n", btree->keys_per_block, (int) node->nkeys);
-   if(btree->keys_per_block < (int) (node->nkeys))
+   if(btree->flags & B_TREE_BUFFERED)
    {
-      // Check with Plank's msg
-      fprintf(stderr, "Node exceeds MAXKEY.\n");
+      buffer_attach(btree);
+      btree->vrun = *(unsigned int*)(buf + 52);
+      btree->vrun_end = *(unsigned int*)(buf + 56);
+      btree->vrun_saved = (btree->vrun != btree->vrun_end);
    }
-
-   unsigned char buf[1024];
-   // First byte signifying whether the node is internal
-   memcpy(buf,   &(node->internal), 1);
-   // 2nd byte signifying the number of keys in the node
-   memcpy(buf+1, &(node->nkeys), 1);
-
-   int k_sz = btree->key_size;
-   // copying all the keys over to the buffer - but can i just copy all the bytes at once?
-   for(int i = 0; i < (int) (node->nkeys); ++i)
+   if(btree->flags & B_TREE_BLOOM)
    {
-      // Don't forget the offset by 2!
-      memcpy(buf + 2 + (i * k_sz), node->keys[i], k_sz);
-      //printf("COPYING KEY WITH LETTER %c\n", *(node->keys[i]));
+      btree->bloom_lba = *(unsigned int*)(buf + 32);
+      btree->bloom_sectors = *(unsigned int*)(buf + 36);
+      btree->bloom_keys = *(unsigned long int*)(buf + 40);
+      btree->bloom_current = *(unsigned int*)(buf + 48);
+      bloom_load(btree);
    }
+}
 
-   // How many bytes do LBA's occupy in a node (remember about an additional one)
-   unsigned int lba_space_sz = ((int) (btree->keys_per_block) + 1) * sizeof(unsigned int);
-   // Copy over all aba's
-   memcpy(buf + 1024 - lba_space_sz, node->lbas, lba_space_sz);
+/*
+Disk space.
 
-   // Write the buffer into the disk
-   //printf("WARNING: ABOUT TO WRITE INTO JDISK NODE WITH LBA %d\n", node->lba);
-   jdisk_write(btree->disk, node->lba, (void*)buf);
-}
+Sectors are handed out from first_free_block up.  Anything that allocates
+first reserves as many sectors as it could possibly use, before it changes
+anything, so that running out never leaves half an operation on disk.  When
+the disk is too small it grows, by a quarter and at least GROW_MIN sectors, up
+to what an lba (or a value handle) can address.  The new size goes into
+sector 0.
+
+B_TREE_ALLOC trees grow in whole groups, so that every group has its bitmap
+sector, and reserve room for a leaf's run and for skipping a bitmap sector.
+*/
 
+#define GROW_MIN    (16384)
+#define ALLOC_RUN   (16)               /* Sectors a new leaf sets aside for its values */
 
-// Should i pass the parent in here?
-void read_node(B_Tree *btree, Tree_Node *node, unsigned int lba, Tree_Node* parent)
+int reserve(B_Tree *btree, unsigned long n)
 {
+   int alloc = (btree->flags & B_TREE_ALLOC) != 0;
+   unsigned long need, want, max;
 
-   if(node == NULL)
+   if(alloc)
    {
-      fprintf(stderr, "Error: Please pass a pre-allocated node.\n");
-      exit(1);
+      n += 2 * ALLOC_RUN;
+   }
+   need = btree->first_free_block + n;
+   if(need <= btree->num_lbas && (!alloc || btree->num_lbas % ALLOC_GROUP == 0))
+   {
+      return 0;
+   }
+   max = (btree->flags & B_TREE_COMPRESS) ? (1UL << 28) : 0xffffffffUL;
+   want = btree->num_lbas + btree->num_lbas / 4;
+   if(want < btree->num_lbas + GROW_MIN)
+   {
+      want = btree->num_lbas + GROW_MIN;
+   }
+   // Only a partial group to fill out
+   if(need <= btree->num_lbas)
+   {
+      want = btree->num_lbas;
    }
+   if(want < need)
+   {
+      want = need;
+   }
+   if(alloc)
+   {
+      want = (want + ALLOC_GROUP - 1) / ALLOC_GROUP * ALLOC_GROUP;
+      max = max / ALLOC_GROUP * ALLOC_GROUP;
+   }
+   if(want > max)
+   {
+      want = max;
+   }
+   if(need > want || jdisk_grow(btree->disk, want * 1024) != 0)
+   {
+      return -1;
+   }
+   btree->size = want * 1024;
+   btree->num_lbas = want;
+   if(alloc)
+   {
+      map_resize(btree, 1);
+   }
+   write_tree(btree);
+   return 0;
+}
 
-   unsigned char buf[1024];
-   jdisk_read(btree->disk, lba, (void*) buf);
+/*
+The free-space bitmap, for B_TREE_ALLOC trees.
+
+Group g is sectors [g * ALLOC_GROUP, (g+1) * ALLOC_GROUP), and its bitmap is
+the group's last sector, which marks itself used.  A bitmap sector that was
+never written reads as zeros -- all free -- so growing the disk writes
+nothing.  Groups are read the first time an allocation looks at them, and
+the ones that changed are written with sector 0.
+
+Placement: alloc_near() takes the first free sector in the ALLOC_RUN after
+its hint, so a leaf's values and the sibling of a split node land right
+behind it.  When there is none, it goes to the end of the used space -- for a
+leaf, with ALLOC_RUN sectors, of which it uses the first and leaves the rest
+free for its values.
+*/
 
-   // Pretty much doing an inverse of the above function, filling an empty node with data
-   node->internal = buf[0];
-   node->nkeys    = buf[1];
-   node->lba  = lba;
-   // Allocate space for keys
-   node->keys     = malloc((btree->keys_per_block + 1) * sizeof(char *));
-   node->lbas     = malloc((btree->keys_per_block + 2) * sizeof(unsigned int));
-   node->children = malloc((btree->keys_per_block + 2) * sizeof(Tree_Node*));
+#define MAP_UNREAD (0)
+#define MAP_CLEAN  (1)
+#define MAP_DIRTY  (2)
+
+// Sizes the bitmap to the disk.  New groups are either on disk (attach) or brand new.
+void map_resize(B_Tree *btree, int fresh)
+{
+   unsigned long groups = btree->num_lbas / ALLOC_GROUP;
+   unsigned long g;
 
-   int i = 0;
-   for(; i < btree->keys_per_block + 1; ++i)
+   if(groups <= btree->map_groups)
    {
-      // Allocate space for individual keys
-      node->keys[i]  = malloc(btree->key_size);
-      node->children[i]  = NULL;
+      return;
+   }
+   btree->map = realloc(btree->map, groups * 1024);
+   btree->map_state = realloc(btree->map_state, groups);
+   for(g = btree->map_groups; g < groups; g++)
+   {
+      memset(btree->map + g * 1024, 0, 1024);
+      btree->map[g * 1024 + 1023] = 0x80;
+      btree->map_state[g] = fresh ? MAP_CLEAN : MAP_UNREAD;
    }
-   node->children[i]  = NULL;
+   btree->map_groups = groups;
+}
 
-   int k_sz = btree->key_size;
+static unsigned char *map_group(B_Tree *btree, unsigned long g)
+{
+   unsigned char *bits = btree->map + g * 1024;
 
-   // Copying the keys over - but can i just copy all the bytes at once?
-   for(int i = 0; i < (int) (node->nkeys); ++i)
+   if(btree->map_state[g] == MAP_UNREAD)
    {
-      memcpy(node->keys[i], buf + 2 + i * k_sz, k_sz);
+      jdisk_read(btree->disk, g * ALLOC_GROUP + ALLOC_GROUP - 1, bits);
+      bits[1023] |= 0x80;
+      btree->map_state[g] = MAP_CLEAN;
    }
+   return bits;
+}
 
-   // Copy existing lbas into the node
-   memcpy(node->lbas, buf + 1024 - (btree->keys_per_block + 1) * sizeof(unsigned int), ((int) (node->nkeys) + 1) * sizeof(unsigned int));
+static int map_used(B_Tree *btree, unsigned long lba)
+{
+   unsigned char *bits = map_group(btree, lba / ALLOC_GROUP);
 
-   node->parent = parent;
+   lba %= ALLOC_GROUP;
+   return (bits[lba >> 3] >> (lba & 7)) & 1;
 }
 
-/*
-This will just create sector 1, a root node sector.
-*/
-void *b_tree_create(char *filename, long size, int key_size)
+void map_set(B_Tree *btree, unsigned long lba)
 {
-   printf("IN FUNCTION CREATE\n");
-   if(key_size <= 0)
-   {
-      return NULL;
-   }
+   unsigned char *bits = map_group(btree, lba / ALLOC_GROUP);
 
-   // Allocate a tree
-   B_Tree *mytree = malloc(sizeof(B_Tree));
+   btree->map_state[lba / ALLOC_GROUP] = MAP_DIRTY;
+   lba %= ALLOC_GROUP;
+   bits[lba >> 3] |= 1 << (lba & 7);
+}
 
-   void* mydisk = jdisk_create(filename, size);
+void map_clear(B_Tree *btree, unsigned long lba)
+{
+   unsigned char *bits = map_group(btree, lba / ALLOC_GROUP);
 
-   // Fill the elements of a tree structure
+   btree->map_state[lba / ALLOC_GROUP] = MAP_DIRTY;
+   lba %= ALLOC_GROUP;
+   bits[lba >> 3] &= ~(1 << (lba & 7));
+}
 
-   mytree->key_size = key_size;
-   mytree->root_lba = 1;
-   // Root is not the first free node
-   mytree->first_free_block = 2;
+void map_flush(B_Tree *btree)
+{
+   for(unsigned long g = 0; g < btree->map_groups; g++)
+   {
+      if(btree->map_state[g] == MAP_DIRTY)
+      {
+         jdisk_write(btree->disk, g * ALLOC_GROUP + ALLOC_GROUP - 1, btree->map + g * 1024);
+         btree->map_state[g] = MAP_CLEAN;
+      }
+   }
+}
 
-   mytree->disk = mydisk;     
-   mytree->size = size;      
-   mytree->num_lbas = mytree->size / 1024;
-   // Maxkey
-   mytree->keys_per_block = (1024 - 6) / (key_size + 4);
-   // Maxkey + 1
-   mytree->lbas_per_block = mytree->keys_per_block + 1;
+/*
+n sectors at the end of the used space, of which the first is returned and
+marked used.  Runs don't straddle a bitmap sector.
+*/
+unsigned int alloc_run(B_Tree *btree, int n)
+{
+   unsigned long lba = btree->first_free_block;
 
-   /* When find() fails, this is a pointer to the external node */
-   mytree->tmp_e = NULL;             
-   //mytree->tmp_e_index;              /* and the index where the key should have gone */ - leave empty for now?
-   mytree->flush = 0;
+   if(!(btree->flags & B_TREE_ALLOC))
+   {
+      return btree->first_free_block++;
+   }
+   if(lba % ALLOC_GROUP + n >= ALLOC_GROUP)
+   {
+      lba = (lba / ALLOC_GROUP + 1) * ALLOC_GROUP;
+   }
+   btree->first_free_block = lba + n;
+   map_set(btree, lba);
+   return lba;
+}
 
-   // We now need to create a root node
-   Tree_Node *root = malloc(sizeof(Tree_Node));
-   root->nkeys = 0;
-   root->flush = 0;
-   root->internal = 0;
-   root->lba = 1;
-   // just allocate some space for these two
-   root->keys = calloc((mytree->keys_per_block + 1), sizeof(char*));
-   for(int i = 0; i < mytree->keys_per_block + 1; ++i)
+unsigned int alloc_near(B_Tree *btree, unsigned int hint, int run)
+{
+   unsigned long lba;
+
+   if(!(btree->flags & B_TREE_ALLOC))
    {
-      root->keys[i] = calloc(1, mytree->key_size);
+      return btree->first_free_block++;
    }
-   root->lbas = calloc((mytree->keys_per_block + 2), sizeof(unsigned int));
-   root->children = malloc((mytree->keys_per_block + 2) * sizeof(Tree_Node*));
-   for(int i = 0; i < mytree->keys_per_block + 2; ++i)
+   for(lba = hint + 1; hint != 0 && lba <= hint + ALLOC_RUN && lba < btree->first_free_block; lba++)
    {
-      root->children[i] = malloc(sizeof(Tree_Node));
+      if(!map_used(btree, lba))
+      {
+         map_set(btree, lba);
+         return lba;
+      }
    }
-   root->parent = NULL;
-   // What should i do here?
-   //root->ptr;                        /* Free list link */
+   return alloc_run(btree, run);
+}
 
-   mytree->root = root;
-   //mytree->free_list = root;         /* Free list of nodes - i'm guessing that this should point to the root? */
+/*
+The Bloom filter, for B_TREE_BLOOM trees.
+
+It's blocked: a key's hash picks one 64-byte block of the filter, and
+BLOOM_K bits in it, so that a lookup touches one cache line.  The whole
+filter is kept in memory, and find_value() asks it before anything else, so a
+key that was never inserted is almost always turned away without a read.
+insert() adds every key before it goes in, so a key that's in the tree is
+always in the filter.  Keys can't be taken out of it, but nothing removes
+keys from the tree either.
+
+The filter is a run of sectors (buffer_run()), and sector 0 says where, how
+many keys it has, and whether it's current.  Its sectors are only written
+when it's built and at detach: the first add after either writes sector 0
+with current = 0.  Attach reads none of it.  A current filter is read in on
+its first use (bloom_ready()), and one that isn't is rebuilt from the tree's
+keys in the background, while bloom_may() says yes to everything.
+
+When there are fewer than BLOOM_BITS / 2 bits a key, bloom_room() gives the
+filter a new run, twice as big or more, up to BLOOM_MAX sectors, and rebuilds
+it in the background the same way.  The old run is freed in the bitmap with
+B_TREE_ALLOC, and goes back to the free space if it's at the end; otherwise
+it's left behind.  Past BLOOM_MAX, more misses get through.
+*/
 
-   // Actually write stuff on a disk
-   write_tree(mytree);
-   write_node(mytree, root);
+#define BLOOM_MIN  (4)                 /* Sectors in a new tree's filter */
+#define BLOOM_MAX  (4096)              /* The most it grows to, about 3 million keys at BLOOM_BITS / 2 */
+#define BLOOM_BITS (20)                /* Bits a key that a filter is built with */
 
-   return (void *) mytree;
+// hash_key() (b_tree_format.h) for the tree's key size.  The hash index uses it too.
+static unsigned long key_hash(B_Tree *btree, void *key)
+{
+   return hash_key((unsigned char *) key, btree->key_size);
 }
 
-void *b_tree_attach(char *filename)
+// bloom_bits() (b_tree_format.h) on the tree's filter, which notes the sector that changed
+static int bloom_probe(B_Tree *btree, void *key, int set)
 {
-   //printf("INSIDE ATTACH\n");
-   B_Tree *mytree = malloc(sizeof(B_Tree));
-   // Attach some file to an empty disk, associated with a newly-created tree
-   mytree->disk = jdisk_attach(filename);
-
-   // Read that btree
-   read_tree(mytree);
+   unsigned long h = key_hash(btree, key);
+   int n = bloom_bits(btree->bloom, btree->bloom_sectors, h, set);
 
-   return (void *)mytree;
+   if(set && n > 0)
+   {
+      btree->bloom_dirty[bloom_block(h, btree->bloom_sectors) / 16] = 1;
+   }
+   return n;
 }
 
+static void bloom_fill(B_Tree *btree);
 
 /*
-Finding a value associated with a key.
-
-Returns LBA of the val associated with the key.
-If key is not in the tree, returns 0.
+Reads the filter in on its first use, or takes it from the rebuild when
+that's done.  0 while it's still being rebuilt.
 */
-unsigned int b_tree_find(void *b_tree, void *key)
+static int bloom_ready(B_Tree *btree)
 {
-   B_Tree* mytree = ((B_Tree *)b_tree);
+   if(btree->bloom_scan != NULL)
+   {
+      return bloom_scan_take(btree);
+   }
+   if(btree->bloom == NULL)
+   {
+      btree->bloom = malloc(btree->bloom_sectors * 1024UL);
+      btree->bloom_dirty = calloc(btree->bloom_sectors, 1);
+      if(jdisk_read_many(btree->disk, btree->bloom_lba, btree->bloom_sectors, btree->bloom) != 0)
+      {
+         bloom_fill(btree);
+      }
+   }
+   return 1;
+}
 
-   // The node that we keep track of at any iteration
-   Tree_Node *curr_node = mytree->root;
+int bloom_may(B_Tree *btree, void *key)
+{
+   if(!bloom_ready(btree))
+   {
+      return 1;
+   }
+   return bloom_probe(btree, key, 0);
+}
 
-   // Indicator stating whether the key has been identified
-   int found_key = 0;
+void bloom_add(B_Tree *btree, void *key)
+{
+   // While the filter is rebuilt, the keys added go in the part that's in memory
+   bloom_ready(btree);
+   // A key that sets no new bits is most likely there already
+   if(bloom_probe(btree, key, 1) == 0)
+   {
+      return;
+   }
+   // The rebuild counts the keys it finds, and this one may be among them
+   if(btree->bloom_scan == NULL)
+   {
+      btree->bloom_keys++;
+   }
+   if(btree->bloom_current)
+   {
+      btree->bloom_current = 0;
+      write_tree(btree);
+   }
+}
 
-   //printf("\nIN FUNCTION FIND\n");
-   //printf("Nkeys in the root %d\n", (int) (curr_node->nkeys));
-   //printf("Root lba %d\n", curr_node->lba);
-   // Iterate while we're on internal node. Otherswise, return 0
-   while(1)
+// Writes all of the filter, and marks it current.  One that a compaction took out of its run gets a new one.
+void bloom_save(B_Tree *btree)
+{
+   if(btree->bloom_lba == 0)
    {
-      //printf("Looping\n");
-      if(curr_node->nkeys == 0 && found_key == 0)
+      if(reserve(btree, btree->bloom_sectors) != 0)
       {
-         //printf("Early termination\n");
-         // Likely an empty root type situation, nothing was found too
-         mytree->tmp_e = curr_node;
-         return 0;
+         return;
       }
+      btree->bloom_lba = buffer_run(btree, btree->bloom_sectors);
+   }
+   for(unsigned int i = 0; i < btree->bloom_sectors; ++i)
+   {
+      jdisk_write(btree->disk, btree->bloom_lba + i, btree->bloom + i * 1024UL);
+      btree->bloom_dirty[i] = 0;
+   }
+   btree->bloom_current = 1;
+   write_tree(btree);
+}
 
-      if(found_key)
-      {
+// Clears the filter and puts every key of the tree in it, then writes all of it
+static void bloom_fill(B_Tree *btree)
+{
+   unsigned char key[256];
+   unsigned int lba;
 
-         // if we're at an external node, grab the val and return
-         if(!(curr_node->internal))
-         {
-            //printf("FOUND VAL AT LBA %d\n", curr_node->lbas[(int)(curr_node->nkeys)]);
-            return curr_node->lbas[(int)(curr_node->nkeys)];
-         }
+   memset(btree->bloom, 0, btree->bloom_sectors * 1024UL);
+   btree->bloom_keys = 0;
+   void *c = b_tree_cursor(btree, NULL);
+   while(b_tree_cursor_next(c, key, &lba))
+   {
+      bloom_probe(btree, key, 1);
+      btree->bloom_keys++;
+   }
+   b_tree_cursor_free(c);
+   bloom_save(btree);
+}
 
-         // Now we just want to get to the external node asap
-         // So grab the rightmost child
-         // Need to actually read the child node from the disk
+/*
+A new, empty filter of the given size in a run of its own, which nothing is
+written to yet: 0, or -1 if there's no room for it.  The old run is given
+back, as in buffer_close().
+*/
+int bloom_build(B_Tree *btree, unsigned int sectors)
+{
+   unsigned int old = btree->bloom_lba, old_sectors = btree->bloom_sectors;
+
+   // Twice the sectors, in case the run has to skip to the next bitmap group
+   if(reserve(btree, 2 * sectors) != 0)
+   {
+      return -1;
+   }
+   if(old != 0 && !(btree->flags & B_TREE_ALLOC) && old + old_sectors == btree->first_free_block)
+   {
+      btree->first_free_block = old;
+      old = 0;
+   }
+   btree->bloom_lba = buffer_run(btree, sectors);
+   btree->bloom_sectors = sectors;
+   btree->bloom = realloc(btree->bloom, sectors * 1024UL);
+   btree->bloom_dirty = realloc(btree->bloom_dirty, sectors);
+   memset(btree->bloom, 0, sectors * 1024UL);
+   memset(btree->bloom_dirty, 0, sectors);
+   btree->bloom_keys = 0;
+   btree->bloom_current = 0;
+   write_tree(btree);
+   // Only once sector 0 no longer says it's there
+   for(unsigned int i = 0; old != 0 && (btree->flags & B_TREE_ALLOC) && i < old_sectors; ++i)
+   {
+      map_clear(btree, old + i);
+   }
+   return 0;
+}
+
+void bloom_room(B_Tree *btree)
+{
+   unsigned long bits = btree->bloom_sectors * 8192UL;
+   unsigned int sectors = btree->bloom_sectors;
+
+   if(sectors >= BLOOM_MAX || btree->bloom_keys * (BLOOM_BITS / 2) <= bits || !bloom_ready(btree))
+   {
+      return;
+   }
+   while(sectors < BLOOM_MAX && sectors * 8192UL < btree->bloom_keys * BLOOM_BITS)
+   {
+      sectors *= 2;
+   }
+   // Without room, the one there is keeps working, only worse.  Finds go to the
+   // tree until the rebuild is done.
+   if(bloom_build(btree, sectors) == 0 && bloom_scan_start(btree) != 0)
+   {
+      bloom_fill(btree);
+   }
+}
+
+/*
+At attach, which reads none of the filter: a current one is read in on its
+first use, and one that isn't is rebuilt in the background.
+*/
+void bloom_load(B_Tree *btree)
+{
+   if(btree->bloom_current)
+   {
+      return;
+   }
+   btree->bloom = calloc(btree->bloom_sectors, 1024);
+   btree->bloom_dirty = calloc(btree->bloom_sectors, 1);
+   btree->bloom_keys = 0;
+   if(bloom_scan_start(btree) != 0)
+   {
+      bloom_fill(btree);
+   }
+}
+
+// Writes what changed, and marks the filter current.  One that's still being rebuilt stays as it is.
+void bloom_close(B_Tree *btree)
+{
+   if(btree->bloom_scan != NULL)
+   {
+      bloom_scan_stop(btree);
+      return;
+   }
+   if(btree->bloom_current)
+   {
+      return;
+   }
+   if(btree->bloom_lba == 0)
+   {
+      bloom_save(btree);
+      return;
+   }
+   for(unsigned int i = 0; i < btree->bloom_sectors; ++i)
+   {
+      if(btree->bloom_dirty[i])
+      {
+         jdisk_write(btree->disk, btree->bloom_lba + i, btree->bloom + i * 1024UL);
+         btree->bloom_dirty[i] = 0;
+      }
+   }
+   btree->bloom_current = 1;
+   write_tree(btree);
+}
+
+/*
+Compaction moves sectors without knowing which are the filter's, so at its
+start the filter is taken into memory and out of its run: sector 0 says it
+has none, and that it isn't current.  Once every sector is placed,
+bloom_home() gives it the room after them if it fits, where only sectors that
+nothing uses are left, and writes it.
+*/
+void bloom_leave(B_Tree *btree)
+{
+   bloom_ready(btree);
+   btree->bloom_lba = 0;
+   btree->bloom_current = 0;
+   write_tree(btree);
+}
+
+void bloom_home(B_Tree *btree, unsigned int lba, unsigned long room)
+{
+   if(btree->bloom_lba != 0)
+   {
+      return;
+   }
+   if(room >= btree->bloom_sectors)
+   {
+      btree->bloom_lba = lba;
+   }
+   // A rebuild writes it when it's done
+   if(btree->bloom_scan == NULL)
+   {
+      bloom_save(btree);
+   }
+}
+
+/*
+Allocates a node along with its key, lba and children arrays.
+The node is not tracked anywhere - this is what the root uses.
+*/
+Tree_Node *new_node(B_Tree *btree)
+{
+   Tree_Node *node = malloc(sizeof(Tree_Node));
+
+   node->keys     = malloc((btree->keys_per_block + 1) * sizeof(char *));
+   node->lbas     = calloc((btree->keys_per_block + 2), sizeof(unsigned int));
+   node->counts   = calloc((btree->keys_per_block + 2), sizeof(unsigned int));
+   node->children = calloc((btree->keys_per_block + 2), sizeof(Tree_Node*));
+   for(int i = 0; i < btree->keys_per_block + 1; ++i)
+   {
+      // Allocate space for individual keys
+      node->keys[i] = calloc(1, btree->key_size);
+   }
+   node->nkeys = 0;
+   node->flush = 0;
+   node->internal = 0;
+   node->lba = 0;
+   node->parent = NULL;
+   node->parent_index = 0;
+   node->ptr = NULL;
+   node->buffer = 0;
+   node->nmsgs = 0;
+   INST(btree->stats.mallocs += btree->keys_per_block + 6);
+   return node;
+}
+
+/*
+Grabs a node off of the free list (or allocates one) for use in the current operation.
+It goes onto the used list, and gets recycled by release_nodes().
+*/
+Tree_Node *get_node(B_Tree *btree)
+{
+   Tree_Node *node = btree->free_list;
+
+   if(node != NULL)
+   {
+      btree->free_list = node->ptr;
+   }
+   else
+   {
+      node = new_node(btree);
+   }
+   node->ptr = btree->used_list;
+   btree->used_list = node;
+   node->flush = 0;
+   return node;
+}
+
+/*
+Puts every node used by the previous operation back on the free list.
+*/
+void release_nodes(B_Tree *btree)
+{
+   Tree_Node *node;
+
+   while(btree->used_list != NULL)
+   {
+      node = btree->used_list;
+      btree->used_list = node->ptr;
+      node->ptr = btree->free_list;
+      btree->free_list = node;
+   }
+}
+
+// Where a buffered tree's node keeps its buffer's lba and message count: right before the lbas
+static unsigned int *buffer_field(B_Tree *btree, unsigned char *buf)
+{
+   return (unsigned int *) (buf + 1024 - btree->lbas_per_block * sizeof(unsigned int) - 8);
+}
+
+void write_node(B_Tree *btree, Tree_Node *node)
+{
+   //printf("MAXKEYS: %d, NKEYS: %d\n", btree->keys_per_block, (int) node->nkeys);
+   if(btree->keys_per_block < (int) (node->nkeys))
+   {
+      // Check with Plank's msg
+      fprintf(stderr, "Node exceeds MAXKEY.\n");
+   }
+
+   // Build the sector in node->bytes, so that it also serves as the packed copy of the keys
+   unsigned char *buf = node->bytes;
+   // First byte signifying whether the node is internal
+   memcpy(buf,   &(node->internal), 1);
+   // 2nd byte signifying the number of keys in the node
+   memcpy(buf+1, &(node->nkeys), 1);
+
+   int k_sz = btree->key_size;
+   // copying all the keys over to the buffer - but can i just copy all the bytes at once?
+   for(int i = 0; i < (int) (node->nkeys); ++i)
+   {
+      // Don't forget the offset by 2!
+      memcpy(buf + 2 + (i * k_sz), node->keys[i], k_sz);
+      //printf("COPYING KEY WITH LETTER %c\n", *(node->keys[i]));
+   }
+
+   // How many bytes do LBA's occupy in a node (remember about an additional one)
+   unsigned int lba_space_sz = ((int) (btree->keys_per_block) + 1) * sizeof(unsigned int);
+   // Copy over all aba's
+   memcpy(buf + 1024 - lba_space_sz, node->lbas, lba_space_sz);
+   if(btree->flags & B_TREE_COUNTED)
+   {
+      if(node->internal)
+      {
+         memcpy(buf + 1024 - 2 * lba_space_sz, node->counts, lba_space_sz);
+      }
+      else
+      {
+         memset(buf + 1024 - 2 * lba_space_sz, 0, lba_space_sz);
+      }
+   }
+   node->flush = 0;
+   if(btree->flags & B_TREE_BUFFERED)
+   {
+      buffer_field(btree, buf)[0] = (node->internal) ? node->buffer : 0;
+      buffer_field(btree, buf)[1] = (node->internal) ? node->nmsgs : 0;
+   }
+
+   INST(btree->stats.bytes_copied += node->nkeys * k_sz + lba_space_sz);
+
+   // Keep the cached copy of an interior node current
+   if(btree->cache != NULL && node->internal)
+   {
+      cache_put(btree, node->lba, buf);
+   }
+
+   if(btree->compact != NULL)
+   {
+      compact_note(btree, node);
+   }
+
+   // The copy of the rightmost leaf is stale once anything but append() writes it
+   if(btree->tail != NULL && node != btree->tail && node->lba == btree->tail->lba)
+   {
+      btree->tail->lba = 0;
+   }
+
+   // Write the buffer into the disk
+   //printf("WARNING: ABOUT TO WRITE INTO JDISK NODE WITH LBA %d\n", node->lba);
+   INST(double device);
+   INST(long start = inst_io_begin(btree, &device));
+   jdisk_write(btree->disk, node->lba, (void*)buf);
+   INST(btree->stats.node_writes++);
+   if(btree->warm != NULL)
+   {
+      warm_wrote(btree);
+   }
+   if(btree->bloom_scan != NULL)
+   {
+      bloom_scan_wrote(btree, buf + 2, node->nkeys, k_sz, node->internal);
+   }
+   INST(inst_io_end(btree, "write_node", node->lba, start, device));
+}
+
+
+// Should i pass the parent in here?
+void read_node(B_Tree *btree, Tree_Node *node, unsigned int lba, Tree_Node* parent)
+{
+
+   if(node == NULL)
+   {
+      fprintf(stderr, "Error: Please pass a pre-allocated node.\n");
+      exit(1);
+   }
+
+   // Read straight into node->bytes - the keys stay there, packed, for find()
+   unsigned char *buf = node->bytes;
+   Cache_Node *cn = (btree->cache != NULL) ? cache_get(btree, lba) : NULL;
+   if(cn != NULL)
+   {
+      memcpy(buf, cn->bytes, 1024);
+      INST(btree->stats.cache_hits++);
+   }
+   else
+   {
+      INST(double device);
+      INST(long start = inst_io_begin(btree, &device));
+      jdisk_read(btree->disk, lba, (void*) buf);
+      INST(btree->stats.cache_misses++);
+      INST(inst_io_end(btree, "read_node", lba, start, device));
+      if(btree->cache != NULL && buf[0])
+      {
+         cache_put(btree, lba, buf);
+      }
+   }
+
+   // Pretty much doing an inverse of the above function, filling an empty node with data
+   node->internal = buf[0];
+   node->nkeys    = buf[1];
+   node->lba  = lba;
+   // The key, lba and children arrays come preallocated from new_node()
+   for(int i = 0; i < btree->keys_per_block + 2; ++i)
+   {
+      node->children[i]  = NULL;
+   }
+
+   int k_sz = btree->key_size;
+
+   // Copying the keys over - but can i just copy all the bytes at once?
+   for(int i = 0; i < (int) (node->nkeys); ++i)
+   {
+      memcpy(node->keys[i], buf + 2 + i * k_sz, k_sz);
+   }
+
+   // Copy existing lbas into the node
+   memcpy(node->lbas, buf + 1024 - (btree->keys_per_block + 1) * sizeof(unsigned int), ((int) (node->nkeys) + 1) * sizeof(unsigned int));
+   INST(btree->stats.bytes_copied += node->nkeys * k_sz + (node->nkeys + 1) * sizeof(unsigned int));
+   node->buffer = 0;
+   node->nmsgs = 0;
+   if((btree->flags & B_TREE_BUFFERED) && node->internal)
+   {
+      node->buffer = buffer_field(btree, buf)[0];
+      node->nmsgs = buffer_field(btree, buf)[1];
+   }
+   if((btree->flags & B_TREE_COUNTED) && node->internal)
+   {
+      memcpy(node->counts, buf + 1024 - 2 * btree->lbas_per_block * sizeof(unsigned int),
+             ((int) (node->nkeys) + 1) * sizeof(unsigned int));
+   }
+   node->flush = 0;
+
+   node->parent = parent;
+}
+
+/*
+Key types.  Integer keys are stored in native byte order, so the search
+kernels can load and compare them as numbers.
+*/
+int key_type_size(int key_type)
+{
+   switch(key_type)
+   {
+      case B_TREE_KEY_U32:  return 4;
+      case B_TREE_KEY_U64:  return 8;
+      case B_TREE_KEY_U128: return 16;
+   }
+   return 0;
+}
+
+Key_Search pick_search(B_Tree *btree)
+{
+   if(btree->key_type == B_TREE_KEY_BYTES)
+   {
+      return key_search_pick(btree->key_size);
+   }
+   return key_search_pick_native(btree->key_size);
+}
+
+/*
+This will just create sector 1, a root node sector.
+*/
+void *b_tree_create(char *filename, long size, int key_size)
+{
+   return b_tree_create_typed(filename, size, key_size, B_TREE_KEY_BYTES);
+}
+
+void *b_tree_create_typed(char *filename, long size, int key_size, int key_type)
+{
+   return b_tree_create_flags(filename, size, key_size, key_type, 0);
+}
+
+void *b_tree_create_flags(char *filename, long size, int key_size, int key_type, int flags)
+{
+   //printf("IN FUNCTION CREATE\n");
+   if(key_size <= 0)
+   {
+      return NULL;
+   }
+   // Integer keys have to be exactly their size
+   if(key_type != B_TREE_KEY_BYTES && key_type_size(key_type) != key_size)
+   {
+      return NULL;
+   }
+   if((flags & ~(B_TREE_COMPRESS | B_TREE_ALLOC | B_TREE_BSTAR | B_TREE_TOPDOWN | B_TREE_BUFFERED | B_TREE_BLOOM |
+                 B_TREE_COUNTED)) != 0)
+   {
+      return NULL;
+   }
+   // Counts change on the whole path of an insert, which a top-down insert has let go of
+   // and a buffered insert never visits
+   if((flags & B_TREE_COUNTED) && (flags & (B_TREE_TOPDOWN | B_TREE_BUFFERED)))
+   {
+      return NULL;
+   }
+   // B* overflows go to siblings after the fact, which a top-down insert never has,
+   // and a buffered insert doesn't go down to a leaf at all
+   if((flags & B_TREE_BSTAR) && (flags & B_TREE_TOPDOWN))
+   {
+      return NULL;
+   }
+   if((flags & B_TREE_BUFFERED) && (flags & (B_TREE_BSTAR | B_TREE_TOPDOWN)))
+   {
+      return NULL;
+   }
+   // Value handles keep 4 bits for the slot
+   if((flags & B_TREE_COMPRESS) && size / 1024 > (1L << 28))
+   {
+      return NULL;
+   }
+
+   void* mydisk = jdisk_create(filename, size);
+   if(mydisk == NULL)
+   {
+      return NULL;
+   }
+
+   // Allocate a tree
+   B_Tree *mytree = malloc(sizeof(B_Tree));
+
+   // Fill the elements of a tree structure
+
+   mytree->key_size = key_size;
+   mytree->root_lba = 1;
+   // Root is not the first free node -- with the allocator, it has a run like any leaf
+   mytree->first_free_block = (flags & B_TREE_ALLOC) ? 1 + ALLOC_RUN : 2;
+
+   mytree->disk = mydisk;     
+   mytree->size = size;      
+   mytree->num_lbas = mytree->size / 1024;
+   // Maxkey, as in read_tree()
+   mytree->keys_per_block = keys_per_node(key_size, flags);
+   // Maxkey + 1
+   mytree->lbas_per_block = mytree->keys_per_block + 1;
+   mytree->key_type = key_type;
+   mytree->flags = flags;
+   mytree->search = pick_search(mytree);
+
+   /* When find() fails, this is a pointer to the external node */
+   mytree->tmp_e = NULL;             
+   //mytree->tmp_e_index;              /* and the index where the key should have gone */ - leave empty for now?
+   mytree->flush = 0;
+   mytree->free_list = NULL;
+   mytree->used_list = NULL;
+   mytree->compact = NULL;
+   mytree->cache = NULL;
+   mytree->warm = NULL;
+   mytree->index = NULL;
+   mytree->rand = 0x9e3779b97f4a7c15UL;
+   mytree->pack_lba = 0;
+   mytree->map = NULL;
+   mytree->map_state = NULL;
+   mytree->map_groups = 0;
+   mytree->tail = NULL;
+   mytree->append = 0;
+   mytree->rbuf = NULL;
+   mytree->vrun_saved = 0;
+   mytree->bloom = NULL;
+   mytree->bloom_dirty = NULL;
+   mytree->bloom_lba = 0;
+   mytree->bloom_sectors = 0;
+   mytree->bloom_keys = 0;
+   mytree->bloom_current = 1;
+   mytree->bloom_scan = NULL;
+   mytree->filename = strdup(filename);
+
+   // The disk has to have room for sector 0 and the root
+   if(reserve(mytree, 0) != 0)
+   {
+      jdisk_unattach(mydisk);
+      unlink(filename);
+      free(mytree->filename);
+      free(mytree);
+      return NULL;
+   }
+
+   // We now need to create a root node
+   Tree_Node *root = new_node(mytree);
+   root->lba = 1;
+
+   mytree->root = root;
+
+   INST(inst_attach(mytree));
+
+   // Actually write stuff on a disk
+   if(flags & B_TREE_ALLOC)
+   {
+      map_resize(mytree, 1);
+      map_set(mytree, 0);
+      map_set(mytree, 1);
+   }
+   write_tree(mytree);
+   write_node(mytree, root);
+   if(flags & B_TREE_BUFFERED)
+   {
+      buffer_attach(mytree);
+   }
+   // A filter that can't get its sectors is just never used.  An empty tree's is all there.
+   if((flags & B_TREE_BLOOM) && bloom_build(mytree, BLOOM_MIN) != 0)
+   {
+      mytree->flags &= ~B_TREE_BLOOM;
+      write_tree(mytree);
+   }
+   else if(flags & B_TREE_BLOOM)
+   {
+      bloom_save(mytree);
+   }
+
+   return (void *) mytree;
+}
+
+void *b_tree_attach(char *filename)
+{
+   //printf("INSIDE ATTACH\n");
+   void *mydisk = jdisk_attach(filename);
+   if(mydisk == NULL)
+   {
+      return NULL;
+   }
+
+   B_Tree *mytree = malloc(sizeof(B_Tree));
+   // Attach some file to an empty disk, associated with a newly-created tree
+   mytree->disk = mydisk;
+   mytree->size = jdisk_size(mydisk);
+   mytree->tmp_e = NULL;
+   mytree->flush = 0;
+   mytree->free_list = NULL;
+   mytree->used_list = NULL;
+   mytree->compact = NULL;
+   mytree->cache = NULL;
+   mytree->warm = NULL;
+   mytree->index = NULL;
+   mytree->rand = 0x9e3779b97f4a7c15UL;
+   mytree->pack_lba = 0;
+   mytree->map = NULL;
+   mytree->map_state = NULL;
+   mytree->map_groups = 0;
+   mytree->tail = NULL;
+   mytree->append = 0;
+   mytree->rbuf = NULL;
+   mytree->vrun_saved = 0;
+   mytree->bloom = NULL;
+   mytree->bloom_dirty = NULL;
+   mytree->bloom_lba = 0;
+   mytree->bloom_sectors = 0;
+   mytree->bloom_keys = 0;
+   mytree->bloom_current = 1;
+   mytree->bloom_scan = NULL;
+   mytree->filename = strdup(filename);
+
+   INST(inst_attach(mytree));
+
+   // Read that btree
+   read_tree(mytree);
+
+   // Warming the cache happens in the background - attach only reads the manifest
+   warm_load(mytree);
+
+   return (void *)mytree;
+}
+
+
+/*
+Finding a value associated with a key.
+
+Returns LBA of the val associated with the key.
+If key is not in the tree, returns 0.
+*/
+unsigned int b_tree_find(void *b_tree, void *key)
+{
+   unsigned int lba;
+
+   INST(inst_op_begin(b_tree));
+   lba = find_value((B_Tree *) b_tree, key);
+   INST(inst_op_end(b_tree, "find"));
+   return lba;
+}
+
+/*
+A lookup at the start of an operation: with the hash index and the cache if
+they're on.
+*/
+unsigned int find_value(B_Tree *mytree, void *key)
+{
+   unsigned int lba;
+
+   if((mytree->flags & B_TREE_BLOOM) && !bloom_may(mytree, key))
+   {
+      INST(mytree->stats.filtered++);
+      return 0;
+   }
+   if(mytree->warm != NULL)
+   {
+      warm_drain(mytree);
+   }
+   if(mytree->index != NULL && (lba = index_get(mytree, key)) != 0)
+   {
+      return lba;
+   }
+   if(mytree->flags & B_TREE_BUFFERED)
+   {
+      lba = find_buffered(mytree, key);
+   }
+   else if(mytree->cache != NULL)
+   {
+      lba = find_cached(mytree, key);
+   }
+   else
+   {
+      lba = find(mytree, key);
+   }
+   if(mytree->index != NULL)
+   {
+      index_put(mytree, key, lba);
+   }
+   return lba;
+}
+
+/*
+The search itself.  On a miss, leaves the external node in tmp_e for insert().
+*/
+unsigned int find(B_Tree *mytree, void *key)
+{
+
+   // Nodes read by the previous operation are no longer needed
+   release_nodes(mytree);
+
+   // The node that we keep track of at any iteration
+   Tree_Node *curr_node = mytree->root;
+
+   // Indicator stating whether the key has been identified
+   int found_key = 0;
+
+   //printf("\nIN FUNCTION FIND\n");
+   //printf("Nkeys in the root %d\n", (int) (curr_node->nkeys));
+   //printf("Root lba %d\n", curr_node->lba);
+   INST(mytree->stats.cache_hits++);
+   // Iterate while we're on internal node. Otherswise, return 0
+   while(1)
+   {
+      //printf("Looping\n");
+      INST(mytree->stats.nodes_visited++);
+      if(curr_node->nkeys == 0 && found_key == 0)
+      {
+         //printf("Early termination\n");
+         // Likely an empty root type situation, nothing was found too
+         mytree->tmp_e = curr_node;
+         mytree->tmp_e_index = 0;
+         return 0;
+      }
+
+      if(found_key)
+      {
+
+         // if we're at an external node, grab the val and return
+         if(!(curr_node->internal))
+         {
+            //printf("FOUND VAL AT LBA %d\n", curr_node->lbas[(int)(curr_node->nkeys)]);
+            return curr_node->lbas[(int)(curr_node->nkeys)];
+         }
+
+         // Now we just want to get to the external node asap
+         // So grab the rightmost child
+         // Need to actually read the child node from the disk
          //printf("KEY FOUND PREVIOSLY -- LOOKING FOR VAL\n");
          //printf("nkeys in the node %d\n", (int)(curr_node->nkeys));
          // Need to make sure a child node exists
          //if(!curr_node->children[(int)(curr_node->nkeys)])
          //{
-            curr_node->children[(int)(curr_node->nkeys)] = malloc(sizeof(Tree_Node));
+            curr_node->children[(int)(curr_node->nkeys)] = get_node(mytree);
             read_node(mytree,  curr_node->children[(int)(curr_node->nkeys)], curr_node->lbas[(int)(curr_node->nkeys)], curr_node);
          //}
 
-         curr_node = curr_node->children[ (int)(curr_node->nkeys)];
+         curr_node = curr_node->children[ (int)(curr_node->nkeys)];
+      }
+      else
+      {
+         // Search the packed keys: i is the first key >= the one we want
+         int equal;
+         int i = mytree->search(curr_node->bytes + 2, (int)(curr_node->nkeys), mytree->key_size, key, &equal);
+         INST_SLOTS(mytree, i, (int)(curr_node->nkeys));
+
+         // Check if the keys are matching
+         if(equal)
+         {
+            // We've found the key, now we need to find the value (in another node)
+            // In the convention we're using, it will be in the right pointer of the
+            // smaller node.
+            // So we're jumping to the left child and then skipping the key comparison in
+            // any further alg iterations, grabbing the rightmost child right away
+            found_key = 1;
+
+            // If we're at an external node, then we're done lol
+            //printf("FOUND THE KEY AT LBA %d\n", curr_node->lba);
+            if(!(curr_node->internal))
+            {
+               return curr_node->lbas[i];
+            }
+         }
+         else if(!(curr_node->internal))
+         {
+            // The key belongs in front of key i (or at the end, if i == nkeys)
+            // If we're at an external node, no key will be found - terminate
+            //printf("KEY NOT FOUND\n");
+            // pointer to external node, and where the key goes in it
+            mytree->tmp_e = curr_node;
+            mytree->tmp_e_index = i;
+            return 0;
+         }
+
+         // Either way, child i is next: it holds the smaller keys, or the value of key i
+         curr_node->children[i] = get_node(mytree);
+         // Need to actually read the child node from the disk
+         read_node(mytree,  curr_node->children[i], curr_node->lbas[i], curr_node);
+         // split() uses this to put the middle key into the parent without searching
+         curr_node->children[i]->parent_index = i;
+         curr_node = curr_node->children[i];
+      }
+   }
+
+   // Means we've somehow failed
+   //printf("SOME ISSUE OCCURED\n");
+   return -1;
+}
+
+/*
+Opens a gap at index i. The unused key buffer at the end
+rotates down into slot i, so that the caller can memcpy a key into it.
+*/
+void shift_node_dat(Tree_Node *node, int i)
+{
+   int j = (int) (node->nkeys);
+   unsigned char *spare = node->keys[j];
+   // Iterate from the end of all lists
+   // remember that there's an additional lba and child
+   node->children[j+1] = node->children[j];
+   node->lbas[j+1] = node->lbas[j];
+   node->counts[j+1] = node->counts[j];
+
+   //printf("SHIFTING LAST LBA %d\n", node->lbas[j+1]);
+   j -= 1;
+
+   for(; j >= i; --j)
+   {
+      node->keys[j + 1] = node->keys[j];
+      node->lbas[j + 1] = node->lbas[j];
+      node->counts[j + 1] = node->counts[j];
+      node->children[j + 1] = node->children[j];
+   }
+   node->keys[i] = spare;
+}
+
+/*
+B_TREE_COUNTED: every internal node has, next to each child's lba, the number
+of keys under the child -- its keys, and its children's counts, all the way
+down.  A leaf has no counts.  An insert adds to the counts on its whole path
+(count_path()) and marks those nodes to flush; a split or a B* spread counts
+the nodes it makes from their own keys and counts (node_count()), and writes
+them as usual; and at the end count_flush() writes the nodes on the path that
+nothing else wrote.  So an insert of a new key writes every node on its path.
+Rewriting a value changes no count.
+*/
+
+// Keys in node and under it
+static unsigned long node_count(Tree_Node *node)
+{
+   unsigned long n = node->nkeys;
+
+   if(node->internal)
+   {
+      for(int i = 0; i <= (int)(node->nkeys); ++i)
+      {
+         n += node->counts[i];
+      }
+   }
+   return n;
+}
+
+// n more keys under node: the counts above it go up, and their nodes need writing
+static void count_path(Tree_Node *node, int n)
+{
+   for(; node->parent != NULL; node = node->parent)
+   {
+      node->parent->counts[node->parent_index] += n;
+      node->parent->flush = 1;
+   }
+}
+
+// Writes the nodes of the operation that have counts to write
+static void count_flush(B_Tree *btree)
+{
+   for(Tree_Node *node = btree->used_list; node != NULL; node = node->ptr)
+   {
+      if(node->flush)
+      {
+         write_node(btree, node);
+      }
+   }
+   if(btree->root->flush)
+   {
+      write_node(btree, btree->root);
+   }
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+#define APPEND_FILL (90)             /* Percent of the keys an append's split leaves behind, see append() */
+
+unsigned int split(B_Tree *mytree, Tree_Node *node_found)
+{
+
+
+      //printf("WARNING: SPLITTING NODE\n");
+      //b_tree_print_tree(mytree);
+
+      // oh boy here we fucking go - need to split
+      
+      // grab a midpoint of keys
+      // this will be the key that we will be moving up
+      int midkey = (int)(node_found->nkeys) / 2;
+
+      // An append only splits nodes on the right edge, and leaves the new one nearly empty
+      if(mytree->append)
+      {
+         int skew = (int)(node_found->nkeys) * APPEND_FILL / 100;
+         if(skew > (int)(node_found->nkeys) - 2)
+         {
+            skew = (int)(node_found->nkeys) - 2;
+         }
+         if(skew > midkey)
+         {
+            midkey = skew;
+         }
+      }
+
+      INST(inst_split(mytree, mytree->depth_base + get_node_level(node_found)));
+
+      // make an empty node
+      // everything from the right to it gets copied to a new node
+      Tree_Node *newnode = get_node(mytree);
+      // now, make copies
+      // copying keys
+      int k = midkey + 1, m = 0;
+      for(; k < (int) (node_found->nkeys); ++k, ++m)
+      {
+         memcpy(newnode->keys[m], node_found->keys[k], mytree->key_size);
+         INST(mytree->stats.bytes_copied += mytree->key_size);
+         newnode->lbas[m] = node_found->lbas[k];
+         newnode->counts[m] = node_found->counts[k];
+         //memcpy(newnode->children[m], node_found->children[k], sizeof(Tree_Node*));
+
+         // we also need to update the old node here
+         node_found->lbas[k] = 0;
+         newnode->children[m] = node_found->children[k];
+         node_found->children[k] = NULL;
+      }
+      // one additional child and LBA
+      newnode->lbas[m] = node_found->lbas[k];
+      newnode->counts[m] = node_found->counts[k];
+      newnode->children[m] = node_found->children[k];
+      node_found->children[k] = NULL;
+      //memcpy(newnode->children[m], node_found->children[k], sizeof(Tree_Node*));
+      
+      newnode->nkeys = (char) (k - midkey - 1);
+      //newnode->flush = 0;
+      if(node_found -> internal)
+      {
+         newnode->internal = 1;   
+      }
+      else
+      {
+         newnode->internal = 0;
+      }
+      // A leaf gets a run for its values, an internal node goes next to its sibling
+      newnode->lba = (newnode->internal) ? alloc_near(mytree, node_found->lba, 1)
+                                        : alloc_near(mytree, node_found->lba, ALLOC_RUN);
+
+      // A buffered tree's flush holds on to the nodes below, so they follow their keys.
+      // (Elsewhere children[] can still point at nodes from earlier operations.)
+      newnode->buffer = 0;
+      newnode->nmsgs = 0;
+      if(mytree->flags & B_TREE_BUFFERED)
+      {
+         for(m = 0; m <= (int)(newnode->nkeys) && newnode->internal; ++m)
+         {
+            if(newnode->children[m] != NULL)
+            {
+               newnode->children[m]->parent = newnode;
+               newnode->children[m]->parent_index = m;
+            }
+         }
+         if(newnode->internal)
+         {
+            newnode->buffer = buffer_run(mytree, BUFFER_SECTORS);
+         }
+      }
+
+      // Make sure that the rightmost links of the updated nodes point where they are supposed to
+      //newnode->lbas[(int) newnode->nkeys] = 0;
+
+      int split_parent = 0;
+      // previous node exists
+      if(node_found->parent != NULL)
+      { 
+         //printf("PREV NODE'S PARENT EXISTS\n");
+
+         //printf("PREV NODE'S PARENT EXISTS\n");
+         // the midkey key goes right where our own pointer is in the parent
+         int n = node_found->parent_index;
+
+         // shift everything to the right
+         shift_node_dat(node_found->parent, n);
+
+         // place the new data at n
+         memcpy(node_found->parent->keys[n], node_found->keys[midkey], mytree->key_size);
+         INST(mytree->stats.bytes_copied += mytree->key_size);
+         // the shift here works a bit weird
+         node_found->parent->lbas[n] = node_found->lba;
+         node_found->parent->lbas[n + 1] = newnode->lba;
+
+         node_found->parent->children[n] = node_found;
+         node_found->parent->children[n + 1] = newnode;
+
+         newnode->parent = node_found->parent;
+         newnode->parent_index = n + 1;
+         node_found->parent->nkeys = (char) (((int) node_found->parent->nkeys) + 1);
+         if(mytree->flags & B_TREE_BUFFERED)
+         {
+            buffer_renumber(node_found->parent, n + 2);
+         }
+
+         if(node_found->parent->nkeys > mytree->keys_per_block)
+         {
+            split_parent = 1;
+         }
+      }
+      else
+      {
+         //printf("WARNING: PREV NODE'S PARENT IS NULL\n");
+         //We need to create a parent node in this case
+         // this will be the new root node then, so brace urself lol
+         // The old root becomes an ordinary node, recycled at the end of the operation
+         node_found->ptr = mytree->used_list;
+         mytree->used_list = node_found;
+         node_found->parent = new_node(mytree);
+
+         node_found->parent->parent = NULL;
+         node_found->parent->nkeys = 1;
+         node_found->parent->internal = 1;
+
+         // place the new data at i
+         memcpy(node_found->parent->keys[0], node_found->keys[midkey], mytree->key_size);
+         INST(mytree->stats.bytes_copied += mytree->key_size);
+         // the shift here works a bit weird
+         node_found->parent->lbas[0] = node_found->lba;
+         node_found->parent->lbas[1] = newnode->lba;
+
+         node_found->parent->children[0] = node_found;
+         node_found->parent->children[1] = newnode;
+         node_found->parent_index = 0;
+
+         newnode->parent = node_found->parent;
+         newnode->parent_index = 1;
+
+         // need to update the btree now
+         mytree->root = node_found->parent;
+
+         newnode->parent->lba = alloc_run(mytree, 1);
+
+         mytree->root_lba = node_found->parent->lba;
+         if(mytree->flags & B_TREE_BUFFERED)
+         {
+            buffer_root(mytree);
+         }
+      }
+      // update the number of keys in the old node
+      node_found->nkeys = (char)(midkey);
+      if(mytree->flags & B_TREE_COUNTED)
+      {
+         node_found->parent->counts[node_found->parent_index] = node_count(node_found);
+         node_found->parent->counts[newnode->parent_index] = node_count(newnode);
+      }
+
+      //printf("WRITING PARENT BEGIN\n");
+      // Now, write the node_found->parent and newnode
+
+      //printf("/-----------------------------------------FINAL ROOT UPDATE %d\n", mytree->root_lba);
+     //mytree->root_lba = node_found->parent->lba;
+
+      // The parent's split may move node_found to the new half of it, but this one is left to write
+      Tree_Node *parent = node_found->parent;
+      if(split_parent)
+      {
+         overflow(mytree, parent);
+      }
+
+      write_node(mytree, parent);
+      //printf("WRITING PARENT END\n");
+
+      write_node(mytree, newnode);
+
+      //printf("IMPORTANT: node_found->parent lba: %d\n", node_found->parent->lba);
+   
+   // write node_found and btree
+   //write_node(mytree, node_found);
+   //mytree->root_lba = node_found->parent->lba;
+   //printf("/-----------------------------------------FINAL ROOT UPDATE %d\n", mytree->root_lba);
+      write_tree(mytree);
+
+      //return val_lba;
+}
+
+/*
+B_TREE_TOPDOWN: insert in one pass from the root down.  A full node is split
+before the descent goes into it, so its parent always has room for the middle
+key and no split goes back up.  The insert holds only the node it's in, its
+parent and a new sibling: release_node() puts the others back on the free list
+as soon as the descent is past them, and cuts the parent pointer to them.
+
+Each split reserves its own sectors.  So when the disk can't grow, an insert
+may return 0 with some nodes already split, but with the tree whole and the key
+not in it.  The root has to have room for a split, so this needs three keys per
+node; with fewer, insert() falls back to the usual two passes.
+*/
+static void release_node(B_Tree *btree, Tree_Node *node)
+{
+   Tree_Node **p;
+
+   for(p = &btree->used_list; *p != NULL; p = &((*p)->ptr))
+   {
+      if(*p == node)
+      {
+         *p = node->ptr;
+         node->ptr = btree->free_list;
+         btree->free_list = node;
+         return;
+      }
+   }
+}
+
+/*
+The value of a key that's in node.  The key is key i, or one of the node's
+separators when i is the node's nkeys.
+*/
+static unsigned int topdown_value(B_Tree *mytree, Tree_Node *node, int i)
+{
+   Tree_Node *child;
+
+   // Its value is in the last leaf under child i
+   while(node->internal)
+   {
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[i], NULL);
+      if(node != mytree->root)
+      {
+         release_node(mytree, node);
+      }
+      node = child;
+      i = node->nkeys;
+   }
+   return node->lbas[i];
+}
+
+unsigned int insert_topdown(B_Tree *mytree, void *key, void *record)
+{
+   Tree_Node *node = mytree->root, *child;
+   int rightmost = 1;
+   int equal, i;
+   unsigned int lba;
+
+   release_nodes(mytree);
+   INST(mytree->depth_base = 0);
+   while(1)
+   {
+      if((int)(node->nkeys) == mytree->keys_per_block)
+      {
+         // A new node, and maybe a new root
+         if(reserve(mytree, 2) != 0)
+         {
+            return 0;
+         }
+         split(mytree, node);
+         write_node(mytree, node);
+
+         // The parent now has the middle key at the node's index, and the new node after it
+         Tree_Node *parent = node->parent;
+         int n = node->parent_index;
+         int cmp = b_tree_compare(mytree, key, parent->keys[n]);
+         if(cmp == 0)
+         {
+            lba = topdown_value(mytree, node, node->nkeys);
+            return (value_write(mytree, lba, record) != 0) ? 0 : lba;
+         }
+         if(cmp > 0)
+         {
+            release_node(mytree, node);
+            node = parent->children[n + 1];
+         }
+         else
+         {
+            release_node(mytree, parent->children[n + 1]);
+            rightmost = 0;
+         }
+      }
+
+      i = mytree->search(node->bytes + 2, (int)(node->nkeys), mytree->key_size, key, &equal);
+      INST(mytree->stats.nodes_visited++);
+      INST_SLOTS(mytree, i, (int)(node->nkeys));
+      if(equal)
+      {
+         lba = (node->internal) ? topdown_value(mytree, node, i) : node->lbas[i];
+         return (value_write(mytree, lba, record) != 0) ? 0 : lba;
+      }
+      if(!node->internal)
+      {
+         break;
+      }
+
+      rightmost = rightmost && (i == (int)(node->nkeys));
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[i], node);
+      child->parent_index = i;
+      node->children[i] = child;
+
+      // Done with the node's parent.  Nothing will look above the node again.
+      if(node->parent != NULL)
+      {
+         if(node->parent != mytree->root)
+         {
+            release_node(mytree, node->parent);
+         }
+         node->parent = NULL;
+         INST(mytree->depth_base++);
+      }
+      node = child;
+   }
+
+   // The leaf has room: the value is all that needs a sector
+   if(reserve(mytree, 1) != 0)
+   {
+      return 0;
+   }
+   lba = value_new(mytree, record, node->lba);
+   shift_node_dat(node, i);
+   memcpy(node->keys[i], key, mytree->key_size);
+   INST(mytree->stats.bytes_copied += mytree->key_size);
+   node->lbas[i] = lba;
+   node->children[i] = NULL;
+   node->nkeys = (unsigned char) ((int)(node->nkeys) + 1);
+   write_node(mytree, node);
+   write_tree(mytree);
+
+   if(rightmost && i + 1 == (int)(node->nkeys) && node != mytree->root && mytree->compact == NULL)
+   {
+      tail_set(mytree, node);
+   }
+   return lba;
+}
+
+/*
+B_TREE_BSTAR: an overflowing node first gives keys to a sibling next to it
+that has room (the left one, then the right one), so that the two end up even
+and the parent only gets a new separator key.  When the siblings are full too,
+the node and one of them become three nodes, each two thirds full, instead of
+two half full ones.  The root, and appends (see append()), still split.
+
+Either way works on the keys of both siblings and the separator between them
+laid end to end, as if they were one node: spread_join() puts them in a scratch
+array, and spread_deal() hands out a range of it to a node.  A leaf's last lba
+is the value of the separator after it, which is what keeps this the same for
+leaves and internal nodes.
+*/
+#define SPREAD_KEYS (3 * 1024)         /* Two nodes' keys and a separator, as bytes */
+#define SPREAD_LBAS (2 * 256 + 4)
+
+static int spread_join(B_Tree *mytree, Tree_Node *a, Tree_Node *b, unsigned char *sep,
+                       unsigned char *keys, unsigned int *lbas, unsigned int *counts)
+{
+   int ks = mytree->key_size;
+   int n = 0;
+
+   for(int i = 0; i < (int)(a->nkeys); ++i, ++n)
+   {
+      memcpy(keys + n * ks, a->keys[i], ks);
+   }
+   memcpy(keys + n * ks, sep, ks);
+   n++;
+   for(int i = 0; i < (int)(b->nkeys); ++i, ++n)
+   {
+      memcpy(keys + n * ks, b->keys[i], ks);
+   }
+   memcpy(lbas, a->lbas, ((int)(a->nkeys) + 1) * sizeof(unsigned int));
+   memcpy(lbas + a->nkeys + 1, b->lbas, ((int)(b->nkeys) + 1) * sizeof(unsigned int));
+   memcpy(counts, a->counts, ((int)(a->nkeys) + 1) * sizeof(unsigned int));
+   memcpy(counts + a->nkeys + 1, b->counts, ((int)(b->nkeys) + 1) * sizeof(unsigned int));
+   INST(mytree->stats.bytes_copied += 2 * (n * ks + (n + 1) * sizeof(unsigned int)));
+   return n;
+}
+
+// Keys [from, to) and the lbas around them, and their counts unless counts is NULL (leaves)
+static void spread_deal(B_Tree *mytree, Tree_Node *node, unsigned char *keys, unsigned int *lbas,
+                        unsigned int *counts, int from, int to)
+{
+   for(int i = from; i < to; ++i)
+   {
+      memcpy(node->keys[i - from], keys + i * mytree->key_size, mytree->key_size);
+      node->children[i - from] = NULL;
+   }
+   memcpy(node->lbas, lbas + from, (to - from + 1) * sizeof(unsigned int));
+   if(counts != NULL)
+   {
+      memcpy(node->counts, counts + from, (to - from + 1) * sizeof(unsigned int));
+   }
+   node->children[to - from] = NULL;
+   node->nkeys = (unsigned char) (to - from);
+}
+
+/*
+Evens out a and b, the children on either side of the parent's key p.
+*/
+static void spread_even(B_Tree *mytree, Tree_Node *node, Tree_Node *a, Tree_Node *b, int p)
+{
+   unsigned char keys[SPREAD_KEYS];
+   unsigned int lbas[SPREAD_LBAS], counts[SPREAD_LBAS];
+   Tree_Node *parent = node->parent;
+
+   int n = spread_join(mytree, a, b, parent->keys[p], keys, lbas, counts);
+   int m = n / 2;
+
+   INST(mytree->stats.redistributions++);
+   spread_deal(mytree, a, keys, lbas, counts, 0, m);
+   memcpy(parent->keys[p], keys + m * mytree->key_size, mytree->key_size);
+   spread_deal(mytree, b, keys, lbas, counts, m + 1, n);
+   if(mytree->flags & B_TREE_COUNTED)
+   {
+      parent->counts[p] = node_count(a);
+      parent->counts[p + 1] = node_count(b);
+   }
+
+   write_node(mytree, (a == node) ? b : a);
+   write_node(mytree, parent);
+}
+
+/*
+Turns a and b, the children on either side of the parent's key p, into three nodes.
+*/
+static void spread_three(B_Tree *mytree, Tree_Node *node, Tree_Node *a, Tree_Node *b, int p)
+{
+   unsigned char keys[SPREAD_KEYS];
+   unsigned int lbas[SPREAD_LBAS], counts[SPREAD_LBAS];
+   Tree_Node *parent = node->parent;
+
+   int n = spread_join(mytree, a, b, parent->keys[p], keys, lbas, counts);
+   int m1 = (n - 2) / 3;
+   int m2 = m1 + 1 + (n - 2 - m1) / 2;
+
+   INST(inst_split(mytree, get_node_level(node)));
+
+   Tree_Node *c = get_node(mytree);
+   c->internal = b->internal;
+   c->lba = (c->internal) ? alloc_near(mytree, b->lba, 1) : alloc_near(mytree, b->lba, ALLOC_RUN);
+   c->parent = parent;
+   c->parent_index = p + 2;
+
+   spread_deal(mytree, a, keys, lbas, counts, 0, m1);
+   spread_deal(mytree, b, keys, lbas, counts, m1 + 1, m2);
+   spread_deal(mytree, c, keys, lbas, counts, m2 + 1, n);
+
+   // a and b keep their places in the parent, with the first separator between them
+   memcpy(parent->keys[p], keys + m1 * mytree->key_size, mytree->key_size);
+   shift_node_dat(parent, p + 1);
+   memcpy(parent->keys[p + 1], keys + m2 * mytree->key_size, mytree->key_size);
+   parent->lbas[p + 2] = c->lba;
+   parent->children[p + 2] = c;
+   parent->nkeys = (unsigned char) ((int)(parent->nkeys) + 1);
+   if(mytree->flags & B_TREE_COUNTED)
+   {
+      parent->counts[p] = node_count(a);
+      parent->counts[p + 1] = node_count(b);
+      parent->counts[p + 2] = node_count(c);
+   }
+
+   if(a != node)
+   {
+      write_node(mytree, a);
+   }
+   if(b != node)
+   {
+      write_node(mytree, b);
+   }
+   write_node(mytree, c);
+   if((int)(parent->nkeys) > mytree->keys_per_block)
+   {
+      overflow(mytree, parent);
+   }
+   write_node(mytree, parent);
+}
+
+/*
+Deals with a node that has one key too many, the way the tree's flags say.  Like
+split(), it writes everything it changes but the node itself.
+*/
+void overflow(B_Tree *mytree, Tree_Node *node)
+{
+   Tree_Node *parent = node->parent;
+   Tree_Node *left = NULL, *right = NULL;
+
+   // Three nodes need at least a key each from two full ones
+   if(!(mytree->flags & B_TREE_BSTAR) || mytree->append || parent == NULL || mytree->keys_per_block < 3)
+   {
+      split(mytree, node);
+      return;
+   }
+
+   int p = node->parent_index;
+   if(p > 0)
+   {
+      left = get_node(mytree);
+      read_node(mytree, left, parent->lbas[p - 1], parent);
+      left->parent_index = p - 1;
+      if((int)(left->nkeys) < mytree->keys_per_block)
+      {
+         spread_even(mytree, node, left, node, p - 1);
+         return;
+      }
+   }
+   if(p < (int)(parent->nkeys))
+   {
+      right = get_node(mytree);
+      read_node(mytree, right, parent->lbas[p + 1], parent);
+      right->parent_index = p + 1;
+      if((int)(right->nkeys) < mytree->keys_per_block)
+      {
+         spread_even(mytree, node, node, right, p);
+         return;
+      }
+      spread_three(mytree, node, node, right, p);
+      return;
+   }
+   spread_three(mytree, node, left, node, p - 1);
+}
+
+/*
+B_TREE_BUFFERED: a write-optimized tree, after Bε-trees.  Every internal node
+has a message buffer, BUFFER_SECTORS sectors of (value lba, key) pairs for
+inserts that haven't got down to their leaves yet.  An insert of a new key
+below an internal root writes its value and appends a message to the root's
+buffer.  When a buffer is full, buffer_flush() sorts it and sends it down a
+level at once: the messages for an internal child are appended to its buffer
+(which is flushed first if they don't fit), and a leaf gets all of its
+inserts in one write, splitting into as many nodes as it takes.  A lookup
+checks the buffers on its way down, newest message first.
+
+A message goes where find() would look for its key: to child i when it equals
+key i, so a separator's value ends up in the last lba of the leaf before it.
+Only new keys become messages.  An insert looks its key up first, in the hash
+index and then down the buffers and nodes, and a key that's there has its
+value written in place, as in any other tree: it keeps its lba, and no value
+sector is left behind.  With B_TREE_BLOOM, a key the filter has never seen
+skips the lookup.  So a key has one message at most, and a message never
+meets its key in a leaf; buffer_leaf() still lets the newest win if it does.
+
+An internal node's sector has its buffer's first sector and message count in
+the 8 bytes before the lbas (buffer_field()), which takes the room of a key.
+A buffer sector is a 2-byte count, 2 bytes of padding, and the messages.  The
+root's buffer is kept in memory, in rbuf, and its count in the root's sector
+isn't kept up to date: buffer_attach() counts the messages in the sectors,
+which is why the root's full sectors are always followed by one with a count
+of 0.  Raw values come from runs of BUFFER_VALUES sectors, so that sector 0
+is written once a run rather than once an insert.  Detach gives back the rest
+of the run, or keeps it in sector 0 for the next attach (buffer_close()).
+
+A flush reserves sectors a leaf at a time.  If the disk can't grow, the
+messages that haven't gone down go back into the buffers they came from, and
+an insert that finds the root's buffer still full returns 0.  A node that
+splits during a flush has nothing in its buffer: the flush that reaches it is
+either flushing it, or started below an empty buffer.
+*/
+#define BUFFER_VALUES (64)             /* Sectors in a run of raw values */
+#define BUFFER_RETRY  (1)              /* buffer_push() made room, and the messages have to go again */
+
+static int buffer_flush(B_Tree *mytree, Tree_Node *node);
+
+static int buffer_per(B_Tree *mytree)
+{
+   return (1024 - 4) / (mytree->key_size + 4);
+}
+
+static int buffer_cap(B_Tree *mytree)
+{
+   return BUFFER_SECTORS * buffer_per(mytree);
+}
+
+// Message i in the sectors of a buffer
+static unsigned char *buffer_msg(B_Tree *mytree, unsigned char *sectors, int i)
+{
+   int per = buffer_per(mytree);
+
+   return sectors + (i / per) * 1024 + 4 + (i % per) * (mytree->key_size + 4);
+}
+
+/*
+Reads in the root's buffer, and counts its messages.  Also used by create.
+*/
+void buffer_attach(B_Tree *btree)
+{
+   int per = buffer_per(btree);
+   unsigned short count;
+
+   btree->rbuf = calloc(BUFFER_SECTORS, 1024);
+   btree->vrun = 0;
+   btree->vrun_end = 0;
+   btree->vrun_saved = 0;
+   btree->drained = 0;
+   if(btree->root->buffer == 0)
+   {
+      btree->root->nmsgs = 0;
+      return;
+   }
+   jdisk_read_many(btree->disk, btree->root->buffer, BUFFER_SECTORS, btree->rbuf);
+   btree->root->nmsgs = 0;
+   for(int s = 0; s < BUFFER_SECTORS; ++s)
+   {
+      memcpy(&count, btree->rbuf + s * 1024, 2);
+      btree->root->nmsgs += (count > per) ? per : count;
+      if(count < per)
+      {
+         break;
+      }
+   }
+}
+
+/*
+Gives back the sectors of the value run that no value got, at detach, so
+that they aren't left behind.  With B_TREE_ALLOC they're freed in the
+bitmap, and a run that's still at the end goes back to the free space.
+Otherwise sector 0 keeps the rest of the run, and the next attach carries on
+with it.
+*/
+void buffer_close(B_Tree *btree)
+{
+   if(btree->vrun == btree->vrun_end)
+   {
+      return;
+   }
+   if(btree->flags & B_TREE_ALLOC)
+   {
+      for(unsigned int lba = btree->vrun; lba < btree->vrun_end; ++lba)
+      {
+         map_clear(btree, lba);
+      }
+   }
+   else if(btree->vrun_end == btree->first_free_block)
+   {
+      btree->first_free_block = btree->vrun;
+   }
+   else
+   {
+      btree->vrun_saved = 1;
+      write_tree(btree);
+      return;
+   }
+   btree->vrun = btree->vrun_end;
+   write_tree(btree);
+}
+
+/*
+A new root, made by split(), gets an empty buffer.
+*/
+void buffer_root(B_Tree *mytree)
+{
+   Tree_Node *root = mytree->root;
+
+   root->buffer = buffer_run(mytree, BUFFER_SECTORS);
+   root->nmsgs = 0;
+   memset(mytree->rbuf, 0, 1024);
+   jdisk_write(mytree->disk, root->buffer, mytree->rbuf);
+}
+
+/*
+Children from index from on have moved over in node.
+*/
+void buffer_renumber(Tree_Node *node, int from)
+{
+   for(int i = from; i <= (int)(node->nkeys); ++i)
+   {
+      if(node->children[i] != NULL)
+      {
+         node->children[i]->parent_index = i;
+      }
+   }
+}
+
+// The sectors of node's buffer: the root's are in memory, anyone else's are read in one I/O
+static unsigned char *buffer_sectors(B_Tree *mytree, Tree_Node *node, unsigned char *buf)
+{
+   int per = buffer_per(mytree);
+
+   if(node == mytree->root)
+   {
+      return mytree->rbuf;
+   }
+   if(node->nmsgs > 0)
+   {
+      INST(double device);
+      INST(long start = inst_io_begin(mytree, &device));
+      jdisk_read_many(mytree->disk, node->buffer, (node->nmsgs + per - 1) / per, buf);
+      INST(inst_io_end(mytree, "read_buffer", node->buffer, start, device));
+   }
+   return buf;
+}
+
+/*
+Appends n messages to node's buffer, which must have room, and writes the
+sectors that changed.  Not the node's own sector, which has the count.
+*/
+static void buffer_add(B_Tree *mytree, Tree_Node *node, unsigned char *msgs, int n)
+{
+   unsigned char local[BUFFER_SECTORS * 1024];
+   unsigned char *sectors = (node == mytree->root) ? mytree->rbuf : local;
+   int per = buffer_per(mytree);
+   int ms = mytree->key_size + 4;
+   int c = node->nmsgs;
+   int first = c / per;
+   int last;
+   unsigned short count;
+
+   if(sectors == local && c % per != 0)
+   {
+      jdisk_read(mytree->disk, node->buffer + first, local + first * 1024);
+   }
+   for(int i = 0; i < n; ++i, ++c)
+   {
+      memcpy(buffer_msg(mytree, sectors, c), msgs + i * ms, ms);
+   }
+   node->nmsgs = c;
+   last = (c == 0) ? 0 : (c - 1) / per;
+   // The root's count ends at a sector that isn't full
+   if(sectors == mytree->rbuf && c % per == 0 && c / per < BUFFER_SECTORS)
+   {
+      last = c / per;
+   }
+   if(n == 0 && sectors == local)
+   {
+      return;
+   }
+   for(int s = first; s <= last; ++s)
+   {
+      count = (c - s * per > per) ? per : c - s * per;
+      memcpy(sectors + s * 1024, &count, 2);
+      memset(sectors + s * 1024 + 2, 0, 2);
+      jdisk_write(mytree->disk, node->buffer + s, sectors + s * 1024);
+   }
+   if(mytree->bloom_scan != NULL)
+   {
+      bloom_scan_wrote(mytree, msgs + 4, n, ms, 1);
+   }
+}
+
+// The newest message for key in node's buffer, 0 if there is none
+static unsigned int buffer_lookup(B_Tree *mytree, Tree_Node *node, void *key)
+{
+   unsigned char buf[BUFFER_SECTORS * 1024], *sectors, *m;
+   unsigned int lba;
+
+   if(node->nmsgs == 0)
+   {
+      return 0;
+   }
+   sectors = buffer_sectors(mytree, node, buf);
+   for(int i = node->nmsgs - 1; i >= 0; --i)
+   {
+      m = buffer_msg(mytree, sectors, i);
+      if(b_tree_compare(mytree, key, m + 4) == 0)
+      {
+         memcpy(&lba, m, 4);
+         return lba;
+      }
+   }
+   return 0;
+}
+
+// Sorts messages by key.  It's a merge sort, so a key's messages stay oldest first.
+static void buffer_sort(B_Tree *mytree, unsigned char *msgs, unsigned char *tmp, int n)
+{
+   int ms = mytree->key_size + 4;
+   int h = n / 2, a = 0, b = h, o = 0;
+
+   if(n < 2)
+   {
+      return;
+   }
+   buffer_sort(mytree, msgs, tmp, h);
+   buffer_sort(mytree, msgs + h * ms, tmp, n - h);
+   while(a < h || b < n)
+   {
+      if(b == n || (a < h && b_tree_compare(mytree, msgs + a * ms + 4, msgs + b * ms + 4) <= 0))
+      {
+         memcpy(tmp + o * ms, msgs + a++ * ms, ms);
+      }
+      else
+      {
+         memcpy(tmp + o * ms, msgs + b++ * ms, ms);
+      }
+      o++;
+   }
+   memcpy(msgs, tmp, n * ms);
+}
+
+// The first of node's keys that is >= key, or nkeys.  Works on keys[], which a flush keeps changing.
+static int buffer_search(B_Tree *mytree, Tree_Node *node, void *key)
+{
+   int lo = 0, hi = node->nkeys, mid;
+
+   while(lo < hi)
+   {
+      mid = (lo + hi) / 2;
+      if(b_tree_compare(mytree, node->keys[mid], key) < 0)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+// The largest key that can go under node: the separator after it, or NULL on the right edge
+static unsigned char *node_bound(Tree_Node *node)
+{
+   for(; node->parent != NULL; node = node->parent)
+   {
+      if(node->parent_index < (int)(node->parent->nkeys))
+      {
+         return node->parent->keys[node->parent_index];
+      }
+   }
+   return NULL;
+}
+
+// The node after node on its level.  Only asked for the halves of a node that split, which are all in memory.
+static Tree_Node *buffer_next(Tree_Node *node)
+{
+   Tree_Node *parent = node->parent;
+
+   if(node->parent_index < (int)(parent->nkeys))
+   {
+      return parent->children[node->parent_index + 1];
+   }
+   return buffer_next(parent)->children[0];
+}
+
+/*
+Puts piece into the parent of prev, right after it, with sep between them.
+The parent splits if it has to.  Returns the node that's left to write:
+the parent, or the half of it that split() doesn't write.
+*/
+static Tree_Node *buffer_link(B_Tree *mytree, Tree_Node *prev, Tree_Node *piece, unsigned char *sep)
+{
+   Tree_Node *parent = prev->parent;
+   int n = prev->parent_index;
+
+   shift_node_dat(parent, n);
+   memcpy(parent->keys[n], sep, mytree->key_size);
+   INST(mytree->stats.bytes_copied += mytree->key_size);
+   parent->lbas[n + 1] = piece->lba;
+   parent->children[n] = prev;
+   parent->children[n + 1] = piece;
+   piece->parent = parent;
+   piece->parent_index = n + 1;
+   parent->nkeys = (unsigned char) ((int)(parent->nkeys) + 1);
+   buffer_renumber(parent, n + 2);
+   if((int)(parent->nkeys) > mytree->keys_per_block)
+   {
+      split(mytree, parent);
+   }
+   return parent;
+}
+
+/*
+Merges messages g[0..gn), sorted, into a leaf, and writes it.  A leaf that
+gets too many keys becomes as many even nodes as it takes, and its parent
+gets a separator for each new one.  Returns 0, or -1 with nothing changed if
+the disk can't grow.
+*/
+static int buffer_leaf(B_Tree *mytree, Tree_Node *leaf, unsigned char *g, int gn)
+{
+   int ks = mytree->key_size, ms = ks + 4, kpb = mytree->keys_per_block;
+   unsigned char *keys = malloc((kpb + gn) * ks);
+   unsigned int *lbas = malloc((kpb + gn + 1) * sizeof(unsigned int));
+   unsigned char *bound = node_bound(leaf);
+   unsigned char *m;
+   unsigned int last = leaf->lbas[leaf->nkeys];
+   int n = 0, a = 0, b, p, level;
+
+   for(b = 0; b < gn; ++b)
+   {
+      m = g + b * ms;
+      // Only the newest message for a key counts
+      if(b + 1 < gn && b_tree_compare(mytree, m + 4, m + ms + 4) == 0)
+      {
+         continue;
+      }
+      while(a < (int)(leaf->nkeys) && b_tree_compare(mytree, leaf->keys[a], m + 4) < 0)
+      {
+         memcpy(keys + n * ks, leaf->keys[a], ks);
+         lbas[n++] = leaf->lbas[a++];
+      }
+      // The separator after the leaf: its value is the leaf's last lba
+      if(bound != NULL && b_tree_compare(mytree, m + 4, bound) == 0)
+      {
+         memcpy(&last, m, 4);
+         continue;
+      }
+      if(a < (int)(leaf->nkeys) && b_tree_compare(mytree, leaf->keys[a], m + 4) == 0)
+      {
+         a++;
+      }
+      memcpy(keys + n * ks, m + 4, ks);
+      memcpy(lbas + n++, m, 4);
+   }
+   for(; a < (int)(leaf->nkeys); ++a, ++n)
+   {
+      memcpy(keys + n * ks, leaf->keys[a], ks);
+      lbas[n] = leaf->lbas[a];
+   }
+   lbas[n] = last;
+   INST(mytree->stats.bytes_copied += n * (ks + sizeof(unsigned int)));
+
+   // p nodes of at most kpb keys, and a separator between each two
+   p = (n <= kpb) ? 1 : (n + kpb + 1) / (kpb + 1);
+   level = get_node_level(leaf);
+   if(reserve(mytree, (p - 1) * (((mytree->flags & B_TREE_ALLOC) ? ALLOC_RUN : 1) + level * (1 + BUFFER_SECTORS))
+                      + 1 + BUFFER_SECTORS) != 0)
+   {
+      free(keys);
+      free(lbas);
+      return -1;
+   }
+
+   Tree_Node *prev = leaf, *piece, *dirty = NULL, *parent;
+   int stay = n - (p - 1);
+   int from = 0, to;
+   for(int q = 0; q < p; ++q)
+   {
+      to = from + stay / p + (q < stay % p);
+      if(q == 0)
+      {
+         spread_deal(mytree, leaf, keys, lbas, NULL, from, to);
+      }
+      else
+      {
+         INST(inst_split(mytree, level));
+         piece = get_node(mytree);
+         piece->internal = 0;
+         piece->buffer = 0;
+         piece->nmsgs = 0;
+         piece->lba = alloc_near(mytree, prev->lba, ALLOC_RUN);
+         spread_deal(mytree, piece, keys, lbas, NULL, from, to);
+         parent = buffer_link(mytree, prev, piece, keys + (from - 1) * ks);
+         if(dirty != NULL && dirty != parent)
+         {
+            write_node(mytree, dirty);
+         }
+         dirty = parent;
+         write_node(mytree, piece);
+         prev = piece;
+      }
+      from = to + 1;
+   }
+   write_node(mytree, leaf);
+   if(dirty != NULL)
+   {
+      write_node(mytree, dirty);
+   }
+   free(keys);
+   free(lbas);
+   return 0;
+}
+
+/*
+Sends messages g[0..gn), sorted, down to child j of node.  Returns 0, -1 if
+the disk is full, or BUFFER_RETRY if the child's own buffer had to be flushed
+to make room: that can split the child, so the messages have to be sent again.
+*/
+static int buffer_push(B_Tree *mytree, Tree_Node *node, int j, unsigned char *g, int gn)
+{
+   Tree_Node *child = node->children[j];
+
+   if(child == NULL || child->lba != node->lbas[j])
+   {
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[j], node);
+      node->children[j] = child;
+   }
+   child->parent = node;
+   child->parent_index = j;
+   if(!child->internal)
+   {
+      return buffer_leaf(mytree, child, g, gn);
+   }
+
+   // Bulk loaded nodes get their buffers when they first need them
+   if(child->buffer == 0)
+   {
+      if(reserve(mytree, BUFFER_SECTORS) != 0)
+      {
+         return -1;
+      }
+      child->buffer = buffer_run(mytree, BUFFER_SECTORS);
+   }
+   if(child->nmsgs + gn <= buffer_cap(mytree))
+   {
+      buffer_add(mytree, child, g, gn);
+      write_node(mytree, child);
+      return 0;
+   }
+   if(buffer_flush(mytree, child) != 0)
+   {
+      return -1;
+   }
+   return BUFFER_RETRY;
+}
+
+/*
+Sends all of node's messages down a level.  node's parents have to be in
+memory, up to the root.  Returns 0, or -1 if the disk is full: then the
+messages that are left are back in the buffers of node and the nodes it split
+into.
+*/
+static int buffer_flush(B_Tree *mytree, Tree_Node *node)
+{
+   unsigned char buf[BUFFER_SECTORS * 1024];
+   int ms = mytree->key_size + 4;
+   int n = node->nmsgs;
+   unsigned char *msgs = malloc(2 * n * ms);
+   unsigned char *sectors = buffer_sectors(mytree, node, buf);
+   unsigned char *hi;
+   Tree_Node *cur;
+   int i, j, k, rv;
+
+   INST(mytree->stats.flushes++);
+   INST(mytree->stats.messages += n);
+   for(i = 0; i < n; ++i)
+   {
+      memcpy(msgs + i * ms, buffer_msg(mytree, sectors, i), ms);
+   }
+   buffer_sort(mytree, msgs, msgs + n * ms, n);
+   node->nmsgs = 0;
+
+   cur = node;
+   i = 0;
+   rv = 0;
+   while(i < n)
+   {
+      // Splits can have put the next messages' keys in one of the nodes that node split into
+      while((hi = node_bound(cur)) != NULL && b_tree_compare(mytree, msgs + i * ms + 4, hi) > 0)
+      {
+         cur = buffer_next(cur);
+      }
+      j = buffer_search(mytree, cur, msgs + i * ms + 4);
+      if(j < (int)(cur->nkeys))
+      {
+         hi = cur->keys[j];
+      }
+      for(k = i + 1; k < n && (hi == NULL || b_tree_compare(mytree, msgs + k * ms + 4, hi) <= 0); ++k) ;
+
+      rv = buffer_push(mytree, cur, j, msgs + i * ms, k - i);
+      if(rv == BUFFER_RETRY)
+      {
+         continue;
+      }
+      if(rv != 0)
+      {
+         break;
+      }
+      i = k;
+   }
+
+   // What's left (nothing, unless the disk is full) goes back where it came from
+   cur = node;
+   while(1)
+   {
+      hi = node_bound(cur);
+      for(k = i; k < n && (hi == NULL || b_tree_compare(mytree, msgs + k * ms + 4, hi) <= 0); ++k) ;
+      if(k > i || cur == node)
+      {
+         buffer_add(mytree, cur, msgs + i * ms, k - i);
+         if(cur != mytree->root)
+         {
+            write_node(mytree, cur);
+         }
+      }
+      i = k;
+      if(i == n)
+      {
+         break;
+      }
+      cur = buffer_next(cur);
+   }
+   free(msgs);
+   write_tree(mytree);
+   return (rv == 0) ? 0 : -1;
+}
+
+// Nodes from earlier operations are gone, and the root mustn't point at them
+static void buffer_begin(B_Tree *mytree)
+{
+   release_nodes(mytree);
+   memset(mytree->root->children, 0, (mytree->keys_per_block + 2) * sizeof(Tree_Node *));
+}
+
+// A raw value goes in the next sector of the current run, so that only a new run changes sector 0
+static unsigned int buffer_value(B_Tree *mytree, unsigned char *record)
+{
+   unsigned long first_free = mytree->first_free_block;
+   unsigned int lba;
+
+   if(mytree->flags & B_TREE_COMPRESS)
+   {
+      if(reserve(mytree, 1) != 0)
+      {
+         return 0;
+      }
+      lba = value_new(mytree, record, 0);
+      if(mytree->first_free_block != first_free)
+      {
+         write_tree(mytree);
+      }
+      return lba;
+   }
+   if(mytree->vrun == mytree->vrun_end)
+   {
+      if(reserve(mytree, BUFFER_VALUES) != 0)
+      {
+         return 0;
+      }
+      mytree->vrun = buffer_run(mytree, BUFFER_VALUES);
+      mytree->vrun_end = mytree->vrun + BUFFER_VALUES;
+      write_tree(mytree);
+   }
+   // A run that sector 0 kept has to come out of it before a value goes in it
+   else if(mytree->vrun_saved)
+   {
+      mytree->vrun_saved = 0;
+      write_tree(mytree);
+   }
+   lba = mytree->vrun++;
+   jdisk_write(mytree->disk, lba, record);
+   return lba;
+}
+
+/*
+fresh says the Bloom filter had never seen key, so it can't be in the tree.
+Otherwise the key is looked up first: one that's there keeps its lba, and
+its value is written in place.
+*/
+unsigned int insert_buffered(B_Tree *mytree, void *key, void *record, int fresh)
+{
+   Tree_Node *root;
+   unsigned char msg[4 + 256];
+   unsigned int lba;
+
+   if(!fresh)
+   {
+      lba = (mytree->index != NULL) ? index_get(mytree, key) : 0;
+      if(lba == 0)
+      {
+         lba = find_buffered(mytree, key);
+      }
+      if(lba != 0)
+      {
+         return (value_write(mytree, lba, record) != 0) ? 0 : lba;
+      }
+   }
+
+   buffer_begin(mytree);
+   root = mytree->root;
+
+   // A bulk loaded root gets its buffer now
+   if(root->buffer == 0)
+   {
+      if(reserve(mytree, BUFFER_SECTORS) != 0)
+      {
+         return 0;
+      }
+      buffer_root(mytree);
+      write_node(mytree, root);
+      write_tree(mytree);
+   }
+   if(root->nmsgs == buffer_cap(mytree))
+   {
+      buffer_flush(mytree, root);
+      buffer_begin(mytree);
+      root = mytree->root;
+      if(root->nmsgs == buffer_cap(mytree))
+      {
+         return 0;
+      }
+   }
+
+   lba = buffer_value(mytree, record);
+   if(lba == 0)
+   {
+      return 0;
+   }
+   memcpy(msg, &lba, 4);
+   memcpy(msg + 4, key, mytree->key_size);
+   buffer_add(mytree, root, msg, 1);
+   mytree->drained = 0;
+   return lba;
+}
+
+unsigned int find_buffered(B_Tree *mytree, void *key)
+{
+   Tree_Node *node = mytree->root, *child;
+   int found = 0, i, equal;
+   unsigned int lba;
+
+   release_nodes(mytree);
+   while(node->internal)
+   {
+      INST(mytree->stats.nodes_visited++);
+      lba = buffer_lookup(mytree, node, key);
+      if(lba != 0)
+      {
+         return lba;
+      }
+      // Once the key is found, its value is in the last leaf under child i
+      if(found)
+      {
+         i = node->nkeys;
+      }
+      else
+      {
+         i = mytree->search(node->bytes + 2, (int)(node->nkeys), mytree->key_size, key, &equal);
+         INST_SLOTS(mytree, i, (int)(node->nkeys));
+         found = equal;
+      }
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[i], node);
+      node = child;
+   }
+   INST(mytree->stats.nodes_visited++);
+   if(found)
+   {
+      return node->lbas[(int)(node->nkeys)];
+   }
+   i = mytree->search(node->bytes + 2, (int)(node->nkeys), mytree->key_size, key, &equal);
+   INST_SLOTS(mytree, i, (int)(node->nkeys));
+   return (equal) ? node->lbas[i] : 0;
+}
+
+/*
+Flushes the buffers of node and everything under it, top down.  below is how
+many levels there are under node.  Returns -1 if the disk filled up.
+*/
+static int buffer_drain_walk(B_Tree *mytree, Tree_Node *node, int below)
+{
+   Tree_Node *child;
+
+   if(node->nmsgs > 0 && buffer_flush(mytree, node) != 0)
+   {
+      return -1;
+   }
+   if(below == 1)
+   {
+      return 0;
+   }
+   // node can gain keys as its children split, which the loop picks up
+   for(int i = 0; i <= (int)(node->nkeys); ++i)
+   {
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[i], node);
+      child->parent_index = i;
+      node->children[i] = child;
+      if(buffer_drain_walk(mytree, child, below - 1) != 0)
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/*
+Empties every buffer.  A root that splits leaves its new half behind, so
+this goes again until the tree's height stays the same.  Returns 0, or -1 if
+the disk is full.
+*/
+int buffer_drain(B_Tree *mytree)
+{
+   Tree_Node *node, *child;
+   unsigned int root_lba;
+   int height, rv;
+
+   while(!mytree->drained)
+   {
+      buffer_begin(mytree);
+      height = 1;
+      for(node = mytree->root; node->internal; node = child, height++)
+      {
+         child = get_node(mytree);
+         read_node(mytree, child, node->lbas[0], node);
+      }
+      root_lba = mytree->root_lba;
+      buffer_begin(mytree);
+      rv = (height > 1) ? buffer_drain_walk(mytree, mytree->root, height - 1) : 0;
+      release_nodes(mytree);
+      if(rv != 0)
+      {
+         fprintf(stderr, "b_tree: the disk is full, and messages are left in buffers\n");
+         return -1;
+      }
+      mytree->drained = (mytree->root_lba == root_lba);
+   }
+   return 0;
+}
+
+unsigned int b_tree_insert(void *b_tree, void *key, void *record)
+{
+   unsigned int lba;
+
+   INST(inst_op_begin(b_tree));
+   if(((B_Tree *) b_tree)->warm != NULL)
+   {
+      warm_drain((B_Tree *) b_tree);
+   }
+   lba = insert((B_Tree *) b_tree, key, record);
+   index_put((B_Tree *) b_tree, key, lba);
+   INST(inst_op_end(b_tree, "insert"));
+   return lba;
+}
+
+unsigned int insert(B_Tree *mytree, void *key, void *record)
+{
+   
+   //printf("\nFUNCTION: INSERT BEGIN\n");
+
+   //printf("SIZE OF THE TREE: %d\n", mytree->size);
+   //printf("MAXKEY: %d\n", mytree->keys_per_block);
+   //printf("PRINTING TREE BEFORE INSERTING\n");
+   //b_tree_print_tree((void*)mytree);
+
+   int fresh = 0;
+   if(mytree->flags & B_TREE_BLOOM)
+   {
+      fresh = !bloom_may(mytree, key);
+      bloom_room(mytree);
+      bloom_add(mytree, key);
+   }
+
+   // A key past the end of the rightmost leaf skips the descent
+   Tree_Node *tail = mytree->tail;
+   if(tail != NULL && tail->lba != 0 && mytree->compact == NULL &&
+      (int)(tail->nkeys) < mytree->keys_per_block &&
+      b_tree_compare(mytree, key, tail->keys[(int)(tail->nkeys) - 1]) > 0)
+   {
+      return append(mytree, key, record);
+   }
+
+   if((mytree->flags & B_TREE_TOPDOWN) && mytree->keys_per_block >= 3)
+   {
+      return insert_topdown(mytree, key, record);
+   }
+
+   // Until the root splits, a buffered tree has nowhere to buffer
+   if((mytree->flags & B_TREE_BUFFERED) && mytree->root->internal)
+   {
+      return insert_buffered(mytree, key, record, fresh);
+   }
+
+   int lba = find(mytree, key);
+
+   if(lba) 
+   {
+      // key found, p, place record into val
+      //printf("WARNING: ABOUT TO WRITE INTO JDISK\n");
+      if(value_write(mytree, lba, record) != 0)
+      {
+         return 0;
+      }
+      // Nothing in sector 0 changed, so it isn't written
+
+      //printf("PRINTING TREE AFTER INSERTING\n");
+      //b_tree_print_tree(mytree);
+
+      // Do we need to update the btree itself now?
+      return lba;
+   }
+   else
+   {
+      // We need to find an appropriate place for the record to be inserted
+      // suppose we've found the external node where this key belongs 
+      Tree_Node *node_found = mytree->tmp_e;
+
+      // find() already searched the node for where the key goes
+      int i = mytree->tmp_e_index;
+
+      // Room for the value, a split on every level and a new root (with its buffer) -- or nothing happens
+      if(reserve(mytree, get_node_level(node_found) + 3 + ((mytree->flags & B_TREE_BUFFERED) ? BUFFER_SECTORS : 0)) != 0)
+      {
+         return 0;
+      }
+
+      // An append goes after the last key of the rightmost leaf
+      mytree->append = (i == (int)(node_found->nkeys));
+      for(Tree_Node *n = node_found; mytree->append && n->parent != NULL; n = n->parent)
+      {
+         mytree->append = (n->parent_index == (int)(n->parent->nkeys));
+      }
+
+      // shift all keys to the right by one 
+      // in the same loop, shift all the lbas and children
+
+      shift_node_dat(node_found, i);
+
+      // write data, which also gives us its lba
+      unsigned int val_lba = value_new(mytree, record, node_found->lba);
+
+      // place the new data at i
+      //printf("Inserting at key %d (maxkeys %d) with start letter %c\n", i, mytree->keys_per_block, *(char*)key);
+      memcpy(node_found->keys[i], key, mytree->key_size);
+      INST(mytree->stats.bytes_copied += mytree->key_size);
+      node_found->lbas[i] = val_lba;
+      node_found->children[i] = NULL;
+
+      node_found->nkeys = (unsigned char) ((int) (node_found ->nkeys) + 1);
+      //printf("CURRENT NUMBER OF KEYS %d\n", node_found->nkeys);
+      if(mytree->flags & B_TREE_COUNTED)
+      {
+         count_path(node_found, 1);
+      }
+
+      // check if we've exceeded maxkey
+      int split_node = ((int)(node_found->nkeys) > mytree->keys_per_block);
+      if(split_node)
+      {
+         overflow(mytree, node_found);
+      }
+
+      // write node_found and btree
+      write_node(mytree, node_found);
+      if(mytree->flags & B_TREE_COUNTED)
+      {
+         count_flush(mytree);
+      }
+      //printf("ROOT LBA IS %d\n", mytree->root_lba);
+      write_tree(mytree);
+
+      // The next append can go straight to this leaf.  After a split, the leaf is
+      // the new node, and the next append through find() picks it up.  Not when the
+      // nodes above would need their counts.
+      if(mytree->append && !split_node && node_found != mytree->root && mytree->compact == NULL &&
+         !(mytree->flags & B_TREE_COUNTED))
+      {
+         tail_set(mytree, node_found);
+      }
+      mytree->append = 0;
+
+      //printf("ROOT LBA IS %d\n", mytree->root_lba);
+
+      //printf("PRINTING TREE AFTER INSERTING\n");
+      //b_tree_print_tree((void*)mytree);
+
+      //printf("FUNCTION: INSERT END\n\n");
+      //printf("/------------------------------INSERTING AT %d\n", val_lba);
+      return val_lba;
+   }
+   return -1;
+}
+
+/*
+Appends.  With increasing keys, like timestamps, every insert goes at the end
+of the rightmost leaf.  Once one has gone there through find(), insert() keeps
+a copy of the leaf in tail, and the ones after it go straight into the copy
+without a descent, until it fills.  write_node() drops the copy when anything
+else writes the leaf, and compaction drops it too.  (A root that's a leaf is
+never the copy: it's in memory already.)
+
+A split that an append causes leaves APPEND_FILL percent of the keys in the old
+node rather than half, and so does every split above it on the right edge, so
+that the nodes behind the appends stay nearly full.
+*/
+void tail_set(B_Tree *mytree, Tree_Node *node)
+{
+   Tree_Node *tail = mytree->tail;
+
+   if(tail == NULL)
+   {
+      tail = new_node(mytree);
+      mytree->tail = tail;
+   }
+   for(int i = 0; i < (int)(node->nkeys); ++i)
+   {
+      memcpy(tail->keys[i], node->keys[i], mytree->key_size);
+   }
+   memcpy(tail->lbas, node->lbas, ((int)(node->nkeys) + 1) * sizeof(unsigned int));
+   INST(mytree->stats.bytes_copied += node->nkeys * mytree->key_size + (node->nkeys + 1) * sizeof(unsigned int));
+   tail->nkeys = node->nkeys;
+   tail->internal = 0;
+   tail->lba = node->lba;
+}
+
+unsigned int append(B_Tree *mytree, void *key, void *record)
+{
+   Tree_Node *tail = mytree->tail;
+   int i = (int)(tail->nkeys);
+
+   // The leaf has room, so only the value needs a sector
+   if(reserve(mytree, 1) != 0)
+   {
+      return 0;
+   }
+   INST(mytree->stats.appends++);
+
+   unsigned int val_lba = value_new(mytree, record, tail->lba);
+
+   shift_node_dat(tail, i);
+   memcpy(tail->keys[i], key, mytree->key_size);
+   INST(mytree->stats.bytes_copied += mytree->key_size);
+   tail->lbas[i] = val_lba;
+   tail->nkeys = (unsigned char) (i + 1);
+
+   write_node(mytree, tail);
+   write_tree(mytree);
+   return val_lba;
+}
+
+/*
+Batches.  insert_run() finds the leaf for the first key of a batch, and then
+puts the keys after it into that leaf without a descent, as long as they keep
+increasing, stay below the separator after the leaf, and the leaf has room.
+The leaf and sector 0 are written once for the whole run, so a sorted batch
+writes each leaf it touches about once.  A key that's there only gets its
+value rewritten.  A full leaf goes through insert(), to split, and so does
+everything while a buffered tree has a root buffer or a compaction runs.
+*/
+static int insert_run(B_Tree *mytree, int n, void **keys, void **records, unsigned int *lbas)
+{
+   unsigned int lba;
+   int i, j, added = 0;
+
+   INST(inst_op_begin(mytree));
+   // The filter only grows between runs, since that scans the tree
+   if(mytree->flags & B_TREE_BLOOM)
+   {
+      bloom_room(mytree);
+   }
+   if(((mytree->flags & B_TREE_BUFFERED) && mytree->root->internal) || mytree->compact != NULL ||
+      (lba = find(mytree, keys[0])) != 0 || (int)(mytree->tmp_e->nkeys) >= mytree->keys_per_block)
+   {
+      lba = insert(mytree, keys[0], records[0]);
+      index_put(mytree, keys[0], lba);
+      INST(inst_op_end(mytree, "insert"));
+      if(lbas != NULL)
+      {
+         lbas[0] = lba;
+      }
+      return (lba != 0);
+   }
+
+   Tree_Node *leaf = mytree->tmp_e;
+   unsigned char *bound = node_bound(leaf);
+
+   i = mytree->tmp_e_index;
+   for(j = 0; j < n; ++j)
+   {
+      if(j > 0)
+      {
+         if(b_tree_compare(mytree, keys[j], keys[j-1]) <= 0 ||
+            (bound != NULL && b_tree_compare(mytree, keys[j], bound) >= 0))
+         {
+            break;
+         }
+         while(i < (int)(leaf->nkeys) && b_tree_compare(mytree, leaf->keys[i], keys[j]) < 0)
+         {
+            ++i;
+         }
+      }
+
+      if(i < (int)(leaf->nkeys) && b_tree_compare(mytree, leaf->keys[i], keys[j]) == 0)
+      {
+         lba = leaf->lbas[i];
+         if(value_write(mytree, lba, records[j]) != 0)
+         {
+            break;
+         }
+      }
+      else
+      {
+         if((int)(leaf->nkeys) >= mytree->keys_per_block || reserve(mytree, 1) != 0)
+         {
+            break;
+         }
+         if(mytree->flags & B_TREE_BLOOM)
+         {
+            bloom_add(mytree, keys[j]);
+         }
+         shift_node_dat(leaf, i);
+         lba = value_new(mytree, records[j], leaf->lba);
+         memcpy(leaf->keys[i], keys[j], mytree->key_size);
+         INST(mytree->stats.bytes_copied += mytree->key_size);
+         leaf->lbas[i] = lba;
+         leaf->children[i] = NULL;
+         leaf->nkeys = (unsigned char) ((int)(leaf->nkeys) + 1);
+         added++;
+      }
+      index_put(mytree, keys[j], lba);
+      if(lbas != NULL)
+      {
+         lbas[j] = lba;
+      }
+   }
+
+   if(j > 0)
+   {
+      write_node(mytree, leaf);
+      if((mytree->flags & B_TREE_COUNTED) && added > 0)
+      {
+         count_path(leaf, added);
+         count_flush(mytree);
+      }
+      write_tree(mytree);
+      INST(mytree->stats.inserts += j - 1);
+      INST(mytree->stats.batched += j - 1);
+   }
+   INST(inst_op_end(mytree, "insert"));
+   return j;
+}
+
+int b_tree_insert_batch(void *b_tree, int n, void **keys, void **records, unsigned int *lbas)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   int j, k;
+
+   if(mytree->warm != NULL)
+   {
+      warm_drain(mytree);
+   }
+   for(j = 0; j < n; j += k)
+   {
+      k = insert_run(mytree, n - j, keys + j, records + j, (lbas == NULL) ? NULL : lbas + j);
+      if(k == 0)
+      {
+         break;
+      }
+   }
+   return j;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/*
+Value sectors.
+
+Without B_TREE_COMPRESS a value is a sector of its own, and its lba is the
+sector.  With it, value_new() cuts off the value's trailing zeros and
+compresses the rest, and if that comes to PACK_MAX bytes or less, appends it
+to the open pack sector; otherwise the value gets a sector as before.  The
+lba is then a handle: sector << 4 | slot, with slot 0 for a sector of its own.
+
+A pack sector is nslots (byte 0), the end of its data (bytes 2-3), and for
+each slot its offset and length (2 bytes each), then the data.  A slot can
+hold up to the next slot's offset (or the end), so a value that's rewritten
+stays where it is as long as it still fits.  When it doesn't, it moves to a
+sector of its own and the slot gets that sector's lba and length PACK_FORWARD,
+so the handle in the leaf never changes.  Every slot has room for at least
+the 4 bytes of a forward.
+
+New sectors come from alloc_near(), with the leaf's sector as the hint.
+*/
+
+#define PACK_MAX     ((1024 - PACK_HEADER) / 2)
+
+static unsigned short *pack_slot(unsigned char *pack, int slot)
+{
+   return (unsigned short *) (pack + 4 + 4 * slot);
+}
+
+static int pack_room(unsigned char *pack, int slot)
+{
+   unsigned short end = *(unsigned short *)(pack + 2);
+
+   if(slot + 1 < pack[0])
+   {
+      end = pack_slot(pack, slot + 1)[0];
+   }
+   return end - pack_slot(pack, slot)[0];
+}
+
+// Where a forwarded slot's value went.  Slots aren't aligned.
+static unsigned int pack_forward(unsigned char *pack, unsigned short *sl)
+{
+   unsigned int lba;
+
+   memcpy(&lba, pack + sl[0], 4);
+   return lba;
+}
+
+// Compressed size of a record into out, or -1 if it's bigger than PACK_MAX
+static int value_compress(unsigned char *record, unsigned char *out)
+{
+   int n;
+
+   for(n = 1024; n > 0 && record[n-1] == 0; n--) ;
+   return lz_compress(record, n, out, PACK_MAX);
+}
+
+unsigned int value_new(B_Tree *btree, unsigned char *record, unsigned int hint)
+{
+   unsigned char z[PACK_MAX];
+   unsigned short *sl, end;
+   unsigned int lba;
+   int len, room, slot;
+
+   if(!(btree->flags & B_TREE_COMPRESS))
+   {
+      lba = alloc_near(btree, hint, 1);
+      jdisk_write(btree->disk, lba, record);
+      return lba;
+   }
+
+   len = value_compress(record, z);
+   if(len < 0)
+   {
+      lba = alloc_near(btree, hint, 1);
+      jdisk_write(btree->disk, lba, record);
+      return lba << 4;
+   }
+   room = (len < 4) ? 4 : len;
+
+   // Start a new pack sector when the open one is full
+   end = *(unsigned short *)(btree->pack + 2);
+   if(btree->pack_lba == 0 || btree->pack[0] == PACK_SLOTS || end + room > 1024)
+   {
+      btree->pack_lba = alloc_near(btree, hint, 1);
+      memset(btree->pack, 0, 1024);
+      end = PACK_HEADER;
+   }
+   slot = btree->pack[0]++;
+   sl = pack_slot(btree->pack, slot);
+   sl[0] = end;
+   sl[1] = len;
+   memcpy(btree->pack + end, z, len);
+   *(unsigned short *)(btree->pack + 2) = end + room;
+   jdisk_write(btree->disk, btree->pack_lba, btree->pack);
+   return btree->pack_lba << 4 | (slot + 1);
+}
+
+// The sector a handle is in: the open pack from memory, anything else read into buf
+static unsigned char *value_sector(B_Tree *btree, unsigned int lba, unsigned char *buf)
+{
+   if(lba == btree->pack_lba)
+   {
+      return btree->pack;
+   }
+   if(jdisk_read(btree->disk, lba, buf) != 0)
+   {
+      return NULL;
+   }
+   return buf;
+}
+
+int value_read(B_Tree *btree, unsigned int lba, unsigned char *record)
+{
+   unsigned char buf[1024], *p;
+   unsigned short *sl;
+   int slot, n;
+
+   if(!(btree->flags & B_TREE_COMPRESS))
+   {
+      return jdisk_read(btree->disk, lba, record);
+   }
+   slot = B_TREE_VALUE_SLOT(lba);
+   lba = B_TREE_VALUE_SECTOR(lba);
+   if(slot == 0)
+   {
+      return jdisk_read(btree->disk, lba, record);
+   }
+   p = value_sector(btree, lba, buf);
+   if(p == NULL || slot > p[0])
+   {
+      return -1;
+   }
+   sl = pack_slot(p, slot - 1);
+   if(sl[1] == PACK_FORWARD)
+   {
+      return jdisk_read(btree->disk, pack_forward(p, sl), record);
+   }
+   n = lz_decompress(p + sl[0], sl[1], record, 1024);
+   if(n < 0)
+   {
+      return -1;
+   }
+   memset(record + n, 0, 1024 - n);
+   return 0;
+}
+
+int value_write(B_Tree *btree, unsigned int lba, unsigned char *record)
+{
+   unsigned char buf[1024], z[PACK_MAX], *p;
+   unsigned short *sl;
+   unsigned int to;
+   int slot, len;
+
+   if(!(btree->flags & B_TREE_COMPRESS))
+   {
+      return jdisk_write(btree->disk, lba, record);
+   }
+   slot = B_TREE_VALUE_SLOT(lba);
+   lba = B_TREE_VALUE_SECTOR(lba);
+   if(slot == 0)
+   {
+      return jdisk_write(btree->disk, lba, record);
+   }
+   p = value_sector(btree, lba, buf);
+   if(p == NULL || slot > p[0])
+   {
+      return -1;
+   }
+   sl = pack_slot(p, slot - 1);
+   if(sl[1] == PACK_FORWARD)
+   {
+      return jdisk_write(btree->disk, pack_forward(p, sl), record);
+   }
+
+   len = value_compress(record, z);
+   if(len >= 0 && len <= pack_room(p, slot - 1))
+   {
+      memcpy(p + sl[0], z, len);
+      sl[1] = len;
+   }
+   else
+   {
+      // Outgrew its slot: forward it, which takes a sector from sector 0's count
+      if(reserve(btree, 1) != 0)
+      {
+         return -1;
+      }
+      to = alloc_near(btree, lba, 1);
+      jdisk_write(btree->disk, to, record);
+      memcpy(p + sl[0], &to, 4);
+      sl[1] = PACK_FORWARD;
+      write_tree(btree);
+   }
+   return jdisk_write(btree->disk, lba, p);
+}
+
+int b_tree_read(void *b_tree, unsigned int lba, void *record)
+{
+   return value_read((B_Tree *) b_tree, lba, record);
+}
+
+
+/*
+Record operations.  They change the value of a key that's already there: find
+its sector, change it, and write just that sector back.  The tree doesn't
+change, so no node or sector 0 is written.
+*/
+
+unsigned int b_tree_update(void *b_tree, void *key, int offset, int len, void *data)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   unsigned char record[1024];
+   unsigned int lba;
+
+   if(offset < 0 || len < 0 || offset + len > 1024)
+   {
+      return 0;
+   }
+   INST(inst_op_begin(mytree));
+   lba = find_value(mytree, key);
+   if(lba != 0)
+   {
+      // A whole sector needs no read
+      if(len < 1024)
+      {
+         value_read(mytree, lba, record);
+      }
+      memcpy(record + offset, data, len);
+      if(value_write(mytree, lba, record) != 0)
+      {
+         lba = 0;
+      }
+   }
+   INST(inst_op_end(mytree, "update"));
+   return lba;
+}
+
+int b_tree_cas(void *b_tree, void *key, int offset, int len, void *expected, void *desired)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   unsigned char record[1024];
+   unsigned int lba;
+   int rv = -1;
+
+   if(offset < 0 || len < 0 || offset + len > 1024)
+   {
+      return -1;
+   }
+   INST(inst_op_begin(mytree));
+   lba = find_value(mytree, key);
+   if(lba != 0)
+   {
+      value_read(mytree, lba, record);
+      rv = (memcmp(record + offset, expected, len) == 0);
+      if(rv)
+      {
+         memcpy(record + offset, desired, len);
+         if(value_write(mytree, lba, record) != 0)
+         {
+            rv = -1;
+         }
+      }
+   }
+   INST(inst_op_end(mytree, "cas"));
+   return rv;
+}
+
+unsigned int b_tree_modify(void *b_tree, void *key, B_Tree_Modify fn, void *arg)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   unsigned char record[1024];
+   unsigned int lba;
+
+   INST(inst_op_begin(mytree));
+   lba = find_value(mytree, key);
+   if(lba != 0)
+   {
+      value_read(mytree, lba, record);
+      if(fn(record, 1, arg) && value_write(mytree, lba, record) != 0)
+      {
+         lba = 0;
+      }
+   }
+   else
+   {
+      memset(record, 0, 1024);
+      if(fn(record, 0, arg))
+      {
+         lba = insert(mytree, key, record);
+         index_put(mytree, key, lba);
+      }
+   }
+   INST(inst_op_end(mytree, "modify"));
+   return lba;
+}
+
+
+/*
+Order statistics, for B_TREE_COUNTED trees.  Each one goes down from the root
+and reads at most one node a level, adding up the counts of the children to
+the left of where it goes: rank() stops at an internal node that has the key,
+and select() goes down the child that the counts say holds key k, or, when k
+is one of a node's own keys, on down to the leaf with its value.
+*/
+
+// Keys under node (which is in memory) that are less than key, or all of them if key is NULL
+static unsigned long rank_under(B_Tree *mytree, Tree_Node *node, void *key)
+{
+   unsigned long rank = 0;
+   Tree_Node *child;
+   int i, equal;
+
+   if(key == NULL)
+   {
+      return node_count(node);
+   }
+   while(1)
+   {
+      INST(mytree->stats.nodes_visited++);
+      i = mytree->search(node->bytes + 2, (int)(node->nkeys), mytree->key_size, key, &equal);
+      INST_SLOTS(mytree, i, (int)(node->nkeys));
+      rank += i;
+      if(!node->internal)
+      {
+         return rank;
+      }
+      for(int j = 0; j < i; ++j)
+      {
+         rank += node->counts[j];
+      }
+      if(equal)
+      {
+         return rank + node->counts[i];
+      }
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[i], node);
+      node = child;
+   }
+}
+
+static void order_begin(B_Tree *mytree)
+{
+   release_nodes(mytree);
+   if(mytree->warm != NULL)
+   {
+      warm_drain(mytree);
+   }
+}
+
+long b_tree_rank(void *b_tree, void *key)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   long rank;
+
+   if(!(mytree->flags & B_TREE_COUNTED))
+   {
+      return -1;
+   }
+   INST(inst_op_begin(mytree));
+   order_begin(mytree);
+   rank = rank_under(mytree, mytree->root, key);
+   INST(inst_op_end(mytree, "rank"));
+   return rank;
+}
+
+/*
+lo and hi go down together for as long as they're in the same child, so the
+nodes above where they part are read once.
+*/
+long b_tree_count_range(void *b_tree, void *lo, void *hi)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   Tree_Node *node, *child;
+   unsigned long below_lo, below_hi;
+   int i, j, eq_lo, eq_hi;
+
+   if(!(mytree->flags & B_TREE_COUNTED))
+   {
+      return -1;
+   }
+   INST(inst_op_begin(mytree));
+   order_begin(mytree);
+   node = mytree->root;
+   while(lo != NULL && hi != NULL && node->internal)
+   {
+      i = mytree->search(node->bytes + 2, (int)(node->nkeys), mytree->key_size, lo, &eq_lo);
+      j = mytree->search(node->bytes + 2, (int)(node->nkeys), mytree->key_size, hi, &eq_hi);
+      if(i != j || eq_lo || eq_hi)
+      {
+         break;
+      }
+      INST(mytree->stats.nodes_visited++);
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[i], node);
+      node = child;
+   }
+   below_lo = (lo == NULL) ? 0 : rank_under(mytree, node, lo);
+   below_hi = rank_under(mytree, node, hi);
+   INST(inst_op_end(mytree, "count"));
+   return (below_hi > below_lo) ? (long) (below_hi - below_lo) : 0;
+}
+
+int b_tree_select(void *b_tree, long k, void *key, unsigned int *lba)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   Tree_Node *node, *child;
+   unsigned long left;
+   int i, found = 0;
+
+   if(!(mytree->flags & B_TREE_COUNTED))
+   {
+      return -1;
+   }
+   if(k < 0 || (unsigned long) k >= node_count(mytree->root))
+   {
+      return 0;
+   }
+   INST(inst_op_begin(mytree));
+   order_begin(mytree);
+   node = mytree->root;
+   left = k;
+   while(1)
+   {
+      INST(mytree->stats.nodes_visited++);
+      if(found)
+      {
+         // Its value is in the last leaf under the child before it
+         i = node->nkeys;
+      }
+      else if(!node->internal)
+      {
+         i = left;
+         memcpy(key, node->keys[i], mytree->key_size);
+      }
+      else
+      {
+         for(i = 0; left >= node->counts[i]; ++i)
+         {
+            left -= node->counts[i];
+            if(left == 0)
+            {
+               memcpy(key, node->keys[i], mytree->key_size);
+               found = 1;
+               break;
+            }
+            left--;
+         }
+      }
+      if(!node->internal)
+      {
+         break;
+      }
+      child = get_node(mytree);
+      read_node(mytree, child, node->lbas[i], node);
+      node = child;
+   }
+   if(lba != NULL)
+   {
+      *lba = node->lbas[i];
+   }
+   INST(inst_op_end(mytree, "select"));
+   return 1;
+}
+
+int b_tree_sample(void *b_tree, void *key, unsigned int *lba)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   unsigned long n, r;
+
+   if(!(mytree->flags & B_TREE_COUNTED))
+   {
+      return -1;
+   }
+   n = node_count(mytree->root);
+   if(n == 0)
+   {
+      return 0;
+   }
+   // xorshift64, and the high bits of r * n for an index in [0, n)
+   r = mytree->rand;
+   r ^= r << 13;
+   r ^= r >> 7;
+   r ^= r << 17;
+   mytree->rand = r;
+   return b_tree_select(mytree, (long) (((unsigned __int128) r * n) >> 64), key, lba);
+}
+
+
+/*
+Interior node cache.
+
+b_tree_set_cache() turns it on.  read_node() keeps a copy of every interior
+sector it reads, and write_node() keeps those copies current, so that once the
+top of the tree is in memory a descent only goes to disk for the leaf.  Slots
+are reused in clock order.  When a node has been hit CACHE_HOT times, it also
+gets an Eytzinger copy of its keys (see key_search.h), which find_cached()
+searches instead of the sector -- if that is faster for this key size.
+*/
+
+#define CACHE_HOT (8)
+
+// The lbas area of a raw node sector
+static unsigned int *raw_lbas(B_Tree *btree, unsigned char *buf)
+{
+   return (unsigned int *) (buf + 1024 - btree->lbas_per_block * sizeof(unsigned int));
+}
+
+typedef struct node_cache {
+   int size;
+   int mask;                     /* Number of hash buckets - 1 */
+   int *buckets;                 /* First slot in each chain, -1 if none */
+   Cache_Node *nodes;
+   int hand;
+   int layouts;                  /* Whether hot nodes get a layout */
+} Node_Cache;
+
+static int *cache_chain(Node_Cache *c, unsigned int lba)
+{
+   return c->buckets + ((lba * 2654435761U) & c->mask);
+}
+
+Cache_Node *cache_get(B_Tree *btree, unsigned int lba)
+{
+   Node_Cache *c = btree->cache;
+   Cache_Node *cn;
+
+   for(int i = *cache_chain(c, lba); i != -1; i = cn->next)
+   {
+      cn = c->nodes + i;
+      if(cn->lba == lba)
+      {
+         cn->ref = 1;
+         cn->hits++;
+         if(cn->hits >= CACHE_HOT && cn->layout == NULL && c->layouts)
+         {
+            cn->layout = key_layout_build(cn->bytes + 2, cn->bytes[1], btree->key_size,
+                                          btree->key_type != B_TREE_KEY_BYTES);
+         }
+         return cn;
+      }
+   }
+   return NULL;
+}
+
+static void cache_unlink(Node_Cache *c, int slot)
+{
+   int *p = cache_chain(c, c->nodes[slot].lba);
+
+   while(*p != slot)
+   {
+      p = &(c->nodes[*p].next);
+   }
+   *p = c->nodes[slot].next;
+   c->nodes[slot].lba = 0;
+   if(c->nodes[slot].layout != NULL)
+   {
+      key_layout_free(c->nodes[slot].layout);
+      c->nodes[slot].layout = NULL;
+   }
+}
+
+/*
+Stores a sector, replacing the old copy if there is one.
+*/
+void cache_put(B_Tree *btree, unsigned int lba, unsigned char *bytes)
+{
+   Node_Cache *c = btree->cache;
+   Cache_Node *cn;
+   int slot, *p;
+
+   for(slot = *cache_chain(c, lba); slot != -1 && c->nodes[slot].lba != lba; slot = c->nodes[slot].next) ;
+
+   if(slot != -1)
+   {
+      // The keys may have changed - the layout gets rebuilt when it's next wanted
+      cn = c->nodes + slot;
+      if(cn->layout != NULL)
+      {
+         key_layout_free(cn->layout);
+         cn->layout = NULL;
+      }
+   }
+   else
+   {
+      // Clock: pass over recently used slots, clearing their bits
+      while(c->nodes[c->hand].lba != 0 && c->nodes[c->hand].ref)
+      {
+         c->nodes[c->hand].ref = 0;
+         c->hand = (c->hand + 1) % c->size;
+      }
+      slot = c->hand;
+      c->hand = (c->hand + 1) % c->size;
+      if(c->nodes[slot].lba != 0)
+      {
+         cache_unlink(c, slot);
+      }
+      cn = c->nodes + slot;
+      cn->lba = lba;
+      cn->hits = 0;
+      cn->ref = 1;
+      p = cache_chain(c, lba);
+      cn->next = *p;
+      *p = slot;
+   }
+   memcpy(cn->bytes, bytes, 1024);
+   INST(btree->stats.bytes_copied += 1024);
+}
+
+void cache_drop(B_Tree *btree, unsigned int lba)
+{
+   Node_Cache *c = btree->cache;
+
+   for(int slot = *cache_chain(c, lba); slot != -1; slot = c->nodes[slot].next)
+   {
+      if(c->nodes[slot].lba == lba)
+      {
+         cache_unlink(c, slot);
+         return;
+      }
+   }
+}
+
+// Like cache_get(), but without counting a hit
+static int cache_has(B_Tree *btree, unsigned int lba)
+{
+   Node_Cache *c = btree->cache;
+
+   for(int slot = *cache_chain(c, lba); slot != -1; slot = c->nodes[slot].next)
+   {
+      if(c->nodes[slot].lba == lba)
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+void b_tree_set_cache(void *b_tree, int max_nodes)
+{
+   B_Tree *btree = (B_Tree *) b_tree;
+   Node_Cache *c = btree->cache;
+
+   if(c != NULL)
+   {
+      for(int i = 0; i < c->size; ++i)
+      {
+         if(c->nodes[i].layout != NULL)
+         {
+            key_layout_free(c->nodes[i].layout);
+         }
+      }
+      free(c->nodes);
+      free(c->buckets);
+      free(c);
+      btree->cache = NULL;
+   }
+   if(max_nodes <= 0)
+   {
+      return;
+   }
+
+   c = malloc(sizeof(Node_Cache));
+   c->size = max_nodes;
+   for(c->mask = 1; c->mask < 2 * max_nodes; c->mask *= 2) ;
+   c->buckets = malloc(c->mask * sizeof(int));
+   memset(c->buckets, 0xff, c->mask * sizeof(int));
+   c->mask -= 1;
+   c->nodes = calloc(max_nodes, sizeof(Cache_Node));
+   c->hand = 0;
+   c->layouts = key_layout_pays(btree->key_size, btree->key_type != B_TREE_KEY_BYTES);
+   btree->cache = c;
+}
+
+/*
+b_tree_find() with the cache on.  Works on sectors rather than Tree_Nodes: the
+root's, then cached ones, and a node from get_node() only for what isn't cached
+(normally just the leaf).  Doesn't set tmp_e, so insert() can't use it.
+*/
+unsigned int find_cached(B_Tree *mytree, void *key)
+{
+   unsigned char *bytes = mytree->root->bytes;
+   Cache_Node *cn = NULL;
+   Tree_Node *node;
+   int found = 0, equal, i;
+
+   release_nodes(mytree);
+   INST(mytree->stats.cache_hits++);
+   while(1)
+   {
+      INST(mytree->stats.nodes_visited++);
+      if(found)
+      {
+         // Rightmost, down to the leaf that holds the value
+         i = bytes[1];
+      }
+      else
+      {
+         if(cn != NULL && cn->layout != NULL)
+         {
+            i = key_layout_search(cn->layout, key, &equal);
+         }
+         else
+         {
+            i = mytree->search(bytes + 2, bytes[1], mytree->key_size, key, &equal);
+         }
+         INST_SLOTS(mytree, i, bytes[1]);
+         found = equal;
+      }
+
+      // In a leaf, lbas[i] is the value of key i, or of the separator above if we found it there
+      if(!bytes[0])
+      {
+         return (found) ? raw_lbas(mytree, bytes)[i] : 0;
+      }
+
+      unsigned int lba = raw_lbas(mytree, bytes)[i];
+      cn = cache_get(mytree, lba);
+      if(cn != NULL)
+      {
+         INST(mytree->stats.cache_hits++);
+         bytes = cn->bytes;
       }
       else
       {
-         // Iterate through the keys in the node
-         for(int i = 0; i < (int)(curr_node->nkeys); ++i)
-         {
-            //printf("%c\n", *(curr_node->keys[i]));
-            int compare = memcmp(key, curr_node->keys[i], mytree->key_size);
+         node = get_node(mytree);
+         read_node(mytree, node, lba, NULL);
+         bytes = node->bytes;
+      }
+   }
+}
 
-            //printf("Compare is %d \n", compare);
-            //return 0;
-            // Check if the keys are matching
-            if(!compare)
-            {
-               // We've found the key, now we need to find the value (in another node)
-               // In the convention we're using, it will be in the right pointer of the
-               // smaller node.
-               // So we're jumping to the left child and then skipping the key comparison in
-               // any further alg iterations, grabbing the rightmost child right away
-               found_key = 1;
-
-               // If we're at an external node, then we're done lol
-               //printf("FOUND THE KEY AT LBA %d\n", curr_node->lba);
-               if(!(curr_node->internal))
-               {
-                  return curr_node->lbas[i];
-               }
-
-               // Need to make sure a child node exists
-               //if(!curr_node->children[i])
-               //{
-                  curr_node->children[i] = malloc(sizeof(Tree_Node));
-                  // Need to actually read the child node from the disk
-                  read_node(mytree,  curr_node->children[i], curr_node->lbas[i], curr_node);
-               //}
-               curr_node = curr_node->children[i];
-               break;
-            }
-            else if(compare < 0)
+/*
+Hash index.
+
+b_tree_set_index() turns it on: an open-addressing table, in memory, from keys
+to their value lbas, so that find_value() answers a key that's in it without
+reading a node.  Slots are linear probed, and there are at least twice as many
+as keys.  A find that goes to the tree puts what it found in, and so do the
+inserts, which also keep it right when a buffered insert gives a key a new
+lba.  When it holds max_keys, a new key takes the place of one that a clock
+over the slots finds unused since the last pass, and the keys after it in the
+probe sequence move back over the hole.  A compaction empties it, since the
+lbas move, and nothing goes in or comes out while one runs.  It never has a
+key that isn't in the tree, so a key that isn't in it is looked up as before.
+*/
+
+typedef struct key_index {
+   long size;                    /* Slots, a power of 2 */
+   long max;                     /* Most keys it holds */
+   long n;
+   long hand;
+   unsigned int *lbas;           /* 0 for an empty slot */
+   unsigned char *refs;          /* Used since the clock last passed */
+   unsigned char *keys;          /* key_size bytes a slot */
+} Key_Index;
+
+static long index_slot(B_Tree *btree, void *key)
+{
+   Key_Index *x = btree->index;
+   long s = key_hash(btree, key) & (x->size - 1);
+
+   while(x->lbas[s] != 0 && memcmp(x->keys + s * btree->key_size, key, btree->key_size) != 0)
+   {
+      s = (s + 1) & (x->size - 1);
+   }
+   return s;
+}
+
+// Empties slot s, and moves back the keys after it that can't be found past the hole
+static void index_remove(B_Tree *btree, long s)
+{
+   Key_Index *x = btree->index;
+   long mask = x->size - 1, j = s, home;
+
+   while(1)
+   {
+      j = (j + 1) & mask;
+      if(x->lbas[j] == 0)
+      {
+         break;
+      }
+      home = key_hash(btree, x->keys + j * btree->key_size) & mask;
+      if(((j - home) & mask) < ((j - s) & mask))
+      {
+         continue;
+      }
+      memcpy(x->keys + s * btree->key_size, x->keys + j * btree->key_size, btree->key_size);
+      x->lbas[s] = x->lbas[j];
+      x->refs[s] = x->refs[j];
+      s = j;
+   }
+   x->lbas[s] = 0;
+   x->n--;
+}
+
+unsigned int index_get(B_Tree *btree, void *key)
+{
+   Key_Index *x = btree->index;
+   long s;
+
+   if(x == NULL || btree->compact != NULL)
+   {
+      return 0;
+   }
+   s = index_slot(btree, key);
+   if(x->lbas[s] != 0)
+   {
+      x->refs[s] = 1;
+      INST(btree->stats.indexed++);
+   }
+   return x->lbas[s];
+}
+
+void index_put(B_Tree *btree, void *key, unsigned int lba)
+{
+   Key_Index *x = btree->index;
+   long s;
+
+   if(x == NULL || lba == 0 || btree->compact != NULL)
+   {
+      return;
+   }
+   s = index_slot(btree, key);
+   if(x->lbas[s] == 0 && x->n >= x->max)
+   {
+      // Clock: pass over recently used slots, clearing their bits
+      while(x->lbas[x->hand] == 0 || x->refs[x->hand])
+      {
+         x->refs[x->hand] = 0;
+         x->hand = (x->hand + 1) & (x->size - 1);
+      }
+      index_remove(btree, x->hand);
+      s = index_slot(btree, key);
+   }
+   if(x->lbas[s] == 0)
+   {
+      memcpy(x->keys + s * btree->key_size, key, btree->key_size);
+      x->n++;
+   }
+   x->lbas[s] = lba;
+   x->refs[s] = 1;
+}
+
+void b_tree_set_index(void *b_tree, long max_keys)
+{
+   B_Tree *btree = (B_Tree *) b_tree;
+   Key_Index *x = btree->index;
+
+   if(x != NULL)
+   {
+      free(x->lbas);
+      free(x->refs);
+      free(x->keys);
+      free(x);
+      btree->index = NULL;
+   }
+   if(max_keys <= 0)
+   {
+      return;
+   }
+
+   x = malloc(sizeof(Key_Index));
+   for(x->size = 1; x->size < 2 * max_keys; x->size *= 2) ;
+   x->max = max_keys;
+   x->n = 0;
+   x->hand = 0;
+   x->lbas = calloc(x->size, sizeof(unsigned int));
+   x->refs = calloc(x->size, 1);
+   x->keys = malloc(x->size * btree->key_size);
+   btree->index = x;
+}
+
+/*
+Background warmup.
+
+Attaching reads sector 0 and the root, and nothing else, however big the tree
+is.  b_tree_warmup() then fills the cache from a thread of its own, so that the
+tree can take operations right away: it reads the top levels breadth first,
+sorting each level's lbas and reading runs of nearby sectors with one
+jdisk_read_many() on a handle of its own (jdisk_reopen()).
+
+The thread never touches the tree.  It queues the sectors it reads, and the
+next operation puts them into the cache.  Each write to a node bumps an epoch;
+a sector is only used if there were no writes between reading it and putting it
+in, so the cache never gets an old copy of a node.
+*/
+
+#define WARM_GAP (8)                   /* Unwanted sectors worth reading through to join two runs */
+#define WARM_RUN (64)                  /* Most sectors in one read */
+
+typedef struct warm_sector {
+   unsigned int lba;
+   unsigned long epoch;               /* Epoch before the read */
+   struct warm_sector *next;
+   unsigned char bytes[1024];
+} Warm_Sector;
+
+typedef struct warmup {
+   B_Tree *tree;                       /* Only for its sizes -- the thread doesn't touch the rest */
+   void *disk;                         /* The thread's own jdisk handle */
+   int levels;
+   unsigned int *list;                 /* Sorted sectors from a manifest, read instead of levels */
+   long nlist;
+   long max_nodes;                     /* No point reading more than the cache holds */
+   unsigned char root[1024];
+   pthread_t thread;
+   int joined;
+
+   atomic_ulong epoch;                 /* Bumped after every node write */
+   atomic_int stop;
+   atomic_int done;
+   atomic_int level;                   /* Levels read so far */
+   atomic_int pending;                 /* Sectors on the queue */
+   pthread_mutex_t lock;
+   Warm_Sector *head;                  /* The queue, under lock */
+   Warm_Sector *tail;
+
+   long installed;                     /* Main thread only */
+   long stale;
+} Warmup;
+
+static int warm_cmp(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+   return (x > y) - (x < y);
+}
+
+// Adds an internal node's children to the next level
+static unsigned int *warm_children(Warmup *w, unsigned char *bytes, unsigned int *next, long *n, long *cap)
+{
+   unsigned int *lbas = raw_lbas(w->tree, bytes);
+
+   if(*n + bytes[1] + 1 > *cap)
+   {
+      *cap = 2 * (*cap + bytes[1] + 1);
+      next = realloc(next, *cap * sizeof(unsigned int));
+   }
+   memcpy(next + *n, lbas, (bytes[1] + 1) * sizeof(unsigned int));
+   *n += bytes[1] + 1;
+   return next;
+}
+
+static void *warm_thread(void *arg)
+{
+   Warmup *w = (Warmup *) arg;
+   unsigned char *buf = malloc(WARM_RUN * 1024), *bytes;
+   unsigned int *cur = NULL, *next = NULL, *t;
+   long ncur = 0, nnext = 0, curcap = 0, nextcap = 0, nodes = 0, i, j, k, m;
+   int leaves;
+   unsigned long e;
+   Warm_Sector *s;
+
+   if(w->list != NULL)
+   {
+      // One pass over the manifest's sectors, which the thread now owns
+      cur = w->list;
+      ncur = curcap = w->nlist;
+   }
+   else if(w->root[0])
+   {
+      cur = warm_children(w, w->root, cur, &ncur, &curcap);
+   }
+   for(int level = 1; level < w->levels && ncur > 0 && !atomic_load(&w->stop); level++)
+   {
+      qsort(cur, ncur, sizeof(unsigned int), warm_cmp);
+      for(i = m = 0; i < ncur; i++)
+      {
+         if(m == 0 || cur[i] != cur[m-1]) cur[m++] = cur[i];
+      }
+      ncur = m;
+
+      nnext = 0;
+      leaves = 0;
+      for(i = 0; i < ncur && !leaves && nodes < w->max_nodes && !atomic_load(&w->stop); i = j)
+      {
+         // One run: sectors close enough together to read with one request
+         for(j = i + 1; j < ncur && cur[j] - cur[i] < WARM_RUN && cur[j] - cur[j-1] <= WARM_GAP; j++) ;
+         // All leaves are at the same depth, so the first sector of a level tells whether it's leaves
+         if(i == 0 && w->list == NULL)
+         {
+            j = 1;
+         }
+         e = atomic_load(&w->epoch);
+         if(jdisk_read_many(w->disk, cur[i], cur[j-1] - cur[i] + 1, buf) != 0)
+         {
+            continue;
+         }
+         for(k = i; k < j && nodes < w->max_nodes; k++)
+         {
+            bytes = buf + (cur[k] - cur[i]) * 1024;
+            // Leaves don't go in the cache.  Neither does garbage: a node written since
+            // its parent was read may point anywhere.
+            if(!bytes[0] || bytes[1] > w->tree->keys_per_block)
             {
-               // In this case, the the key is in a "smaller" node
-               // We need to look at the left child of the key
-
-               // If we're at an external node, no key will be found - terminate
-               //printf("Key less\n");
-               if(!(curr_node->internal))
-               {
-                  //printf("KEY NOT FOUND\n");
-                  // pointer to external node
-                  mytree->tmp_e = curr_node;
-                  return 0;
-               }
-               // Need to make sure a child node exists
-               //if(!curr_node->children[i])
-               //{
-                  curr_node->children[i] = malloc(sizeof(Tree_Node));
-                  // Need to actually read the child node from the disk
-                  read_node(mytree,  curr_node->children[i], curr_node->lbas[i], curr_node);
-               //}
-               curr_node = curr_node->children[i];
-               break;
+               leaves |= (i == 0 && !bytes[0]);
+               continue;
             }
-            else if(compare > 0 && i == (curr_node->nkeys) - 1)
+            s = malloc(sizeof(Warm_Sector));
+            s->lba = cur[k];
+            s->epoch = e;
+            s->next = NULL;
+            memcpy(s->bytes, bytes, 1024);
+            pthread_mutex_lock(&w->lock);
+            if(w->tail == NULL) w->head = s; else w->tail->next = s;
+            w->tail = s;
+            atomic_fetch_add(&w->pending, 1);
+            pthread_mutex_unlock(&w->lock);
+            if(w->list == NULL)
             {
-               // the default situation here would be to just go to the next key
-               // But if we're at the last key, jump to the rightmost child 
-
-               // If we're at an external node, no key will be found - terminate
-               //printf("Key greater jump\n");
-               if(!(curr_node->internal))
-               {
-                  //printf("KEY NOT FOUND\n");
-                  // pointer to external node
-                  mytree->tmp_e = curr_node;
-                  return 0;
-               }
-               // Need to make sure a child node exists
-               //if(!curr_node->children[i + 1])
-               //{
-                  curr_node->children[i + 1] = malloc(sizeof(Tree_Node));
-                  // Need to actually read the child node from the disk
-                  read_node(mytree,  curr_node->children[i + 1], curr_node->lbas[i + 1], curr_node);
-               //}
-               curr_node = curr_node->children[i + 1];
-               break;
+               next = warm_children(w, bytes, next, &nnext, &nextcap);
             }
+            nodes++;
          }
       }
+      if(leaves)
+      {
+         break;
+      }
+      atomic_store(&w->level, level);
+      t = cur; cur = next; next = t;
+      m = curcap; curcap = nextcap; nextcap = m;
+      ncur = nnext;
    }
 
-   // Means we've somehow failed
-   //printf("SOME ISSUE OCCURED\n");
-   return -1;
+   free(cur);
+   free(next);
+   free(buf);
+   atomic_store(&w->done, 1);
+   return NULL;
 }
 
-void shift_node_dat(Tree_Node *node, int i)
+void warm_wrote(B_Tree *btree)
 {
-   int j = (int) (node->nkeys);
-   // Iterate from the end of all lists
-   // remember that there's an additional lba and child
-   node->children[j+1] = node->children[j];
-   node->lbas[j+1] = node->lbas[j];
+   atomic_fetch_add(&btree->warm->epoch, 1);
+}
 
-   //printf("SHIFTING LAST LBA %d\n", node->lbas[j+1]);
-   j -= 1;
+/*
+Puts what the thread has read into the cache.  Runs at the start of operations.
+*/
+void warm_drain(B_Tree *btree)
+{
+   Warmup *w = btree->warm;
+   Warm_Sector *s, *list;
+   int done = atomic_load(&w->done);
 
-   for(; j >= i; --j)
+   if(atomic_load(&w->pending) > 0)
    {
-      node->keys[j + 1] = node->keys[j];
-      node->lbas[j + 1] = node->lbas[j];
-      node->children[j + 1] = node->children[j];
+      pthread_mutex_lock(&w->lock);
+      list = w->head;
+      w->head = w->tail = NULL;
+      atomic_store(&w->pending, 0);
+      pthread_mutex_unlock(&w->lock);
+
+      unsigned long e = atomic_load(&w->epoch);
+      while(list != NULL)
+      {
+         s = list;
+         list = s->next;
+         if(s->epoch != e || btree->cache == NULL)
+         {
+            w->stale++;
+         }
+         else if(!cache_has(btree, s->lba))
+         {
+            // A copy that's already there is just as current, and may have a layout
+            cache_put(btree, s->lba, s->bytes);
+            w->installed++;
+         }
+         free(s);
+      }
+   }
+   if(done && !w->joined)
+   {
+      pthread_join(w->thread, NULL);
+      jdisk_unattach(w->disk);
+      w->joined = 1;
+   }
+}
+
+static void warm_free(B_Tree *btree)
+{
+   Warmup *w = btree->warm;
+   Warm_Sector *s;
+
+   atomic_store(&w->stop, 1);
+   if(!w->joined)
+   {
+      pthread_join(w->thread, NULL);
+      jdisk_unattach(w->disk);
+   }
+   while(w->head != NULL)
+   {
+      s = w->head;
+      w->head = s->next;
+      free(s);
+   }
+   pthread_mutex_destroy(&w->lock);
+   free(w);
+   btree->warm = NULL;
+}
+
+static int warm_start(B_Tree *btree, int levels, unsigned int *list, long nlist)
+{
+   Warmup *w;
+
+   if(btree->warm != NULL)
+   {
+      warm_free(btree);
+   }
+   w = malloc(sizeof(Warmup));
+   w->tree = btree;
+   w->disk = jdisk_reopen(btree->disk);
+   if(w->disk == NULL)
+   {
+      free(w);
+      return -1;
+   }
+   w->levels = levels;
+   w->list = list;
+   w->nlist = nlist;
+   w->max_nodes = btree->cache->size;
+   memcpy(w->root, btree->root->bytes, 1024);
+   w->joined = 0;
+   atomic_init(&w->epoch, 0);
+   atomic_init(&w->stop, 0);
+   atomic_init(&w->done, 0);
+   atomic_init(&w->level, 0);
+   atomic_init(&w->pending, 0);
+   pthread_mutex_init(&w->lock, NULL);
+   w->head = w->tail = NULL;
+   w->installed = 0;
+   w->stale = 0;
+   btree->warm = w;
+   if(pthread_create(&w->thread, NULL, warm_thread, w) != 0)
+   {
+      jdisk_unattach(w->disk);
+      pthread_mutex_destroy(&w->lock);
+      free(w);
+      btree->warm = NULL;
+      return -1;
+   }
+   return 0;
+}
+
+int b_tree_warmup(void *b_tree, int levels)
+{
+   B_Tree *btree = (B_Tree *) b_tree;
+
+   if(btree->cache == NULL || levels < 1)
+   {
+      return -1;
+   }
+   return warm_start(btree, levels, NULL, 0);
+}
+
+/*
+Warmup manifests.  tree_file.warm lists the sectors in the cache, so that the
+next process to attach can start where this one left off: a line with the
+cache size, the disk's sector count and the number of sectors, then the
+sectors, one per line, in lba order.  It is written to a temporary file and
+renamed, so a crash leaves the old one.
+*/
+
+#define WARM_MAGIC "b_tree_warmup"
+
+int b_tree_save_warmup(void *b_tree)
+{
+   B_Tree *btree = (B_Tree *) b_tree;
+   Node_Cache *c = btree->cache;
+   unsigned int *lbas;
+   char *fn, *tmp;
+   long n = 0;
+   FILE *f;
+   int rv;
+
+   if(c == NULL)
+   {
+      return -1;
+   }
+   lbas = malloc((c->size + 1) * sizeof(unsigned int));
+   for(int i = 0; i < c->size; ++i)
+   {
+      if(c->nodes[i].lba != 0)
+      {
+         lbas[n++] = c->nodes[i].lba;
+      }
+   }
+   qsort(lbas, n, sizeof(unsigned int), warm_cmp);
+
+   fn = malloc(strlen(btree->filename) + 10);
+   tmp = malloc(strlen(btree->filename) + 10);
+   sprintf(fn, "%s.warm", btree->filename);
+   sprintf(tmp, "%s.warm~", btree->filename);
+   rv = -1;
+   f = fopen(tmp, "w");
+   if(f != NULL)
+   {
+      fprintf(f, "%s %d %lu %ld\n", WARM_MAGIC, c->size, btree->num_lbas, n);
+      for(long i = 0; i < n; ++i)
+      {
+         fprintf(f, "%u\n", lbas[i]);
+      }
+      rv = (fclose(f) == 0 && rename(tmp, fn) == 0) ? 0 : -1;
+   }
+   free(fn);
+   free(tmp);
+   free(lbas);
+   return rv;
+}
+
+/*
+At attach: if there is a manifest for this disk, turn the cache on at its size
+and start a warmup from it.  Only the manifest is read here.
+*/
+void warm_load(B_Tree *btree)
+{
+   char *fn, magic[32];
+   unsigned long sectors;
+   unsigned int *lbas;
+   long n, i;
+   int size;
+   FILE *f;
+
+   fn = malloc(strlen(btree->filename) + 10);
+   sprintf(fn, "%s.warm", btree->filename);
+   f = fopen(fn, "r");
+   free(fn);
+   if(f == NULL)
+   {
+      return;
+   }
+   if(fscanf(f, "%31s %d %lu %ld", magic, &size, &sectors, &n) != 4 || strcmp(magic, WARM_MAGIC) != 0 ||
+      sectors != btree->num_lbas || size < 1 || n < 0 || n > size)
+   {
+      fclose(f);
+      return;
+   }
+   lbas = malloc((n + 1) * sizeof(unsigned int));
+   for(i = 0; i < n && fscanf(f, "%u", lbas + i) == 1 && lbas[i] < sectors; ++i) ;
+   fclose(f);
+   if(i < n)
+   {
+      free(lbas);
+      return;
+   }
+
+   b_tree_set_cache(btree, size);
+   if(n == 0 || warm_start(btree, 2, lbas, n) != 0)
+   {
+      free(lbas);
+   }
+}
+
+int b_tree_warmup_progress(void *b_tree, long *nodes, int *levels)
+{
+   B_Tree *btree = (B_Tree *) b_tree;
+   Warmup *w = btree->warm;
+
+   if(w == NULL)
+   {
+      *nodes = 0;
+      *levels = 0;
+      return 0;
+   }
+   warm_drain(btree);
+   *nodes = w->installed;
+   *levels = atomic_load(&w->level);
+   return !w->joined;
+}
+
+/*
+Rebuilding a Bloom filter in the background, when sector 0 says the one on disk
+isn't current.  Until it's done, bloom_may() says that every key may be there.
+
+The thread has a jdisk handle of its own.  It reads the internal nodes and their
+buffers a level at a time from the root that sector 0 names, then the leaves in
+lba order with runs of reads, and sets the bits of every key it sees in a filter
+of its own.  It never touches the tree: when it's done, the next operation ORs its
+bits into the tree's filter and writes it (bloom_scan_take()).
+
+A key that moves while the thread runs goes into a node or buffer that's
+written, and every write puts its keys in the tree's filter (bloom_scan_wrote()),
+so the thread only has to find the keys that stay where they are.  It can only
+miss those if the internal nodes change while it reads them, so each write to
+one bumps an epoch, and the internal levels are read again if it changed.
+Once they're read, a leaf that's written has its keys added by the write, and
+one that isn't is where they said.
+*/
+
+#define BLOOM_RUN (64)                 /* Most leaves in one read */
+
+typedef struct bloom_scan {
+   B_Tree *tree;                       /* Only for its sizes -- the thread doesn't touch the rest */
+   void *disk;                         /* The thread's own jdisk handle */
+   unsigned char *bits;                /* The thread's filter, as big as the tree's */
+   unsigned long keys;                 /* Keys it set bits for */
+   pthread_t thread;
+
+   atomic_ulong epoch;                 /* Bumped after every write to an internal node or a buffer */
+   atomic_int stop;
+   atomic_int done;
+} Bloom_Scan;
+
+static void bloom_scan_keys(Bloom_Scan *s, unsigned char *keys, int n, int stride)
+{
+   for(int i = 0; i < n; ++i)
+   {
+      bloom_bits(s->bits, s->tree->bloom_sectors, key_hash(s->tree, keys + i * stride), 1);
+   }
+   s->keys += n;
+}
+
+/*
+An internal node's keys and messages, and its children added to the next
+level.  The root's message count is in its buffer's sectors, as for
+buffer_attach().  -1 if the sector isn't an internal node, which means it was
+written.
+*/
+static int bloom_scan_internal(Bloom_Scan *s, unsigned char *bytes, int root, unsigned int **next, long *n, long *cap)
+{
+   B_Tree *t = s->tree;
+   unsigned char msgs[BUFFER_SECTORS * 1024];
+   unsigned int *field, nmsgs;
+   unsigned short count;
+   int per = buffer_per(t);
+
+   if(!bytes[0] || bytes[1] > t->keys_per_block)
+   {
+      return -1;
+   }
+   bloom_scan_keys(s, bytes + 2, bytes[1], t->key_size);
+   if(*n + bytes[1] + 1 > *cap)
+   {
+      *cap = 2 * (*cap + bytes[1] + 1);
+      *next = realloc(*next, *cap * sizeof(unsigned int));
+   }
+   memcpy(*next + *n, raw_lbas(t, bytes), (bytes[1] + 1) * sizeof(unsigned int));
+   *n += bytes[1] + 1;
+   if(!(t->flags & B_TREE_BUFFERED))
+   {
+      return 0;
+   }
+   field = buffer_field(t, bytes);
+   nmsgs = (root) ? (unsigned int) buffer_cap(t) : field[1];
+   if(nmsgs > (unsigned int) buffer_cap(t))
+   {
+      return -1;
+   }
+   if(nmsgs > 0 && jdisk_read_many(s->disk, field[0], (nmsgs + per - 1) / per, msgs) != 0)
+   {
+      return -1;
+   }
+   for(int i = 0; root && i < BUFFER_SECTORS; ++i)
+   {
+      memcpy(&count, msgs + i * 1024, 2);
+      if(count < per)
+      {
+         nmsgs = i * per + count;
+         break;
+      }
+   }
+   for(unsigned int i = 0; i < nmsgs; ++i)
+   {
+      bloom_scan_keys(s, buffer_msg(t, msgs, i) + 4, 1, 0);
    }
+   return 0;
 }
 
+static void *bloom_scan_thread(void *arg)
+{
+   Bloom_Scan *s = (Bloom_Scan *) arg;
+   B_Tree *t = s->tree;
+   unsigned char *buf = malloc(BLOOM_RUN * 1024), *bytes;
+   unsigned int *cur = NULL, *next = NULL, *tmp;
+   long ncur, nnext, curcap = 0, nextcap = 0, i, j, m;
+   unsigned long e;
+   int bad;
+
+   // The internal levels, again until no write changed them while they were read
+   do
+   {
+      e = atomic_load(&s->epoch);
+      memset(s->bits, 0, t->bloom_sectors * 1024UL);
+      s->keys = 0;
+      ncur = 0;
+      bad = 1;
+      if(jdisk_read(s->disk, 0, buf) != 0 || jdisk_read(s->disk, *(unsigned int *) (buf + 4), buf) != 0 ||
+         buf[1] > t->keys_per_block)
+      {
+         continue;
+      }
+      if(!buf[0])
+      {
+         bloom_scan_keys(s, buf + 2, buf[1], t->key_size);
+         break;
+      }
+      bad = bloom_scan_internal(s, buf, 1, &cur, &ncur, &curcap) != 0;
+      while(!bad && !atomic_load(&s->stop))
+      {
+         // All leaves are at the same depth, so the first sector of a level tells whether it's leaves
+         if(jdisk_read(s->disk, cur[0], buf) != 0 || buf[1] > t->keys_per_block)
+         {
+            bad = 1;
+            break;
+         }
+         if(!buf[0])
+         {
+            break;
+         }
+         nnext = 0;
+         for(i = 0; i < ncur && !bad; ++i)
+         {
+            bad = (i > 0 && jdisk_read(s->disk, cur[i], buf) != 0) ||
+                  bloom_scan_internal(s, buf, 0, &next, &nnext, &nextcap) != 0;
+         }
+         tmp = cur; cur = next; next = tmp;
+         m = curcap; curcap = nextcap; nextcap = m;
+         ncur = nnext;
+      }
+   } while((bad || atomic_load(&s->epoch) != e) && !atomic_load(&s->stop));
+
+   // The leaves, in runs of nearby sectors
+   qsort(cur, ncur, sizeof(unsigned int), warm_cmp);
+   for(i = 0; i < ncur && !atomic_load(&s->stop); i = j)
+   {
+      for(j = i + 1; j < ncur && cur[j] - cur[i] < BLOOM_RUN && cur[j] - cur[j-1] <= WARM_GAP; j++) ;
+      if(jdisk_read_many(s->disk, cur[i], cur[j-1] - cur[i] + 1, buf) != 0)
+      {
+         continue;
+      }
+      for(m = i; m < j; m++)
+      {
+         // A sector that isn't a leaf any more was written, and its keys went in with the write
+         bytes = buf + (cur[m] - cur[i]) * 1024;
+         if(!bytes[0] && bytes[1] <= t->keys_per_block)
+         {
+            bloom_scan_keys(s, bytes + 2, bytes[1], t->key_size);
+         }
+      }
+   }
 
+   free(cur);
+   free(next);
+   free(buf);
+   atomic_store(&s->done, 1);
+   return NULL;
+}
 
+static void bloom_scan_free(Bloom_Scan *s)
+{
+   jdisk_unattach(s->disk);
+   free(s->bits);
+   free(s);
+}
 
+int bloom_scan_start(B_Tree *btree)
+{
+   Bloom_Scan *s = malloc(sizeof(Bloom_Scan));
 
+   s->tree = btree;
+   s->disk = jdisk_reopen(btree->disk);
+   if(s->disk == NULL)
+   {
+      free(s);
+      return -1;
+   }
+   s->bits = malloc(btree->bloom_sectors * 1024UL);
+   s->keys = 0;
+   atomic_init(&s->epoch, 0);
+   atomic_init(&s->stop, 0);
+   atomic_init(&s->done, 0);
+   btree->bloom_scan = s;
+   if(pthread_create(&s->thread, NULL, bloom_scan_thread, s) != 0)
+   {
+      btree->bloom_scan = NULL;
+      bloom_scan_free(s);
+      return -1;
+   }
+   return 0;
+}
 
+// A write to n keys, stride bytes apart, while the filter is rebuilt
+void bloom_scan_wrote(B_Tree *btree, unsigned char *keys, int n, int stride, int internal)
+{
+   for(int i = 0; i < n; ++i)
+   {
+      bloom_probe(btree, keys + i * stride, 1);
+   }
+   if(internal)
+   {
+      atomic_fetch_add(&btree->bloom_scan->epoch, 1);
+   }
+}
 
+/*
+Once the thread is done, ORs its bits into the tree's filter, which has had
+the keys added and written since it started, and writes the lot.  1 if it
+did, 0 if the thread is still going.
+*/
+int bloom_scan_take(B_Tree *btree)
+{
+   Bloom_Scan *s = btree->bloom_scan;
+   unsigned long *to = (unsigned long *) btree->bloom, *from = (unsigned long *) s->bits;
 
+   if(!atomic_load(&s->done))
+   {
+      return 0;
+   }
+   pthread_join(s->thread, NULL);
+   for(unsigned long i = 0; i < btree->bloom_sectors * 1024UL / sizeof(unsigned long); ++i)
+   {
+      to[i] |= from[i];
+   }
+   // bloom_add() didn't count the keys added meanwhile: most were written where the thread saw them
+   btree->bloom_keys = s->keys;
+   btree->bloom_scan = NULL;
+   bloom_scan_free(s);
+   bloom_save(btree);
+   return 1;
+}
 
+// At detach: the filter stays not current, and the next attach starts again
+void bloom_scan_stop(B_Tree *btree)
+{
+   Bloom_Scan *s = btree->bloom_scan;
 
+   atomic_store(&s->stop, 1);
+   pthread_join(s->thread, NULL);
+   btree->bloom_scan = NULL;
+   bloom_scan_free(s);
+}
 
+/*
+Online compaction.
+
+b_tree_compact_begin() walks the tree once and lays out a plan: internal nodes
+in breadth-first order, then every leaf in key order, each followed by its values.
+b_tree_compact_step() then places sectors a few at a time: the sector that belongs
+in the next slot swaps places with whatever is there, and the lbas pointing at
+the two of them are fixed.  To find those lbas, the compactor keeps the owner of
+every sector (the node that points at it).  write_node() and write_tree() report
+to compact_note(), so the owners stay right while inserts run between steps.
+Sectors allocated after begin are not part of the plan and stay at the end.
+*/
 
+#define COMPACT_NONE (0xffffffff)
+
+typedef struct compactor {
+   unsigned long n_lbas;         /* Size of the arrays below */
+   unsigned int *owner;          /* owner[lba] = lba of the node pointing at it, 0 for the root */
+   unsigned char *kind;          /* kind[lba] = 0 unknown, 1 node, 2 value */
+   unsigned int *plan;           /* Sectors, by their current lba, in the order we want them */
+   unsigned int *pos;            /* pos[lba] = index of the sector in plan, or COMPACT_NONE */
+   unsigned long plan_n;
+   unsigned long next;           /* Next plan index to place.  It goes to lba next+1 */
+   unsigned long end;            /* First free block at begin: below it, the plan's sectors are all that's used */
+} Compactor;
+
+// Records who owns the lbas in a node that was just written (NULL: the root, owned by sector 0)
+void compact_note(B_Tree *btree, Tree_Node *node)
+{
+   Compactor *c = btree->compact;
 
+   if(node == NULL)
+   {
+      if(btree->root_lba < c->n_lbas)
+      {
+         c->owner[btree->root_lba] = 0;
+         c->kind[btree->root_lba] = 1;
+      }
+      return;
+   }
+   if(node->lba >= c->n_lbas)
+   {
+      return;
+   }
+   c->kind[node->lba] = 1;
+   for(int i = 0; i <= (int) node->nkeys; ++i)
+   {
+      unsigned int lba = node->lbas[i];
+      if(lba == 0 || lba >= c->n_lbas)
+      {
+         continue;
+      }
+      c->owner[lba] = node->lba;
+      c->kind[lba] = (node->internal) ? 1 : 2;
+   }
+}
 
+static void compact_free(B_Tree *btree)
+{
+   Compactor *c = btree->compact;
+
+   free(c->owner);
+   free(c->kind);
+   free(c->plan);
+   free(c->pos);
+   free(c);
+   btree->compact = NULL;
+}
 
+static void compact_plan(Compactor *c, unsigned int lba)
+{
+   if(lba == 0 || lba >= c->n_lbas || c->pos[lba] != COMPACT_NONE)
+   {
+      return;
+   }
+   c->pos[lba] = c->plan_n;
+   c->plan[c->plan_n++] = lba;
+}
 
+int b_tree_compact_begin(void *b_tree)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   Compactor *c;
+   unsigned char buf[1024];
+   unsigned int *queue, *lbas;
+   unsigned long head, tail;
 
+   // Packed value sectors are shared, and handles name them.  The bitmap would have
+   // to be rebuilt, and bitmap sectors can't move.  Nor does it know message buffers.
+   if(mytree->flags & (B_TREE_COMPRESS | B_TREE_ALLOC | B_TREE_BUFFERED))
+   {
+      return -1;
+   }
+   if(mytree->compact != NULL)
+   {
+      compact_free(mytree);
+   }
+   // Sectors are about to move
+   if(mytree->tail != NULL)
+   {
+      mytree->tail->lba = 0;
+   }
+   if(mytree->index != NULL)
+   {
+      b_tree_set_index(mytree, mytree->index->max);
+   }
+   c = malloc(sizeof(Compactor));
+   c->n_lbas = mytree->num_lbas;
+   c->owner = malloc(c->n_lbas * sizeof(unsigned int));
+   c->kind  = calloc(c->n_lbas, 1);
+   c->plan  = malloc(c->n_lbas * sizeof(unsigned int));
+   c->pos   = malloc(c->n_lbas * sizeof(unsigned int));
+   queue    = malloc(c->n_lbas * sizeof(unsigned int));
+   if(c->owner == NULL || c->kind == NULL || c->plan == NULL || c->pos == NULL || queue == NULL)
+   {
+      free(queue);
+      mytree->compact = c;
+      compact_free(mytree);
+      return -1;
+   }
+   memset(c->owner, 0xff, c->n_lbas * sizeof(unsigned int));
+   memset(c->pos, 0xff, c->n_lbas * sizeof(unsigned int));
+   c->plan_n = 0;
+   c->next = 0;
+   c->end = mytree->first_free_block;
+   if(mytree->flags & B_TREE_BLOOM)
+   {
+      bloom_leave(mytree);
+   }
 
+   // Breadth-first.  All leaves are on the last level, so they come out in key order,
+   // after every internal node.
+   head = 0;
+   tail = 0;
+   queue[tail++] = mytree->root_lba;
+   c->owner[mytree->root_lba] = 0;
+   c->kind[mytree->root_lba] = 1;
+   while(head < tail)
+   {
+      unsigned int lba = queue[head++];
+      jdisk_read(mytree->disk, lba, buf);
+      lbas = raw_lbas(mytree, buf);
+      compact_plan(c, lba);
+      for(int i = 0; i <= (int) buf[1]; ++i)
+      {
+         if(lbas[i] == 0 || lbas[i] >= c->n_lbas)
+         {
+            continue;
+         }
+         c->owner[lbas[i]] = lba;
+         c->kind[lbas[i]] = (buf[0]) ? 1 : 2;
+         if(buf[0])
+         {
+            queue[tail++] = lbas[i];
+         }
+         else
+         {
+            compact_plan(c, lbas[i]);
+         }
+      }
+   }
+   free(queue);
+   mytree->compact = c;
+   return 0;
+}
 
+// Where the sector that was at lba is after a and b trade places
+static unsigned int compact_moved(unsigned int lba, unsigned int a, unsigned int b)
+{
+   if(lba == a) return b;
+   if(lba == b) return a;
+   return lba;
+}
 
-unsigned int split(B_Tree *mytree, Tree_Node *node_found)
+// Swaps a and b wherever they appear in a raw node's lbas
+static void compact_fix(B_Tree *btree, unsigned char *buf, unsigned int a, unsigned int b)
 {
+   unsigned int *lbas = raw_lbas(btree, buf);
 
+   for(int i = 0; i <= (int) buf[1]; ++i)
+   {
+      lbas[i] = compact_moved(lbas[i], a, b);
+   }
+}
 
-      //printf("WARNING: SPLITTING NODE\n");
-      //b_tree_print_tree(mytree);
+static void compact_swap(B_Tree *btree, unsigned int a, unsigned int b)
+{
+   Compactor *c = btree->compact;
+   unsigned char bufa[1024], bufb[1024], pbuf[1024];
+   unsigned int parent[2], tmp, *lbas;
+   unsigned char k;
+   int root_moved = 0;
+
+   jdisk_read(btree->disk, a, bufa);
+   jdisk_read(btree->disk, b, bufb);
+
+   // Owners, at the place they will be after the swap
+   parent[0] = c->owner[a];
+   parent[1] = c->owner[b];
+   for(int i = 0; i < 2; ++i)
+   {
+      if(parent[i] != COMPACT_NONE && parent[i] != 0)
+      {
+         parent[i] = compact_moved(parent[i], a, b);
+      }
+   }
 
-      // oh boy here we fucking go - need to split
-      
-      // grab a midpoint of keys
-      // this will be the key that we will be moving up
-      int midkey = (int)(node_found->nkeys) / 2;
+   // Every sector written below goes around the node cache
+   if(btree->cache != NULL)
+   {
+      cache_drop(btree, a);
+      cache_drop(btree, b);
+      for(int i = 0; i < 2; ++i)
+      {
+         if(parent[i] != COMPACT_NONE && parent[i] != 0)
+         {
+            cache_drop(btree, parent[i]);
+         }
+      }
+   }
 
-      // make an empty node
-      // everything from the right to it gets copied to a new node
-      Tree_Node *newnode = malloc(sizeof(Tree_Node));
-      
-      newnode->keys      = calloc((mytree->keys_per_block + 1), sizeof(char*));
-      newnode->lbas      = malloc((mytree->keys_per_block + 2) * sizeof(unsigned int));
-      newnode->children  = calloc((mytree->keys_per_block + 2), sizeof(Tree_Node*));
-      int j = 0;
-      for(; j < mytree->keys_per_block + 1; ++j)
+   // Point the owners at the new places.  bufa is headed to b, and bufb to a.
+   for(int i = 0; i < 2; ++i)
+   {
+      if(parent[i] == COMPACT_NONE || (i == 1 && parent[1] == parent[0]))
       {
-         newnode->keys[j] = calloc(1, mytree->key_size);
-         newnode->children[j] = malloc(sizeof(Tree_Node));
+         continue;
       }
-      newnode->children[j] = malloc(sizeof(Tree_Node));
-      // now, make copies
-      // copying keys
-      int k = midkey + 1, m = 0;
-      for(; k < (int) (node_found->nkeys); ++k, ++m)
+      if(parent[i] == 0)
       {
-         memcpy(newnode->keys[m], node_found->keys[k], mytree->key_size);
-         newnode->lbas[m] = node_found->lbas[k];
-         //memcpy(newnode->children[m], node_found->children[k], sizeof(Tree_Node*));
-
-         // we also need to update the old node here
-         node_found->keys[k] = 0;
-         node_found->lbas[k] = 0;
-         node_found->children[k] = NULL;
+         btree->root_lba = compact_moved(btree->root_lba, a, b);
+         root_moved = 1;
       }
-      // one additional child and LBA
-      newnode->lbas[m] = node_found->lbas[k];
-      //memcpy(newnode->children[m], node_found->children[k], sizeof(Tree_Node*));
-      
-      newnode->nkeys = (char) (k - midkey - 1);
-      //newnode->flush = 0;
-      if(node_found -> internal)
+      else if(parent[i] == b)
       {
-         newnode->internal = 1;   
+         compact_fix(btree, bufa, a, b);
+      }
+      else if(parent[i] == a)
+      {
+         compact_fix(btree, bufb, a, b);
       }
       else
       {
-         newnode->internal = 0;
+         jdisk_read(btree->disk, parent[i], pbuf);
+         compact_fix(btree, pbuf, a, b);
+         jdisk_write(btree->disk, parent[i], pbuf);
       }
-      newnode->lba = mytree->first_free_block;
-      // Update the first free node
-      mytree->first_free_block = mytree->first_free_block + 1;
-
-      // Make sure that the rightmost links of the updated nodes point where they are supposed to
-      //newnode->lbas[(int) newnode->nkeys] = 0;
-
-      int split_parent = 0;
-      // previous node exists
-      if(node_found->parent != NULL)
-      { 
-         //printf("PREV NODE'S PARENT EXISTS\n");
-
-         //printf("PREV NODE'S PARENT EXISTS\n");
-         // find where the midkey key belongs
-         int n = 0;
-         for(; n < (int) (node_found->parent->nkeys); ++n)
-         {
-            if(memcmp(node_found->keys[midkey], node_found->parent->keys[n], mytree->key_size) < 0)
-            {
-               break;
-            }
-         }
+   }
+   jdisk_write(btree->disk, b, bufa);
+   jdisk_write(btree->disk, a, bufb);
+   if(btree->warm != NULL)
+   {
+      warm_wrote(btree);
+   }
+   // A node that moves, and the parent that points at it, are writes to a rebuild
+   if(btree->bloom_scan != NULL)
+   {
+      if(c->kind[a] == 1)
+      {
+         bloom_scan_wrote(btree, bufa + 2, bufa[1], btree->key_size, 1);
+      }
+      if(c->kind[b] == 1)
+      {
+         bloom_scan_wrote(btree, bufb + 2, bufb[1], btree->key_size, 1);
+      }
+   }
 
-         // shift everything to the right
-         shift_node_dat(node_found->parent, n);
+   // Bookkeeping follows the sectors
+   c->owner[b] = parent[0];
+   c->owner[a] = parent[1];
+   k = c->kind[a];
+   c->kind[a] = c->kind[b];
+   c->kind[b] = k;
+   if(c->pos[a] != COMPACT_NONE) c->plan[c->pos[a]] = b;
+   if(c->pos[b] != COMPACT_NONE) c->plan[c->pos[b]] = a;
+   tmp = c->pos[a];
+   c->pos[a] = c->pos[b];
+   c->pos[b] = tmp;
+
+   // Whatever the moved nodes point at now has a new owner
+   if(c->kind[b] == 1)
+   {
+      lbas = raw_lbas(btree, bufa);
+      for(int i = 0; i <= (int) bufa[1]; ++i)
+      {
+         if(lbas[i] != 0 && lbas[i] < c->n_lbas) c->owner[lbas[i]] = b;
+      }
+   }
+   if(c->kind[a] == 1)
+   {
+      lbas = raw_lbas(btree, bufb);
+      for(int i = 0; i <= (int) bufb[1]; ++i)
+      {
+         if(lbas[i] != 0 && lbas[i] < c->n_lbas) c->owner[lbas[i]] = a;
+      }
+   }
 
-         // place the new data at n
-         node_found->parent->keys[n] = node_found->keys[midkey];
-         // the shift here works a bit weird
-         node_found->parent->lbas[n] = node_found->lba;
-         node_found->parent->lbas[n + 1] = newnode->lba;
+   // The root lives in memory - reload it if it moved or one of its lbas did
+   if(root_moved)
+   {
+      write_tree(btree);
+   }
+   if(root_moved || parent[0] == btree->root_lba || parent[1] == btree->root_lba)
+   {
+      read_node(btree, btree->root, btree->root_lba, NULL);
+   }
+}
 
-         node_found->parent->children[n] = node_found;
-         node_found->parent->children[n + 1] = newnode;
+/*
+Places up to max_moves sectors.  Returns how many plan entries are left;
+when that reaches 0 the compaction is over.  Value lbas returned by earlier
+finds and inserts are not valid across a compaction.
+*/
+long b_tree_compact_step(void *b_tree, int max_moves)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   Compactor *c = mytree->compact;
+   int moves = 0;
+   long left;
 
-         newnode->parent = node_found->parent;
-         node_found->parent->nkeys = (char) (((int) node_found->parent->nkeys) + 1);
+   if(c == NULL)
+   {
+      return 0;
+   }
+   // Nodes from the last operation may be about to move
+   release_nodes(mytree);
 
-         if(node_found->parent->nkeys > mytree->keys_per_block)
-         {
-            split_parent = 1;
-         }
+   while(c->next < c->plan_n && moves < max_moves)
+   {
+      unsigned int lba = c->plan[c->next];
+      if(lba != c->next + 1)
+      {
+         compact_swap(mytree, lba, c->next + 1);
+         ++moves;
       }
-      else
+      c->next++;
+   }
+
+   left = c->plan_n - c->next;
+   if(left == 0)
+   {
+      if(mytree->flags & B_TREE_BLOOM)
       {
-         //printf("WARNING: PREV NODE'S PARENT IS NULL\n");
-         //We need to create a parent node in this case
-         // this will be the new root node then, so brace urself lol
-         node_found->parent = malloc(sizeof(Tree_Node));
-      
-         node_found->parent->keys      = malloc((mytree->keys_per_block + 1) * sizeof(char*));
-         node_found->parent->lbas      = malloc((mytree->keys_per_block + 2) * sizeof(unsigned int));
-         node_found->parent->children  = malloc((mytree->keys_per_block + 2) * sizeof(Tree_Node*));
-         j = 0;
-         for(; j < mytree->keys_per_block + 1; ++j)
-         {
-            node_found->parent->keys[j] = calloc(1, mytree->key_size);
-            node_found->parent->children[j] = malloc(sizeof(Tree_Node));
-         }
-         node_found->parent->children[j] = malloc(sizeof(Tree_Node));
+         bloom_home(mytree, c->plan_n + 1, c->end - (c->plan_n + 1));
+      }
+      compact_free(mytree);
+   }
+   return left;
+}
 
-         node_found->parent->parent = NULL;
-         node_found->parent->nkeys = 1;
-         node_found->parent->internal = 1;
+static void free_node(B_Tree *btree, Tree_Node *node)
+{
+   for(int i = 0; i < btree->keys_per_block + 1; ++i)
+   {
+      free(node->keys[i]);
+   }
+   free(node->keys);
+   free(node->lbas);
+   free(node->counts);
+   free(node->children);
+   free(node);
+}
 
-         // place the new data at i
-         node_found->parent->keys[0] = node_found->keys[midkey];
-         // the shift here works a bit weird
-         node_found->parent->lbas[0] = node_found->lba;
-         node_found->parent->lbas[1] = newnode->lba;
+/*
+Lets go of the tree and its jdisk.  Everything has already been written.
+*/
+int b_tree_detach(void *b_tree)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   Tree_Node *node;
+   int rv;
 
-         node_found->parent->children[0] = node_found;
-         node_found->parent->children[1] = newnode;
+   INST(inst_detach(mytree));
+   if(mytree->warm != NULL)
+   {
+      warm_free(mytree);
+   }
+   if(mytree->flags & B_TREE_BLOOM)
+   {
+      bloom_close(mytree);
+   }
+   if(mytree->flags & B_TREE_BUFFERED)
+   {
+      buffer_close(mytree);
+   }
+   release_nodes(mytree);
+   while(mytree->free_list != NULL)
+   {
+      node = mytree->free_list;
+      mytree->free_list = node->ptr;
+      free_node(mytree, node);
+   }
+   free_node(mytree, mytree->root);
+   free(mytree->rbuf);
+   if(mytree->tail != NULL)
+   {
+      free_node(mytree, mytree->tail);
+   }
+   if(mytree->compact != NULL)
+   {
+      compact_free(mytree);
+   }
+   if(mytree->cache != NULL)
+   {
+      b_tree_save_warmup(mytree);
+   }
+   b_tree_set_cache(mytree, 0);
+   b_tree_set_index(mytree, 0);
+   if(mytree->map != NULL)
+   {
+      map_flush(mytree);
+   }
+   rv = jdisk_unattach(mytree->disk);
+   free(mytree->map);
+   free(mytree->map_state);
+   free(mytree->bloom);
+   free(mytree->bloom_dirty);
+   free(mytree->filename);
+   free(mytree);
+   return rv;
+}
 
-         newnode->parent = node_found->parent;
+// Just use the convenient btree struct 
+void *b_tree_disk(void *b_tree) 
+{
+    return ((B_Tree *)b_tree) -> disk;
+}
 
-         // need to update the btree now
-         mytree->root = node_found->parent;
+// Same as prev function
+int b_tree_key_size(void *b_tree) 
+{
+    return ((B_Tree *)b_tree) -> key_size;
+}
+
+int b_tree_key_type(void *b_tree)
+{
+    return ((B_Tree *)b_tree) -> key_type;
+}
 
-         newnode->parent->lba = mytree->first_free_block;
+int b_tree_flags(void *b_tree)
+{
+    return ((B_Tree *)b_tree) -> flags;
+}
 
-         mytree->root_lba = node_found->parent->lba;
+unsigned long b_tree_sectors(void *b_tree)
+{
+    return ((B_Tree *)b_tree) -> first_free_block;
+}
 
-         // Update the first free node
-         mytree->first_free_block = mytree->first_free_block + 1;
+/*
+Walks the internal nodes a level at a time.  Leaves are counted from their
+parents' lbas, so they are never read.
+*/
+long b_tree_nodes(void *b_tree, int *height)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   unsigned char buf[1024];
+   unsigned int *level, *next;
+   long n, nnext, nodes;
+
+   level = malloc(sizeof(unsigned int));
+   level[0] = mytree->root_lba;
+   n = 1;
+   nodes = 1;
+   *height = 1;
+   while(1)
+   {
+      jdisk_read(mytree->disk, level[0], buf);
+      if(!buf[0])
+      {
+         break;
       }
-      // update the number of keys in the old node
-      node_found->nkeys = (char)(midkey);
-
-      //printf("WRITING PARENT BEGIN\n");
-      // Now, write the node_found->parent and newnode
+      next = malloc(n * mytree->lbas_per_block * sizeof(unsigned int));
+      nnext = 0;
+      for(long i = 0; i < n; ++i)
+      {
+         if(i > 0)
+         {
+            jdisk_read(mytree->disk, level[i], buf);
+         }
+         memcpy(next + nnext, raw_lbas(mytree, buf), (buf[1] + 1) * sizeof(unsigned int));
+         nnext += buf[1] + 1;
+      }
+      free(level);
+      level = next;
+      n = nnext;
+      nodes += n;
+      (*height)++;
+   }
+   free(level);
+   return nodes;
+}
 
-      //printf("/-----------------------------------------FINAL ROOT UPDATE %d\n", mytree->root_lba);
-     //mytree->root_lba = node_found->parent->lba;
+/*
+Compares two keys in the tree's order: memcmp for byte strings, numerically for integers.
+*/
+int b_tree_compare(void *b_tree, void *a, void *b)
+{
+   B_Tree *tr = (B_Tree *) b_tree;
 
-      if(split_parent)
+   switch(tr->key_type)
+   {
+      case B_TREE_KEY_U32:
       {
-         split(mytree, node_found->parent);
+         unsigned int x, y;
+         memcpy(&x, a, 4);
+         memcpy(&y, b, 4);
+         return (x > y) - (x < y);
       }
+      case B_TREE_KEY_U64:
+      {
+         unsigned long x, y;
+         memcpy(&x, a, 8);
+         memcpy(&y, b, 8);
+         return (x > y) - (x < y);
+      }
+      case B_TREE_KEY_U128:
+      {
+         unsigned __int128 x, y;
+         memcpy(&x, a, 16);
+         memcpy(&y, b, 16);
+         return (x > y) - (x < y);
+      }
+   }
+   return memcmp(a, b, tr->key_size);
+}
 
-      write_node(mytree, node_found->parent);
-      //printf("WRITING PARENT END\n");
-
-      write_node(mytree, newnode);
+/*
+Keys as text, for the tools.  Integer keys are read digit by digit into an
+unsigned __int128, so a u128 can use all 128 bits, and a number too big for
+the key's width is refused instead of being cut down to it.
+*/
+int b_tree_parse_key(char *s, int key_size, int key_type, void *key)
+{
+   unsigned __int128 x, limit;
+   int base, len, d;
 
-      //printf("IMPORTANT: node_found->parent lba: %d\n", node_found->parent->lba);
-   
-   // write node_found and btree
-   //write_node(mytree, node_found);
-   //mytree->root_lba = node_found->parent->lba;
-   //printf("/-----------------------------------------FINAL ROOT UPDATE %d\n", mytree->root_lba);
-      write_tree(mytree);
+   if(key_type == B_TREE_KEY_BYTES)
+   {
+      len = strlen(s);
+      if(len > key_size)
+      {
+         return 0;
+      }
+      memmove(key, s, len);
+      memset((char *) key + len, 0, key_size - len);
+      return 1;
+   }
 
-      //return val_lba;
+   base = 10;
+   if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+   {
+      base = 16;
+      s += 2;
+   }
+   else if(s[0] == '0' && s[1] != '\0')
+   {
+      base = 8;
+      s++;
+   }
+   if(*s == '\0')
+   {
+      return 0;
+   }
+   limit = (key_size >= 16) ? ~(unsigned __int128) 0 : ((unsigned __int128) 1 << (8 * key_size)) - 1;
+   x = 0;
+   for(; *s != '\0'; s++)
+   {
+      if(*s >= '0' && *s <= '9') d = *s - '0';
+      else if(*s >= 'a' && *s <= 'f') d = *s - 'a' + 10;
+      else if(*s >= 'A' && *s <= 'F') d = *s - 'A' + 10;
+      else return 0;
+      if(d >= base || x > (limit - d) / base)
+      {
+         return 0;
+      }
+      x = x * base + d;
+   }
+   memcpy(key, &x, key_size);
+   return 1;
 }
 
-unsigned int b_tree_insert(void *b_tree, void *key, void *record)
+void b_tree_format_key(void *key, int key_size, int key_type, char *s)
 {
-   
-   //printf("\nFUNCTION: INSERT BEGIN\n");
+   unsigned __int128 x;
+   char digits[40];
+   int n;
 
-   B_Tree* mytree = (B_Tree*) b_tree;
+   if(key_type == B_TREE_KEY_BYTES)
+   {
+      memcpy(s, key, key_size);
+      s[key_size] = '\0';
+      return;
+   }
+   x = 0;
+   memcpy(&x, key, key_size);
+   n = 0;
+   do
+   {
+      digits[n++] = '0' + (int) (x % 10);
+      x /= 10;
+   } while(x != 0);
+   while(n > 0)
+   {
+      *s++ = digits[--n];
+   }
+   *s = '\0';
+}
 
-   //printf("SIZE OF THE TREE: %d\n", mytree->size);
-   //printf("MAXKEY: %d\n", mytree->keys_per_block);
-   //printf("PRINTING TREE BEFORE INSERTING\n");
-   //b_tree_print_tree((void*)mytree);
+/*
+Ordered scans.
+
+A cursor is a stack of sectors, root to leaf, each with the index it's at.  In
+a leaf that's the next key; in an internal node it's the child being walked.
+Keys come out in order: a leaf's keys, then the separator above it once the
+child is done -- whose value is in the last lba of the leaf we just left (carry).
+The cursor reads sectors straight from the jdisk, so it doesn't disturb the
+nodes of the current operation, but it is not valid across inserts.
+*/
 
-   int lba = b_tree_find(b_tree, key);
+#define CURSOR_LEVELS (40)
 
-   if(lba) 
+typedef struct {
+   B_Tree *tree;
+   int depth;                    /* Levels on the stack - 0 once the scan is over */
+   unsigned int carry;           /* Value lba of the separator above the leaf just finished */
+   struct {
+      unsigned char bytes[1024+KEY_SEARCH_PAD];
+      int pos;
+   } level[CURSOR_LEVELS];
+} Cursor;
+
+// Pushes the node at lba, and its leftmost descendants down to a leaf
+static void cursor_descend(Cursor *c, unsigned int lba)
+{
+   while(c->depth < CURSOR_LEVELS)
    {
-      // key found, p, place record into val
-      //printf("WARNING: ABOUT TO WRITE INTO JDISK\n");
-      jdisk_write(((B_Tree*) b_tree)->disk, lba, record);
-      write_tree(mytree);
+      jdisk_read(c->tree->disk, lba, c->level[c->depth].bytes);
+      c->level[c->depth].pos = 0;
+      c->depth++;
+      if(!c->level[c->depth-1].bytes[0])
+      {
+         return;
+      }
+      lba = raw_lbas(c->tree, c->level[c->depth-1].bytes)[0];
+   }
+   fprintf(stderr, "b_tree_cursor: tree deeper than %d levels\n", CURSOR_LEVELS);
+   c->depth = 0;
+}
 
-      //printf("PRINTING TREE AFTER INSERTING\n");
-      //b_tree_print_tree(mytree);
+/*
+Starts a scan at the first key >= start_key, or at the first key if start_key is NULL.
+*/
+void *b_tree_cursor(void *b_tree, void *start_key)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   Cursor *c = malloc(sizeof(Cursor));
+   unsigned char *bytes;
+   int i, equal;
 
-      // Do we need to update the btree itself now?
-      return lba;
+   // Keys that are still in buffers aren't in the leaves yet
+   if(mytree->flags & B_TREE_BUFFERED)
+   {
+      buffer_drain(mytree);
    }
-   else
+   c->tree = mytree;
+   c->carry = 0;
+   // The root is in memory, and its bytes are current between operations
+   memcpy(c->level[0].bytes, mytree->root->bytes, 1024);
+   c->depth = 1;
+   while(1)
    {
-      // We need to find an appropriate place for the record to be inserted
-      // suppose we've found the external node where this key belongs 
-      Tree_Node *node_found = mytree->tmp_e;
+      bytes = c->level[c->depth-1].bytes;
+      i = 0;
+      if(start_key != NULL)
+      {
+         // If key i equals start_key, child i's keys are all smaller - we come out
+         // of the bottom right of it, and key i is next
+         i = mytree->search(bytes + 2, bytes[1], mytree->key_size, start_key, &equal);
+      }
+      c->level[c->depth-1].pos = i;
+      if(!bytes[0] || c->depth == CURSOR_LEVELS)
+      {
+         break;
+      }
+      jdisk_read(mytree->disk, raw_lbas(mytree, bytes)[i], c->level[c->depth].bytes);
+      c->depth++;
+   }
+   return (void *) c;
+}
+
+/*
+Copies the next key and its value lba out.  Returns 0 when there are no more.
+*/
+int b_tree_cursor_next(void *cursor, void *key, unsigned int *lba)
+{
+   Cursor *c = (Cursor *) cursor;
+   int ks = c->tree->key_size;
 
-      // Search for a place in the found node to insert the key
-      int i = 0;
-      //while(memcmp(key, node_found->keys[i], mytree->key_size) > 0 && (int) *(node_found->keys[i]) != 0)
-      //{
-      //   ++i;
-      //}
+   while(c->depth > 0)
+   {
+      unsigned char *bytes = c->level[c->depth-1].bytes;
+      int pos = c->level[c->depth-1].pos;
+      unsigned int *lbas = raw_lbas(c->tree, bytes);
 
-      for(; i < (int) (node_found->nkeys); ++i)
+      if(!bytes[0])
       {
-         if(memcmp(key, node_found->keys[i], mytree->key_size) < 0)
+         if(pos < bytes[1])
          {
-            break;
+            memcpy(key, bytes + 2 + pos * ks, ks);
+            *lba = lbas[pos];
+            c->level[c->depth-1].pos++;
+            return 1;
          }
+         c->carry = lbas[bytes[1]];
       }
+      else if(pos < bytes[1])
+      {
+         // Child pos is done, so separator pos is next, then child pos+1
+         memcpy(key, bytes + 2 + pos * ks, ks);
+         *lba = c->carry;
+         c->level[c->depth-1].pos++;
+         cursor_descend(c, lbas[pos + 1]);
+         return 1;
+      }
+      c->depth--;
+   }
+   return 0;
+}
 
-      // shift all keys to the right by one 
-      // in the same loop, shift all the lbas and children
-
-      shift_node_dat(node_found, i);
+void b_tree_cursor_free(void *cursor)
+{
+   free(cursor);
+}
 
-      // lba of the val
-      unsigned long val_lba = mytree->first_free_block;
+/*
+Export and import.
 
-      // modify the tree
-      mytree->first_free_block = mytree->first_free_block + 1;
+An export is a header (see b_tree.h) and then the pairs in key order: the key,
+a 2-byte value length, and the value sector with its trailing zeros cut off.
+Keys come from a cursor and values are read by value_read() straight into the
+output buffer, behind their key and length, so nothing is copied on the way
+out.
+*/
 
-      // place the new data at i
-      //printf("Inserting at key %d (maxkeys %d) with start letter %c\n", i, mytree->keys_per_block, *(char*)key);
-      node_found->keys[i] = key;
-      node_found->lbas[i] = val_lba;
-      node_found->children[i] = record;
+#define EXPORT_BUFSIZE (1 << 20)
+#define EXPORT_HEADER  (24)
 
-      node_found->nkeys = (unsigned char) ((int) (node_found ->nkeys) + 1);
-      //printf("CURRENT NUMBER OF KEYS %d\n", node_found->nkeys);
+static int write_all(int fd, unsigned char *buf, long n)
+{
+   long k;
 
-      // check if we've exceeded maxkey
-      if((int)(node_found->nkeys) > mytree->keys_per_block)
+   while(n > 0)
+   {
+      k = write(fd, buf, n);
+      if(k <= 0)
       {
-         split(mytree, node_found);
+         return 0;
       }
+      buf += k;
+      n -= k;
+   }
+   return 1;
+}
 
-      // write node_found and btree
-      write_node(mytree, node_found);
-      //printf("ROOT LBA IS %d\n", mytree->root_lba);
-      write_tree(mytree);
-      // write data
-      jdisk_write(mytree->disk, val_lba, record);
-
-      //printf("ROOT LBA IS %d\n", mytree->root_lba);
-
-      //printf("PRINTING TREE AFTER INSERTING\n");
-      //b_tree_print_tree((void*)mytree);
+long b_tree_export(void *b_tree, char *filename)
+{
+   B_Tree *mytree = (B_Tree *) b_tree;
+   int ks = mytree->key_size;
+   unsigned char *buf, *val;
+   unsigned int lba;
+   unsigned short len;
+   unsigned long count;
+   long n;
+   void *c;
+   int fd, ok;
+
+   fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if(fd < 0)
+   {
+      return -1;
+   }
+   // Room for one more pair past the flush point
+   buf = malloc(EXPORT_BUFSIZE + ks + 2 + 1024);
+   memset(buf, 0, EXPORT_HEADER);
+   *((unsigned int *)(buf)) = B_TREE_EXPORT_MAGIC;
+   *((unsigned int *)(buf + 4)) = ks;
+   *((unsigned int *)(buf + 8)) = mytree->key_type;
+   n = EXPORT_HEADER;
+   count = 0;
+   ok = 1;
+
+   c = b_tree_cursor(mytree, NULL);
+   while(ok && b_tree_cursor_next(c, buf + n, &lba))
+   {
+      val = buf + n + ks + 2;
+      value_read(mytree, lba, val);
+      for(len = 1024; len > 0 && val[len-1] == 0; len--) ;
+      memcpy(buf + n + ks, &len, 2);
+      n += ks + 2 + len;
+      count++;
+      if(n >= EXPORT_BUFSIZE)
+      {
+         ok = write_all(fd, buf, n);
+         n = 0;
+      }
+   }
+   b_tree_cursor_free(c);
 
-      //printf("FUNCTION: INSERT END\n\n");
-      //printf("/------------------------------INSERTING AT %d\n", val_lba);
-      return val_lba;
+   // The count goes into the header last, so a cut-short export can't pass for a whole one
+   ok = ok && write_all(fd, buf, n) && pwrite(fd, &count, 8, 16) == 8;
+   free(buf);
+   if(close(fd) != 0 || !ok)
+   {
+      return -1;
    }
-   return -1;
+   return count;
 }
 
+/*
+Bulk loading.  Sorted keys build the tree bottom up: each level has one open
+node, filled left to right.  When a leaf is full, the next key goes up as the
+separator after it, with its value in the leaf's last lba; when an internal
+node is full, the separator passes through to the level above.  Nodes are
+written once, when they fill, so the whole load costs a write per sector.
+
+Nodes are filled to one short of MAXKEY.  That leaves room at the end to fold
+a last node that came out empty into its left neighbor, and it lets later
+inserts into a node go without a split.
+*/
 
+typedef struct {
+   B_Tree *tree;
+   int fill;                           /* Keys per node */
+   int top;                            /* Highest level so far */
+   unsigned int reuse;                 /* The old root's sector, for the first node written */
+   Tree_Node *open[CURSOR_LEVELS];     /* The node being filled on each level */
+   Tree_Node *prev[CURSOR_LEVELS];     /* The last node written on each level */
+} Bulk;
+
+static Bulk *bulk_begin(B_Tree *mytree)
+{
+   Bulk *b = malloc(sizeof(Bulk));
+
+   b->tree = mytree;
+   b->fill = mytree->keys_per_block - 1;
+   b->top = 0;
+   b->reuse = mytree->root_lba;
+   b->open[0] = new_node(mytree);
+   b->prev[0] = new_node(mytree);
+   return b;
+}
 
+static unsigned int bulk_lba(Bulk *b)
+{
+   unsigned int lba = b->reuse;
 
+   if(lba == 0)
+   {
+      lba = alloc_run(b->tree, 1);
+   }
+   b->reuse = 0;
+   return lba;
+}
 
+static void bulk_sep(Bulk *b, int level, void *key);
 
+// Writes out the full node on a level, and sends key up as the separator after it
+static void bulk_close(Bulk *b, int level, void *key)
+{
+   Tree_Node *node = b->open[level];
 
+   node->internal = (level > 0);
+   node->lba = bulk_lba(b);
+   write_node(b->tree, node);
+   b->open[level] = b->prev[level];
+   b->open[level]->nkeys = 0;
+   b->prev[level] = node;
 
+   // Nodes have at least two keys, so 40 levels is more than 32-bit lbas can address
+   if(level == b->top)
+   {
+      b->top++;
+      b->open[b->top] = new_node(b->tree);
+      b->prev[b->top] = new_node(b->tree);
+   }
+   b->open[level+1]->lbas[b->open[level+1]->nkeys] = node->lba;
+   b->open[level+1]->counts[b->open[level+1]->nkeys] = node_count(node);
+   bulk_sep(b, level+1, key);
+}
 
+static void bulk_sep(Bulk *b, int level, void *key)
+{
+   Tree_Node *node = b->open[level];
 
+   if(node->nkeys == b->fill)
+   {
+      bulk_close(b, level, key);
+      return;
+   }
+   memcpy(node->keys[node->nkeys], key, b->tree->key_size);
+   node->nkeys++;
+}
 
+static void bulk_add(Bulk *b, void *key, void *record)
+{
+   Tree_Node *leaf = b->open[0];
+   unsigned int val = value_new(b->tree, record, 0);
 
+   if(leaf->nkeys == b->fill)
+   {
+      leaf->lbas[leaf->nkeys] = val;
+      bulk_close(b, 0, key);
+      return;
+   }
+   memcpy(leaf->keys[leaf->nkeys], key, b->tree->key_size);
+   leaf->lbas[leaf->nkeys] = val;
+   leaf->nkeys++;
+}
 
+/*
+Writes the open nodes, bottom up, and makes the top one the root.
+*/
+static void bulk_finish(Bulk *b)
+{
+   B_Tree *mytree = b->tree;
+   Tree_Node *node, *p;
+   unsigned int child = 0;             /* The open node's last pointer: 0 for the last leaf */
+   unsigned long count = 0;            /* and the keys under it */
+   int level = 0, up;
 
+   while(level < b->top)
+   {
+      node = b->open[level];
+      node->lbas[node->nkeys] = child;
+      node->counts[node->nkeys] = count;
+      if(node->nkeys > 0)
+      {
+         node->internal = (level > 0);
+         node->lba = bulk_lba(b);
+         write_node(mytree, node);
+         child = node->lba;
+         count = node_count(node);
+         level++;
+         continue;
+      }
 
+      // A node with no keys can't stand.  Its pointer goes to the last node written
+      // on its level, along with the separator between the two -- the newest key on
+      // the levels above.  The open nodes in between are empty too, and are dropped.
+      for(up = level + 1; b->open[up]->nkeys == 0; up++) ;
+      node = b->open[up];
+      node->nkeys--;
+      p = b->prev[level];
+      memcpy(p->keys[p->nkeys], node->keys[node->nkeys], mytree->key_size);
+      p->nkeys++;
+      p->lbas[p->nkeys] = child;
+      p->counts[p->nkeys] = count;
+      write_node(mytree, p);
+
+      // The nodes written above p, on the levels in between, now have 1 + count more keys
+      if(mytree->flags & B_TREE_COUNTED)
+      {
+         for(int l = level + 1; l < up; ++l)
+         {
+            b->prev[l]->counts[b->prev[l]->nkeys] += 1 + count;
+            write_node(mytree, b->prev[l]);
+         }
+      }
 
+      // The node above already points at p, so it is complete
+      child = node->lbas[node->nkeys];
+      count += 1 + node->counts[node->nkeys];
+      level = up;
+   }
 
+   node = b->open[b->top];
+   node->lbas[node->nkeys] = child;
+   node->counts[node->nkeys] = count;
+   if(node->nkeys == 0 && b->top > 0)
+   {
+      mytree->root_lba = child;
+   }
+   else
+   {
+      node->internal = (b->top > 0);
+      node->lba = bulk_lba(b);
+      write_node(mytree, node);
+      mytree->root_lba = node->lba;
+   }
+   read_node(mytree, mytree->root, mytree->root_lba, NULL);
+   write_tree(mytree);
 
+   for(level = 0; level <= b->top; level++)
+   {
+      free_node(mytree, b->open[level]);
+      free_node(mytree, b->prev[level]);
+   }
+   free(b);
+}
 
+typedef struct {
+   int fd;
+   unsigned char *buf;
+   long pos;
+   long end;
+} Import_Reader;
+
+// Makes sure that n bytes are buffered at r->pos.  0 at the end of the file.
+static int import_need(Import_Reader *r, long n)
+{
+   long k;
 
+   if(r->end - r->pos >= n)
+   {
+      return 1;
+   }
+   memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+   r->end -= r->pos;
+   r->pos = 0;
+   while(r->end < n)
+   {
+      k = read(r->fd, r->buf + r->end, EXPORT_BUFSIZE - r->end);
+      if(k <= 0)
+      {
+         return 0;
+      }
+      r->end += k;
+   }
+   return 1;
+}
 
-// Just use the convenient btree struct 
-void *b_tree_disk(void *b_tree) 
+/*
+Converts an exported key to this tree's key size.  Byte keys are zero-padded,
+or cut if what's cut is zeros; integer keys keep their value.  Either way the
+order is kept.  Returns 0 if the key doesn't fit.
+*/
+static int import_key(B_Tree *mytree, unsigned char *src, int src_size, unsigned char *dst)
 {
-    return ((B_Tree *)b_tree) -> disk;
+   int ks = mytree->key_size;
+   unsigned __int128 x;
+
+   if(mytree->key_type == B_TREE_KEY_BYTES)
+   {
+      for(int i = ks; i < src_size; i++)
+      {
+         if(src[i] != 0)
+         {
+            return 0;
+         }
+      }
+      memcpy(dst, src, (src_size < ks) ? src_size : ks);
+      if(src_size < ks)
+      {
+         memset(dst + src_size, 0, ks - src_size);
+      }
+      return 1;
+   }
+   x = 0;
+   memcpy(&x, src, src_size);
+   if(ks < 16 && (x >> (8 * ks)) != 0)
+   {
+      return 0;
+   }
+   memcpy(dst, &x, ks);
+   return 1;
 }
 
-// Same as prev function
-int b_tree_key_size(void *b_tree) 
+/*
+Reads an export into the tree.  Into an empty tree, the pairs are bulk loaded
+for as long as they come in order; anything else is inserted.
+*/
+long b_tree_import(void *b_tree, char *filename)
 {
-    return ((B_Tree *)b_tree) -> key_size;
+   B_Tree *mytree = (B_Tree *) b_tree;
+   int ks = mytree->key_size;
+   Import_Reader r;
+   unsigned char *key, *last, record[1024];
+   unsigned int src_size, src_type;
+   unsigned short len;
+   unsigned long count, n;
+   Bulk *b;
+   int ok;
+
+   r.fd = open(filename, O_RDONLY);
+   if(r.fd < 0)
+   {
+      return -1;
+   }
+   r.buf = malloc(EXPORT_BUFSIZE);
+   r.pos = 0;
+   r.end = 0;
+   if(!import_need(&r, EXPORT_HEADER) || *((unsigned int *)(r.buf)) != B_TREE_EXPORT_MAGIC)
+   {
+      fprintf(stderr, "b_tree_import: %s is not a b_tree export\n", filename);
+      free(r.buf);
+      close(r.fd);
+      return -1;
+   }
+   src_size = *((unsigned int *)(r.buf + 4));
+   src_type = *((unsigned int *)(r.buf + 8));
+   count = *((unsigned long *)(r.buf + 16));
+   r.pos = EXPORT_HEADER;
+   // Byte keys and integer keys aren't in the same order
+   if(src_size == 0 || src_size > EXPORT_BUFSIZE / 2 ||
+      (src_type == B_TREE_KEY_BYTES) != (mytree->key_type == B_TREE_KEY_BYTES))
+   {
+      fprintf(stderr, "b_tree_import: %s has keys that don't go into this tree\n", filename);
+      free(r.buf);
+      close(r.fd);
+      return -1;
+   }
+
+   b = NULL;
+   if(mytree->root->nkeys == 0 && !mytree->root->internal && mytree->compact == NULL)
+   {
+      b = bulk_begin(mytree);
+   }
+   key = malloc(ks);
+   last = malloc(ks);
+   ok = 1;
+   for(n = 0; n < count; n++)
+   {
+      if(!import_need(&r, src_size + 2))
+      {
+         ok = 0;
+         break;
+      }
+      memcpy(&len, r.buf + r.pos + src_size, 2);
+      if(len > 1024 || !import_need(&r, src_size + 2 + len))
+      {
+         ok = 0;
+         break;
+      }
+      if(!import_key(mytree, r.buf + r.pos, src_size, key))
+      {
+         fprintf(stderr, "b_tree_import: key %lu doesn't fit in %d bytes\n", n, ks);
+         ok = 0;
+         break;
+      }
+      memcpy(record, r.buf + r.pos + src_size + 2, len);
+      memset(record + len, 0, 1024 - len);
+      r.pos += src_size + 2 + len;
+
+      if(b != NULL && n > 0 && b_tree_compare(mytree, key, last) <= 0)
+      {
+         bulk_finish(b);
+         b = NULL;
+      }
+      // The add, and writing out every open node afterwards
+      if(b != NULL && reserve(mytree, 2 * b->top + 4) != 0)
+      {
+         break;
+      }
+      if(b != NULL)
+      {
+         if(mytree->flags & B_TREE_BLOOM)
+         {
+            bloom_add(mytree, key);
+         }
+         bulk_add(b, key, record);
+         memcpy(last, key, ks);
+      }
+      else if(b_tree_insert(mytree, key, record) == 0)
+      {
+         break;
+      }
+   }
+   if(b != NULL)
+   {
+      bulk_finish(b);
+   }
+   // A bulk load fills the filter past its size, and it only grows on an insert
+   if(mytree->flags & B_TREE_BLOOM)
+   {
+      bloom_room(mytree);
+   }
+
+   free(key);
+   free(last);
+   free(r.buf);
+   close(r.fd);
+   if(!ok)
+   {
+      fprintf(stderr, "b_tree_import: %s is cut short or damaged after %lu pairs\n", filename, n);
+      return -1;
+   }
+   if(n < count)
+   {
+      fprintf(stderr, "b_tree_import: the disk is full after %lu pairs\n", n);
+      return -1;
+   }
+   return n;
 }
 
 /*
@@ -794,6 +6000,31 @@ void print_possible_hex(void *val, int len)
    return;
 }
 
+void print_key(B_Tree *b_tree, void *key)
+{
+   unsigned int u32;
+   unsigned long u64[2];
+
+   switch(b_tree->key_type)
+   {
+      case B_TREE_KEY_U32:
+         memcpy(&u32, key, 4);
+         printf("%u\n", u32);
+         break;
+      case B_TREE_KEY_U64:
+         memcpy(u64, key, 8);
+         printf("%lu\n", u64[0]);
+         break;
+      case B_TREE_KEY_U128:
+         // Native order on x86: the low half comes first
+         memcpy(u64, key, 16);
+         printf("0x%016lx%016lx\n", u64[1], u64[0]);
+         break;
+      default:
+         print_possible_hex(key, 8);
+   }
+}
+
 void print_node(B_Tree *b_tree, Tree_Node *node)
 {
    int i;
@@ -802,7 +6033,7 @@ void print_node(B_Tree *b_tree, Tree_Node *node)
    for(i = 0; i < node->nkeys; i++)
    {
       printf("   key %d: ", i);
-      print_possible_hex(node->keys[i], 8);
+      print_key(b_tree, node->keys[i]);
    }
    for(i = 0; i < (int) (node->nkeys+1); i++)
    {
@@ -819,7 +6050,7 @@ void print_node(B_Tree *b_tree, Tree_Node *node)
       {
          //if(!(node->children[i]))
          //{
-            node->children[i] = malloc(sizeof(Tree_Node));
+            node->children[i] = get_node(b_tree);
             read_node(b_tree, node->children[i], node->lbas[i], node);
          //}
          //return;
@@ -835,6 +6066,10 @@ void b_tree_print_tree(void *tree)
    printf("/-------------------------PRINT BEGIN--------------------/\n");
    printf("b_tree information\n");
    printf("key size: %u\n", tr->key_size);
+   if(tr->key_type != B_TREE_KEY_BYTES)
+   {
+      printf("key type: u%d\n", tr->key_size * 8);
+   }
    printf("root lba: %u\n", tr->root_lba);
    printf("sectors:  %lu\n", tr->first_free_block);
    printf("\n");
@@ -844,7 +6079,7 @@ void b_tree_print_tree(void *tree)
    /* now load in the root node, if not already loaded */
    if(!(tr->root))
    {
-      tr->root = malloc(sizeof(Tree_Node));
+      tr->root = new_node(tr);
       read_node(tree, tr->root, tr->root_lba, NULL);
    }
 
@@ -0,0 +1,852 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "b_tree.h"
+
+/* Benchmark driver for the b_tree.
+
+   Runs a load phase (insert n keys) followed by a run phase (a mix of finds and
+   writes drawn from a key distribution), or replays a tree-*.txt file.  For each
+   phase it reports ops/sec, latency percentiles, jdisk reads and writes per op,
+   modeled device time and CPU time, and bytes allocated per op.  The allocation
+   numbers come from wrapping malloc/calloc/realloc at link time (see the
+   bin/b_tree_bench rule). */
+
+#define BUFSIZE 4000
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_bench tree_file [options]\n");
+  fprintf(stderr, "   -w uniform|zipfian|sequential|counters\n");
+  fprintf(stderr, "                                   key distribution (default uniform); counters is zipfian,\n");
+  fprintf(stderr, "                                   with writes that increment a counter in the value\n");
+  fprintf(stderr, "   -n keys                         keys inserted by the load phase (default 10000)\n");
+  fprintf(stderr, "   -o ops                          operations in the run phase (default 10000)\n");
+  fprintf(stderr, "   -r read_fraction                fraction of run ops that are finds (default 0.5)\n");
+  fprintf(stderr, "   -k key_size                     4 to 254 (default 8)\n");
+  fprintf(stderr, "   -K bytes|u32|u64|u128           key type; the integer types set key_size (default bytes)\n");
+  fprintf(stderr, "   -c nodes                        interior node cache size (default 0, off)\n");
+  fprintf(stderr, "   -x keys                         hash index size, from keys to value lbas (default 0, off)\n");
+  fprintf(stderr, "   -W levels|manifest              restart (detach, attach) before the run phase, and warm the\n");
+  fprintf(stderr, "                                   top levels into the cache in the background (0: restart cold),\n");
+  fprintf(stderr, "                                   or reload what was cached at detach from the warmup manifest\n");
+  fprintf(stderr, "   -v value_size                   bytes of text in each value (default 0: just the id)\n");
+  fprintf(stderr, "   -V raw|lz                       values in sectors of their own, or compressed and packed\n");
+  fprintf(stderr, "   -A end|bitmap                   sector allocator: always at the end, or the bitmap with\n");
+  fprintf(stderr, "                                   placement near the leaf (default end)\n");
+  fprintf(stderr, "   -S half|bstar|topdown|buffered  full nodes split in half, share keys with a sibling and\n");
+  fprintf(stderr, "                                   split two into three, or split on the way down; or inserts\n");
+  fprintf(stderr, "                                   are buffered in internal nodes (default half)\n");
+  fprintf(stderr, "   -F none|bloom                   keep a Bloom filter of the keys (default none)\n");
+  fprintf(stderr, "   -m miss_fraction                fraction of run finds for keys that aren't there (default 0)\n");
+  fprintf(stderr, "   -O plain|counted                keep subtree counts in internal nodes (default plain)\n");
+  fprintf(stderr, "   -q count_fraction               fraction of run finds that count the keys between two loaded\n");
+  fprintf(stderr, "                                   keys: from the counts, or with a cursor (default 0)\n");
+  fprintf(stderr, "   -R 0|1                          finds also read the value (default 0)\n");
+  fprintf(stderr, "   -z theta                        zipfian skew (default 0.99)\n");
+  fprintf(stderr, "   -s seed                         (default 1)\n");
+  fprintf(stderr, "   -d none|fixed|hdd|nvme          jdisk latency model (default: $JDISK_LATENCY, else fixed)\n");
+  fprintf(stderr, "   -t tree.txt                     replay a tree-*.txt file instead\n");
+  fprintf(stderr, "   -j json_file                    also write the results as JSON (- for stdout)\n");
+  fprintf(stderr, "tree_file is scratch -- it is removed and recreated.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+/* ---------------------------------------------------------------- */
+/* Allocation accounting: the link line passes -Wl,--wrap=malloc etc. */
+
+long Alloc_bytes;
+long Alloc_calls;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  Alloc_bytes += size;
+  Alloc_calls++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+  Alloc_bytes += n * size;
+  Alloc_calls++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+  Alloc_bytes += size;
+  Alloc_calls++;
+  return __real_realloc(p, size);
+}
+
+/* ---------------------------------------------------------------- */
+/* Per-phase statistics */
+
+typedef struct {
+  char *name;
+  long ops;
+  double seconds;
+  long *lat;           /* Latency of each op in nanoseconds */
+  long reads;
+  long writes;
+  long alloc_bytes;
+  long alloc_calls;
+  long errors;         /* Finds that didn't return the expected lba, and other failed checks */
+  double device;       /* Modeled device seconds */
+  double cpu;          /* Process CPU seconds */
+  long start;
+} Phase;
+
+static long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static double cpu_seconds()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void phase_init(Phase *p, char *name, long max_ops)
+{
+  p->name = name;
+  p->ops = 0;
+  p->seconds = 0;
+  p->lat = (long *) malloc(sizeof(long) * (max_ops > 0 ? max_ops : 1));
+  p->reads = 0;
+  p->writes = 0;
+  p->alloc_bytes = 0;
+  p->alloc_calls = 0;
+  p->errors = 0;
+  p->device = 0;
+  p->cpu = 0;
+}
+
+static void phase_begin(Phase *p, void *jd)
+{
+  p->reads = jdisk_reads(jd);
+  p->writes = jdisk_writes(jd);
+  p->alloc_bytes = Alloc_bytes;
+  p->alloc_calls = Alloc_calls;
+  p->device = jdisk_device_time(jd);
+  p->cpu = cpu_seconds();
+  p->start = now_ns();
+}
+
+static void phase_end(Phase *p, void *jd)
+{
+  p->seconds = (now_ns() - p->start) / 1e9;
+  p->reads = jdisk_reads(jd) - p->reads;
+  p->writes = jdisk_writes(jd) - p->writes;
+  p->alloc_bytes = Alloc_bytes - p->alloc_bytes;
+  p->alloc_calls = Alloc_calls - p->alloc_calls;
+  p->device = jdisk_device_time(jd) - p->device;
+  p->cpu = cpu_seconds() - p->cpu;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+  long x = *(long *) a, y = *(long *) b;
+  return (x < y) ? -1 : (x > y);
+}
+
+static double percentile(Phase *p, double q)
+{
+  long i;
+
+  if (p->ops == 0) return 0;
+  i = (long) (q * p->ops);
+  if (i >= p->ops) i = p->ops - 1;
+  return p->lat[i] / 1000.0;
+}
+
+static double per_op(Phase *p, long x)
+{
+  return (p->ops == 0) ? 0 : (double) x / p->ops;
+}
+
+static void phase_print(Phase *p)
+{
+  qsort(p->lat, p->ops, sizeof(long), cmp_long);
+  printf("%-6s ops: %ld  ops/sec: %.0f  p50: %.2fus  p99: %.2fus  p999: %.2fus\n",
+         p->name, p->ops, (p->seconds > 0) ? p->ops / p->seconds : 0,
+         percentile(p, .50), percentile(p, .99), percentile(p, .999));
+  printf("%-6s reads/op: %.3f  writes/op: %.3f  bytes alloc/op: %.1f  mallocs/op: %.3f",
+         p->name, per_op(p, p->reads), per_op(p, p->writes),
+         per_op(p, p->alloc_bytes), per_op(p, p->alloc_calls));
+  if (p->errors) printf("  ERRORS: %ld", p->errors);
+  printf("\n");
+  printf("%-6s cpu/op: %.2fus  device/op: %.2fus  (modeled)\n",
+         p->name, per_op(p, 1) * p->cpu * 1e6, per_op(p, 1) * p->device * 1e6);
+}
+
+static void phase_json(FILE *f, Phase *p)
+{
+  fprintf(f, "    \"%s\": {\"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+          p->name, p->ops, p->seconds, (p->seconds > 0) ? p->ops / p->seconds : 0);
+  fprintf(f, "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, ",
+          percentile(p, .50), percentile(p, .99), percentile(p, .999));
+  fprintf(f, "\"reads_per_op\": %.4f, \"writes_per_op\": %.4f, ",
+          per_op(p, p->reads), per_op(p, p->writes));
+  fprintf(f, "\"cpu_us_per_op\": %.3f, \"device_us_per_op\": %.3f, ",
+          per_op(p, 1) * p->cpu * 1e6, per_op(p, 1) * p->device * 1e6);
+  fprintf(f, "\"bytes_alloc_per_op\": %.2f, \"mallocs_per_op\": %.4f, \"errors\": %ld}",
+          per_op(p, p->alloc_bytes), per_op(p, p->alloc_calls), p->errors);
+}
+
+/* ---------------------------------------------------------------- */
+/* Key generation */
+
+/* Bijective mixers, so that distinct ids give distinct keys, scattered over the key space */
+
+static unsigned long mix64(unsigned long x)
+{
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9UL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebUL;
+  x ^= x >> 31;
+  return x;
+}
+
+static unsigned long mix32(unsigned long x)
+{
+  unsigned int y = x;
+
+  y ^= y >> 16; y *= 0x7feb352dU;
+  y ^= y >> 15; y *= 0x846ca68bU;
+  y ^= y >> 16;
+  return y;
+}
+
+int Sequential;
+int Zipfian;
+int Counters;
+int Value_size = 0;           /* -v */
+int Value_flags = 0;          /* -V lz: B_TREE_COMPRESS */
+int Alloc_flags = 0;          /* -A bitmap: B_TREE_ALLOC */
+int Split_flags = 0;          /* -S bstar: B_TREE_BSTAR, -S topdown: B_TREE_TOPDOWN, -S buffered: B_TREE_BUFFERED */
+char *Splits = "half";
+int Filter_flags = 0;         /* -F bloom: B_TREE_BLOOM */
+long Index_keys = 0;          /* -x */
+int Order_flags = 0;          /* -O counted: B_TREE_COUNTED */
+int Read_values = 0;          /* -R */
+
+int Key_type = B_TREE_KEY_BYTES;
+int Cache_nodes = 0;
+int Warm_levels = -1;         /* -W: restart before the run phase, WARM_MANIFEST to use the manifest */
+
+#define WARM_MANIFEST (-2)
+
+/* Byte-string keys are big-endian, so memcmp order is numeric order.  Integer
+   keys are native.  Ids are used as-is for the sequential workload, and
+   scrambled otherwise. */
+
+static void make_key(unsigned char *key, int key_size, unsigned long id)
+{
+  unsigned long x;
+  int i, w;
+
+  w = (key_size < 8) ? 4 : 8;
+  x = Sequential ? id : ((w == 4) ? mix32(id) : mix64(id));
+  memset(key, 0, key_size);
+  if (Key_type != B_TREE_KEY_BYTES) {
+    memcpy(key, &x, w);
+    return;
+  }
+  for (i = 0; i < w; i++) key[w-1-i] = (x >> (8*i)) & 0xff;
+}
+
+/* A value: the id, then up to Value_size bytes of words, as in a text record */
+
+static void make_value(unsigned char *val, long id)
+{
+  static char *words[] = { "name", "address", "city", "state", "knoxville", "tennessee", "status",
+                           "active", "pending", "order", "customer", "total", "shipped", "=", ";" };
+  unsigned long x;
+  int n, w;
+
+  memset(val, 0, JDISK_SECTOR_SIZE);
+  n = sprintf((char *) val, "%ld", id);
+  x = id;
+  while (n < Value_size) {
+    x = mix64(x + 1);
+    w = x % (sizeof(words) / sizeof(words[0]));
+    if (n + (int) strlen(words[w]) + 1 > Value_size) break;
+    n += sprintf((char *) val + n, " %s", words[w]);
+  }
+}
+
+/* Zipfian ranks over [0, n), as in Gray et al., "Quickly Generating Billion-Record
+   Synthetic Databases".  Rank 0 is the hottest. */
+
+typedef struct {
+  long n;
+  double theta, alpha, zetan, eta;
+} Zipf;
+
+static double zeta(long n, double theta)
+{
+  double sum;
+  long i;
+
+  sum = 0;
+  for (i = 1; i <= n; i++) sum += 1.0 / pow(i, theta);
+  return sum;
+}
+
+static void zipf_init(Zipf *z, long n, double theta)
+{
+  double zeta2;
+
+  z->n = n;
+  z->theta = theta;
+  z->zetan = zeta(n, theta);
+  zeta2 = zeta(2, theta);
+  z->alpha = 1.0 / (1.0 - theta);
+  z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static long zipf_next(Zipf *z)
+{
+  double u, uz;
+  long r;
+
+  u = drand48();
+  uz = u * z->zetan;
+  if (uz < 1.0) return 0;
+  if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+  r = (long) (z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return (r >= z->n) ? z->n - 1 : r;
+}
+
+/* ---------------------------------------------------------------- */
+
+int Latency_model = -1;      /* -1: leave jdisk's default */
+double Latency_param;
+
+static void parse_latency(char *s)
+{
+  char *colon;
+  double param;
+
+  colon = strchr(s, ':');
+  param = (colon == NULL) ? -1 : atof(colon+1);
+  if (strncmp(s, "none", 4) == 0) {
+    Latency_model = JDISK_LATENCY_NONE;
+    Latency_param = 0;
+  } else if (strncmp(s, "fixed", 5) == 0) {
+    Latency_model = JDISK_LATENCY_FIXED;
+    Latency_param = (param < 0) ? JDISK_DELAY : param;
+  } else if (strncmp(s, "hdd", 3) == 0) {
+    Latency_model = JDISK_LATENCY_HDD;
+    Latency_param = 0;
+  } else if (strncmp(s, "nvme", 4) == 0) {
+    Latency_model = JDISK_LATENCY_NVME;
+    Latency_param = (param < 1) ? 32 : param;
+  } else {
+    usage("bad -d");
+  }
+}
+
+static void *make_tree(char *fn, long keys, int key_size)
+{
+  void *t;
+
+  unlink(fn);
+  t = b_tree_create_flags(fn, (2 * keys + 64) * JDISK_SECTOR_SIZE, key_size, Key_type, Value_flags | Alloc_flags | Split_flags | Filter_flags | Order_flags);
+  if (t == NULL) {
+    fprintf(stderr, "Couldn't create b_tree -- calling perror()\n");
+    perror(fn);
+    exit(1);
+  }
+  if (Latency_model >= 0) jdisk_set_latency(b_tree_disk(t), Latency_model, Latency_param);
+  b_tree_set_cache(t, Cache_nodes);
+  b_tree_set_index(t, Index_keys);
+  return t;
+}
+
+static void timed_insert(Phase *p, void *t, unsigned char *key, unsigned char *val, unsigned int *lba)
+{
+  long t0;
+
+  t0 = now_ns();
+  *lba = b_tree_insert(t, key, val);
+  p->lat[p->ops++] = now_ns() - t0;
+}
+
+static void timed_find(Phase *p, void *t, unsigned char *key, unsigned int *lba)
+{
+  unsigned char val[JDISK_SECTOR_SIZE];
+  long t0;
+
+  t0 = now_ns();
+  *lba = b_tree_find(t, key);
+  if (Read_values && *lba != 0) b_tree_read(t, *lba, val);
+  p->lat[p->ops++] = now_ns() - t0;
+}
+
+/* The keys in [lo, hi): from the subtree counts, or walking a cursor */
+
+static long timed_count(Phase *p, void *t, unsigned char *lo, unsigned char *hi)
+{
+  unsigned char key[BUFSIZE];
+  unsigned int lba;
+  long t0, count;
+  void *c;
+
+  t0 = now_ns();
+  if (Order_flags & B_TREE_COUNTED) {
+    count = b_tree_count_range(t, lo, hi);
+  } else {
+    count = 0;
+    c = b_tree_cursor(t, lo);
+    while (b_tree_cursor_next(c, key, &lba) && b_tree_compare(t, key, hi) < 0) count++;
+    b_tree_cursor_free(c);
+  }
+  p->lat[p->ops++] = now_ns() - t0;
+  return count;
+}
+
+/* The counters workload keeps a count at this offset in each value */
+
+#define COUNTER_OFFSET (512)
+
+static int increment(void *record, int exists, void *arg)
+{
+  unsigned long c;
+
+  (void) exists;              /* A missing key starts from a zeroed record */
+  (void) arg;
+  memcpy(&c, (char *) record + COUNTER_OFFSET, sizeof(c));
+  c++;
+  memcpy((char *) record + COUNTER_OFFSET, &c, sizeof(c));
+  return 1;
+}
+
+/* Replays a tree-*.txt file: "rn lba key val" per line.  Every key is inserted,
+   then every key is looked up and checked against the lba that insert returned. */
+
+static int replay(char *fn, char *txt, int key_size, Phase *load, Phase *run, void **tp)
+{
+  FILE *f;
+  char line[BUFSIZE], key[BUFSIZE], val[BUFSIZE];
+  double rn;
+  unsigned int lba, *lbas;
+  char **keys, **vals;
+  long n, i, ks;
+  void *t, *jd;
+
+  f = fopen(txt, "r");
+  if (f == NULL) { perror(txt); exit(1); }
+  n = 0;
+  ks = 0;
+  keys = NULL;
+  vals = NULL;
+  while (fgets(line, BUFSIZE, f) != NULL) {
+    if (sscanf(line, "%lf %u %s %s", &rn, &lba, key, val) != 4) continue;
+    keys = (char **) realloc(keys, sizeof(char *) * (n+1));
+    vals = (char **) realloc(vals, sizeof(char *) * (n+1));
+    keys[n] = strdup(key);
+    vals[n] = strdup(val);
+    if ((long) strlen(key) > ks) ks = strlen(key);
+    n++;
+  }
+  fclose(f);
+
+  if (key_size == 0) key_size = (ks < 4) ? 4 : ks;
+  if (ks > key_size) usage("replay file has keys longer than key_size");
+
+  t = make_tree(fn, n, key_size);
+  *tp = t;
+  jd = b_tree_disk(t);
+  lbas = (unsigned int *) malloc(sizeof(unsigned int) * (n > 0 ? n : 1));
+  phase_init(load, "load", n);
+  phase_init(run, "run", n);
+
+  /* Pad outside of the timed region, as b_tree_test does */
+  phase_begin(load, jd);
+  for (i = 0; i < n; i++) {
+    memset(key, 0, key_size);
+    memset(val, 0, JDISK_SECTOR_SIZE);
+    strcpy(key, keys[i]);
+    strcpy(val, vals[i]);
+    timed_insert(load, t, (unsigned char *) key, (unsigned char *) val, lbas+i);
+  }
+  phase_end(load, jd);
+
+  phase_begin(run, jd);
+  for (i = 0; i < n; i++) {
+    memset(key, 0, key_size);
+    strcpy(key, keys[i]);
+    timed_find(run, t, (unsigned char *) key, &lba);
+    if (lba != lbas[i]) run->errors++;
+  }
+  phase_end(run, jd);
+  return key_size;
+}
+
+int main(int argc, char **argv)
+{
+  char *fn, *workload, *txt, *json;
+  long n, ops, i, id, next_id, seq;
+  double read_fraction, miss_fraction, count_fraction, theta;
+  int key_size;
+  long seed;
+  void *t, *jd;
+  unsigned char key[BUFSIZE], hi[BUFSIZE];
+  char warm_fn[BUFSIZE];
+  unsigned char val[JDISK_SECTOR_SIZE];
+  unsigned int lba;
+  long *perm, tmp, j, warm_nodes, t0, attach_ns, increments, nodes, grown;
+  unsigned long count, sectors;
+  void *c;
+  int warm_levels, warming, height;
+  Phase load, run;
+  Zipf z;
+  FILE *f;
+
+  if (argc < 2 || argv[1][0] == '-') usage(NULL);
+  fn = argv[1];
+  workload = "uniform";
+  n = 10000;
+  ops = 10000;
+  read_fraction = .5;
+  miss_fraction = 0;
+  count_fraction = 0;
+  key_size = 0;
+  theta = .99;
+  seed = 1;
+  txt = NULL;
+  json = NULL;
+
+  for (i = 2; i < argc; i += 2) {
+    if (argv[i][0] != '-' || strlen(argv[i]) != 2 || i+1 >= argc) usage(NULL);
+    switch (argv[i][1]) {
+      case 'w': workload = argv[i+1]; break;
+      case 'n': if (sscanf(argv[i+1], "%ld", &n) != 1 || n < 1) {
+                  usage("bad -n");
+                }
+                break;
+      case 'o': if (sscanf(argv[i+1], "%ld", &ops) != 1 || ops < 0) {
+                  usage("bad -o");
+                }
+                break;
+      case 'r': if (sscanf(argv[i+1], "%lf", &read_fraction) != 1 ||
+                    read_fraction < 0 || read_fraction > 1) {
+                  usage("bad -r");
+                }
+                break;
+      case 'k': if (sscanf(argv[i+1], "%d", &key_size) != 1 ||
+                    key_size < 4 || key_size > 254) {
+                  usage("key_size must be between 4 and 254");
+                }
+                break;
+      case 'K': if (strcmp(argv[i+1], "u32") == 0) {
+                  Key_type = B_TREE_KEY_U32;
+                } else if (strcmp(argv[i+1], "u64") == 0) {
+                  Key_type = B_TREE_KEY_U64;
+                } else if (strcmp(argv[i+1], "u128") == 0) {
+                  Key_type = B_TREE_KEY_U128;
+                } else if (strcmp(argv[i+1], "bytes") != 0) {
+                  usage("bad -K");
+                }
+                break;
+      case 'c': if (sscanf(argv[i+1], "%d", &Cache_nodes) != 1 || Cache_nodes < 0) {
+                  usage("bad -c");
+                }
+                break;
+      case 'x': if (sscanf(argv[i+1], "%ld", &Index_keys) != 1 || Index_keys < 0) {
+                  usage("bad -x");
+                }
+                break;
+      case 'W': if (strcmp(argv[i+1], "manifest") == 0) {
+                  Warm_levels = WARM_MANIFEST;
+                } else if (sscanf(argv[i+1], "%d", &Warm_levels) != 1 || Warm_levels < 0) {
+                  usage("bad -W");
+                }
+                break;
+      case 'v': if (sscanf(argv[i+1], "%d", &Value_size) != 1 || Value_size < 0 ||
+                    Value_size > JDISK_SECTOR_SIZE - 1) {
+                  usage("bad -v");
+                }
+                break;
+      case 'V': if (strcmp(argv[i+1], "raw") == 0) {
+                  Value_flags = 0;
+                } else if (strcmp(argv[i+1], "lz") == 0) {
+                  Value_flags = B_TREE_COMPRESS;
+                } else {
+                  usage("bad -V");
+                }
+                break;
+      case 'A': if (strcmp(argv[i+1], "end") == 0) {
+                  Alloc_flags = 0;
+                } else if (strcmp(argv[i+1], "bitmap") == 0) {
+                  Alloc_flags = B_TREE_ALLOC;
+                } else {
+                  usage("bad -A");
+                }
+                break;
+      case 'S': if (strcmp(argv[i+1], "half") == 0) {
+                  Split_flags = 0;
+                } else if (strcmp(argv[i+1], "bstar") == 0) {
+                  Split_flags = B_TREE_BSTAR;
+                } else if (strcmp(argv[i+1], "topdown") == 0) {
+                  Split_flags = B_TREE_TOPDOWN;
+                } else if (strcmp(argv[i+1], "buffered") == 0) {
+                  Split_flags = B_TREE_BUFFERED;
+                } else {
+                  usage("bad -S");
+                }
+                Splits = argv[i+1];
+                break;
+      case 'F': if (strcmp(argv[i+1], "none") == 0) {
+                  Filter_flags = 0;
+                } else if (strcmp(argv[i+1], "bloom") == 0) {
+                  Filter_flags = B_TREE_BLOOM;
+                } else {
+                  usage("bad -F");
+                }
+                break;
+      case 'm': if (sscanf(argv[i+1], "%lf", &miss_fraction) != 1 ||
+                    miss_fraction < 0 || miss_fraction > 1) {
+                  usage("bad -m");
+                }
+                break;
+      case 'O': if (strcmp(argv[i+1], "plain") == 0) {
+                  Order_flags = 0;
+                } else if (strcmp(argv[i+1], "counted") == 0) {
+                  Order_flags = B_TREE_COUNTED;
+                } else {
+                  usage("bad -O");
+                }
+                break;
+      case 'q': if (sscanf(argv[i+1], "%lf", &count_fraction) != 1 ||
+                    count_fraction < 0 || count_fraction > 1) {
+                  usage("bad -q");
+                }
+                break;
+      case 'R': if (sscanf(argv[i+1], "%d", &Read_values) != 1) {
+                  usage("bad -R");
+                }
+                break;
+      case 'z': if (sscanf(argv[i+1], "%lf", &theta) != 1 ||
+                    theta <= 0 || theta >= 1) {
+                  usage("bad -z");
+                }
+                break;
+      case 's': if (sscanf(argv[i+1], "%ld", &seed) != 1) {
+                  usage("bad -s");
+                }
+                break;
+      case 'd': parse_latency(argv[i+1]); break;
+      case 't': txt = argv[i+1]; break;
+      case 'j': json = argv[i+1]; break;
+      default: usage(NULL);
+    }
+  }
+  srand48(seed);
+  if (Warm_levels != 0 && Warm_levels != -1 && Cache_nodes == 0) usage("-W needs the cache (-c)");
+
+  if (Key_type != B_TREE_KEY_BYTES) {
+    if (key_size != 0 && key_size != (2 << Key_type)) usage("-k doesn't match -K");
+    key_size = 2 << Key_type;
+  }
+
+  if (txt != NULL) {
+    if (Key_type != B_TREE_KEY_BYTES) usage("replay keys are strings -- can't use -K");
+    workload = "replay";
+    key_size = replay(fn, txt, key_size, &load, &run, &t);
+    n = load.ops;
+    ops = run.ops;
+    read_fraction = 1;
+  } else {
+    if (strcmp(workload, "uniform") != 0 && strcmp(workload, "zipfian") != 0 &&
+        strcmp(workload, "sequential") != 0 && strcmp(workload, "counters") != 0) usage("bad workload");
+    if (key_size == 0) key_size = 8;
+    /* Miss probes use ids up to 2n + ops, which have to stay distinct from the loaded ones */
+    if (key_size < 8 && 2 * n + ops > 0xffffffffL) usage("too many keys for key_size < 8");
+    Sequential = (strcmp(workload, "sequential") == 0);
+    Counters = (strcmp(workload, "counters") == 0);
+    Zipfian = (strcmp(workload, "zipfian") == 0 || Counters);
+    if (Zipfian) zipf_init(&z, n, theta);
+
+    t = make_tree(fn, n + ops, key_size);
+    jd = b_tree_disk(t);
+    memset(val, 0, JDISK_SECTOR_SIZE);
+    phase_init(&load, "load", n);
+    phase_init(&run, "run", ops);
+
+    /* Load: ids 0..n-1, in order for sequential, shuffled otherwise */
+    perm = (long *) malloc(sizeof(long) * n);
+    for (i = 0; i < n; i++) perm[i] = i;
+    if (!Sequential) {
+      for (i = n-1; i > 0; i--) {
+        j = lrand48() % (i+1);
+        tmp = perm[i]; perm[i] = perm[j]; perm[j] = tmp;
+      }
+    }
+    phase_begin(&load, jd);
+    for (i = 0; i < n; i++) {
+      make_key(key, key_size, perm[i]);
+      make_value(val, perm[i]);
+      timed_insert(&load, t, key, val, &lba);
+    }
+    phase_end(&load, jd);
+    free(perm);
+
+    /* Restart: the run phase starts right after attach, while the warmup runs */
+    if (Warm_levels != -1) {
+      b_tree_detach(t);
+      sprintf(warm_fn, "%s.warm", fn);
+      if (Warm_levels != WARM_MANIFEST) unlink(warm_fn);
+      t0 = now_ns();
+      t = b_tree_attach(fn);
+      attach_ns = now_ns() - t0;
+      if (t == NULL) { perror(fn); exit(1); }
+      if (Latency_model >= 0) jdisk_set_latency(b_tree_disk(t), Latency_model, Latency_param);
+      if (Warm_levels != WARM_MANIFEST) {
+        b_tree_set_cache(t, Cache_nodes);
+        if (Warm_levels > 0) b_tree_warmup(t, Warm_levels);
+      }
+      b_tree_set_index(t, Index_keys);
+      jd = b_tree_disk(t);
+    }
+
+    /* Run: finds hit loaded keys, but for miss_fraction of them, which look for
+       ids past any that get inserted, and count_fraction of the rest, which count
+       the keys between two loaded ones; writes are appends (sequential),
+       inserts of new keys (uniform), hot-key updates (zipfian) or
+       hot-key increments (counters) */
+    next_id = n;
+    seq = 0;
+    increments = 0;
+    sectors = b_tree_sectors(t);
+    nodes = b_tree_nodes(t, &height);
+    phase_begin(&run, jd);
+    for (i = 0; i < ops; i++) {
+      if (drand48() < read_fraction) {
+        if (drand48() < miss_fraction) {
+          make_key(key, key_size, n + ops + lrand48() % n);
+          timed_find(&run, t, key, &lba);
+          if (lba != 0) run.errors++;
+          continue;
+        }
+        if (drand48() < count_fraction) {
+          make_key(key, key_size, lrand48() % n);
+          make_key(hi, key_size, lrand48() % n);
+          if (b_tree_compare(t, key, hi) > 0) {
+            memcpy(val, key, key_size);
+            memcpy(key, hi, key_size);
+            memcpy(hi, val, key_size);
+          }
+          if (timed_count(&run, t, key, hi) < 0) run.errors++;
+          continue;
+        }
+        if (Sequential) {
+          id = seq;
+          seq = (seq + 1) % n;
+        } else if (Zipfian) {
+          id = zipf_next(&z);
+        } else {
+          id = lrand48() % n;
+        }
+        make_key(key, key_size, id);
+        timed_find(&run, t, key, &lba);
+        if (lba == 0) run.errors++;
+      } else if (Counters) {
+        make_key(key, key_size, zipf_next(&z));
+        t0 = now_ns();
+        lba = b_tree_modify(t, key, increment, NULL);
+        run.lat[run.ops++] = now_ns() - t0;
+        if (lba == 0) run.errors++;
+        increments++;
+      } else {
+        id = (Zipfian) ? zipf_next(&z) : next_id++;
+        make_key(key, key_size, id);
+        make_value(val, id);
+        timed_insert(&run, t, key, val, &lba);
+      }
+    }
+    phase_end(&run, jd);
+
+    /* Zipfian and counters runs only update loaded keys, which are written in place,
+       so the only sectors they may take are for nodes that split: any others are left
+       behind.  A compressed value can move to a sector of its own when it grows, and
+       with the allocator a run can skip to the next group (b_tree_dcs checks its leaks). */
+    if (Zipfian && !(Value_flags & B_TREE_COMPRESS) && !(Alloc_flags & B_TREE_ALLOC)) {
+      grown = (long) (b_tree_sectors(t) - sectors) - (b_tree_nodes(t, &height) - nodes);
+      if (grown != 0) {
+        printf("update-only run leaked %ld sectors\n", grown);
+        run.errors++;
+      }
+    }
+
+    /* The counts have to add up to the increments */
+    if (Counters) {
+      c = b_tree_cursor(t, NULL);
+      while (b_tree_cursor_next(c, key, &lba)) {
+        b_tree_read(t, lba, val);
+        memcpy(&count, val + COUNTER_OFFSET, sizeof(count));
+        increments -= count;
+      }
+      b_tree_cursor_free(c);
+      if (increments != 0) run.errors++;
+    }
+  }
+
+  printf("workload: %s  keys: %ld  ops: %ld  read_fraction: %.2f  miss_fraction: %.2f  key_size: %d%s  cache: %d  index: %ld  seed: %ld\n",
+         workload, n, ops, read_fraction, miss_fraction, key_size, (Key_type == B_TREE_KEY_BYTES) ? "" : " (integer)",
+         Cache_nodes, Index_keys, seed);
+  phase_print(&load);
+  phase_print(&run);
+  printf("values: %s  value_size: %d  allocator: %s  filter: %s  sectors used: %lu\n",
+         (Value_flags & B_TREE_COMPRESS) ? "lz" : "raw", Value_size, (Alloc_flags & B_TREE_ALLOC) ? "bitmap" : "end",
+         (Filter_flags & B_TREE_BLOOM) ? "bloom" : "none", b_tree_sectors(t));
+  nodes = b_tree_nodes(t, &height);
+  printf("splits: %s  order: %s  count_fraction: %.2f  nodes: %ld  height: %d\n", Splits,
+         (Order_flags & B_TREE_COUNTED) ? "counted" : "plain", count_fraction, nodes, height);
+  if (Warm_levels != -1 && txt == NULL) {
+    warming = b_tree_warmup_progress(t, &warm_nodes, &warm_levels);
+    printf("restart: attach %.1fus  warmup: %d levels  %ld nodes cached%s\n", attach_ns / 1000.0,
+           warm_levels, warm_nodes, (warming) ? " (still running)" : "");
+  }
+
+  if (json != NULL) {
+    f = (strcmp(json, "-") == 0) ? stdout : fopen(json, "w");
+    if (f == NULL) { perror(json); exit(1); }
+    fprintf(f, "{\n");
+    fprintf(f, "  \"workload\": \"%s\", \"keys\": %ld, \"ops\": %ld, \"read_fraction\": %.4f, \"miss_fraction\": %.4f,\n",
+            workload, n, ops, read_fraction, miss_fraction);
+    fprintf(f, "  \"key_size\": %d, \"key_type\": \"%s\", \"cache_nodes\": %d, \"index_keys\": %ld, \"theta\": %.4f, \"seed\": %ld, \"sector_size\": %d,\n",
+            key_size, (Key_type == B_TREE_KEY_BYTES) ? "bytes" : (Key_type == B_TREE_KEY_U32) ? "u32" :
+            (Key_type == B_TREE_KEY_U64) ? "u64" : "u128", Cache_nodes, Index_keys, theta, seed, JDISK_SECTOR_SIZE);
+    fprintf(f, "  \"values\": \"%s\", \"value_size\": %d, \"allocator\": \"%s\", \"filter\": \"%s\", \"read_values\": %d, \"sectors_used\": %lu,\n",
+            (Value_flags & B_TREE_COMPRESS) ? "lz" : "raw", Value_size, (Alloc_flags & B_TREE_ALLOC) ? "bitmap" : "end",
+            (Filter_flags & B_TREE_BLOOM) ? "bloom" : "none", Read_values, b_tree_sectors(t));
+    fprintf(f, "  \"splits\": \"%s\", \"order\": \"%s\", \"count_fraction\": %.4f, \"nodes\": %ld, \"height\": %d,\n",
+            Splits, (Order_flags & B_TREE_COUNTED) ? "counted" : "plain", count_fraction, nodes, height);
+    fprintf(f, "  \"phases\": {\n");
+    phase_json(f, &load);
+    fprintf(f, ",\n");
+    phase_json(f, &run);
+    fprintf(f, "\n  }\n}\n");
+    if (f != stdout) fclose(f);
+  }
+
+  b_tree_detach(t);
+  exit((load.errors + run.errors) ? 1 : 0);
+}
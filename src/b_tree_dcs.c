@@ -0,0 +1,729 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "b_tree.h"
+#include "b_tree_format.h"
+#include "lz.h"
+
+/* b_tree_dcs: offline consistency checker and analyzer for a b_tree jdisk file.
+
+   Checks that keys are sorted within each node and fall between the separators
+   above them, that node fill is within bounds, that every node and value lba is
+   inside [1, first_free_block) and referenced exactly once, and that all leaves
+   sit at the same depth.  Reports fill-factor histograms, height, and sectors
+   that nothing references.
+
+   The top of the tree is walked by the main thread until there are enough
+   subtrees, which are then split over worker threads.  Each worker walks its
+   subtrees a level at a time, reading each level in lba order.
+
+   In a compressed tree (B_TREE_COMPRESS), value lbas are handles.  A pack sector
+   may be referenced by many handles, but each of its slots by one; afterwards
+   every pack sector is read to check its slots and forwards, and that each
+   value decompresses.
+
+   In a tree with the allocator (B_TREE_ALLOC), every referenced sector has to be
+   marked used in its group's bitmap.  Sectors that are marked used and that
+   nothing references are leaks; free ones below the first free block are the
+   room leaves keep for their values.
+
+   In a buffered tree (B_TREE_BUFFERED), internal nodes have message buffers.
+   Every sector of a buffer counts as referenced, and so does the rest of the
+   value run that sector 0 keeps at detach.  Each message's key has to be
+   one that could go under its node, and its value is checked like any other.
+   The root's count is in its buffer's sectors rather than in its own.
+
+   In a tree with a Bloom filter (B_TREE_BLOOM), the filter's sectors count as
+   referenced, and when sector 0 says it's current, every key (and message) has
+   to be in it.
+
+   In a counted tree (B_TREE_COUNTED), an internal node's count for each child
+   has to be the number of keys the child has and its own counts add up to, and
+   a leaf's count its number of keys.  So every count is right, and the root's
+   add up to all the keys.
+
+   It also reports how far values are from their leaves, which is what the
+   allocator tries to keep small. */
+
+#define MAX_ERRORS_PRINTED (20)
+#define FILL_BUCKETS (10)
+#define MAX_DEPTH (64)
+#define NEAR (16)                       /* A value this close to its leaf counts as near */
+#define WALK_RUN (64)                   /* Most adjacent nodes the walk reads at once */
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_dcs tree_file [threads]\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+typedef struct {
+  unsigned int lba;
+  int depth;
+  unsigned char *lo;          /* Keys in the node must be > lo and < hi.  NULL = unbounded */
+  unsigned char *hi;
+  long count;                 /* B_TREE_COUNTED: keys the parent says are under the node, -1 for the root */
+} Entry;
+
+typedef struct {
+  Entry *e;
+  long n;
+  long size;
+} Entry_List;
+
+typedef struct {
+  long nodes[2];                        /* [0] = leaves, [1] = internal */
+  long keys[2];
+  long fill[2][FILL_BUCKETS+1];
+  long underfull;
+  long values[2];                       /* [0] = in sectors of their own, [1] = packed */
+  long near;                            /* Values within NEAR sectors of their leaf */
+  double distance;                      /* Sum of the distances */
+  long messages;                        /* In buffers */
+  long errors;
+  int leaf_depth_min;
+  int leaf_depth_max;
+} Stats;
+
+typedef struct {
+  char *fn;
+  void *jd;
+  Entry_List todo;
+  Stats s;
+} Worker;
+
+/* Global, read-only after the superblock is read */
+
+int Key_size;
+int Key_type;                           /* B_TREE_KEY_* */
+int Max_keys;
+unsigned int Root_lba;
+unsigned long First_free;
+unsigned long Num_lbas;
+int Compress;                           /* B_TREE_COMPRESS is set */
+int Alloc;                              /* B_TREE_ALLOC is set */
+int Buffered;                           /* B_TREE_BUFFERED is set */
+int Counted;                            /* B_TREE_COUNTED is set */
+long Root_count;                        /* and the keys the root's counts add up to */
+unsigned char *Bloom;                   /* The Bloom filter, if it's current, else NULL */
+unsigned int Bloom_sectors;
+unsigned char *Seen;                    /* One bit per sector */
+unsigned short *Slots;                  /* Compressed trees: one bit per referenced slot of each sector */
+pthread_mutex_t Print_lock = PTHREAD_MUTEX_INITIALIZER;
+long Printed = 0;
+
+static void error(Stats *s, unsigned int lba, char *msg)
+{
+  s->errors++;
+  pthread_mutex_lock(&Print_lock);
+  if (Printed < MAX_ERRORS_PRINTED) printf("ERROR at lba %u: %s\n", lba, msg);
+  Printed++;
+  pthread_mutex_unlock(&Print_lock);
+}
+
+/* Marks a sector as referenced.  Returns 0 if it already was. */
+
+static int mark(unsigned int lba)
+{
+  unsigned char bit, old;
+
+  bit = 1 << (lba & 7);
+  old = __atomic_fetch_or(Seen + (lba >> 3), bit, __ATOMIC_RELAXED);
+  return (old & bit) == 0;
+}
+
+static void check_lba(Stats *s, unsigned int from, unsigned int lba, char *what)
+{
+  char msg[100];
+
+  if (lba < 1 || lba >= First_free || lba >= Num_lbas) {
+    sprintf(msg, "%s lba %u out of range [1, %lu)", what, lba, First_free);
+    error(s, from, msg);
+  } else if (!mark(lba)) {
+    sprintf(msg, "%s lba %u is referenced more than once", what, lba);
+    error(s, from, msg);
+  }
+}
+
+/* Values in compressed trees are handles.  Pack sectors are checked later, by check_packs(). */
+
+static void check_value(Stats *s, unsigned int from, unsigned int h, char *what)
+{
+  char msg[100];
+  unsigned int lba;
+  unsigned short bit, old;
+
+  lba = Compress ? B_TREE_VALUE_SECTOR(h) : h;
+  s->distance += (lba > from) ? lba - from : from - lba;
+  if (lba <= from + NEAR && from <= lba + NEAR) s->near++;
+
+  if (!Compress || B_TREE_VALUE_SLOT(h) == 0) {
+    check_lba(s, from, Compress ? B_TREE_VALUE_SECTOR(h) : h, what);
+    s->values[0]++;
+    return;
+  }
+  s->values[1]++;
+  lba = B_TREE_VALUE_SECTOR(h);
+  if (lba < 1 || lba >= First_free || lba >= Num_lbas) {
+    sprintf(msg, "%s handle %u: sector %u out of range [1, %lu)", what, h, lba, First_free);
+    error(s, from, msg);
+    return;
+  }
+  bit = 1 << (B_TREE_VALUE_SLOT(h) - 1);
+  old = __atomic_fetch_or(Slots + lba, bit, __ATOMIC_RELAXED);
+  if (old & bit) {
+    sprintf(msg, "%s handle %u is referenced more than once", what, h);
+    error(s, from, msg);
+  }
+}
+
+static void append(Entry_List *l, unsigned int lba, int depth, unsigned char *lo, unsigned char *hi, long count)
+{
+  if (l->n == l->size) {
+    l->size = (l->size == 0) ? 1024 : l->size * 2;
+    l->e = (Entry *) realloc(l->e, sizeof(Entry) * l->size);
+  }
+  l->e[l->n].lba = lba;
+  l->e[l->n].depth = depth;
+  l->e[l->n].lo = lo;
+  l->e[l->n].hi = hi;
+  l->e[l->n].count = count;
+  l->n++;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+  unsigned int x = ((Entry *) a)->lba, y = ((Entry *) b)->lba;
+  return (x < y) ? -1 : (x > y);
+}
+
+/* Keys compare the way the tree orders them: integer types as native numbers */
+
+static int cmp_key(const unsigned char *a, const unsigned char *b)
+{
+  unsigned __int128 x, y;
+
+  if (Key_type == B_TREE_KEY_BYTES) return memcmp(a, b, Key_size);
+  x = 0;
+  y = 0;
+  memcpy(&x, a, Key_size);
+  memcpy(&y, b, Key_size);
+  return (x > y) - (x < y);
+}
+
+/* Whether the filter has key's bits, with the hash and bits of b_tree_format.h */
+
+static int bloom_has(unsigned char *key)
+{
+  return bloom_bits(Bloom, Bloom_sectors, hash_key(key, Key_size), 0);
+}
+
+/* Checks the message buffer of an internal node: buffer lba and count are the 8
+   bytes before the lbas. */
+
+static void check_buffer(void *jd, Stats *s, Entry *e, unsigned char *node)
+{
+  unsigned char *buf, *m;
+  unsigned int lba, count, value, *field, per, i;
+  unsigned short c;
+  int ms;
+
+  field = (unsigned int *) (node + JDISK_SECTOR_SIZE - (Max_keys + 1) * sizeof(unsigned int) - 8);
+  lba = field[0];
+  count = field[1];
+  if (lba == 0) {
+    if (count != 0) error(s, e->lba, "messages in a buffer that doesn't exist");
+    return;
+  }
+  for (i = 0; i < BUFFER_SECTORS; i++) check_lba(s, e->lba, lba + i, "buffer");
+  ms = Key_size + 4;
+  per = (JDISK_SECTOR_SIZE - 4) / ms;
+  buf = (unsigned char *) malloc(BUFFER_SECTORS * JDISK_SECTOR_SIZE);
+  if (lba + BUFFER_SECTORS > Num_lbas || jdisk_read_many(jd, lba, BUFFER_SECTORS, buf) != 0) {
+    error(s, e->lba, "can't read the buffer");
+    free(buf);
+    return;
+  }
+  if (e->lba == Root_lba) {
+    count = 0;
+    for (i = 0; i < BUFFER_SECTORS; i++) {
+      memcpy(&c, buf + i * JDISK_SECTOR_SIZE, 2);
+      count += (c > per) ? per : c;
+      if (c < per) break;
+    }
+  }
+  if (count > BUFFER_SECTORS * per) {
+    error(s, e->lba, "more messages than fit in a buffer");
+    count = BUFFER_SECTORS * per;
+  }
+  s->messages += count;
+  for (i = 0; i < count; i++) {
+    m = buf + (i / per) * JDISK_SECTOR_SIZE + 4 + (i % per) * ms;
+    if ((e->lo != NULL && cmp_key(e->lo, m + 4) >= 0) || (e->hi != NULL && cmp_key(m + 4, e->hi) > 0)) {
+      error(s, e->lba, "message key is not between the node's separators");
+    }
+    if (Bloom != NULL && !bloom_has(m + 4)) error(s, e->lba, "message key is missing from the Bloom filter");
+    memcpy(&value, m, 4);
+    check_value(s, e->lba, value, "message value");
+  }
+  free(buf);
+}
+
+/* Checks one node, whose sector the caller has read into buf.  For internal
+   nodes, appends the children to next and returns the sector buffer, which must
+   stay around while the children are checked (their bounds point into it).  Leaf
+   buffers are returned to the caller to reuse. */
+
+static unsigned char *check_node(void *jd, Stats *s, Entry *e, Entry_List *next, unsigned char *buf)
+{
+  int nkeys, internal, i, b;
+  unsigned char *key, *prev;
+  unsigned int *lbas, *counts;
+  long count;
+
+  internal = buf[0];
+  nkeys = buf[1];
+  lbas = (unsigned int *) (buf + JDISK_SECTOR_SIZE - (Max_keys + 1) * sizeof(unsigned int));
+
+  if (internal > 1) error(s, e->lba, "internal flag is neither 0 nor 1");
+  internal = (internal != 0);
+  if (nkeys > Max_keys) {
+    error(s, e->lba, "more keys than fit in a node");
+    return buf;
+  }
+  if (e->lba != Root_lba) {
+    if (nkeys == 0) error(s, e->lba, "empty non-root node");
+    if (nkeys < Max_keys / 2) s->underfull++;
+  }
+  if (e->depth >= MAX_DEPTH) {
+    error(s, e->lba, "tree is deeper than MAX_DEPTH -- probably a cycle");
+    return buf;
+  }
+
+  s->nodes[internal]++;
+  s->keys[internal] += nkeys;
+  b = (nkeys * FILL_BUCKETS) / Max_keys;
+  s->fill[internal][b]++;
+
+  prev = e->lo;
+  for (i = 0; i < nkeys; i++) {
+    key = buf + 2 + i * Key_size;
+    if (prev != NULL && cmp_key(prev, key) >= 0) {
+      error(s, e->lba, (i == 0) ? "first key is not above the parent's separator"
+                                : "keys are not in increasing order");
+    }
+    if (Bloom != NULL && !bloom_has(key)) error(s, e->lba, "key is missing from the Bloom filter");
+    prev = key;
+  }
+  if (e->hi != NULL && nkeys > 0 && cmp_key(buf + 2 + (nkeys-1) * Key_size, e->hi) >= 0) {
+    error(s, e->lba, "last key is not below the parent's separator");
+  }
+
+  /* The counts sit right before the lbas */
+  counts = lbas - (Max_keys + 1);
+  if (Counted) {
+    count = nkeys;
+    for (i = 0; internal && i <= nkeys; i++) count += counts[i];
+    if (e->count < 0) {
+      Root_count = count;
+    } else if (count != e->count) {
+      error(s, e->lba, "the parent's count for the node is not its number of keys");
+    }
+  }
+
+  if (!internal) {
+    if (s->leaf_depth_min < 0 || e->depth < s->leaf_depth_min) s->leaf_depth_min = e->depth;
+    if (e->depth > s->leaf_depth_max) s->leaf_depth_max = e->depth;
+    for (i = 0; i < nkeys; i++) check_value(s, e->lba, lbas[i], "value");
+    /* The last lba of a leaf holds the value of the separator right above it */
+    if (e->hi != NULL) check_value(s, e->lba, lbas[nkeys], "separator value");
+    return buf;
+  }
+
+  if (Buffered) check_buffer(jd, s, e, buf);
+  for (i = 0; i <= nkeys; i++) {
+    check_lba(s, e->lba, lbas[i], "child");
+    append(next, lbas[i], e->depth + 1,
+           (i == 0) ? e->lo : buf + 2 + (i-1) * Key_size,
+           (i == nkeys) ? e->hi : buf + 2 + i * Key_size, (Counted) ? (long) counts[i] : -1);
+  }
+  return NULL;
+}
+
+/* Walks a list of subtrees a level at a time.  Each level is read in lba order,
+   with runs of adjacent nodes (up to WALK_RUN) read in one jdisk_read_many; if
+   that fails, the run's nodes are read one at a time so the bad one gets the
+   error.  Internal node buffers are kept (their keys bound the next level);
+   leaf buffers are reused. */
+
+static void walk(void *jd, Stats *s, Entry_List *level, long max_nodes, Entry_List *rest)
+{
+  Entry_List next;
+  Entry *e;
+  unsigned char *buf, *spare, *run;
+  long i, n, j;
+  int ok;
+
+  spare = NULL;
+  run = (unsigned char *) malloc(WALK_RUN * JDISK_SECTOR_SIZE);
+  while (level->n > 0) {
+    qsort(level->e, level->n, sizeof(Entry), cmp_entry);
+    next.e = NULL;
+    next.n = 0;
+    next.size = 0;
+    for (i = 0; i < level->n; i += n) {
+      e = level->e + i;
+      for (n = 1; i + n < level->n && n < WALK_RUN && e[n].lba == e[0].lba + n; n++) ;
+      ok = (n > 1 && jdisk_read_many(jd, e[0].lba, n, run) == 0);
+      for (j = 0; j < n; j++) {
+        buf = (spare != NULL) ? spare : (unsigned char *) malloc(JDISK_SECTOR_SIZE);
+        if (ok) {
+          memcpy(buf, run + j * JDISK_SECTOR_SIZE, JDISK_SECTOR_SIZE);
+        } else if (jdisk_read(jd, e[j].lba, buf) != 0) {
+          error(s, e[j].lba, "jdisk_read failed");
+          spare = buf;
+          continue;
+        }
+        spare = check_node(jd, s, e + j, &next, buf);
+      }
+    }
+    free(level->e);
+    *level = next;
+    if (max_nodes > 0 && level->n >= max_nodes) break;
+  }
+  free(run);
+  free(spare);
+  if (rest != NULL) *rest = *level;
+}
+
+static void *worker(void *arg)
+{
+  Worker *w;
+
+  w = (Worker *) arg;
+  w->jd = jdisk_attach(w->fn);
+  if (w->jd == NULL) {
+    perror(w->fn);
+    exit(1);
+  }
+  walk(w->jd, &w->s, &w->todo, 0, NULL);
+  jdisk_unattach(w->jd);
+  return NULL;
+}
+
+static void init_stats(Stats *s)
+{
+  memset(s, 0, sizeof(Stats));
+  s->leaf_depth_min = -1;
+}
+
+static void merge_stats(Stats *to, Stats *from)
+{
+  int i, j;
+
+  for (i = 0; i < 2; i++) {
+    to->nodes[i] += from->nodes[i];
+    to->keys[i] += from->keys[i];
+    for (j = 0; j <= FILL_BUCKETS; j++) to->fill[i][j] += from->fill[i][j];
+  }
+  to->underfull += from->underfull;
+  to->values[0] += from->values[0];
+  to->values[1] += from->values[1];
+  to->near += from->near;
+  to->distance += from->distance;
+  to->messages += from->messages;
+  to->errors += from->errors;
+  if (from->leaf_depth_min >= 0 &&
+      (to->leaf_depth_min < 0 || from->leaf_depth_min < to->leaf_depth_min)) {
+    to->leaf_depth_min = from->leaf_depth_min;
+  }
+  if (from->leaf_depth_max > to->leaf_depth_max) to->leaf_depth_max = from->leaf_depth_max;
+}
+
+/* Reads every referenced pack sector: the header has to make sense, referenced
+   slots have to exist and decompress, and forwarded values get checked like
+   other value sectors.  Returns the number of pack sectors. */
+
+static long check_packs(void *jd, Stats *s, long *forwarded, long *bytes)
+{
+  unsigned char buf[JDISK_SECTOR_SIZE], out[JDISK_SECTOR_SIZE];
+  unsigned short *sl, end;
+  unsigned int to;
+  unsigned long lba;
+  long packs;
+  int i, nslots;
+
+  packs = 0;
+  for (lba = 1; lba < First_free && lba < Num_lbas; lba++) {
+    if (Slots[lba] == 0) continue;
+    packs++;
+    check_lba(s, 0, lba, "pack sector");
+    if (jdisk_read(jd, lba, buf) != 0) {
+      error(s, lba, "jdisk_read failed");
+      continue;
+    }
+    nslots = buf[0];
+    end = *(unsigned short *) (buf + 2);
+    if (nslots > PACK_SLOTS || end > JDISK_SECTOR_SIZE || (Slots[lba] >> nslots) != 0) {
+      error(s, lba, "pack header is bad, or a handle names a slot it doesn't have");
+      continue;
+    }
+    *bytes += end;
+    for (i = 0; i < nslots; i++) {
+      if (!(Slots[lba] & (1 << i))) continue;
+      sl = (unsigned short *) (buf + 4 + 4 * i);
+      if (sl[0] < PACK_HEADER || sl[0] + ((sl[1] == PACK_FORWARD) ? 4 : sl[1]) > end) {
+        error(s, lba, "pack slot is outside the sector's data");
+      } else if (sl[1] == PACK_FORWARD) {
+        (*forwarded)++;
+        memcpy(&to, buf + sl[0], 4);
+        check_lba(s, lba, to, "forwarded value");
+      } else if (lz_decompress(buf + sl[0], sl[1], out, JDISK_SECTOR_SIZE) < 0) {
+        error(s, lba, "packed value doesn't decompress");
+      }
+    }
+  }
+  return packs;
+}
+
+/* Checks the allocator's bitmaps against what the walk saw.  Returns the number
+   of free sectors below the first free block; leaks count as unreferenced. */
+
+static long check_bitmaps(void *jd, Stats *s, long *unreferenced)
+{
+  unsigned char bits[JDISK_SECTOR_SIZE];
+  unsigned long g, lba, end;
+  long nfree;
+  int used, seen;
+  char msg[100];
+
+  nfree = 0;
+  for (g = 0; g * ALLOC_GROUP < First_free && g * ALLOC_GROUP < Num_lbas; g++) {
+    if ((g+1) * ALLOC_GROUP - 1 >= Num_lbas) {
+      error(s, 0, "the disk ends in the middle of a bitmap group");
+      break;
+    }
+    if (!mark((g+1) * ALLOC_GROUP - 1)) error(s, (g+1) * ALLOC_GROUP - 1, "the tree references a bitmap sector");
+    if (jdisk_read(jd, (g+1) * ALLOC_GROUP - 1, bits) != 0) {
+      error(s, (g+1) * ALLOC_GROUP - 1, "jdisk_read failed");
+      continue;
+    }
+    end = (g+1) * ALLOC_GROUP - 1;
+    if (end > First_free) end = First_free;
+    for (lba = (g == 0) ? 1 : g * ALLOC_GROUP; lba < end; lba++) {
+      used = (bits[(lba % ALLOC_GROUP) >> 3] >> (lba & 7)) & 1;
+      seen = (Seen[lba >> 3] >> (lba & 7)) & 1;
+      if (seen && !used) {
+        sprintf(msg, "sector %lu is in use but free in the bitmap", lba);
+        error(s, (g+1) * ALLOC_GROUP - 1, msg);
+      } else if (used && !seen) {
+        (*unreferenced)++;
+      } else if (!used) {
+        nfree++;
+      }
+    }
+  }
+  return nfree;
+}
+
+static void print_histogram(char *name, Stats *s, int internal)
+{
+  int j;
+
+  if (s->nodes[internal] == 0) return;
+  printf("%s: %ld nodes, %ld keys, average fill %.1f%%\n", name, s->nodes[internal],
+         s->keys[internal], 100.0 * s->keys[internal] / (s->nodes[internal] * (double) Max_keys));
+  for (j = 0; j <= FILL_BUCKETS; j++) {
+    if (s->fill[internal][j] == 0) continue;
+    if (j == FILL_BUCKETS) {
+      printf("   100%%     : %ld\n", s->fill[internal][j]);
+    } else {
+      printf("   %3d-%3d%% : %ld\n", j * 100 / FILL_BUCKETS, (j+1) * 100 / FILL_BUCKETS - 1,
+             s->fill[internal][j]);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  void *jd;
+  unsigned char buf[JDISK_SECTOR_SIZE];
+  int nthreads, t, bstar, topdown, bloom, bloom_current;
+  unsigned int tag, bloom_lba;
+  long i, per, unreferenced, packs, forwarded, bytes, nfree, nvalues;
+  Entry_List top;
+  Worker *w;
+  pthread_t *tids;
+  Stats total;
+
+  if (argc != 2 && argc != 3) usage(NULL);
+  nthreads = (argc == 3) ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) usage("threads must be at least 1");
+
+  jd = jdisk_attach(argv[1]);
+  if (jd == NULL) { perror(argv[1]); exit(1); }
+  if (jdisk_read(jd, 0, buf) != 0) { fprintf(stderr, "Couldn't read sector 0\n"); exit(1); }
+
+  Key_size = *(unsigned int *) buf;
+  Root_lba = *(unsigned int *) (buf + 4);
+  First_free = *(unsigned long *) (buf + 8);
+  Num_lbas = jdisk_size(jd) / JDISK_SECTOR_SIZE;
+  if (Key_size < 4 || Key_size > 254) {
+    fprintf(stderr, "Bad key size %d in sector 0 -- not a b_tree?\n", Key_size);
+    exit(1);
+  }
+  Key_type = B_TREE_KEY_BYTES;
+  tag = *(unsigned int *) (buf + 16);
+  if ((tag & 0xffffff00) == B_TREE_KEY_TYPE_TAG && (tag & 0xff) >= B_TREE_KEY_U32 && (tag & 0xff) <= B_TREE_KEY_U128 &&
+      Key_size == (2 << (tag & 0xff))) {
+    Key_type = tag & 0xff;
+  }
+  Compress = 0;
+  tag = *(unsigned int *) (buf + 20);
+  Alloc = 0;
+  bstar = 0;
+  topdown = 0;
+  Buffered = 0;
+  Counted = 0;
+  bloom = 0;
+  if ((tag & 0xffffff00) == B_TREE_FLAGS_TAG) {
+    Compress = (tag & B_TREE_COMPRESS) != 0;
+    Alloc = (tag & B_TREE_ALLOC) != 0;
+    bstar = (tag & B_TREE_BSTAR) != 0;
+    topdown = (tag & B_TREE_TOPDOWN) != 0;
+    Buffered = (tag & B_TREE_BUFFERED) != 0;
+    bloom = (tag & B_TREE_BLOOM) != 0;
+    Counted = (tag & B_TREE_COUNTED) != 0;
+  }
+  /* A buffered tree's nodes give up a key's room for the buffer's lba and count,
+     and a counted tree's have a count next to every lba */
+  if (Counted) {
+    Max_keys = (JDISK_SECTOR_SIZE - 10 - (Buffered ? 8 : 0)) / (Key_size + 8);
+  } else {
+    Max_keys = (JDISK_SECTOR_SIZE - 6 - (Buffered ? 8 : 0)) / (Key_size + 4);
+  }
+  printf("key size: %d%s  keys per node: %d  root lba: %u%s%s%s%s%s%s%s\n", Key_size,
+         (Key_type == B_TREE_KEY_BYTES) ? "" : " (integer)", Max_keys, Root_lba,
+         Compress ? "  compressed values" : "", Alloc ? "  bitmap allocator" : "",
+         bstar ? "  B* splits" : "", topdown ? "  top-down inserts" : "", Buffered ? "  buffered inserts" : "",
+         bloom ? "  Bloom filter" : "", Counted ? "  counted" : "");
+  printf("sectors: %lu  first free block: %lu\n", Num_lbas, First_free);
+  if (First_free > Num_lbas) printf("WARNING: first free block is past the end of the disk\n");
+  if (*(unsigned long *) (buf + 24) != 0 && *(unsigned long *) (buf + 24) != Num_lbas) {
+    printf("WARNING: sector 0 says the disk has grown to %lu sectors\n", *(unsigned long *) (buf + 24));
+  }
+
+  Seen = (unsigned char *) calloc(Num_lbas / 8 + 1, 1);
+  mark(0);
+  if (Compress) Slots = (unsigned short *) calloc(Num_lbas, sizeof(unsigned short));
+
+  /* The filter is only checked against the keys when it's current */
+  init_stats(&total);
+  Bloom = NULL;
+  if (bloom) {
+    bloom_lba = *(unsigned int *) (buf + 32);
+    Bloom_sectors = *(unsigned int *) (buf + 36);
+    bloom_current = *(unsigned int *) (buf + 48);
+    printf("Bloom filter: %u sectors at lba %u, about %lu keys%s\n", Bloom_sectors, bloom_lba,
+           *(unsigned long *) (buf + 40), bloom_current ? "" : " (not current: rebuilt after the next attach)");
+    /* A compaction takes the filter out of its sectors, and writes it when it's over */
+    for (i = 0; bloom_lba != 0 && i < Bloom_sectors; i++) check_lba(&total, 0, bloom_lba + i, "Bloom filter");
+    if (bloom_current && bloom_lba != 0 && Bloom_sectors > 0) {
+      Bloom = (unsigned char *) malloc(Bloom_sectors * (long) JDISK_SECTOR_SIZE);
+      if (bloom_lba + Bloom_sectors > Num_lbas || jdisk_read_many(jd, bloom_lba, Bloom_sectors, Bloom) != 0) {
+        error(&total, 0, "can't read the Bloom filter");
+        free(Bloom);
+        Bloom = NULL;
+      }
+    }
+  }
+
+  /* What's left of a buffered tree's value run, which the next attach carries on with */
+  if (Buffered && *(unsigned int *) (buf + 52) != *(unsigned int *) (buf + 56)) {
+    for (i = *(unsigned int *) (buf + 52); i < *(unsigned int *) (buf + 56); i++) check_lba(&total, 0, i, "value run");
+  }
+
+  /* Walk the top of the tree until there are a few subtrees per thread */
+  top.e = NULL;
+  top.n = 0;
+  top.size = 0;
+  check_lba(&total, 0, Root_lba, "root");
+  append(&top, Root_lba, 0, NULL, NULL, -1);
+  walk(jd, &total, &top, (nthreads > 1) ? nthreads * 4 : 1, &top);
+
+  /* Hand out contiguous (in key order) runs of subtrees */
+  if (nthreads > top.n) nthreads = (top.n == 0) ? 1 : top.n;
+  w = (Worker *) malloc(sizeof(Worker) * nthreads);
+  tids = (pthread_t *) malloc(sizeof(pthread_t) * nthreads);
+  per = (top.n + nthreads - 1) / nthreads;
+  for (t = 0; t < nthreads; t++) {
+    w[t].fn = argv[1];
+    init_stats(&w[t].s);
+    w[t].todo.e = NULL;
+    w[t].todo.n = 0;
+    w[t].todo.size = 0;
+    for (i = t * per; i < (t+1) * per && i < top.n; i++) {
+      append(&w[t].todo, top.e[i].lba, top.e[i].depth, top.e[i].lo, top.e[i].hi, top.e[i].count);
+    }
+    if (pthread_create(tids + t, NULL, worker, w + t) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (t = 0; t < nthreads; t++) {
+    pthread_join(tids[t], NULL);
+    merge_stats(&total, &w[t].s);
+  }
+  if (Counted) {
+    printf("keys by the root's counts: %ld\n", Root_count);
+    if (Root_count != total.keys[0] + total.keys[1]) error(&total, Root_lba, "the root's counts don't add up to the keys in the tree");
+  }
+
+  packs = 0;
+  forwarded = 0;
+  bytes = 0;
+  if (Compress) packs = check_packs(jd, &total, &forwarded, &bytes);
+
+  unreferenced = 0;
+  nfree = 0;
+  if (Alloc) {
+    nfree = check_bitmaps(jd, &total, &unreferenced);
+  } else {
+    for (i = 1; i < (long) First_free && i < (long) Num_lbas; i++) {
+      if (!(Seen[i >> 3] & (1 << (i & 7)))) unreferenced++;
+    }
+  }
+  if (total.leaf_depth_min != total.leaf_depth_max) {
+    error(&total, Root_lba, "leaves are not all at the same depth");
+  }
+
+  printf("threads: %d\n", nthreads);
+  printf("height: %d\n", total.leaf_depth_max + 1);
+  print_histogram("internal", &total, 1);
+  print_histogram("leaves", &total, 0);
+  printf("under-filled non-root nodes: %ld\n", total.underfull);
+  printf("keys: %ld\n", total.keys[0] + total.keys[1]);
+  if (Buffered) printf("messages in buffers: %ld\n", total.messages);
+  if (Compress) {
+    printf("values: %ld packed in %ld sectors (%.1f per sector, %.0f bytes used per sector), "
+           "%ld forwarded, %ld in sectors of their own\n",
+           total.values[1], packs, (packs == 0) ? 0 : total.values[1] / (double) packs,
+           (packs == 0) ? 0 : bytes / (double) packs, forwarded, total.values[0]);
+  }
+  nvalues = total.values[0] + total.values[1];
+  if (nvalues > 0) {
+    printf("values within %d sectors of their leaf: %.1f%%  average distance: %.0f sectors\n", NEAR,
+           100.0 * total.near / nvalues, total.distance / nvalues);
+  }
+  printf("unreferenced sectors below first free block: %ld\n", unreferenced);
+  if (Alloc) printf("free sectors below first free block: %ld\n", nfree);
+  printf("unused sectors at the end of the disk: %lu\n",
+         (First_free < Num_lbas) ? Num_lbas - First_free : 0);
+  if (Printed > MAX_ERRORS_PRINTED) printf("(%ld more errors not printed)\n", Printed - MAX_ERRORS_PRINTED);
+  printf("%s: %ld errors\n", (total.errors == 0) ? "OK" : "FAILED", total.errors);
+  exit(total.errors == 0 ? 0 : 1);
+}
@@ -0,0 +1,286 @@
+/* The instrumented build of the b_tree.
+
+   This compiles src/b_tree.c with B_TREE_INSTRUMENT defined, which turns on
+   the INST() hooks, and adds the counter and trace API from b_tree_instrument.h.
+   Link it in place of obj/b_tree.o (see bin/b_tree_test_inst).
+
+   Environment variables, read when a tree is created or attached:
+     B_TREE_TRACE=file    write a Chrome trace of every operation, node read/write and split
+     B_TREE_SAMPLE=n      time one out of every n operations
+     B_TREE_STATS=file    where to print the counters at exit (default stderr, "none" for nowhere) */
+
+#define B_TREE_INSTRUMENT
+#include <time.h>
+#include "b_tree.c"
+
+typedef struct {
+  FILE *f;
+  long epoch;
+  long events;
+} Trace_File;
+
+static B_Tree *Inst_tree = NULL;    /* Most recently attached tree, for the exit report */
+static int Registered = 0;
+
+static long inst_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void inst_emit(B_Tree *btree, B_Tree_Event *e)
+{
+  if (btree->trace != NULL) btree->trace(btree->trace_arg, e);
+}
+
+static void inst_exit()
+{
+  char *s;
+  FILE *f;
+
+  if (Inst_tree == NULL) return;
+  b_tree_trace_close(Inst_tree);
+  s = getenv("B_TREE_STATS");
+  if (s != NULL && strcmp(s, "none") == 0) return;
+  f = (s == NULL) ? stderr : fopen(s, "w");
+  if (f == NULL) { perror(s); return; }
+  b_tree_print_stats(Inst_tree, f);
+  if (f != stderr) fclose(f);
+}
+
+void inst_attach(B_Tree *btree)
+{
+  char *s;
+
+  memset(&btree->stats, 0, sizeof(B_Tree_Stats));
+  btree->trace = NULL;
+  btree->trace_arg = NULL;
+  btree->op_count = 0;
+  btree->op_start = 0;
+  btree->op_device = 0;
+  s = getenv("B_TREE_SAMPLE");
+  btree->sample_every = (s == NULL) ? 0 : atoi(s);
+  s = getenv("B_TREE_TRACE");
+  if (s != NULL && b_tree_trace_file(btree, s) != 0) perror(s);
+
+  if (!Registered) atexit(inst_exit);
+  Registered = 1;
+  Inst_tree = btree;
+}
+
+/* A detached tree reports now, since it won't be around at exit */
+
+void inst_detach(B_Tree *btree)
+{
+  if (btree != Inst_tree) {
+    b_tree_trace_close(btree);
+    return;
+  }
+  inst_exit();
+  Inst_tree = NULL;
+}
+
+void inst_op_begin(B_Tree *btree)
+{
+  btree->op_count++;
+  if (btree->trace != NULL ||
+      (btree->sample_every > 0 && btree->op_count % btree->sample_every == 0)) {
+    btree->op_device = jdisk_device_time(btree->disk);
+    btree->op_start = inst_now();
+  } else {
+    btree->op_start = 0;
+  }
+}
+
+void inst_op_end(B_Tree *btree, const char *name)
+{
+  B_Tree_Event e;
+  long dur;
+  int b;
+
+  if (strcmp(name, "find") == 0) {
+    btree->stats.finds++;
+  } else if (strcmp(name, "insert") != 0) {
+    btree->stats.updates++;
+  } else {
+    btree->stats.inserts++;
+  }
+  if (btree->op_start == 0) return;
+
+  dur = inst_now() - btree->op_start;
+  btree->stats.sampled_ops++;
+  btree->stats.sampled_ns += dur;
+  if (dur > btree->stats.max_ns) btree->stats.max_ns = dur;
+  for (b = 0; b < B_TREE_LAT_BUCKETS-1 && (dur >> (b+1)) != 0; b++) ;
+  btree->stats.latency[b]++;
+
+  e.name = name;
+  e.phase = 'X';
+  e.ts = btree->op_start;
+  e.dur = dur;
+  e.device_us = (jdisk_device_time(btree->disk) - btree->op_device) * 1e6;
+  e.lba = 0;
+  e.level = -1;
+  inst_emit(btree, &e);
+  btree->op_start = 0;
+}
+
+/* Node I/O is only timed when somebody is listening */
+
+long inst_io_begin(B_Tree *btree, double *device)
+{
+  if (btree->trace == NULL) return 0;
+  *device = jdisk_device_time(btree->disk);
+  return inst_now();
+}
+
+void inst_io_end(B_Tree *btree, const char *name, unsigned int lba, long start, double device)
+{
+  B_Tree_Event e;
+
+  if (start == 0) return;
+  e.name = name;
+  e.phase = 'X';
+  e.ts = start;
+  e.dur = inst_now() - start;
+  e.device_us = (jdisk_device_time(btree->disk) - device) * 1e6;
+  e.lba = lba;
+  e.level = -1;
+  inst_emit(btree, &e);
+}
+
+void inst_split(B_Tree *btree, int level)
+{
+  B_Tree_Event e;
+
+  btree->stats.splits[(level < B_TREE_MAX_LEVELS) ? level : B_TREE_MAX_LEVELS-1]++;
+  if (btree->trace == NULL) return;
+  e.name = "split";
+  e.phase = 'i';
+  e.ts = inst_now();
+  e.dur = 0;
+  e.device_us = 0;
+  e.lba = 0;
+  e.level = level;
+  inst_emit(btree, &e);
+}
+
+/* ---------------------------------------------------------------- */
+
+void b_tree_stats(void *b_tree, B_Tree_Stats *stats)
+{
+  memcpy(stats, &((B_Tree *) b_tree)->stats, sizeof(B_Tree_Stats));
+}
+
+void b_tree_reset_stats(void *b_tree)
+{
+  memset(&((B_Tree *) b_tree)->stats, 0, sizeof(B_Tree_Stats));
+}
+
+void b_tree_set_sample_rate(void *b_tree, int n)
+{
+  ((B_Tree *) b_tree)->sample_every = (n < 0) ? 0 : n;
+}
+
+void b_tree_set_trace(void *b_tree, B_Tree_Trace_Fn fn, void *arg)
+{
+  b_tree_trace_close(b_tree);
+  ((B_Tree *) b_tree)->trace = fn;
+  ((B_Tree *) b_tree)->trace_arg = arg;
+}
+
+void b_tree_print_stats(void *b_tree, FILE *f)
+{
+  B_Tree_Stats *s;
+  long ops;
+  int i;
+
+  s = &((B_Tree *) b_tree)->stats;
+  ops = s->finds + s->inserts + s->updates;
+  if (ops == 0) ops = 1;
+  fprintf(f, "finds: %ld  inserts: %ld (%ld appends, %ld batched)  updates: %ld\n", s->finds, s->inserts,
+          s->appends, s->batched, s->updates);
+  fprintf(f, "nodes visited: %ld (%.2f/op)  key slots scanned: %ld (%.2f/op)\n",
+          s->nodes_visited, (double) s->nodes_visited / ops,
+          s->key_slots_scanned, (double) s->key_slots_scanned / ops);
+  fprintf(f, "cache hits: %ld  cache misses: %ld  node writes: %ld\n",
+          s->cache_hits, s->cache_misses, s->node_writes);
+  fprintf(f, "bytes copied: %ld (%.1f/op)  mallocs: %ld\n",
+          s->bytes_copied, (double) s->bytes_copied / ops, s->mallocs);
+  fprintf(f, "splits by depth:");
+  for (i = 0; i < B_TREE_MAX_LEVELS; i++) {
+    if (s->splits[i] != 0) fprintf(f, "  %d: %ld", i, s->splits[i]);
+  }
+  fprintf(f, "\n");
+  if (s->redistributions != 0) fprintf(f, "redistributions: %ld\n", s->redistributions);
+  if (s->flushes != 0) fprintf(f, "buffer flushes: %ld (%ld messages)\n", s->flushes, s->messages);
+  if (s->filtered != 0) fprintf(f, "lookups the Bloom filter turned away: %ld\n", s->filtered);
+  if (s->indexed != 0) fprintf(f, "lookups the hash index answered: %ld\n", s->indexed);
+  if (s->sampled_ops > 0) {
+    fprintf(f, "sampled ops: %ld  mean: %.2fus  max: %.2fus\n", s->sampled_ops,
+            s->sampled_ns / 1000.0 / s->sampled_ops, s->max_ns / 1000.0);
+    for (i = 0; i < B_TREE_LAT_BUCKETS; i++) {
+      if (s->latency[i] != 0) {
+        fprintf(f, "   [%9.2fus, %9.2fus): %ld\n", (1L << i) / 1000.0,
+                (1L << (i+1)) / 1000.0, s->latency[i]);
+      }
+    }
+  }
+}
+
+/* ---------------------------------------------------------------- */
+/* Chrome trace-event output: one JSON array of events, timestamps in microseconds */
+
+static void trace_file_event(void *arg, B_Tree_Event *e)
+{
+  Trace_File *tf;
+
+  tf = (Trace_File *) arg;
+  fprintf(tf->f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", (tf->events == 0) ? "" : ",\n",
+          e->name, e->phase, (e->ts - tf->epoch) / 1000.0);
+  if (e->phase == 'X') fprintf(tf->f, "\"dur\":%.3f,", e->dur / 1000.0);
+  if (e->phase == 'i') fprintf(tf->f, "\"s\":\"t\",");
+  fprintf(tf->f, "\"pid\":1,\"tid\":1,\"args\":{");
+  if (e->level >= 0) {
+    fprintf(tf->f, "\"level\":%d", e->level);
+  } else {
+    fprintf(tf->f, "\"device_us\":%.3f", e->device_us);
+    if (e->lba != 0) fprintf(tf->f, ",\"lba\":%u", e->lba);
+  }
+  fprintf(tf->f, "}}");
+  tf->events++;
+}
+
+int b_tree_trace_file(void *b_tree, char *fn)
+{
+  Trace_File *tf;
+  FILE *f;
+
+  f = fopen(fn, "w");
+  if (f == NULL) return -1;
+  tf = (Trace_File *) malloc(sizeof(Trace_File));
+  tf->f = f;
+  tf->epoch = inst_now();
+  tf->events = 0;
+  fprintf(f, "[\n");
+  b_tree_set_trace(b_tree, trace_file_event, tf);
+  return 0;
+}
+
+void b_tree_trace_close(void *b_tree)
+{
+  B_Tree *btree;
+  Trace_File *tf;
+
+  btree = (B_Tree *) b_tree;
+  if (btree->trace == trace_file_event) {
+    tf = (Trace_File *) btree->trace_arg;
+    fprintf(tf->f, "\n]\n");
+    fclose(tf->f);
+    free(tf);
+  }
+  btree->trace = NULL;
+  btree->trace_arg = NULL;
+}
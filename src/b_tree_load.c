@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "b_tree.h"
+
+/* b_tree_load: a pipelined loader.
+
+   Reads the b_tree_test command format (I key val, F key, P, C) and the
+   tree-*.txt format (rn lba key val, which is an insert), and runs it through
+   three threads:
+
+     parse  reads lines and fills chunks of padded records
+     sort   sorts each run of inserts in a chunk by key, so the tree sees them
+            in order (stable, so repeated keys keep their order; -u turns it off)
+     apply  runs the records against the tree, in the sorted order
+
+   Stages are connected by bounded single-producer, single-consumer lock-free
+   queues.  Chunks come from a fixed pool and go back to parse through a third
+   queue, so a slow stage holds the others back rather than using more memory.
+
+   With -v, results are printed like b_tree_test prints them, in input order.
+   Sorting changes which lbas inserts get, but not what finds see. */
+
+#define BUFSIZE 4000
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_load file [CREATE file_size key_size|u32|u64|u128] [options]\n");
+  fprintf(stderr, "   -i input        read from input instead of stdin\n");
+  fprintf(stderr, "   -b records      records per chunk (default 1024)\n");
+  fprintf(stderr, "   -q chunks       chunks in the pool (default 8)\n");
+  fprintf(stderr, "   -u              don't sort\n");
+  fprintf(stderr, "   -v              print every result, like b_tree_test\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+/* ---------------------------------------------------------------- */
+/* Bounded SPSC queue of pointers.  head is only written by the consumer and
+   tail only by the producer.  A full or empty queue yields the CPU, since the
+   stage on the other side may need it. */
+
+typedef struct {
+  void **slot;
+  unsigned long mask;
+  _Atomic unsigned long head;
+  _Atomic unsigned long tail;
+} Queue;
+
+typedef struct {
+  long items;
+  double busy;                /* Seconds spent working */
+  double wait;                /* Seconds spent waiting on a queue */
+} Stage;
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void queue_init(Queue *q, int size)
+{
+  int n;
+
+  for (n = 1; n < size; n *= 2) ;
+  q->slot = (void **) malloc(sizeof(void *) * n);
+  q->mask = n - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+}
+
+static void queue_push(Queue *q, void *p, Stage *st)
+{
+  unsigned long t;
+  double t0;
+
+  t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if (t - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask) {
+    t0 = now();
+    while (t - atomic_load_explicit(&q->head, memory_order_acquire) > q->mask) sched_yield();
+    st->wait += now() - t0;
+  }
+  q->slot[t & q->mask] = p;
+  atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+}
+
+static void *queue_pop(Queue *q, Stage *st)
+{
+  unsigned long h;
+  double t0;
+  void *p;
+
+  h = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (atomic_load_explicit(&q->tail, memory_order_acquire) == h) {
+    t0 = now();
+    while (atomic_load_explicit(&q->tail, memory_order_acquire) == h) sched_yield();
+    st->wait += now() - t0;
+  }
+  p = q->slot[h & q->mask];
+  atomic_store_explicit(&q->head, h + 1, memory_order_release);
+  return p;
+}
+
+/* ---------------------------------------------------------------- */
+
+typedef struct {
+  char op;                    /* 'I', 'F', 'P', 'C', or 'E' for a line that was rejected */
+  char err[20];
+  unsigned int lba;
+  unsigned char key[256];
+  unsigned char val[JDISK_SECTOR_SIZE];
+} Record;
+
+typedef struct {
+  int n;
+  int *order;                 /* The order apply runs the records in */
+  Record *r;
+} Chunk;
+
+typedef struct {
+  void *tree;
+  FILE *in;
+  int key_size;
+  int key_type;
+  int chunk_size;
+  int sort;
+  int verbose;
+  Queue free_q, sort_q, apply_q;
+  Stage parse, sorter, apply;
+  long lines;
+  long bad;
+} Loader;
+
+/* Splits a line into up to 4 whitespace-separated words, in place */
+
+static int split(char *line, char **w)
+{
+  int n;
+
+  n = 0;
+  while (n < 4) {
+    while (isspace(*line)) line++;
+    if (*line == '\0') break;
+    w[n++] = line;
+    while (*line != '\0' && !isspace(*line)) line++;
+    if (*line != '\0') *line++ = '\0';
+  }
+  return n;
+}
+
+/* As in b_tree_test: byte keys are zero-padded strings, integer keys are numbers */
+
+static void parse_line(Loader *l, char *line, Record *r)
+{
+  char *w[4], *k, *v;
+  int n;
+
+  n = split(line, w);
+  k = NULL;
+  v = NULL;
+  r->op = 'E';
+  strcpy(r->err, "Bad line");
+  if (n == 1 && (strcmp(w[0], "P") == 0 || strcmp(w[0], "C") == 0)) {
+    r->op = w[0][0];
+    return;
+  } else if (n == 2 && strcmp(w[0], "F") == 0) {
+    k = w[1];
+  } else if (n == 3 && strcmp(w[0], "I") == 0) {
+    k = w[1];
+    v = w[2];
+  } else if (n == 4) {
+    /* tree-*.txt: rn lba key val */
+    k = w[2];
+    v = w[3];
+  } else {
+    return;
+  }
+
+  if (!b_tree_parse_key(k, l->key_size, l->key_type, r->key)) {
+    strcpy(r->err, "Key too big");
+    return;
+  }
+  if (v != NULL) {
+    if (strlen(v) > JDISK_SECTOR_SIZE) {
+      strcpy(r->err, "Val too big");
+      return;
+    }
+    memset(r->val, 0, JDISK_SECTOR_SIZE);
+    memcpy(r->val, v, strlen(v));
+  }
+  r->op = (v != NULL) ? 'I' : 'F';
+}
+
+static void *parse_stage(void *arg)
+{
+  Loader *l;
+  Chunk *c;
+  char line[BUFSIZE], *p;
+  double t0;
+  int eof;
+
+  l = (Loader *) arg;
+  eof = 0;
+  while (!eof) {
+    c = (Chunk *) queue_pop(&l->free_q, &l->parse);
+    t0 = now();
+    c->n = 0;
+    while (c->n < l->chunk_size) {
+      if (fgets(line, BUFSIZE, l->in) == NULL) {
+        eof = 1;
+        break;
+      }
+      l->lines++;
+      for (p = line; isspace(*p); p++) ;
+      if (*p == '\0') continue;
+      parse_line(l, line, c->r + c->n);
+      if (c->r[c->n].op == 'E') l->bad++;
+      c->n++;
+    }
+    l->parse.items += c->n;
+    l->parse.busy += now() - t0;
+    queue_push(&l->sort_q, c, &l->parse);
+  }
+  queue_push(&l->sort_q, NULL, &l->parse);
+  return NULL;
+}
+
+/* qsort has no context argument, and only the sort thread uses these */
+
+static void *Sort_tree;
+static Chunk *Sort_chunk;
+
+static int cmp_record(const void *a, const void *b)
+{
+  int x, y, c;
+
+  x = *(int *) a;
+  y = *(int *) b;
+  c = b_tree_compare(Sort_tree, Sort_chunk->r[x].key, Sort_chunk->r[y].key);
+  if (c != 0) return c;
+  return x - y;
+}
+
+static void *sort_stage(void *arg)
+{
+  Loader *l;
+  Chunk *c;
+  double t0;
+  int i, j;
+
+  l = (Loader *) arg;
+  Sort_tree = l->tree;
+  while ((c = (Chunk *) queue_pop(&l->sort_q, &l->sorter)) != NULL) {
+    t0 = now();
+    for (i = 0; i < c->n; i++) c->order[i] = i;
+    if (l->sort) {
+      /* Only runs of inserts move: a find or P in between sees what came before it */
+      Sort_chunk = c;
+      for (i = 0; i < c->n; i = j + 1) {
+        for (j = i; j < c->n && c->r[j].op == 'I'; j++) ;
+        if (j - i > 1) qsort(c->order + i, j - i, sizeof(int), cmp_record);
+      }
+    }
+    l->sorter.items += c->n;
+    l->sorter.busy += now() - t0;
+    queue_push(&l->apply_q, c, &l->sorter);
+  }
+  queue_push(&l->apply_q, NULL, &l->sorter);
+  return NULL;
+}
+
+static void apply(Loader *l, Record *r)
+{
+  switch (r->op) {
+    case 'I': r->lba = b_tree_insert(l->tree, r->key, r->val); break;
+    case 'F': r->lba = b_tree_find(l->tree, r->key); break;
+    case 'P': b_tree_print_tree(l->tree); break;
+    case 'C':
+      r->lba = b_tree_compact_begin(l->tree);
+      if (r->lba == 0) {
+        while (b_tree_compact_step(l->tree, 64) > 0) ;
+      }
+      break;
+  }
+}
+
+static void print_result(Record *r)
+{
+  switch (r->op) {
+    case 'I': printf("Insert return value: %u\n", r->lba); break;
+    case 'F': printf("Find return value: %d\n", r->lba); break;
+    case 'C': printf("%s\n", (r->lba == 0) ? "Compacted" : "Compaction failed"); break;
+    case 'E': printf("%s\n", r->err); break;
+  }
+}
+
+/* A run of inserts goes in sorted order, and then its results are printed in
+   input order.  Anything else is a run of one. */
+
+static void *apply_stage(void *arg)
+{
+  Loader *l;
+  Chunk *c;
+  double t0;
+  int i, j, k;
+
+  l = (Loader *) arg;
+  while ((c = (Chunk *) queue_pop(&l->apply_q, &l->apply)) != NULL) {
+    t0 = now();
+    for (i = 0; i < c->n; i = j) {
+      for (j = i; j < c->n && c->r[j].op == 'I'; j++) ;
+      if (j == i) j = i + 1;
+      for (k = i; k < j; k++) apply(l, c->r + c->order[k]);
+      if (l->verbose) {
+        for (k = i; k < j; k++) print_result(c->r + k);
+      }
+    }
+    l->apply.items += c->n;
+    l->apply.busy += now() - t0;
+    queue_push(&l->free_q, c, &l->apply);
+  }
+  return NULL;
+}
+
+/* ---------------------------------------------------------------- */
+
+static void print_stage(char *name, Stage *s, double wall)
+{
+  printf("%-6s %9ld records  busy %7.3fs (%9.0f records/s)  waiting %7.3fs  idle %5.1f%%\n",
+         name, s->items, s->busy, (s->busy > 0) ? s->items / s->busy : 0, s->wait,
+         (wall > 0) ? 100 * (1 - s->busy / wall) : 0);
+}
+
+int main(int argc, char **argv)
+{
+  Loader l;
+  Chunk *chunks;
+  pthread_t tid[3];
+  unsigned long file_size;
+  char *input;
+  int i, nchunks, first_opt;
+  double t0, wall;
+
+  if (argc < 2 || argv[1][0] == '-') usage(NULL);
+  memset(&l, 0, sizeof(Loader));
+  l.chunk_size = 1024;
+  l.sort = 1;
+  nchunks = 8;
+  input = NULL;
+
+  if (argc >= 5 && strcmp(argv[2], "CREATE") == 0) {
+    l.key_type = B_TREE_KEY_BYTES;
+    if (strcmp(argv[4], "u32") == 0) l.key_type = B_TREE_KEY_U32;
+    if (strcmp(argv[4], "u64") == 0) l.key_type = B_TREE_KEY_U64;
+    if (strcmp(argv[4], "u128") == 0) l.key_type = B_TREE_KEY_U128;
+    l.key_size = (l.key_type == B_TREE_KEY_BYTES) ? atoi(argv[4]) : atoi(argv[4]+1) / 8;
+    if (l.key_size < 4 || l.key_size > 254) usage("key_size must be between 4 and 254");
+    if (sscanf(argv[3], "%lu", &file_size) != 1 || file_size == 0 ||
+        file_size % JDISK_SECTOR_SIZE != 0) {
+      usage("bad file size.");
+    }
+    l.tree = b_tree_create_typed(argv[1], file_size, l.key_size, l.key_type);
+    if (l.tree == NULL) {
+      fprintf(stderr, "Couldn't create b_tree -- calling perror()\n");
+      perror(argv[1]);
+      exit(1);
+    }
+    first_opt = 5;
+  } else {
+    l.tree = b_tree_attach(argv[1]);
+    if (l.tree == NULL) {
+      fprintf(stderr, "Couldn't attach to %s.  Calling perror().\n", argv[1]);
+      perror(argv[1]);
+      exit(1);
+    }
+    l.key_size = b_tree_key_size(l.tree);
+    l.key_type = b_tree_key_type(l.tree);
+    first_opt = 2;
+  }
+
+  for (i = first_opt; i < argc; i++) {
+    if (strcmp(argv[i], "-u") == 0) {
+      l.sort = 0;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      l.verbose = 1;
+    } else if (i+1 < argc && strcmp(argv[i], "-i") == 0) {
+      input = argv[++i];
+    } else if (i+1 < argc && strcmp(argv[i], "-b") == 0) {
+      if (sscanf(argv[++i], "%d", &l.chunk_size) != 1 || l.chunk_size < 1) usage("bad -b");
+    } else if (i+1 < argc && strcmp(argv[i], "-q") == 0) {
+      if (sscanf(argv[++i], "%d", &nchunks) != 1 || nchunks < 2) usage("bad -q");
+    } else {
+      usage(NULL);
+    }
+  }
+  l.in = stdin;
+  if (input != NULL) {
+    l.in = fopen(input, "r");
+    if (l.in == NULL) { perror(input); exit(1); }
+  }
+
+  queue_init(&l.free_q, nchunks);
+  queue_init(&l.sort_q, nchunks + 1);
+  queue_init(&l.apply_q, nchunks + 1);
+  chunks = (Chunk *) malloc(sizeof(Chunk) * nchunks);
+  for (i = 0; i < nchunks; i++) {
+    chunks[i].r = (Record *) malloc(sizeof(Record) * l.chunk_size);
+    chunks[i].order = (int *) malloc(sizeof(int) * l.chunk_size);
+    queue_push(&l.free_q, chunks + i, &l.parse);
+  }
+
+  t0 = now();
+  pthread_create(tid, NULL, parse_stage, &l);
+  pthread_create(tid + 1, NULL, sort_stage, &l);
+  pthread_create(tid + 2, NULL, apply_stage, &l);
+  for (i = 0; i < 3; i++) pthread_join(tid[i], NULL);
+  wall = now() - t0;
+
+  for (i = 0; i < nchunks; i++) {
+    free(chunks[i].r);
+    free(chunks[i].order);
+  }
+  print_stage("parse", &l.parse, wall);
+  print_stage("sort", &l.sorter, wall);
+  print_stage("apply", &l.apply, wall);
+  printf("lines: %ld  bad: %ld  wall: %.3fs  (%.0f records/s)\n", l.lines, l.bad, wall,
+         (wall > 0) ? l.apply.items / wall : 0);
+  printf("Reads: %ld\n", jdisk_reads(b_tree_disk(l.tree)));
+  printf("Writes: %ld\n", jdisk_writes(b_tree_disk(l.tree)));
+  b_tree_detach(l.tree);
+  exit(0);
+}
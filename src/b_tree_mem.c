@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "b_tree_mem.h"
+
+/* See include/b_tree_mem.h.
+
+   A memtable is a skip list: each key is in the list at level 0, and in the
+   ones above it with odds of 1 in 4 per level.  Values are kept without their
+   trailing zeros.  There are at most two tables: the active one, which takes
+   inserts, and the one being merged, which nothing changes, so the merge
+   thread walks it without the lock.  The merge takes the tree's lock for
+   MERGE_CHUNK keys at a time, so that finds which miss the memtables don't
+   wait for a whole merge.
+
+   The keys go into the tree in order, through b_tree_insert_batch(), so each
+   leaf that a chunk touches is read and written about once, however many of
+   its keys are in the chunk, and the leaves go by in key order. */
+
+#define MAX_LEVEL   (20)
+#define MERGE_CHUNK (256)              /* Keys per b_tree_insert_batch(), and per hold of the tree's lock */
+
+typedef struct skip {
+  unsigned char *value;       /* Without its trailing zeros */
+  int len;
+  int level;
+  struct skip *next[1];       /* level of them, then the key */
+} Skip;
+
+typedef struct {
+  Skip *head;
+  int level;
+  long n;
+} Table;
+
+typedef struct {
+  void *tree;
+  int key_size;
+  long max_keys;
+  pthread_mutex_t lock;       /* Protects the tables and everything below */
+  pthread_cond_t cond;        /* Signalled when a table is set aside or merged */
+  pthread_mutex_t tlock;      /* Held while the tree or its jdisk is in use */
+  Table *active;
+  Table *merging;             /* NULL when nothing is being merged */
+  unsigned long rand;
+  int stop;
+  int failed;
+  long merges;
+  long merged;
+  long stalls;
+  pthread_t tid;
+} Mem;
+
+/* ---------------------------------------------------------------- */
+/* Skip lists */
+
+static unsigned char *skip_key(Skip *s)
+{
+  return (unsigned char *) (s->next + s->level);
+}
+
+static Skip *skip_new(int level, int key_size)
+{
+  Skip *s;
+
+  s = (Skip *) malloc(sizeof(Skip) + (level - 1) * sizeof(Skip *) + key_size);
+  s->value = NULL;
+  s->len = 0;
+  s->level = level;
+  memset(s->next, 0, level * sizeof(Skip *));
+  return s;
+}
+
+static Table *table_new(Mem *m)
+{
+  Table *t;
+
+  t = (Table *) malloc(sizeof(Table));
+  t->head = skip_new(MAX_LEVEL, m->key_size);
+  t->level = 1;
+  t->n = 0;
+  return t;
+}
+
+static void table_free(Table *t)
+{
+  Skip *s, *next;
+
+  for (s = t->head; s != NULL; s = next) {
+    next = s->next[0];
+    free(s->value);
+    free(s);
+  }
+  free(t);
+}
+
+/* xorshift64, with the lock held */
+
+static int random_level(Mem *m)
+{
+  unsigned long r;
+  int level;
+
+  m->rand ^= m->rand << 13;
+  m->rand ^= m->rand >> 7;
+  m->rand ^= m->rand << 17;
+  r = m->rand;
+  level = 1;
+  while (level < MAX_LEVEL && (r & 3) == 0) {
+    level++;
+    r >>= 2;
+  }
+  return level;
+}
+
+/* The last node at each level whose key is < key goes into prev (if not NULL).
+   Returns the node with the key, or NULL. */
+
+static Skip *table_search(Mem *m, Table *t, void *key, Skip **prev)
+{
+  Skip *x;
+  int l;
+
+  x = t->head;
+  for (l = t->level - 1; l >= 0; l--) {
+    while (x->next[l] != NULL && b_tree_compare(m->tree, skip_key(x->next[l]), key) < 0) x = x->next[l];
+    if (prev != NULL) prev[l] = x;
+  }
+  x = x->next[0];
+  if (x != NULL && b_tree_compare(m->tree, skip_key(x), key) == 0) return x;
+  return NULL;
+}
+
+static void table_put(Mem *m, Table *t, void *key, unsigned char *record)
+{
+  Skip *prev[MAX_LEVEL], *s;
+  int l, level, len;
+
+  s = table_search(m, t, key, prev);
+  if (s == NULL) {
+    level = random_level(m);
+    for (l = t->level; l < level; l++) prev[l] = t->head;
+    if (level > t->level) t->level = level;
+    s = skip_new(level, m->key_size);
+    memcpy(skip_key(s), key, m->key_size);
+    for (l = 0; l < level; l++) {
+      s->next[l] = prev[l]->next[l];
+      prev[l]->next[l] = s;
+    }
+    t->n++;
+  }
+
+  len = JDISK_SECTOR_SIZE;
+  while (len > 0 && record[len-1] == 0) len--;
+  free(s->value);
+  s->value = (unsigned char *) malloc(len + 1);
+  memcpy(s->value, record, len);
+  s->len = len;
+}
+
+static void value_out(Skip *s, void *record)
+{
+  memcpy(record, s->value, s->len);
+  memset((unsigned char *) record + s->len, 0, JDISK_SECTOR_SIZE - s->len);
+}
+
+/* ---------------------------------------------------------------- */
+/* Merging */
+
+/* With the lock held, and nothing being merged */
+
+static void set_aside(Mem *m)
+{
+  m->merging = m->active;
+  m->active = table_new(m);
+  pthread_cond_broadcast(&m->cond);
+}
+
+static void *merger(void *arg)
+{
+  Mem *m;
+  Table *t;
+  Skip *s;
+  unsigned char *bufs;
+  void *keys[MERGE_CHUNK], *records[MERGE_CHUNK];
+  long count;
+  int i, done, failed;
+
+  m = (Mem *) arg;
+  bufs = (unsigned char *) malloc(MERGE_CHUNK * JDISK_SECTOR_SIZE);
+  for (i = 0; i < MERGE_CHUNK; i++) records[i] = bufs + i * JDISK_SECTOR_SIZE;
+  pthread_mutex_lock(&m->lock);
+  while (1) {
+    while ((m->merging == NULL || m->failed) && !m->stop) pthread_cond_wait(&m->cond, &m->lock);
+    if (m->stop) {
+      pthread_mutex_unlock(&m->lock);
+      free(bufs);
+      return NULL;
+    }
+    t = m->merging;
+    pthread_mutex_unlock(&m->lock);
+
+    count = 0;
+    failed = 0;
+    s = t->head->next[0];
+    while (s != NULL && !failed) {
+      for (i = 0; i < MERGE_CHUNK && s != NULL; i++, s = s->next[0]) {
+        keys[i] = skip_key(s);
+        value_out(s, records[i]);
+      }
+      pthread_mutex_lock(&m->tlock);
+      done = b_tree_insert_batch(m->tree, i, keys, records, NULL);
+      pthread_mutex_unlock(&m->tlock);
+      count += done;
+      failed = (done < i);
+    }
+
+    /* A failed table stays where finds look, and so do its keys that made it in */
+    pthread_mutex_lock(&m->lock);
+    m->merged += count;
+    if (failed) {
+      m->failed = 1;
+    } else {
+      m->merging = NULL;
+      m->merges++;
+      table_free(t);
+    }
+    pthread_cond_broadcast(&m->cond);
+  }
+}
+
+/* ---------------------------------------------------------------- */
+
+void *b_tree_mem_open(void *b_tree, long max_keys)
+{
+  Mem *m;
+
+  if (max_keys < 1) return NULL;
+  m = (Mem *) calloc(1, sizeof(Mem));
+  m->tree = b_tree;
+  m->key_size = b_tree_key_size(b_tree);
+  m->max_keys = max_keys;
+  m->rand = 0x9e3779b97f4a7c15UL;
+  m->active = table_new(m);
+  m->merging = NULL;
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->cond, NULL);
+  pthread_mutex_init(&m->tlock, NULL);
+  pthread_create(&m->tid, NULL, merger, m);
+  return (void *) m;
+}
+
+int b_tree_mem_close(void *mem)
+{
+  Mem *m;
+  int rv;
+
+  m = (Mem *) mem;
+  rv = b_tree_mem_flush(mem);
+  pthread_mutex_lock(&m->lock);
+  m->stop = 1;
+  pthread_cond_broadcast(&m->cond);
+  pthread_mutex_unlock(&m->lock);
+  pthread_join(m->tid, NULL);
+
+  table_free(m->active);
+  if (m->merging != NULL) table_free(m->merging);
+  pthread_mutex_destroy(&m->lock);
+  pthread_cond_destroy(&m->cond);
+  pthread_mutex_destroy(&m->tlock);
+  free(m);
+  return rv;
+}
+
+int b_tree_mem_insert(void *mem, void *key, void *record)
+{
+  Mem *m;
+
+  m = (Mem *) mem;
+  pthread_mutex_lock(&m->lock);
+  if (m->failed) {
+    pthread_mutex_unlock(&m->lock);
+    return -1;
+  }
+  table_put(m, m->active, key, (unsigned char *) record);
+  if (m->active->n >= m->max_keys) {
+    if (m->merging != NULL) {
+      m->stalls++;
+      while (m->merging != NULL && !m->failed) pthread_cond_wait(&m->cond, &m->lock);
+    }
+    if (!m->failed && m->active->n >= m->max_keys) set_aside(m);
+  }
+  pthread_mutex_unlock(&m->lock);
+  return 0;
+}
+
+int b_tree_mem_find(void *mem, void *key, void *record)
+{
+  Mem *m;
+  Skip *s;
+  unsigned int lba;
+  int found;
+
+  m = (Mem *) mem;
+  pthread_mutex_lock(&m->lock);
+  s = table_search(m, m->active, key, NULL);
+  if (s == NULL && m->merging != NULL) s = table_search(m, m->merging, key, NULL);
+  if (s != NULL) value_out(s, record);
+  pthread_mutex_unlock(&m->lock);
+  if (s != NULL) return 1;
+
+  /* A table that merges after the miss above has already put its keys in the tree */
+  pthread_mutex_lock(&m->tlock);
+  lba = b_tree_find(m->tree, key);
+  found = (lba != 0 && b_tree_read(m->tree, lba, record) == 0);
+  pthread_mutex_unlock(&m->tlock);
+  return found;
+}
+
+int b_tree_mem_flush(void *mem)
+{
+  Mem *m;
+  int rv;
+
+  m = (Mem *) mem;
+  pthread_mutex_lock(&m->lock);
+  if (m->active->n > 0) {
+    while (m->merging != NULL && !m->failed) pthread_cond_wait(&m->cond, &m->lock);
+    if (!m->failed) set_aside(m);
+  }
+  while (m->merging != NULL && !m->failed) pthread_cond_wait(&m->cond, &m->lock);
+  rv = (m->failed) ? -1 : 0;
+  pthread_mutex_unlock(&m->lock);
+  return rv;
+}
+
+long b_tree_mem_keys(void *mem)
+{
+  Mem *m;
+  long n;
+
+  m = (Mem *) mem;
+  pthread_mutex_lock(&m->lock);
+  n = m->active->n + ((m->merging != NULL) ? m->merging->n : 0);
+  pthread_mutex_unlock(&m->lock);
+  return n;
+}
+
+void b_tree_mem_stats(void *mem, long *merges, long *merged, long *stalls)
+{
+  Mem *m;
+
+  m = (Mem *) mem;
+  pthread_mutex_lock(&m->lock);
+  if (merges != NULL) *merges = m->merges;
+  if (merged != NULL) *merged = m->merged;
+  if (stalls != NULL) *stalls = m->stalls;
+  pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "b_tree_mem.h"
+
+/* Ingest through the memtable front-end, against inserting straight into the tree.
+
+   Creates a tree with 64-bit integer keys and inserts n scrambled keys, through a
+   memtable of -m keys (or, with -m 0, with b_tree_insert()), timing each insert.
+   Then it finds every key and a miss for each, checks the values, flushes, and
+   checks them again in the tree itself.  Set $JDISK_LATENCY to see the modeled
+   device time that the order of the merge saves. */
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_mem_bench file [options]\n");
+  fprintf(stderr, "   -n keys                         (default 100000)\n");
+  fprintf(stderr, "   -m memtable-keys                0 for straight inserts (default 10000)\n");
+  fprintf(stderr, "   -S plain|buffered               the tree's structure (default plain)\n");
+  fprintf(stderr, "   -s seed                         (default 1)\n");
+  fprintf(stderr, "file is scratch -- it is removed and recreated.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+static long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned long mix64(unsigned long x)
+{
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9UL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebUL;
+  x ^= x >> 31;
+  return x;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+  long x = *(long *) a, y = *(long *) b;
+  return (x < y) ? -1 : (x > y);
+}
+
+static double pct(long *lat, long n, double q)
+{
+  long i;
+
+  i = (long) (q * n);
+  if (i >= n) i = n - 1;
+  return lat[i] / 1000.0;
+}
+
+/* The value of key k, as a full sector */
+
+static void value_of(unsigned long key, unsigned char *buf)
+{
+  memset(buf, 0, JDISK_SECTOR_SIZE);
+  sprintf((char *) buf, "%lu", key);
+}
+
+int main(int argc, char **argv)
+{
+  char *fn;
+  int i, flags, errors;
+  long n, k, seed, max_keys, *lat, t0, t_insert, t_find, t_flush, merges, merged, stalls;
+  unsigned long *keys, miss;
+  unsigned char buf[JDISK_SECTOR_SIZE], want[JDISK_SECTOR_SIZE];
+  unsigned int lba;
+  void *tree, *jd, *mem;
+
+  if (argc < 2 || argv[1][0] == '-') usage(NULL);
+  fn = argv[1];
+  n = 100000;
+  max_keys = 10000;
+  flags = 0;
+  seed = 1;
+  for (i = 2; i < argc; i += 2) {
+    if (argv[i][0] != '-' || strlen(argv[i]) != 2 || i+1 >= argc) usage(NULL);
+    switch (argv[i][1]) {
+      case 'n': if (sscanf(argv[i+1], "%ld", &n) != 1 || n < 1) usage("bad -n"); break;
+      case 'm': if (sscanf(argv[i+1], "%ld", &max_keys) != 1 || max_keys < 0) usage("bad -m"); break;
+      case 'S': if (strcmp(argv[i+1], "plain") == 0) {
+                  flags = 0;
+                } else if (strcmp(argv[i+1], "buffered") == 0) {
+                  flags = B_TREE_BUFFERED;
+                } else {
+                  usage("bad -S");
+                }
+                break;
+      case 's': if (sscanf(argv[i+1], "%ld", &seed) != 1) usage("bad -s"); break;
+      default: usage(NULL);
+    }
+  }
+
+  keys = (unsigned long *) malloc(sizeof(unsigned long) * n);
+  lat = (long *) malloc(sizeof(long) * n);
+  for (k = 0; k < n; k++) keys[k] = mix64(2 * k + seed * 2 * n);
+
+  unlink(fn);
+  tree = b_tree_create_flags(fn, 2 * n * JDISK_SECTOR_SIZE, 8, B_TREE_KEY_U64, flags);
+  if (tree == NULL) {
+    fprintf(stderr, "Couldn't create %s -- calling perror()\n", fn);
+    perror(fn);
+    exit(1);
+  }
+  jd = b_tree_disk(tree);
+  mem = (max_keys > 0) ? b_tree_mem_open(tree, max_keys) : NULL;
+
+  errors = 0;
+  t_insert = now_ns();
+  for (k = 0; k < n; k++) {
+    value_of(keys[k], buf);
+    t0 = now_ns();
+    if (mem != NULL) {
+      if (b_tree_mem_insert(mem, keys + k, buf) != 0) errors++;
+    } else {
+      if (b_tree_insert(tree, keys + k, buf) == 0) errors++;
+    }
+    lat[k] = now_ns() - t0;
+  }
+  t_insert = now_ns() - t_insert;
+
+  /* Hits, and misses (odd keys of the same scramble aren't in the tree) */
+  t_find = now_ns();
+  for (k = 0; k < n; k++) {
+    value_of(keys[k], want);
+    miss = mix64(2 * k + 1 + seed * 2 * n);
+    if (mem != NULL) {
+      if (b_tree_mem_find(mem, keys + k, buf) != 1 || memcmp(buf, want, JDISK_SECTOR_SIZE) != 0) errors++;
+      if (b_tree_mem_find(mem, &miss, buf) != 0) errors++;
+    } else {
+      lba = b_tree_find(tree, keys + k);
+      if (lba == 0 || b_tree_read(tree, lba, buf) != 0 || memcmp(buf, want, JDISK_SECTOR_SIZE) != 0) errors++;
+      if (b_tree_find(tree, &miss) != 0) errors++;
+    }
+  }
+  t_find = now_ns() - t_find;
+
+  merges = merged = stalls = 0;
+  t_flush = now_ns();
+  if (mem != NULL) {
+    if (b_tree_mem_flush(mem) != 0) errors++;
+    b_tree_mem_stats(mem, &merges, &merged, &stalls);
+    if (b_tree_mem_keys(mem) != 0 || merged != n) errors++;
+    if (b_tree_mem_close(mem) != 0) errors++;
+  }
+  t_flush = now_ns() - t_flush;
+
+  for (k = 0; k < n; k++) {
+    value_of(keys[k], want);
+    lba = b_tree_find(tree, keys + k);
+    if (lba == 0 || b_tree_read(tree, lba, buf) != 0 || memcmp(buf, want, JDISK_SECTOR_SIZE) != 0) errors++;
+  }
+
+  qsort(lat, n, sizeof(long), cmp_long);
+  printf("keys: %ld  memtable: %ld  structure: %s\n", n, max_keys,
+         (flags & B_TREE_BUFFERED) ? "buffered" : "plain");
+  printf("insert: %.0f ops/sec  p50: %.2fus  p99: %.2fus  p999: %.2fus  max: %.2fus\n",
+         n / (t_insert / 1e9), pct(lat, n, .50), pct(lat, n, .99), pct(lat, n, .999), lat[n-1] / 1000.0);
+  printf("find (hit+miss): %.0f ops/sec   flush: %.3f sec\n", 2 * n / (t_find / 1e9), t_flush / 1e9);
+  printf("merges: %ld  merged keys: %ld  stalled inserts: %ld\n", merges, merged, stalls);
+  printf("reads: %ld  writes: %ld  device time: %.3f sec (modeled)\n",
+         jdisk_reads(jd), jdisk_writes(jd), jdisk_device_time(jd));
+  printf("%s: %d errors\n", (errors == 0) ? "OK" : "FAILED", errors);
+  b_tree_detach(tree);
+  exit(errors != 0);
+}
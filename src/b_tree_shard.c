@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "b_tree_shard.h"
+
+/* See include/b_tree_shard.h.
+
+   Each shard has a queue of requests and a worker thread.  Callers put requests
+   on the queue and wait on a Batch, which counts down as workers finish them.
+   The worker takes the whole queue at once and runs it with the shard's lock
+   held; the lock also covers value reads and cursors, since a jdisk is not
+   safe to use from two threads. */
+
+#define OP_INSERT (0)
+#define OP_FIND   (1)
+#define OP_READ   (2)
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int left;
+} Batch;
+
+typedef struct request {
+  int op;
+  void *key;
+  void *record;
+  unsigned int lba;           /* In: the lba for OP_READ.  Out: the result */
+  int rv;
+  Batch *batch;
+  struct request *next;
+} Request;
+
+typedef struct {
+  void *tree;
+  pthread_mutex_t lock;       /* Held while the tree or its jdisk is in use */
+  pthread_mutex_t qlock;      /* Protects the queue */
+  pthread_cond_t qcond;
+  Request *head;
+  Request *tail;
+  int stop;
+  pthread_t tid;
+} Shard;
+
+typedef struct {
+  int n;
+  int partition;
+  int key_size;
+  unsigned char **splits;     /* n-1 of them, for RANGE */
+  Shard *s;
+} Shards;
+
+typedef struct {
+  Shards *sh;
+  void **cursors;
+  unsigned char *keys;        /* Each shard's next key, key_size apart */
+  unsigned int *lbas;
+  int *valid;
+} Shard_Cursor;
+
+/* ---------------------------------------------------------------- */
+
+static void *worker(void *arg)
+{
+  Shard *s;
+  Request *r, *next;
+  Batch *b;
+
+  s = (Shard *) arg;
+  while (1) {
+    pthread_mutex_lock(&s->qlock);
+    while (s->head == NULL && !s->stop) pthread_cond_wait(&s->qcond, &s->qlock);
+    if (s->head == NULL) {
+      pthread_mutex_unlock(&s->qlock);
+      return NULL;
+    }
+    r = s->head;
+    s->head = NULL;
+    s->tail = NULL;
+    pthread_mutex_unlock(&s->qlock);
+
+    pthread_mutex_lock(&s->lock);
+    for (; r != NULL; r = next) {
+      next = r->next;
+      switch (r->op) {
+        case OP_INSERT: r->lba = b_tree_insert(s->tree, r->key, r->record); break;
+        case OP_FIND:   r->lba = b_tree_find(s->tree, r->key); break;
+        case OP_READ:   r->rv = b_tree_read(s->tree, r->lba, r->record); break;
+      }
+      b = r->batch;
+      pthread_mutex_lock(&b->lock);
+      b->left--;
+      if (b->left == 0) pthread_cond_signal(&b->cond);
+      pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+static void enqueue(Shard *s, Request *r)
+{
+  r->next = NULL;
+  pthread_mutex_lock(&s->qlock);
+  if (s->tail == NULL) {
+    s->head = r;
+  } else {
+    s->tail->next = r;
+  }
+  s->tail = r;
+  pthread_cond_signal(&s->qcond);
+  pthread_mutex_unlock(&s->qlock);
+}
+
+static void batch_init(Batch *b, int n)
+{
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->cond, NULL);
+  b->left = n;
+}
+
+static void batch_wait(Batch *b)
+{
+  pthread_mutex_lock(&b->lock);
+  while (b->left > 0) pthread_cond_wait(&b->cond, &b->lock);
+  pthread_mutex_unlock(&b->lock);
+  pthread_mutex_destroy(&b->lock);
+  pthread_cond_destroy(&b->cond);
+}
+
+/* Runs one request on one shard and waits for it */
+
+static void run_one(Shards *sh, int shard, Request *r)
+{
+  Batch b;
+
+  batch_init(&b, 1);
+  r->batch = &b;
+  enqueue(sh->s + shard, r);
+  batch_wait(&b);
+}
+
+/* ---------------------------------------------------------------- */
+/* Manifest and setup */
+
+static void put_hex(FILE *f, unsigned char *k, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++) fprintf(f, "%02x", k[i]);
+}
+
+static int get_hex(char *s, unsigned char *k, int len)
+{
+  int i;
+  unsigned int x;
+
+  if (strlen(s) != (size_t) (2 * len)) return -1;
+  for (i = 0; i < len; i++) {
+    if (sscanf(s + 2*i, "%2x", &x) != 1) return -1;
+    k[i] = x;
+  }
+  return 0;
+}
+
+static char *shard_file(char *base, int i)
+{
+  char *fn;
+
+  fn = (char *) malloc(strlen(base) + 20);
+  sprintf(fn, "%s.%d", base, i);
+  return fn;
+}
+
+static void start(Shards *sh)
+{
+  Shard *s;
+  int i;
+
+  for (i = 0; i < sh->n; i++) {
+    s = sh->s + i;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->qlock, NULL);
+    pthread_cond_init(&s->qcond, NULL);
+    s->head = NULL;
+    s->tail = NULL;
+    s->stop = 0;
+    pthread_create(&s->tid, NULL, worker, s);
+  }
+}
+
+static Shards *new_shards(int n, int partition)
+{
+  Shards *sh;
+
+  sh = (Shards *) malloc(sizeof(Shards));
+  sh->n = n;
+  sh->partition = partition;
+  sh->splits = (unsigned char **) calloc(n, sizeof(unsigned char *));
+  sh->s = (Shard *) calloc(n, sizeof(Shard));
+  return sh;
+}
+
+static void free_shards(Shards *sh, int detach)
+{
+  int i;
+
+  for (i = 0; i < sh->n; i++) {
+    if (detach && sh->s[i].tree != NULL) b_tree_detach(sh->s[i].tree);
+    free(sh->splits[i]);
+  }
+  free(sh->splits);
+  free(sh->s);
+  free(sh);
+}
+
+/* Undoes a create that failed partway: the shard files it made are removed as
+   well, so that the same base can be created again.  A file that was already
+   there, so that its create failed, isn't one of them. */
+
+static void remove_shards(Shards *sh, char *base)
+{
+  char *fn;
+  int i;
+
+  for (i = 0; i < sh->n; i++) {
+    if (sh->s[i].tree == NULL) continue;
+    b_tree_detach(sh->s[i].tree);
+    sh->s[i].tree = NULL;
+    fn = shard_file(base, i);
+    unlink(fn);
+    free(fn);
+  }
+  free_shards(sh, 0);
+}
+
+void *b_tree_shard_create(char *base, int nshards, long shard_size, int key_size, int key_type,
+                          int partition, void **splits)
+{
+  Shards *sh;
+  FILE *f;
+  char *fn;
+  int i;
+
+  if (nshards < 1 || (partition != B_TREE_SHARD_HASH && partition != B_TREE_SHARD_RANGE)) return NULL;
+  if (partition == B_TREE_SHARD_RANGE && nshards > 1 && splits == NULL) return NULL;
+
+  sh = new_shards(nshards, partition);
+  sh->key_size = key_size;
+  for (i = 0; i < nshards; i++) {
+    fn = shard_file(base, i);
+    sh->s[i].tree = b_tree_create_typed(fn, shard_size, key_size, key_type);
+    free(fn);
+    if (sh->s[i].tree == NULL) {
+      remove_shards(sh, base);
+      return NULL;
+    }
+  }
+  if (partition == B_TREE_SHARD_RANGE) {
+    for (i = 0; i < nshards-1; i++) {
+      if (i > 0 && b_tree_compare(sh->s[0].tree, splits[i-1], splits[i]) >= 0) {
+        remove_shards(sh, base);
+        return NULL;
+      }
+      sh->splits[i] = (unsigned char *) malloc(key_size);
+      memcpy(sh->splits[i], splits[i], key_size);
+    }
+  }
+
+  f = fopen(base, "w");
+  if (f == NULL) {
+    remove_shards(sh, base);
+    return NULL;
+  }
+  fprintf(f, "b_tree_shard\nshards %d\npartition %s\n", nshards,
+          (partition == B_TREE_SHARD_HASH) ? "hash" : "range");
+  if (partition == B_TREE_SHARD_RANGE) {
+    for (i = 0; i < nshards-1; i++) {
+      fprintf(f, "split ");
+      put_hex(f, sh->splits[i], key_size);
+      fprintf(f, "\n");
+    }
+  }
+  fclose(f);
+
+  start(sh);
+  return (void *) sh;
+}
+
+void *b_tree_shard_attach(char *base)
+{
+  Shards *sh;
+  FILE *f;
+  char word[100], part[100], hex[600], *fn;
+  int n, i, ok;
+
+  f = fopen(base, "r");
+  if (f == NULL) return NULL;
+  if (fscanf(f, "%99s shards %d partition %99s", word, &n, part) != 3 ||
+      strcmp(word, "b_tree_shard") != 0 || n < 1 ||
+      (strcmp(part, "hash") != 0 && strcmp(part, "range") != 0)) {
+    fprintf(stderr, "%s: not a b_tree_shard manifest\n", base);
+    fclose(f);
+    return NULL;
+  }
+
+  sh = new_shards(n, (strcmp(part, "hash") == 0) ? B_TREE_SHARD_HASH : B_TREE_SHARD_RANGE);
+  ok = 1;
+  for (i = 0; i < n && ok; i++) {
+    fn = shard_file(base, i);
+    sh->s[i].tree = b_tree_attach(fn);
+    free(fn);
+    ok = (sh->s[i].tree != NULL);
+  }
+  if (ok) {
+    sh->key_size = b_tree_key_size(sh->s[0].tree);
+    for (i = 0; i < n; i++) {
+      ok = ok && b_tree_key_size(sh->s[i].tree) == sh->key_size &&
+           b_tree_key_type(sh->s[i].tree) == b_tree_key_type(sh->s[0].tree);
+    }
+    if (sh->partition == B_TREE_SHARD_RANGE) {
+      for (i = 0; i < n-1 && ok; i++) {
+        sh->splits[i] = (unsigned char *) malloc(sh->key_size);
+        ok = (fscanf(f, " split %599s", hex) == 1 && get_hex(hex, sh->splits[i], sh->key_size) == 0);
+      }
+    }
+  }
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "%s: shards are missing or don't match the manifest\n", base);
+    free_shards(sh, 1);
+    return NULL;
+  }
+
+  start(sh);
+  return (void *) sh;
+}
+
+void b_tree_shard_close(void *shards)
+{
+  Shards *sh;
+  Shard *s;
+  int i;
+
+  sh = (Shards *) shards;
+  for (i = 0; i < sh->n; i++) {
+    s = sh->s + i;
+    pthread_mutex_lock(&s->qlock);
+    s->stop = 1;
+    pthread_cond_signal(&s->qcond);
+    pthread_mutex_unlock(&s->qlock);
+    pthread_join(s->tid, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->qlock);
+    pthread_cond_destroy(&s->qcond);
+  }
+  free_shards(sh, 1);
+}
+
+/* ---------------------------------------------------------------- */
+/* Routing */
+
+int b_tree_shard_count(void *shards)
+{
+  return ((Shards *) shards)->n;
+}
+
+void *b_tree_shard_tree(void *shards, int shard)
+{
+  return ((Shards *) shards)->s[shard].tree;
+}
+
+/* FNV-1a over the key bytes, then a final mix so that the low bits are good */
+
+int b_tree_shard_of(void *shards, void *key)
+{
+  Shards *sh;
+  unsigned long h;
+  unsigned char *k;
+  int i, lo, hi, mid;
+
+  sh = (Shards *) shards;
+  if (sh->n == 1) return 0;
+  if (sh->partition == B_TREE_SHARD_HASH) {
+    k = (unsigned char *) key;
+    h = 0xcbf29ce484222325UL;
+    for (i = 0; i < sh->key_size; i++) {
+      h ^= k[i];
+      h *= 0x100000001b3UL;
+    }
+    h ^= h >> 31;
+    return h % sh->n;
+  }
+
+  /* The number of splits <= key */
+  lo = 0;
+  hi = sh->n - 1;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (b_tree_compare(sh->s[0].tree, sh->splits[mid], key) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+unsigned int b_tree_shard_insert(void *shards, void *key, void *record)
+{
+  Request r;
+
+  r.op = OP_INSERT;
+  r.key = key;
+  r.record = record;
+  run_one((Shards *) shards, b_tree_shard_of(shards, key), &r);
+  return r.lba;
+}
+
+unsigned int b_tree_shard_find(void *shards, void *key)
+{
+  Request r;
+
+  r.op = OP_FIND;
+  r.key = key;
+  run_one((Shards *) shards, b_tree_shard_of(shards, key), &r);
+  return r.lba;
+}
+
+int b_tree_shard_read(void *shards, int shard, unsigned int lba, void *buf)
+{
+  Request r;
+
+  r.op = OP_READ;
+  r.lba = lba;
+  r.record = buf;
+  run_one((Shards *) shards, shard, &r);
+  return r.rv;
+}
+
+void b_tree_shard_insert_batch(void *shards, int n, void **keys, void **records, unsigned int *lbas)
+{
+  Shards *sh;
+  Request *r;
+  Batch b;
+  int i;
+
+  if (n <= 0) return;
+  sh = (Shards *) shards;
+  r = (Request *) malloc(sizeof(Request) * n);
+  batch_init(&b, n);
+  for (i = 0; i < n; i++) {
+    r[i].op = OP_INSERT;
+    r[i].key = keys[i];
+    r[i].record = records[i];
+    r[i].batch = &b;
+    enqueue(sh->s + b_tree_shard_of(shards, keys[i]), r + i);
+  }
+  batch_wait(&b);
+  if (lbas != NULL) {
+    for (i = 0; i < n; i++) lbas[i] = r[i].lba;
+  }
+  free(r);
+}
+
+/* ---------------------------------------------------------------- */
+/* Merged scan: one cursor per shard, and the smallest head goes next.  Shard
+   counts are small, so a linear pass beats keeping a heap. */
+
+static void advance(Shard_Cursor *c, int i)
+{
+  Shard *s;
+
+  s = c->sh->s + i;
+  pthread_mutex_lock(&s->lock);
+  c->valid[i] = b_tree_cursor_next(c->cursors[i], c->keys + i * c->sh->key_size, c->lbas + i);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void *b_tree_shard_cursor(void *shards, void *start_key)
+{
+  Shards *sh;
+  Shard_Cursor *c;
+  int i;
+
+  sh = (Shards *) shards;
+  c = (Shard_Cursor *) malloc(sizeof(Shard_Cursor));
+  c->sh = sh;
+  c->cursors = (void **) malloc(sizeof(void *) * sh->n);
+  c->keys = (unsigned char *) malloc(sh->key_size * sh->n);
+  c->lbas = (unsigned int *) malloc(sizeof(unsigned int) * sh->n);
+  c->valid = (int *) malloc(sizeof(int) * sh->n);
+  for (i = 0; i < sh->n; i++) {
+    pthread_mutex_lock(&sh->s[i].lock);
+    c->cursors[i] = b_tree_cursor(sh->s[i].tree, start_key);
+    pthread_mutex_unlock(&sh->s[i].lock);
+    advance(c, i);
+  }
+  return (void *) c;
+}
+
+int b_tree_shard_cursor_next(void *cursor, void *key, int *shard, unsigned int *lba)
+{
+  Shard_Cursor *c;
+  int i, best, ks;
+
+  c = (Shard_Cursor *) cursor;
+  ks = c->sh->key_size;
+  best = -1;
+  for (i = 0; i < c->sh->n; i++) {
+    if (!c->valid[i]) continue;
+    if (best < 0 || b_tree_compare(c->sh->s[0].tree, c->keys + i * ks, c->keys + best * ks) < 0) best = i;
+  }
+  if (best < 0) return 0;
+
+  memcpy(key, c->keys + best * ks, ks);
+  *lba = c->lbas[best];
+  if (shard != NULL) *shard = best;
+  advance(c, best);
+  return 1;
+}
+
+void b_tree_shard_cursor_free(void *cursor)
+{
+  Shard_Cursor *c;
+  int i;
+
+  c = (Shard_Cursor *) cursor;
+  for (i = 0; i < c->sh->n; i++) b_tree_cursor_free(c->cursors[i]);
+  free(c->cursors);
+  free(c->keys);
+  free(c->lbas);
+  free(c->valid);
+  free(c);
+}
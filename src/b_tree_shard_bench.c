@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "b_tree_shard.h"
+
+/* Ingest throughput of the sharded front-end.
+
+   Creates a sharded tree with 64-bit integer keys, inserts n keys in batches,
+   then checks that every key can be found and reads back its value, and that a
+   merged scan returns them all in order.  Run it with -S 1, 2, 4, ... to see
+   how ingest scales with shards (and so with cores). */
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: b_tree_shard_bench base [options]\n");
+  fprintf(stderr, "   -S shards                       (default 4)\n");
+  fprintf(stderr, "   -n keys                         (default 100000)\n");
+  fprintf(stderr, "   -b batch                        keys per b_tree_shard_insert_batch() (default 1000)\n");
+  fprintf(stderr, "   -p hash|range                   partitioning (default hash)\n");
+  fprintf(stderr, "   -s seed                         (default 1)\n");
+  fprintf(stderr, "base and base.0, base.1, ... are scratch -- they are removed and recreated.\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long mix64(unsigned long x)
+{
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9UL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebUL;
+  x ^= x >> 31;
+  return x;
+}
+
+int main(int argc, char **argv)
+{
+  char *base, fn[1000];
+  int nshards, batch, partition, i, shard, errors;
+  long n, k, j, seed, count;
+  unsigned long *keys, *splits, key, prev;
+  unsigned char *vals, buf[JDISK_SECTOR_SIZE];
+  void **kp, **vp, **sp, *sh, *c;
+  unsigned int lba;
+  double t0, t_insert, t_find, t_scan;
+
+  if (argc < 2 || argv[1][0] == '-') usage(NULL);
+  base = argv[1];
+  nshards = 4;
+  n = 100000;
+  batch = 1000;
+  partition = B_TREE_SHARD_HASH;
+  seed = 1;
+  for (i = 2; i < argc; i += 2) {
+    if (argv[i][0] != '-' || strlen(argv[i]) != 2 || i+1 >= argc) usage(NULL);
+    switch (argv[i][1]) {
+      case 'S': if (sscanf(argv[i+1], "%d", &nshards) != 1 || nshards < 1) usage("bad -S"); break;
+      case 'n': if (sscanf(argv[i+1], "%ld", &n) != 1 || n < 1) usage("bad -n"); break;
+      case 'b': if (sscanf(argv[i+1], "%d", &batch) != 1 || batch < 1) usage("bad -b"); break;
+      case 'p': if (strcmp(argv[i+1], "hash") == 0) {
+                  partition = B_TREE_SHARD_HASH;
+                } else if (strcmp(argv[i+1], "range") == 0) {
+                  partition = B_TREE_SHARD_RANGE;
+                } else {
+                  usage("bad -p");
+                }
+                break;
+      case 's': if (sscanf(argv[i+1], "%ld", &seed) != 1) usage("bad -s"); break;
+      default: usage(NULL);
+    }
+  }
+
+  /* Scrambled ids, so keys are distinct and spread over the key space */
+  keys = (unsigned long *) malloc(sizeof(unsigned long) * n);
+  vals = (unsigned char *) calloc(n, 32);
+  for (k = 0; k < n; k++) {
+    keys[k] = mix64(k + seed * n);
+    sprintf((char *) vals + 32 * k, "%lu", keys[k]);
+  }
+
+  /* Range splits cut the key space evenly */
+  splits = (unsigned long *) malloc(sizeof(unsigned long) * nshards);
+  sp = (void **) malloc(sizeof(void *) * nshards);
+  for (i = 0; i < nshards-1; i++) {
+    splits[i] = (0xffffffffffffffffUL / nshards) * (i+1);
+    sp[i] = splits + i;
+  }
+
+  unlink(base);
+  for (i = 0; i < nshards; i++) {
+    sprintf(fn, "%s.%d", base, i);
+    unlink(fn);
+  }
+  sh = b_tree_shard_create(base, nshards, (2 * n / nshards + 2 * n / 10 + 64) * JDISK_SECTOR_SIZE,
+                           8, B_TREE_KEY_U64, partition, sp);
+  if (sh == NULL) {
+    fprintf(stderr, "Couldn't create the shards -- calling perror()\n");
+    perror(base);
+    exit(1);
+  }
+
+  /* The value is copied out by the insert, but records must be a full sector */
+  kp = (void **) malloc(sizeof(void *) * batch);
+  vp = (void **) malloc(sizeof(void *) * batch);
+  t0 = now();
+  for (k = 0; k < n; k += batch) {
+    for (j = 0; j < batch && k + j < n; j++) {
+      kp[j] = keys + k + j;
+      vp[j] = malloc(JDISK_SECTOR_SIZE);
+      memset(vp[j], 0, JDISK_SECTOR_SIZE);
+      strcpy((char *) vp[j], (char *) vals + 32 * (k + j));
+    }
+    b_tree_shard_insert_batch(sh, j, kp, vp, NULL);
+    for (j = 0; j < batch && k + j < n; j++) free(vp[j]);
+  }
+  t_insert = now() - t0;
+
+  errors = 0;
+  t0 = now();
+  for (k = 0; k < n; k++) {
+    lba = b_tree_shard_find(sh, keys + k);
+    if (lba == 0) {
+      errors++;
+      continue;
+    }
+    b_tree_shard_read(sh, b_tree_shard_of(sh, keys + k), lba, buf);
+    if (strcmp((char *) buf, (char *) vals + 32 * k) != 0) errors++;
+  }
+  t_find = now() - t0;
+
+  t0 = now();
+  c = b_tree_shard_cursor(sh, NULL);
+  count = 0;
+  prev = 0;
+  while (b_tree_shard_cursor_next(c, &key, &shard, &lba)) {
+    if (count > 0 && key <= prev) errors++;
+    if (partition == B_TREE_SHARD_RANGE && shard != b_tree_shard_of(sh, &key)) errors++;
+    prev = key;
+    count++;
+  }
+  b_tree_shard_cursor_free(c);
+  t_scan = now() - t0;
+  if (count != n) errors++;
+
+  printf("shards: %d  partition: %s  keys: %ld  batch: %d\n", nshards,
+         (partition == B_TREE_SHARD_HASH) ? "hash" : "range", n, batch);
+  printf("insert: %.0f ops/sec   find+read: %.0f ops/sec   scan: %.0f keys/sec\n",
+         n / t_insert, n / t_find, count / t_scan);
+  for (i = 0; i < nshards; i++) {
+    printf("shard %d: %ld reads  %ld writes\n", i, jdisk_reads(b_tree_disk(b_tree_shard_tree(sh, i))),
+           jdisk_writes(b_tree_disk(b_tree_shard_tree(sh, i))));
+  }
+  printf("%s: %d errors\n", (errors == 0) ? "OK" : "FAILED", errors);
+  b_tree_shard_close(sh);
+  exit(errors != 0);
+}
@@ -9,33 +9,59 @@
 
 void usage(char *s)
 {
-  fprintf(stderr, "usage: b_tree_test file [CREATE file_size key_size]\n");
+  fprintf(stderr, "usage: b_tree_test file [CREATE file_size key_size|u32|u64|u128 [compress] [alloc] [bstar|topdown|buffered] [bloom] [counted]]\n");
   if (s != NULL) fprintf(stderr, "%s\n", s);
   exit(1);
 }
 
+/* For integer key types, the key on the line is a number: see b_tree_parse_key() */
+
 int main(int argc, char **argv)
 {
   void *bp, *jd;
-  int key_size, record_size, m, i;
+  int key_size, key_type, flags, m, i;
   unsigned long file_size;
+  long k;
   unsigned int lba;
   char line[BUFSIZE];
   char fi[BUFSIZE];
   char key[BUFSIZE];
   char val[BUFSIZE];
 
-  if (argc != 2 && argc != 5) usage(NULL);
-  if (argc == 5) {
+  if (argc != 2 && (argc < 5 || argc > 10)) usage(NULL);
+  if (argc >= 5) {
     if (strcmp(argv[2], "CREATE") != 0) usage(NULL);
-    key_size = atoi(argv[4]);
-    record_size = JDISK_SECTOR_SIZE;
+    flags = 0;
+    for (i = 5; i < argc; i++) {
+      if (strcmp(argv[i], "compress") == 0) {
+        flags |= B_TREE_COMPRESS;
+      } else if (strcmp(argv[i], "alloc") == 0) {
+        flags |= B_TREE_ALLOC;
+      } else if (strcmp(argv[i], "bstar") == 0) {
+        flags |= B_TREE_BSTAR;
+      } else if (strcmp(argv[i], "topdown") == 0) {
+        flags |= B_TREE_TOPDOWN;
+      } else if (strcmp(argv[i], "buffered") == 0) {
+        flags |= B_TREE_BUFFERED;
+      } else if (strcmp(argv[i], "bloom") == 0) {
+        flags |= B_TREE_BLOOM;
+      } else if (strcmp(argv[i], "counted") == 0) {
+        flags |= B_TREE_COUNTED;
+      } else {
+        usage(NULL);
+      }
+    }
+    key_type = B_TREE_KEY_BYTES;
+    if (strcmp(argv[4], "u32") == 0) key_type = B_TREE_KEY_U32;
+    if (strcmp(argv[4], "u64") == 0) key_type = B_TREE_KEY_U64;
+    if (strcmp(argv[4], "u128") == 0) key_type = B_TREE_KEY_U128;
+    key_size = (key_type == B_TREE_KEY_BYTES) ? atoi(argv[4]) : atoi(argv[4]+1) / 8;
     if (key_size < 4 || key_size > 254) usage("key_size must be between 4 and 254\n");
     if (sscanf(argv[3], "%lu", &file_size) != 1 || file_size == 0 ||
         file_size % JDISK_SECTOR_SIZE != 0) {
       usage("bad file size.\n");
     }
-    bp = b_tree_create(argv[1], file_size, key_size);
+    bp = b_tree_create_flags(argv[1], file_size, key_size, key_type, flags);
     if (bp == NULL) {
       fprintf(stderr, "Couldn't create b_tree -- calling perror()\n");
       perror(argv[1]);
@@ -51,35 +77,70 @@ int main(int argc, char **argv)
     }
     jd = b_tree_disk(bp);
     key_size = b_tree_key_size(bp);
+    key_type = b_tree_key_type(bp);
     printf("Attached to %s.  FS: %lu  -  KS: %d\n", argv[1], jdisk_size(jd), key_size);
   }
   while (fgets((char *) line, BUFSIZE, stdin) != NULL) {
     m = sscanf(line, "%s %s %s", fi, key, val);
     if (m == 0) {
-    } else if ((m == 1 && strcmp(fi, "P") != 0) 
-                      || (m == 2 && strcmp(fi, "F") != 0)
+    } else if ((m == 1 && strcmp(fi, "P") != 0 && strcmp(fi, "C") != 0) 
+                      || (m == 2 && strcmp(fi, "F") != 0 && strcmp(fi, "R") != 0
+                                 && strcmp(fi, "E") != 0 && strcmp(fi, "L") != 0
+                                 && strcmp(fi, "K") != 0 && strcmp(fi, "S") != 0)
                       || (m == 3 && strcmp(fi, "I") != 0)) {
-      printf("Line must be 'I key val' or 'F key'\n");
+      printf("Line must be 'I key val', 'F key', 'R key', 'K key', 'S k', 'E file', 'L file', 'P' or 'C'\n");
     } else if (strcmp(fi, "P") == 0) {
        b_tree_print_tree(bp);
+    } else if (strcmp(fi, "C") == 0) {
+      if (b_tree_compact_begin(bp) != 0) {
+        printf("Compaction failed\n");
+      } else {
+        while (b_tree_compact_step(bp, 64) > 0) ;
+        printf("Compacted\n");
+      }
+    } else if (strcmp(fi, "E") == 0) {
+      printf("Export return value: %ld\n", b_tree_export(bp, key));
+    } else if (strcmp(fi, "L") == 0) {
+      printf("Import return value: %ld\n", b_tree_import(bp, key));
+    } else if (strcmp(fi, "S") == 0) {
+      /* Selects the k-th key, from 0 */
+      k = atol(key);
+      m = b_tree_select(bp, k, key, &lba);
+      if (m != 1) {
+        printf("Select return value: %d\n", m);
+      } else {
+        b_tree_format_key(key, key_size, key_type, val);
+        printf("Select: %s at lba %u\n", val, lba);
+      }
+    } else if (strcmp(fi, "K") == 0) {
+      if (!b_tree_parse_key(key, key_size, key_type, key)) {
+        printf("Key too big\n");
+      } else {
+        printf("Rank: %ld\n", b_tree_rank(bp, key));
+      }
     } else if (strcmp(fi, "I") == 0) {
-      if (strlen(key) > key_size) {
+      if (!b_tree_parse_key(key, key_size, key_type, key)) {
         printf("Key too big\n");
       } else if (strlen(val) > JDISK_SECTOR_SIZE) {
         printf("Val too big\n");
       } else {
-        for (i = strlen(key); i < key_size; i++) key[i] = '\0';
         for (i = strlen(val); i < JDISK_SECTOR_SIZE; i++) val[i] = '\0';
         lba = b_tree_insert(bp, key, val);
         printf("Insert return value: %u\n", lba);
       }
     } else {
-      if (strlen(key) > key_size) {
+      if (!b_tree_parse_key(key, key_size, key_type, key)) {
         printf("Key too big\n");
       } else {
-        for (i = strlen(key); i < key_size; i++) key[i] = '\0';
         lba = b_tree_find(bp, key);
-        printf("Find return value: %d\n", lba);
+        if (strcmp(fi, "F") == 0) {
+          printf("Find return value: %d\n", lba);
+        } else if (lba == 0 || b_tree_read(bp, lba, val) != 0) {
+          printf("Not found\n");
+        } else {
+          val[JDISK_SECTOR_SIZE] = '\0';
+          printf("Read: %s\n", val);
+        }
       }
     }
   }
@@ -3,22 +3,106 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <math.h>
 #include "jdisk.h"
 
+/* Parameters of the modeled devices, in nanoseconds. */
+
+#define HDD_SETTLE     (500000.0)       /* Head settle (~0.5 ms) on any non-sequential access */
+#define HDD_FULL_SEEK  (8000000.0)      /* Seek across the whole disk */
+#define HDD_ROTATION   (4170000.0)      /* Half a revolution at 7200 rpm */
+#define HDD_TRANSFER   (6800.0)         /* One sector at ~150 MB/s */
+
+#define NVME_READ      (80000.0)        /* Read latency at queue depth 1 */
+#define NVME_WRITE     (20000.0)        /* Write latency (absorbed by the device buffer) */
+#define NVME_TRANSFER  (400.0)          /* One sector at ~2.5 GB/s */
+#define NVME_QD        (32)             /* Default queue depth (sectors in flight per request) */
+
 typedef struct {
   unsigned long size;  
   int fd;
   char *fn;
   int reads;
   int writes;
+  int model;           /* JDISK_LATENCY_xxx */
+  double param;        /* Fixed: microseconds per I/O.  NVMe: queue depth */
+  unsigned int head;   /* Last lba touched, for the HDD model */
+  double device_ns;    /* Modeled device time, accumulated over all I/O */
 } Disk;
 
+/* Picks the latency model from the JDISK_LATENCY environment variable:
+   none, fixed[:us], hdd, or nvme[:queue_depth].  The default is fixed at JDISK_DELAY. */
+
+static void default_latency(Disk *d)
+{
+  char *s, *colon;
+  double param;
+
+  d->head = 0;
+  d->device_ns = 0;
+  d->model = JDISK_LATENCY_FIXED;
+  d->param = JDISK_DELAY;
+
+  s = getenv("JDISK_LATENCY");
+  if (s == NULL) return;
+  colon = strchr(s, ':');
+  param = (colon == NULL) ? -1 : atof(colon+1);
+  if (strncmp(s, "none", 4) == 0) {
+    jdisk_set_latency(d, JDISK_LATENCY_NONE, 0);
+  } else if (strncmp(s, "fixed", 5) == 0) {
+    jdisk_set_latency(d, JDISK_LATENCY_FIXED, (param < 0) ? JDISK_DELAY : param);
+  } else if (strncmp(s, "hdd", 3) == 0) {
+    jdisk_set_latency(d, JDISK_LATENCY_HDD, 0);
+  } else if (strncmp(s, "nvme", 4) == 0) {
+    jdisk_set_latency(d, JDISK_LATENCY_NVME, (param < 1) ? NVME_QD : param);
+  } else {
+    fprintf(stderr, "jdisk: unknown JDISK_LATENCY %s -- using fixed\n", s);
+  }
+}
+
+/* Modeled time for an I/O of nsectors starting at lba.  Nothing sleeps: the
+   time is only accounted, so CPU time and device time can be reported apart. */
+
+static double model_time(Disk *d, unsigned int lba, int nsectors, int is_write)
+{
+  double t, dist;
+  int waves;
+
+  switch (d->model) {
+    case JDISK_LATENCY_FIXED:
+      return d->param * 1000.0 * nsectors;
+
+    case JDISK_LATENCY_HDD:
+      t = HDD_TRANSFER * nsectors;
+      if (lba != d->head + 1 && lba != d->head) {
+        dist = (lba > d->head) ? lba - d->head : d->head - lba;
+        t += HDD_SETTLE + HDD_ROTATION
+           + HDD_FULL_SEEK * sqrt(dist / (double) (d->size / JDISK_SECTOR_SIZE));
+      }
+      d->head = lba + nsectors - 1;
+      return t;
+
+    case JDISK_LATENCY_NVME:
+      /* A multi-sector request is split over the queue: each wave of
+         up to param sectors costs one device latency.  jdisk calls are
+         synchronous, so separate requests never overlap: the queue depth
+         only helps multi-sector transfers (jdisk_read_many), and a
+         single-sector I/O always pays the queue-depth-1 latency. */
+      waves = (nsectors + (int) d->param - 1) / (int) d->param;
+      return waves * (is_write ? NVME_WRITE : NVME_READ) + NVME_TRANSFER * nsectors;
+
+    default:
+      return 0;
+  }
+}
+
+/* The file is sized with ftruncate(), so it starts out sparse and reads as
+   zeros: creating a disk takes the same time whatever its size. */
+
 void *jdisk_create(char *fn, unsigned long size)
 {
   int fd;
   Disk *d;
-  char buf[JDISK_SECTOR_SIZE];
-  long i;
   
   if (size <= 0 || size % JDISK_SECTOR_SIZE != 0) return NULL;
   if (size / JDISK_SECTOR_SIZE > 0xffffffff) return NULL;
@@ -26,8 +110,10 @@ void *jdisk_create(char *fn, unsigned long size)
   fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0666);
   if (fd < 0) return NULL;
 
-  for (i = 0; i < size; i += JDISK_SECTOR_SIZE) {
-    write(fd, buf, JDISK_SECTOR_SIZE);
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    unlink(fn);
+    return NULL;
   }
   
   d = (Disk *) malloc(sizeof(Disk));
@@ -36,6 +122,7 @@ void *jdisk_create(char *fn, unsigned long size)
   d->fn = strdup(fn);
   d->reads = 0;
   d->writes = 0;
+  default_latency(d);
   return (void *) d;
 }
 
@@ -56,6 +143,7 @@ void *jdisk_attach(char *fn)
   d->size = lseek(fd, zero, SEEK_END);
   d->reads = 0;
   d->writes = 0;
+  default_latency(d);
   if (d->size % JDISK_SECTOR_SIZE != 0) {
     fprintf(stderr, "jdisk_attach: Disk size needs to be a multiple of %d\n",
        JDISK_SECTOR_SIZE);
@@ -64,6 +152,21 @@ void *jdisk_attach(char *fn)
   return (void *) d;
 }
 
+/* A second handle on the same file, with its own file position and counters,
+   so that another thread can read the disk.  It keeps jd's latency model. */
+
+void *jdisk_reopen(void *jd)
+{
+  Disk *d, *nd;
+
+  d = (Disk *) jd;
+  nd = (Disk *) jdisk_attach(d->fn);
+  if (nd == NULL) return NULL;
+  nd->model = d->model;
+  nd->param = d->param;
+  return (void *) nd;
+}
+
 int jdisk_unattach(void *vd)
 {
   Disk *d;
@@ -83,28 +186,73 @@ unsigned long jdisk_size(void *vd)
   return d->size;
 }
 
+/* Extends the file, sparsely, like jdisk_create().  Other handles on the disk
+   (jdisk_reopen()) pick up the new size when they first go past the old one. */
+
+int jdisk_grow(void *jd, unsigned long size)
+{
+  Disk *d;
+
+  d = (Disk *) jd;
+  if (size <= d->size) return 0;
+  if (size % JDISK_SECTOR_SIZE != 0 || size / JDISK_SECTOR_SIZE > 0xffffffff) return -1;
+  if (ftruncate(d->fd, size) != 0) return -1;
+  d->size = size;
+  return 0;
+}
+
+/* Whether sectors [lba, lba+n) are on the disk, looking at the file again if
+   they seem not to be, in case another handle grew it */
+
+static int in_range(Disk *d, unsigned int lba, unsigned long n)
+{
+  off_t end;
+
+  if (lba + n <= d->size / JDISK_SECTOR_SIZE) return 1;
+  end = lseek(d->fd, 0, SEEK_END);
+  if (end > 0 && end % JDISK_SECTOR_SIZE == 0 && end > (off_t) d->size) d->size = end;
+  return lba + n <= d->size / JDISK_SECTOR_SIZE;
+}
+
 int jdisk_read(void *jd, unsigned int lba, void *buf)
 {
   Disk *d;
 
   d = (Disk *) jd;
 
-  if (lba >= (d->size / JDISK_SECTOR_SIZE)) return -2;
-  lseek(d->fd, lba * JDISK_SECTOR_SIZE, SEEK_SET);
-  usleep(JDISK_DELAY);
+  if (!in_range(d, lba, 1)) return -2;
+  lseek(d->fd, (off_t) lba * JDISK_SECTOR_SIZE, SEEK_SET);
+  d->device_ns += model_time(d, lba, 1, 0);
   if (read(d->fd, buf, JDISK_SECTOR_SIZE) != JDISK_SECTOR_SIZE) return -1;
   d->reads++;
   return 0;
 }
 
+/* Reads n consecutive sectors with one request, which the latency models charge
+   as one I/O.  Each sector counts as a read. */
+
+int jdisk_read_many(void *jd, unsigned int lba, int n, void *buf)
+{
+  Disk *d;
+
+  d = (Disk *) jd;
+
+  if (n < 1 || !in_range(d, lba, n)) return -2;
+  lseek(d->fd, (off_t) lba * JDISK_SECTOR_SIZE, SEEK_SET);
+  d->device_ns += model_time(d, lba, n, 0);
+  if (read(d->fd, buf, (long) n * JDISK_SECTOR_SIZE) != (long) n * JDISK_SECTOR_SIZE) return -1;
+  d->reads += n;
+  return 0;
+}
+
 int jdisk_write(void *jd, unsigned int lba, void *buf)
 {
   Disk *d;
 
   d = (Disk *)jd;
-  if (lba >= (d->size / JDISK_SECTOR_SIZE)) return -2;
-  lseek(d->fd, lba * JDISK_SECTOR_SIZE, SEEK_SET);
-  usleep(JDISK_DELAY);
+  if (!in_range(d, lba, 1)) return -2;
+  lseek(d->fd, (off_t) lba * JDISK_SECTOR_SIZE, SEEK_SET);
+  d->device_ns += model_time(d, lba, 1, 1);
   if (write(d->fd, buf, JDISK_SECTOR_SIZE) != JDISK_SECTOR_SIZE) return -1;
   d->writes++;
   return 0;
@@ -127,3 +275,24 @@ long jdisk_writes(void *jd)
   return d->writes;
 }
 
+
+int jdisk_set_latency(void *jd, int model, double param)
+{
+  Disk *d;
+
+  d = (Disk *)jd;
+  if (model < JDISK_LATENCY_NONE || model > JDISK_LATENCY_NVME) return -1;
+  if (model == JDISK_LATENCY_FIXED && param < 0) return -1;
+  if (model == JDISK_LATENCY_NVME && param < 1) return -1;
+  d->model = model;
+  d->param = param;
+  return 0;
+}
+
+double jdisk_device_time(void *jd)
+{
+  Disk *d;
+
+  d = (Disk *)jd;
+  return d->device_ns / 1e9;
+}
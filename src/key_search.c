@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "key_search.h"
+
+/* In-node search kernels.  See include/key_search.h.
+
+   linear: the loop b_tree_find() used to run, one memcmp per key.
+   binary: binary search with memcmp.
+   sse42:  binary search, comparing 16 bytes per step with pcmpestri.
+   avx2:   4- and 8-byte keys only.  Byte-swaps 8 (or 4) keys per vector into
+           native integers and counts how many are below the probe.
+
+   The native kernels are for trees with integer key types, whose keys are
+   stored in native byte order and compared as unsigned numbers:
+
+   native:      binary search on 4-, 8- or 16-byte integers.
+   native_avx2: the avx2 kernel without the byte swaps.
+
+   The SIMD kernels are compiled with target attributes and picked at run time,
+   so the file builds without -mavx2 and the binary runs on any x86-64. */
+
+int key_search_linear(const unsigned char *keys, int nkeys, int key_size,
+                      const unsigned char *probe, int *equal)
+{
+  int i, c;
+
+  for (i = 0; i < nkeys; i++) {
+    c = memcmp(probe, keys + i * key_size, key_size);
+    if (c <= 0) {
+      *equal = (c == 0);
+      return i;
+    }
+  }
+  *equal = 0;
+  return nkeys;
+}
+
+int key_search_binary(const unsigned char *keys, int nkeys, int key_size,
+                      const unsigned char *probe, int *equal)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = nkeys;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (memcmp(keys + mid * key_size, probe, key_size) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *equal = (lo < nkeys && memcmp(keys + lo * key_size, probe, key_size) == 0);
+  return lo;
+}
+
+#define NATIVE_SEARCH(type) \
+  { \
+    type p, k; \
+    memcpy(&p, probe, sizeof(type)); \
+    lo = 0; \
+    hi = nkeys; \
+    while (lo < hi) { \
+      mid = (lo + hi) / 2; \
+      memcpy(&k, keys + mid * sizeof(type), sizeof(type)); \
+      if (k < p) { \
+        lo = mid + 1; \
+      } else { \
+        hi = mid; \
+      } \
+    } \
+    if (lo < nkeys) memcpy(&k, keys + lo * sizeof(type), sizeof(type)); \
+    *equal = (lo < nkeys && k == p); \
+  }
+
+int key_search_native(const unsigned char *keys, int nkeys, int key_size,
+                      const unsigned char *probe, int *equal)
+{
+  int lo, hi, mid;
+
+  switch (key_size) {
+    case 4:  NATIVE_SEARCH(unsigned int); break;
+    case 8:  NATIVE_SEARCH(unsigned long); break;
+    default: NATIVE_SEARCH(unsigned __int128); break;
+  }
+  return lo;
+}
+
+/* ---------------------------------------------------------------- */
+
+/* memcmp, 16 bytes at a time.  pcmpestri finds the first differing byte. */
+
+__attribute__((target("sse4.2")))
+static inline int cmp_sse42(const unsigned char *a, const unsigned char *b, int len)
+{
+  __m128i x, y;
+  int off, n, i;
+
+  for (off = 0; off < len; off += 16) {
+    n = (len - off < 16) ? len - off : 16;
+    x = _mm_loadu_si128((const __m128i *) (a + off));
+    y = _mm_loadu_si128((const __m128i *) (b + off));
+    i = _mm_cmpestri(x, n, y, n, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_EACH |
+                                 _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+    if (i < n) return (int) a[off+i] - (int) b[off+i];
+  }
+  return 0;
+}
+
+__attribute__((target("sse4.2")))
+int key_search_sse42(const unsigned char *keys, int nkeys, int key_size,
+                     const unsigned char *probe, int *equal)
+{
+  unsigned char p[256 + KEY_SEARCH_PAD];
+  int lo, hi, mid;
+
+  /* The probe belongs to the caller, who owes us no padding */
+  memcpy(p, probe, key_size);
+  lo = 0;
+  hi = nkeys;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cmp_sse42(keys + mid * key_size, p, key_size) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *equal = (lo < nkeys && cmp_sse42(keys + lo * key_size, p, key_size) == 0);
+  return lo;
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Keys are sorted, so the number of keys below the probe is the answer.  Once a
+   vector has a key >= probe, we can stop.  bswap is 0 for native keys; it is a
+   constant at every call, so the swaps compile away. */
+
+#define SWAP64(x) (bswap ? __builtin_bswap64(x) : (x))
+#define SWAP32(x) (bswap ? __builtin_bswap32(x) : (x))
+
+__attribute__((target("avx2")))
+static inline int search_u64_avx2(const unsigned char *keys, int nkeys, const unsigned char *probe,
+                                  int *equal, int bswap)
+{
+  unsigned long p, k;
+  __m256i vp, v, sign, swap;
+  int i, mask;
+
+  memcpy(&p, probe, 8);
+  p = SWAP64(p);
+  sign = _mm256_set1_epi64x(0x8000000000000000L);
+  vp = _mm256_set1_epi64x(p ^ 0x8000000000000000UL);
+  swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  for (i = 0; i + 4 <= nkeys; i += 4) {
+    v = _mm256_loadu_si256((const __m256i *) (keys + i * 8));
+    if (bswap) v = _mm256_shuffle_epi8(v, swap);
+    v = _mm256_xor_si256(v, sign);
+    mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vp, v)));
+    if (mask != 0xf) {
+      i += __builtin_popcount(mask);
+      break;
+    }
+  }
+  for (; i < nkeys; i++) {
+    memcpy(&k, keys + i * 8, 8);
+    if (SWAP64(k) >= p) break;
+  }
+  if (i < nkeys) {
+    memcpy(&k, keys + i * 8, 8);
+    *equal = (SWAP64(k) == p);
+  } else {
+    *equal = 0;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static inline int search_u32_avx2(const unsigned char *keys, int nkeys, const unsigned char *probe,
+                                  int *equal, int bswap)
+{
+  unsigned int p, k;
+  __m256i vp, v, sign, swap;
+  int i, mask;
+
+  memcpy(&p, probe, 4);
+  p = SWAP32(p);
+  sign = _mm256_set1_epi32(0x80000000);
+  vp = _mm256_set1_epi32(p ^ 0x80000000U);
+  swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  for (i = 0; i + 8 <= nkeys; i += 8) {
+    v = _mm256_loadu_si256((const __m256i *) (keys + i * 4));
+    if (bswap) v = _mm256_shuffle_epi8(v, swap);
+    v = _mm256_xor_si256(v, sign);
+    mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vp, v)));
+    if (mask != 0xff) {
+      i += __builtin_popcount(mask);
+      break;
+    }
+  }
+  for (; i < nkeys; i++) {
+    memcpy(&k, keys + i * 4, 4);
+    if (SWAP32(k) >= p) break;
+  }
+  if (i < nkeys) {
+    memcpy(&k, keys + i * 4, 4);
+    *equal = (SWAP32(k) == p);
+  } else {
+    *equal = 0;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+int key_search_avx2(const unsigned char *keys, int nkeys, int key_size,
+                    const unsigned char *probe, int *equal)
+{
+  if (key_size == 8) return search_u64_avx2(keys, nkeys, probe, equal, 1);
+  if (key_size == 4) return search_u32_avx2(keys, nkeys, probe, equal, 1);
+  return key_search_binary(keys, nkeys, key_size, probe, equal);
+}
+
+__attribute__((target("avx2")))
+int key_search_native_avx2(const unsigned char *keys, int nkeys, int key_size,
+                           const unsigned char *probe, int *equal)
+{
+  if (key_size == 8) return search_u64_avx2(keys, nkeys, probe, equal, 0);
+  if (key_size == 4) return search_u32_avx2(keys, nkeys, probe, equal, 0);
+  return key_search_native(keys, nkeys, key_size, probe, equal);
+}
+
+/* ---------------------------------------------------------------- */
+
+int key_search_supported(Key_Search f, int key_size)
+{
+  __builtin_cpu_init();
+  if (f == key_search_avx2) {
+    return (key_size == 4 || key_size == 8) && __builtin_cpu_supports("avx2");
+  }
+  if (f == key_search_native_avx2) {
+    return (key_size == 4 || key_size == 8) && __builtin_cpu_supports("avx2");
+  }
+  if (f == key_search_native) return (key_size == 4 || key_size == 8 || key_size == 16);
+  if (f == key_search_sse42) return __builtin_cpu_supports("sse4.2");
+  return 1;
+}
+
+/* From bin/key_search_bench: pcmpestri only pays off while a key fits in one
+   register, and with big keys a sector holds so few of them that the
+   early-exit linear scan beats binary search. */
+
+Key_Search key_search_pick(int key_size)
+{
+  if (key_search_supported(key_search_avx2, key_size)) return key_search_avx2;
+  if (key_size <= 16 && key_search_supported(key_search_sse42, key_size)) return key_search_sse42;
+  if (key_size >= 60) return key_search_linear;
+  return key_search_binary;
+}
+
+Key_Search key_search_pick_native(int key_size)
+{
+  if (key_search_supported(key_search_native_avx2, key_size)) return key_search_native_avx2;
+  return key_search_native;
+}
+
+char *key_search_name(Key_Search f)
+{
+  if (f == key_search_linear) return "linear";
+  if (f == key_search_binary) return "binary";
+  if (f == key_search_sse42) return "sse42";
+  if (f == key_search_avx2) return "avx2";
+  if (f == key_search_native) return "native";
+  if (f == key_search_native_avx2) return "native_avx2";
+  return "unknown";
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Eytzinger layout.  An in-order walk of the implicit tree visits the slots in
+   key order, so that's how it's filled. */
+
+static void layout_fill(Key_Layout *l, const unsigned char *keys, int *next, int k)
+{
+  if (k > l->nkeys) return;
+  layout_fill(l, keys, next, 2*k);
+  memcpy(l->keys + k * l->key_size, keys + *next * l->key_size, l->key_size);
+  l->index[k] = *next;
+  (*next)++;
+  layout_fill(l, keys, next, 2*k+1);
+}
+
+Key_Layout *key_layout_build(const unsigned char *keys, int nkeys, int key_size, int native)
+{
+  Key_Layout *l;
+  void *p;
+  int next;
+
+  l = (Key_Layout *) malloc(sizeof(Key_Layout));
+  l->nkeys = nkeys;
+  l->key_size = key_size;
+  l->native = native;
+  if (posix_memalign(&p, 64, (nkeys + 1) * key_size + KEY_SEARCH_PAD) != 0) {
+    free(l);
+    return NULL;
+  }
+  l->keys = (unsigned char *) p;
+  l->index = (unsigned char *) malloc(nkeys + 1);
+  l->index[0] = nkeys;
+  next = 0;
+  layout_fill(l, keys, &next, 1);
+  return l;
+}
+
+/* Descend, going right while the slot's key is below the probe, with a prefetch
+   four levels down.  The answer is the last slot where we went left: shifting
+   off the trailing right turns (1 bits), and the left turn, leaves it -- or 0 if
+   we never went left, which index[] maps to nkeys. */
+
+#define LAYOUT_NATIVE(type) \
+  { \
+    type p, x; \
+    memcpy(&p, probe, sizeof(type)); \
+    while (k <= n) { \
+      __builtin_prefetch(l->keys + 16 * k * sizeof(type)); \
+      memcpy(&x, l->keys + k * sizeof(type), sizeof(type)); \
+      k = 2*k + (x < p); \
+    } \
+    k >>= __builtin_ffs(~k); \
+    if (k != 0) memcpy(&x, l->keys + k * sizeof(type), sizeof(type)); \
+    *equal = (k != 0 && x == p); \
+  }
+
+int key_layout_search(Key_Layout *l, const unsigned char *probe, int *equal)
+{
+  int k, n, ks;
+
+  k = 1;
+  n = l->nkeys;
+  ks = l->key_size;
+  if (l->native) {
+    switch (ks) {
+      case 4:  LAYOUT_NATIVE(unsigned int); break;
+      case 8:  LAYOUT_NATIVE(unsigned long); break;
+      default: LAYOUT_NATIVE(unsigned __int128); break;
+    }
+  } else {
+    while (k <= n) {
+      __builtin_prefetch(l->keys + 16 * k * ks);
+      k = 2*k + (memcmp(l->keys + k * ks, probe, ks) < 0);
+    }
+    k >>= __builtin_ffs(~k);
+    *equal = (k != 0 && memcmp(l->keys + k * ks, probe, ks) == 0);
+  }
+  return l->index[k];
+}
+
+void key_layout_free(Key_Layout *l)
+{
+  free(l->keys);
+  free(l->index);
+  free(l);
+}
+
+/* Per bin/key_search_bench: the layout matches or beats the native kernels, and
+   beats memcmp kernels except at 4 and 8 bytes (avx2 is faster) and once a
+   sector holds only a handful of keys. */
+
+int key_layout_pays(int key_size, int native)
+{
+  if (native) return 1;
+  if (key_search_supported(key_search_avx2, key_size)) return 0;
+  return key_size <= 64;
+}
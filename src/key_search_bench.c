@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "jdisk.h"
+#include "key_search.h"
+
+/* Microbenchmark for the in-node search kernels.
+
+   For each key size, fills a node's worth of sorted random keys (as many as
+   b_tree puts in a sector), then times every supported kernel on the same
+   probes -- half of them present, half absent -- and checks they agree.
+
+   For 4-, 8- and 16-byte keys, it also byte-reverses the keys and probes, which
+   turns them into native integers in the same order, and times the native
+   kernels that integer-keyed trees use.  "eytz" is a search of the node's
+   Eytzinger layout (key_layout_search), as the node cache does for hot nodes. */
+
+#define PROBES (4096)
+
+void usage(char *s)
+{
+  fprintf(stderr, "usage: key_search_bench [rounds] [key_size ...]\n");
+  if (s != NULL) fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+int KS;
+
+static int cmp_key(const void *a, const void *b)
+{
+  return memcmp(a, b, KS);
+}
+
+static long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void reverse(unsigned char *k, int key_size)
+{
+  unsigned char c;
+  int i;
+
+  for (i = 0; i < key_size / 2; i++) {
+    c = k[i];
+    k[i] = k[key_size-1-i];
+    k[key_size-1-i] = c;
+  }
+}
+
+static Key_Layout *Layout;
+
+static int layout_kernel(const unsigned char *keys, int nkeys, int key_size,
+                         const unsigned char *probe, int *equal)
+{
+  (void) keys;                /* Layout holds them, in its own order */
+  (void) nkeys;
+  (void) key_size;
+  return key_layout_search(Layout, probe, equal);
+}
+
+static double time_kernel(Key_Search f, char *name, unsigned char *keys, int nkeys, int key_size,
+                          unsigned char *probes, int *expect_i, int *expect_eq, long rounds)
+{
+  int i, n, eq;
+  long r, t0, sink;
+  double ns;
+
+  for (i = 0; i < PROBES; i++) {
+    n = f(keys, nkeys, key_size, probes + i*key_size, &eq);
+    if (n != expect_i[i] || eq != expect_eq[i]) {
+      printf("\n%s disagrees with linear on probe %d\n", name, i);
+      exit(1);
+    }
+  }
+  sink = 0;
+  t0 = now_ns();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < PROBES; i++) {
+      sink += f(keys, nkeys, key_size, probes + i*key_size, &eq) + eq;
+    }
+  }
+  ns = (now_ns() - t0) / (double) (rounds * PROBES);
+  if (sink == -1) printf("!");
+  return ns;
+}
+
+static void run(int key_size, long rounds)
+{
+  Key_Search kernels[] = { key_search_linear, key_search_binary, key_search_sse42, key_search_avx2 };
+  Key_Search native[] = { key_search_native, key_search_native_avx2 };
+  int nk = sizeof(kernels) / sizeof(Key_Search);
+  unsigned char *keys, *probes;
+  int nkeys, i, j, k, *expect_i, *expect_eq;
+  double base, ns;
+
+  nkeys = (JDISK_SECTOR_SIZE - 6) / (key_size + 4);
+  keys = (unsigned char *) malloc(nkeys * key_size + KEY_SEARCH_PAD);
+  probes = (unsigned char *) malloc(PROBES * key_size);
+  expect_i = (int *) malloc(PROBES * sizeof(int));
+  expect_eq = (int *) malloc(PROBES * sizeof(int));
+
+  /* Sorted, distinct keys.  Only the first few bytes vary, as with padded strings. */
+  KS = key_size;
+  do {
+    memset(keys, 0, nkeys * key_size + KEY_SEARCH_PAD);
+    for (i = 0; i < nkeys; i++) {
+      for (j = 0; j < key_size && j < 6; j++) keys[i*key_size + j] = lrand48() & 0xff;
+    }
+    qsort(keys, nkeys, key_size, cmp_key);
+    for (i = 1; i < nkeys && memcmp(keys + (i-1)*key_size, keys + i*key_size, key_size) != 0; i++) ;
+  } while (i < nkeys);
+
+  for (i = 0; i < PROBES; i++) {
+    if (i % 2 == 0) {
+      memcpy(probes + i*key_size, keys + (lrand48() % nkeys) * key_size, key_size);
+    } else {
+      memset(probes + i*key_size, 0, key_size);
+      for (j = 0; j < key_size && j < 6; j++) probes[i*key_size + j] = lrand48() & 0xff;
+    }
+    expect_i[i] = key_search_linear(keys, nkeys, key_size, probes + i*key_size, expect_eq + i);
+  }
+
+  printf("key_size %3d  (%3d keys/node):", key_size, nkeys);
+  base = 0;
+  for (k = 0; k < nk; k++) {
+    if (!key_search_supported(kernels[k], key_size)) continue;
+    if (kernels[k] == key_search_avx2 && key_size != 4 && key_size != 8) continue;
+    ns = time_kernel(kernels[k], key_search_name(kernels[k]), keys, nkeys, key_size, probes,
+                     expect_i, expect_eq, rounds);
+    if (k == 0) base = ns;
+    printf("  %s %6.1fns (%4.1fx)", key_search_name(kernels[k]), ns, base / ns);
+  }
+  Layout = key_layout_build(keys, nkeys, key_size, 0);
+  ns = time_kernel(layout_kernel, "eytz", keys, nkeys, key_size, probes, expect_i, expect_eq, rounds);
+  printf("  eytz %6.1fns (%4.1fx)", ns, base / ns);
+  key_layout_free(Layout);
+
+  if (key_search_supported(key_search_native, key_size)) {
+    for (i = 0; i < nkeys; i++) reverse(keys + i*key_size, key_size);
+    for (i = 0; i < PROBES; i++) reverse(probes + i*key_size, key_size);
+    for (k = 0; k < (int) (sizeof(native) / sizeof(Key_Search)); k++) {
+      if (!key_search_supported(native[k], key_size)) continue;
+      ns = time_kernel(native[k], key_search_name(native[k]), keys, nkeys, key_size, probes,
+                       expect_i, expect_eq, rounds);
+      printf("  %s %6.1fns (%4.1fx)", key_search_name(native[k]), ns, base / ns);
+    }
+    Layout = key_layout_build(keys, nkeys, key_size, 1);
+    ns = time_kernel(layout_kernel, "native eytz", keys, nkeys, key_size, probes, expect_i, expect_eq, rounds);
+    printf("  native_eytz %6.1fns (%4.1fx)", ns, base / ns);
+    key_layout_free(Layout);
+  }
+  printf("\n");
+  free(keys);
+  free(probes);
+  free(expect_i);
+  free(expect_eq);
+}
+
+int main(int argc, char **argv)
+{
+  int sizes[] = { 4, 8, 12, 16, 24, 32, 64, 128, 254 };
+  long rounds;
+  int i, ks;
+
+  rounds = 200;
+  if (argc > 1 && sscanf(argv[1], "%ld", &rounds) != 1) usage("bad rounds");
+  srand48(1);
+  if (argc > 2) {
+    for (i = 2; i < argc; i++) {
+      ks = atoi(argv[i]);
+      if (ks < 4 || ks > 254) usage("key_size must be between 4 and 254");
+      run(ks, rounds);
+    }
+  } else {
+    for (i = 0; i < (int) (sizeof(sizes) / sizeof(int)); i++) run(sizes[i], rounds);
+  }
+  printf("picked for b_tree: ");
+  for (i = 0; i < (int) (sizeof(sizes) / sizeof(int)); i++) {
+    printf("%d:%s ", sizes[i], key_search_name(key_search_pick(sizes[i])));
+  }
+  printf("\n");
+  exit(0);
+}
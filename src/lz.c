@@ -0,0 +1,133 @@
+#include <string.h>
+#include "lz.h"
+
+/* See include/lz.h.  Greedy matching with a hash table of 4-byte sequences;
+   everything is bounds-checked, since the input is a sector off the disk. */
+
+#define LZ_MIN_MATCH  (4)
+#define LZ_HASH_BITS  (12)
+#define LZ_MAX_OFFSET (65535)
+
+static unsigned int read32(const unsigned char *p)
+{
+  unsigned int x;
+
+  memcpy(&x, p, 4);
+  return x;
+}
+
+static int lz_hash(unsigned int x)
+{
+  return (x * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* A length in a token nibble, with the rest in 255s */
+
+static int put_length(unsigned char **op, unsigned char *oend, int len)
+{
+  for (len -= 15; len >= 255; len -= 255) {
+    if (*op >= oend) return 0;
+    *(*op)++ = 255;
+  }
+  if (*op >= oend) return 0;
+  *(*op)++ = len;
+  return 1;
+}
+
+static int put_sequence(unsigned char **op, unsigned char *oend, const unsigned char *lit,
+                        int nlit, int offset, int match)
+{
+  unsigned char *token;
+  int ml;
+
+  if (*op >= oend) return 0;
+  token = (*op)++;
+  ml = (match > 0) ? match - LZ_MIN_MATCH : 0;
+  *token = ((nlit < 15) ? nlit : 15) << 4 | ((ml < 15) ? ml : 15);
+  if (nlit >= 15 && !put_length(op, oend, nlit)) return 0;
+  if (oend - *op < nlit) return 0;
+  memcpy(*op, lit, nlit);
+  *op += nlit;
+  if (match == 0) return 1;
+
+  if (oend - *op < 2) return 0;
+  *(*op)++ = offset & 0xff;
+  *(*op)++ = offset >> 8;
+  if (ml >= 15 && !put_length(op, oend, ml)) return 0;
+  return 1;
+}
+
+int lz_compress(const unsigned char *in, int n, unsigned char *out, int cap)
+{
+  int table[1 << LZ_HASH_BITS];
+  unsigned char *op, *oend;
+  int i, anchor, ref, h, ml;
+
+  memset(table, 0xff, sizeof(table));
+  op = out;
+  oend = out + cap;
+  anchor = 0;
+  i = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    h = lz_hash(read32(in + i));
+    ref = table[h];
+    table[h] = i;
+    if (ref < 0 || i - ref > LZ_MAX_OFFSET || read32(in + ref) != read32(in + i)) {
+      i++;
+      continue;
+    }
+    for (ml = LZ_MIN_MATCH; i + ml < n && in[ref + ml] == in[i + ml]; ml++) ;
+    if (!put_sequence(&op, oend, in + anchor, i - anchor, i - ref, ml)) return -1;
+    i += ml;
+    anchor = i;
+  }
+  if (anchor < n && !put_sequence(&op, oend, in + anchor, n - anchor, 0, 0)) return -1;
+  return op - out;
+}
+
+/* The other half of put_length() */
+
+static int get_length(const unsigned char **ip, const unsigned char *iend, int len)
+{
+  int b;
+
+  if (len != 15) return len;
+  do {
+    if (*ip >= iend) return -1;
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+int lz_decompress(const unsigned char *in, int n, unsigned char *out, int cap)
+{
+  const unsigned char *ip, *iend;
+  unsigned char *op, *oend;
+  int token, nlit, offset, ml;
+
+  ip = in;
+  iend = in + n;
+  op = out;
+  oend = out + cap;
+  while (ip < iend) {
+    token = *ip++;
+    nlit = get_length(&ip, iend, token >> 4);
+    if (nlit < 0 || iend - ip < nlit || oend - op < nlit) return -1;
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    ml = get_length(&ip, iend, token & 15);
+    if (ml < 0) return -1;
+    ml += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op - out || oend - op < ml) return -1;
+    /* Byte at a time: the match may overlap what it's copying */
+    for (; ml > 0; ml--, op++) *op = *(op - offset);
+  }
+  return op - out;
+}